@@ -0,0 +1,96 @@
+#ifndef VM_ADDRESS_SPACE_H
+#define VM_ADDRESS_SPACE_H
+#include <Windows.h>
+#include "hardware.h"
+#include "pte.h"
+#include "pte_scan.h"
+#include "trimmer.h"
+#include "api.h"
+
+// An address space gives a tenant its own VA, PTEs and allocations on top of the PFNs, page lists and page file
+// That everyone shares. Each space is a slice of our VA space carved out on region boundaries, so the slice's PTEs
+// And PTE regions belong to the space alone, and allocations made in it are kept in a VAD tree of its own
+// Memory allocated with plain vm_alloc lives outside of every slice, in what is effectively the default space
+
+// Each space counts the pages it has resident, that is the valid PTEs in its regions
+// Once it is over its soft limit the trimmers take pages from it before anything else, and only from it
+// At its hard limit a fault in the space trims the space itself before it is given another page
+// Either limit can be left at zero, which means the space has no such limit
+
+// The count follows the region age counts, so it changes wherever the global age count does when pages come or go
+
+// The working set of a space is estimated from the accessed bits that the aging walk and the trimmers harvest
+// Every full walk samples how many pages the space touched since the last one. A minimum working set keeps
+// The age based trimming away from a space until it has more resident, and a maximum makes a space the first
+// To be trimmed when memory runs short
+
+// The number of working set samples each space keeps for its history
+#define WORKING_SET_HISTORY_SIZE                 64
+
+typedef struct {
+    ULONG tick;
+    ULONG64 pages;
+} WORKING_SET_SAMPLE, *PWORKING_SET_SAMPLE;
+
+typedef struct _ADDRESS_SPACE {
+    BOOLEAN in_use;
+    PVOID start_va;
+    ULONG64 num_pages;
+    ULONG64 first_region;
+    ULONG64 num_regions;
+    // The allocations made in the space. It is protected by vad_tree_lock like the default tree
+    PVAD vad_root;
+    ULONG64 soft_limit;
+    ULONG64 hard_limit;
+    volatile LONG64 resident_pages;
+    // The pages vm_lock has pinned in the space, which count against MAX_PINNED_PAGES_PER_ADDRESS_SPACE
+    volatile LONG64 pinned_pages;
+    // Held while the space is trimmed down to a limit, so the space is only ever trimmed for it once at a time
+    CRITICAL_SECTION trim_lock;
+    // Trims start where the last one stopped, so the first regions of a space are not always the ones to lose pages
+    ULONG64 trim_cursor;
+    volatile LONG64 pages_trimmed_over_soft_limit;
+    volatile LONG64 pages_trimmed_over_hard_limit;
+    volatile LONG64 hard_limit_faults;
+    ULONG64 min_working_set;
+    ULONG64 max_working_set;
+    // Accessed bits harvested in the space's regions since the last full aging walk
+    volatile LONG64 pages_accessed;
+    ULONG64 working_set_pages;
+    ULONG64 peak_working_set_pages;
+    ULONG64 working_set_total;
+    ULONG64 working_set_samples;
+    WORKING_SET_SAMPLE working_set_history[WORKING_SET_HISTORY_SIZE];
+    volatile LONG64 pages_trimmed_over_max_working_set;
+    volatile LONG64 protected_region_trims;
+} ADDRESS_SPACE, *PADDRESS_SPACE;
+
+extern ADDRESS_SPACE address_spaces[MAX_ADDRESS_SPACES];
+extern CRITICAL_SECTION address_spaces_lock;
+
+// Holds one more than the index of the space owning each PTE region, or zero for regions outside of every space
+extern PUCHAR region_address_spaces;
+
+// These are what programs use to keep tenants apart
+extern PADDRESS_SPACE vm_create_address_space(ULONG64 num_bytes, ULONG64 soft_limit_bytes, ULONG64 hard_limit_bytes);
+extern VOID vm_delete_address_space(PADDRESS_SPACE space);
+extern PVOID vm_alloc_in_space(PADDRESS_SPACE space, ULONG64 num_bytes);
+extern VOID vm_set_address_space_limits(PADDRESS_SPACE space, ULONG64 soft_limit_bytes, ULONG64 hard_limit_bytes);
+extern VOID vm_set_working_set_limits(PADDRESS_SPACE space, ULONG64 min_working_set_bytes, ULONG64 max_working_set_bytes);
+extern ULONG64 vm_working_set_size(PADDRESS_SPACE space);
+
+extern VOID initialize_address_spaces(VOID);
+extern PADDRESS_SPACE address_space_from_region(PPTE_REGION region);
+extern VOID charge_address_space(PPTE_REGION region, LONG64 num_pages);
+extern BOOLEAN charge_address_space_pins(PPTE_REGION region, LONG64 num_pages);
+extern BOOLEAN is_address_space_at_hard_limit(PPTE_REGION region, ULONG64 num_pages);
+extern VOID enforce_address_space_limits(PPTE_REGION region, ULONG64 num_pages);
+extern ULONG64 trim_address_spaces_over_soft_limit(PTRIM_BATCH batch, PTRIMMER_STATS stats);
+extern ULONG64 trim_address_spaces_over_max_working_set(ULONG64 max_trims, PTRIM_BATCH batch, PTRIMMER_STATS stats);
+extern BOOLEAN is_working_set_protected(PPTE_REGION region);
+extern VOID record_accessed_pages(PPTE_REGION region, PPTE_SCAN_RESULT scan);
+extern VOID sample_working_sets(VOID);
+extern VOID print_working_set_history(PADDRESS_SPACE space);
+extern VOID print_address_space_statistics(VOID);
+
+#endif //VM_ADDRESS_SPACE_H
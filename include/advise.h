@@ -0,0 +1,53 @@
+#ifndef VM_ADVISE_H
+#define VM_ADVISE_H
+#include <Windows.h>
+#include "hardware.h"
+#include "pte.h"
+
+// These hints are remembered in the PTE_REGION, so they apply to every page of each region a range touches
+// Normal regions are aged, trimmed and faulted in like any other
+#define VM_ADVICE_NORMAL                         0
+// Hard faults read the pages after the faulting one, and pages the walk has passed go straight to the oldest age
+#define VM_ADVICE_SEQUENTIAL                     1
+// No readahead and no early trimming, this is how a sequential region is put back
+#define VM_ADVICE_RANDOM                         2
+// The trimmers only take pages that have reached the oldest age from these regions
+#define VM_ADVICE_HIGH_PRIORITY                  3
+
+// These two are acted on once and are not remembered
+// The range's pages on disc are read into standby in the background by the prefetch thread
+#define VM_ADVICE_WILLNEED                       4
+// The range's pages in memory are moved to the oldest age, so they are the first ones trimmed
+#define VM_ADVICE_DONTNEED                       5
+
+// A hard fault in a sequential region brings in up to this many of the pages after it in the same region
+#define READAHEAD_PAGES                          ((ULONG64) 16)
+
+// The prefetch thread takes WILLNEED ranges from a ring of this many, requests beyond that are dropped
+#define PREFETCH_QUEUE_SIZE                      ((ULONG64) 64)
+
+// Speculative reads stop once the free and standby lists together hold this few pages
+// They are only worth it while they do not take pages that faulting threads need
+#define PREFETCH_MIN_AVAILABLE_PAGES             (DESIRED_NUMBER_OF_PHYSICAL_PAGES / 16)
+
+typedef struct {
+    PVOID virtual_address;
+    ULONG64 num_pages;
+} PREFETCH_REQUEST, *PPREFETCH_REQUEST;
+
+extern HANDLE prefetch_wake_event;
+
+extern volatile LONG64 pages_prefetched;
+extern volatile LONG64 pages_read_ahead;
+extern volatile LONG64 prefetch_requests_dropped;
+
+extern VOID initialize_advice(VOID);
+extern VOID advise_va_range(PVOID virtual_address, ULONG64 num_pages, ULONG advice);
+extern BOOLEAN prefetch_disc_pte(PPTE pte);
+extern VOID read_ahead(PPTE pte);
+extern VOID age_out_ptes(PPTE first_pte, ULONG64 num_ptes, BOOLEAN only_unaccessed, PPTE_REGION_AGE_COUNT age_count);
+extern VOID print_advice_statistics(VOID);
+
+extern DWORD prefetch_thread(PVOID context);
+
+#endif //VM_ADVISE_H
@@ -0,0 +1,69 @@
+#ifndef VM_AGER_H
+#define VM_AGER_H
+#include <Windows.h>
+#include "pte.h"
+#include "trimmer.h"
+
+// Aging is split into tasks of this many consecutive PTE regions
+// Tasks are small enough to balance across workers but large enough to keep the deques cold
+#define REGIONS_PER_AGING_TASK                   ((ULONG64) 32)
+
+typedef struct {
+    ULONG64 first_region;
+    ULONG64 num_regions;
+    // Where this task falls in the sweep, used to find where the next sweep should pick up
+    ULONG64 sweep_position;
+} AGING_TASK, *PAGING_TASK;
+
+// Policies that filter region walks keep two Bloom filters of region indices
+// One is read by the current walk while the other collects the regions that produce accessed bits for the next walk
+#define BLOOM_FILTER_SIZE_LOG2                   15
+#define BLOOM_FILTER_SIZE_IN_BITS                ((ULONG64) 1 << BLOOM_FILTER_SIZE_LOG2)
+#define BLOOM_FILTER_SIZE_IN_WORDS               (BLOOM_FILTER_SIZE_IN_BITS / 64)
+#define BLOOM_FILTER_HASHES                      2
+
+// Every this many walks, a filtered walk visits every active region so that regions that woke up are found again
+// This is also when the ages of skipped regions catch up, which keeps the trimmer's age lists roughly in order
+#define FULL_WALK_INTERVAL                       8
+
+// Each worker owns a deque of tasks. It pops from the head of its own deque and steals from the tail of others
+typedef struct {
+    PAGING_TASK tasks;
+    ULONG64 head;
+    ULONG64 tail;
+    CRITICAL_SECTION lock;
+    HANDLE wake_event;
+
+    // Age count changes are kept per worker and merged into global_age_count once per task
+    LONG64 age_count_delta[NUMBER_OF_AGES];
+
+    // Pages trimmed by the worker while it ages under pressure wait here until they are put on the modified list
+    TRIM_BATCH trim_batch;
+    ULONG64 pages_trimmed;
+
+    ULONG64 pages_aged;
+    ULONG64 regions_skipped;
+    ULONG64 tasks_run;
+    ULONG64 tasks_stolen;
+    DOUBLE busy_time;
+} AGING_WORKER, *PAGING_WORKER;
+
+extern PAGING_WORKER aging_workers;
+extern ULONG number_of_aging_workers;
+extern ULONG64 max_aging_tasks;
+
+// When this is nonzero the system is under pressure and the aging workers trim this many pages as they age
+// The trimmers stand down while it is set so that each region is only walked once per cycle
+extern volatile LONG64 fused_trim_target;
+
+extern CRITICAL_SECTION aging_round_lock;
+extern HANDLE aging_round_done_event;
+
+extern VOID bloom_filter_insert_region(PPTE_REGION region);
+extern ULONG64 age_regions_in_parallel(ULONG64 num_pte_ages, ULONG num_workers);
+extern VOID print_aging_statistics(VOID);
+extern VOID benchmark_aging_pool(VOID);
+
+extern DWORD aging_worker_thread(PVOID context);
+
+#endif //VM_AGER_H
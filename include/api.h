@@ -0,0 +1,49 @@
+#ifndef VM_API_H
+#define VM_API_H
+#include <Windows.h>
+#include "section.h"
+
+// Every allocation is described by one virtual address descriptor, kept in an AVL tree ordered by start address
+typedef struct _VAD {
+    struct _VAD *left;
+    struct _VAD *right;
+    LONG height;
+    PVOID start_va;
+    ULONG64 num_pages;
+    // Set when the range maps a section rather than holding private memory
+    PSECTION section;
+    // Set when the range is the slice of an address space, whose own allocations are in its own tree, see address_space.h
+    struct _ADDRESS_SPACE *space;
+} VAD, *PVAD;
+
+extern PVAD vad_root;
+extern CRITICAL_SECTION vad_tree_lock;
+
+extern volatile LONG64 vm_pages_released;
+extern volatile LONG64 vm_disc_slots_released;
+extern volatile LONG64 vm_pages_discarded;
+
+// These are what programs use in place of malloc and free
+extern PVOID vm_alloc(ULONG64 num_bytes);
+extern BOOLEAN vm_free(PVOID virtual_address);
+extern BOOLEAN vm_decommit(PVOID virtual_address, ULONG64 num_bytes);
+extern BOOLEAN vm_discard(PVOID virtual_address, ULONG64 num_bytes);
+extern BOOLEAN vm_populate(PVOID virtual_address, ULONG64 num_bytes);
+extern BOOLEAN vm_lock(PVOID virtual_address, ULONG64 num_bytes);
+extern BOOLEAN vm_unlock(PVOID virtual_address, ULONG64 num_bytes);
+extern BOOLEAN vm_advise(PVOID virtual_address, ULONG64 num_bytes, ULONG advice);
+extern BOOLEAN vm_clone(PVOID source_va, PVOID destination_va, ULONG64 num_bytes);
+
+extern VOID initialize_vad_tree(VOID);
+extern PVAD find_vad(PVOID virtual_address);
+extern BOOLEAN is_va_allocated(PVOID virtual_address);
+extern BOOLEAN find_va_section(PVOID virtual_address, PSECTION *section, PULONG64 section_page);
+extern PVOID allocate_va_range(struct _ADDRESS_SPACE *space, ULONG64 num_pages, PSECTION section);
+extern PVOID reserve_address_space_va(struct _ADDRESS_SPACE *space, ULONG64 num_pages);
+extern VOID release_address_space_va(struct _ADDRESS_SPACE *space);
+extern PPFN release_invalid_pte(PPTE pte, PULONG64 disc_slots_released);
+extern VOID release_va_range(PVOID virtual_address, ULONG64 num_pages);
+extern VOID discard_va_range(PVOID virtual_address, ULONG64 num_pages);
+extern VOID print_api_statistics(VOID);
+
+#endif //VM_API_H
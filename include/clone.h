@@ -0,0 +1,38 @@
+#ifndef VM_CLONE_H
+#define VM_CLONE_H
+#include <Windows.h>
+#include "pte.h"
+
+// vm_clone makes a range read the same as another without copying it
+// Pages in memory are mapped into both ranges with PTE_COPY_ON_WRITE_BIT set and the frame's share_count raised
+// Pages on disc have their disc slot shared, and whichever range faults first reads its own copy
+// Pages on the modified list have nothing on disc to share yet, so the clone gets its own copy of them right away
+
+// AWE cannot map a page read only, so writes to shared pages are caught by access_va the same way cpu_stamp stands in
+// For the accessed bit. A real CPU would raise a write fault on the read only mapping instead
+
+// A page that is still shared cannot be trimmed, but each PTE mapping it can let go of it when trimmed
+// The first one writes the page to a disc slot the frame holds, and every one that lets go takes a share of that slot
+// Once a single PTE is left, the page is private again and trimmed like any other
+
+// The most PTEs a frame can be shared between, as many as share_count can count
+#define MAX_FRAME_SHARERS                        0xFFFF
+
+// Modified pages are copied for the clone through this window, which holds the source and the destination page
+extern PVOID clone_copy_va;
+extern CRITICAL_SECTION clone_copy_va_lock;
+
+extern volatile LONG64 pages_shared_by_clone;
+extern volatile LONG64 disc_slots_shared_by_clone;
+extern volatile LONG64 pages_copied_by_clone;
+extern volatile LONG64 copy_on_write_faults;
+extern volatile LONG64 copy_on_write_copies;
+extern volatile LONG64 copy_on_write_ptes_unshared;
+
+extern VOID clone_va_range(PVOID source_va, PVOID destination_va, ULONG64 num_pages);
+extern VOID copy_on_write_fault(PVOID virtual_address);
+extern BOOLEAN make_copy_on_write_private(PPTE pte);
+extern BOOLEAN unshare_copy_on_write_pte(PPTE pte);
+extern VOID print_clone_statistics(VOID);
+
+#endif //VM_CLONE_H
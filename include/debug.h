@@ -25,6 +25,22 @@
 
 #define VA_ACCESS_MARKING                            0
 
+// Times each PTE scan kernel the CPU supports before the system starts
+#define PTE_SCAN_BENCHMARK                           0
+
+// Measures how the aging rate scales with the number of aging workers once the faulting threads finish
+#define AGING_POOL_BENCHMARK                         0
+
+// Compares random page reads over contiguous runs of frames against scattered frames before the system starts
+#define LARGE_PAGE_BENCHMARK                         0
+
+// Times random walks over the PTE regions and the PFNs once the faulting threads finish
+// Comparing runs with and without LARGE_PAGE_METADATA shows what the large pages save
+#define METADATA_WALK_BENCHMARK                      0
+
+// Compares faulting in a fresh buffer through access_va against vm_populate once the faulting threads finish
+#define POPULATE_BENCHMARK                           0
+
 #define READWRITE_LOGGING                            0
 #if READWRITE_LOGGING
 
@@ -63,6 +79,7 @@ extern LONG64 readwrite_log_index;
 #endif
 
 typedef struct {
+    ULONG64 num_accesses;
     ULONG64 num_first_accesses;
     ULONG64 num_reaccesses;
     ULONG64 num_faults;
@@ -30,7 +30,46 @@
 #define NUMBER_OF_DISC_PAGES                     (NUMBER_OF_USER_DISC_PAGES + NUMBER_OF_SYSTEM_DISC_PAGES)
 
 #define NUMBER_OF_FAULTING_THREADS               2
-#define NUMBER_OF_SYSTEM_THREADS                 4
+// Trimmers claim disjoint PTE regions, so several of them can trim at once
+#define NUMBER_OF_TRIMMING_THREADS               2
+// Each modified writer drains the sharded modified list into the page file
+#define NUMBER_OF_MODIFIED_WRITERS               2
+// The trimmers, the modified writers, the scheduler, the aging thread and the prefetch thread
+#define NUMBER_OF_SYSTEM_THREADS                 (NUMBER_OF_TRIMMING_THREADS + NUMBER_OF_MODIFIED_WRITERS + 3)
+// The aging pool uses whatever cores are left over, up to this many
+#define MAX_NUMBER_OF_AGING_THREADS              8
+
+// vm_lock refuses to pin more than this many pages in total, so that pinning cannot starve everyone else of memory
+#define MAX_PINNED_PAGES                         (DESIRED_NUMBER_OF_PHYSICAL_PAGES / 8)
+
+// No single address space may pin more than this share of the quota, so one tenant cannot lock everyone else out
+#define MAX_PINNED_PAGES_PER_ADDRESS_SPACE       (MAX_PINNED_PAGES / 4)
+
+// The number of files that can be mapped with vm_map_file at once, each file page's disc index holds its slot
+#define MAX_MAPPED_FILES                         64
+
+// The modified writer leaves pages on the modified list for this long after they are trimmed, as the pages that are
+// Faulted back are mostly faulted back soon. Younger pages are only written when free and standby pages would run out
+// Before they come of age. Zero writes pages as soon as they are trimmed
+#define MODIFIED_RESCUE_WINDOW_MS                1000
+
+// The number of address spaces that can be carved out of the VA space at once, see address_space.h
+#define MAX_ADDRESS_SPACES                       16
+
+// A fault in an address space at its hard limit trims this many pages past the limit, so the next faults do not trim
+#define ADDRESS_SPACE_TRIM_SLACK                 64
+
+// Regions found fully valid and fully accessed by the aging walk are moved onto an aligned run of frames
+// AWE still maps the run as 4KB pages, so this only pays for the copy until there is a real large mapping to use it
+#define LARGE_PAGE_PROMOTION                     0
+
+// The PFNs are put on large pages when the OS has them, falling back to reserved 4KB pages
+// The PTEs and PTE regions stay on 4KB pages, so that they are still committed lazily and can be paged out
+#define LARGE_PAGE_METADATA                      1
+
+// Large pages commit the whole PFN array from frame 0 up, so they are only used when that is at most this many times
+// What the PFNs of our own frames need. Sparse frame numbers fall back to committing just those PFNs
+#define LARGE_PAGE_METADATA_MAX_OVERCOMMIT       2
 
 #endif //HARDWARE_H
 
@@ -0,0 +1,41 @@
+#ifndef VM_LARGE_PAGE_H
+#define VM_LARGE_PAGE_H
+#include <Windows.h>
+#include "pte.h"
+#include "pte_scan.h"
+
+// A PTE region maps exactly as much VA as one large page, so a promoted region is backed by one aligned run of frames
+#define FRAMES_PER_LARGE_PAGE                    PTE_REGION_SIZE
+#define LARGE_PAGE_SIZE                          (FRAMES_PER_LARGE_PAGE * PAGE_SIZE)
+
+// The benchmark walks this many large pages worth of memory, which is well past what the TLB covers with 4KB pages
+#define LARGE_PAGE_BENCHMARK_RUNS                8
+#define LARGE_PAGE_BENCHMARK_ACCESSES            ((ULONG64) 1 << 24)
+
+// The metadata walk benchmark visits this many random PFNs and this many random PTE regions
+#define METADATA_BENCHMARK_PFN_READS             ((ULONG64) 1 << 24)
+#define METADATA_BENCHMARK_REGION_WALKS          ((ULONG64) 1 << 18)
+
+// These are the frame numbers that start an aligned run of FRAMES_PER_LARGE_PAGE frames we own, found at startup
+extern PULONG64 large_page_runs;
+extern ULONG64 number_of_large_page_runs;
+
+// Promotion copies the old frames into the run through these two windows, one large page each
+extern PVOID large_page_copy_va;
+extern CRITICAL_SECTION large_page_copy_va_lock;
+
+extern volatile LONG64 regions_promoted;
+extern volatile LONG64 regions_demoted;
+extern volatile LONG64 promotions_without_run;
+extern volatile LONG64 promotions_with_referenced_pages;
+
+extern VOID initialize_large_pages(VOID);
+extern BOOLEAN allocate_large_page_run(PULONG_PTR frame_numbers);
+extern VOID free_large_page_run(PULONG_PTR frame_numbers);
+extern BOOLEAN try_promote_region(PPTE_REGION region, PPTE_SCAN_RESULT scan);
+extern VOID demote_region(PPTE_REGION region);
+extern VOID print_large_page_statistics(VOID);
+extern VOID benchmark_large_pages(VOID);
+extern VOID benchmark_metadata_walks(VOID);
+
+#endif //VM_LARGE_PAGE_H
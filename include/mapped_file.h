@@ -0,0 +1,42 @@
+#ifndef VM_MAPPED_FILE_H
+#define VM_MAPPED_FILE_H
+#include <Windows.h>
+#include "hardware.h"
+#include "pfn.h"
+#include "section.h"
+
+// vm_map_file maps part of a file through a section whose pages page to and from the file instead of the page file
+// Its prototype PTEs start out in disc format with PTE_FILE_BIT set, and their disc index names a page of the file
+// Rather than a page file slot. The PFNs of its pages are marked file_backed and keep that disc index while resident
+
+// A page that none of its mappings wrote is clean, so trimming its last mapping puts it straight on the standby list
+// With no write at all. Written pages go through the modified list, and the modified writer writes them to the file
+
+// The protection a file is mapped with. A read only view opens the file for reading alone, so files that are read only
+// Or that another process has open for writing can still be mapped, and any write to such a view is a fatal error
+#define VM_FILE_READ_ONLY                        0
+#define VM_FILE_READ_WRITE                       1
+
+// The disc index of a file page is its mapped file slot above these bits and its page in the view below them
+#define MAPPED_FILE_PAGE_BITS                    32
+#define MAPPED_FILE_PAGE_MASK                    (((ULONG64) 1 << MAPPED_FILE_PAGE_BITS) - 1)
+
+// The sections of the files mapped right now, a file's slot is what the disc indices of its pages point at
+extern PSECTION mapped_files[MAX_MAPPED_FILES];
+extern CRITICAL_SECTION mapped_files_lock;
+
+extern volatile LONG64 file_pages_read;
+extern volatile LONG64 file_pages_written;
+extern volatile LONG64 clean_file_pages_trimmed;
+
+extern PVOID vm_map_file(PCSTR path, ULONG64 offset, ULONG64 num_bytes, ULONG protection);
+
+extern VOID initialize_mapped_files(VOID);
+extern ULONG64 file_disc_index(PSECTION section, ULONG64 section_page);
+extern VOID read_file_page(PSECTION section, ULONG64 section_page, PPFN pfn);
+extern VOID write_file_page(PPFN pfn, PVOID source_va);
+extern VOID flush_mapped_file(PSECTION section);
+extern VOID close_mapped_file(PSECTION section);
+extern VOID print_mapped_file_statistics(VOID);
+
+#endif //VM_MAPPED_FILE_H
@@ -0,0 +1,28 @@
+#ifndef VM_MOD_WRITER_H
+#define VM_MOD_WRITER_H
+#include <Windows.h>
+#include "hardware.h"
+
+// Each modified writer has its own VA window to map pages into and its own place to search the page file bitmap
+// Writers start on their home shards and then move round-robin through the rest, stealing pages from other shards
+typedef struct {
+    PVOID write_va;
+    ULONG home_shard;
+    ULONG next_shard;
+    ULONG64 first_disc_region;
+
+    ULONG64 pages_written;
+    ULONG64 batches_written;
+    ULONG64 pages_stolen;
+    // Pages written while standby was about to run out, when pages still inside the rescue window are taken too
+    ULONG64 pages_written_in_hurry;
+    DOUBLE busy_time;
+} MODIFIED_WRITER, *PMODIFIED_WRITER;
+
+extern MODIFIED_WRITER modified_writers[NUMBER_OF_MODIFIED_WRITERS];
+extern HANDLE mw_wake_events[NUMBER_OF_MODIFIED_WRITERS];
+
+extern VOID wake_modified_writers(VOID);
+extern VOID print_modified_write_statistics(VOID);
+
+#endif //VM_MOD_WRITER_H
@@ -47,8 +47,15 @@ extern volatile LONG64 freed_spaces_size;
 
 extern volatile LONG64 last_checked_index;
 
+// How many more PTEs than one hold each disc slot, vm_clone shares the slots of pages that are out of memory
+// Freeing a shared slot only takes one holder off it. The count is as wide as a LONG so that repeated clones of
+// The same range cannot wrap it
+extern volatile LONG *disc_slot_sharers;
+
 extern ULONG64 get_disc_indices(PULONG64 disc_indices, ULONG64 num_indices);
+extern ULONG64 get_disc_indices_from_region(PULONG64 disc_indices, ULONG64 num_indices, PULONG64 search_region);
 extern VOID free_disc_index(ULONG64 disc_index);
+extern VOID share_disc_index(ULONG64 disc_index);
 VOID free_disc_indices(PULONG64 disc_indices, ULONG64 num_indices, ULONG64 start_index);
 
 VOID write_to_pagefile(ULONG64 disc_index, PVOID src_va);
@@ -15,12 +15,31 @@ typedef struct {
     ULONG state:3;
     ULONG dirtied:1;
     ULONG reference:3;
+    // Set when the page's VA is freed while the modified writer holds a reference, the writer frees the page
+    ULONG released:1;
+    // The number of valid PTEs mapping an active page that vm_clone shared, zero while only one PTE maps it
+    // Once it drops back to one, the last PTE makes the page private again the next time it is written or trimmed
+    // For a section page it is the number of mappings, see section.h
+    ULONG share_count:16;
+    // Set for pages of a mapped file, whose disc index names their page of the file, see mapped_file.h
+    ULONG file_backed:1;
+    // Set when a mapping that wrote a file backed page has gone, so the page is written back once the last one goes
+    ULONG file_dirty:1;
+    // Which standby list the page goes on once it is clean, set whenever it leaves its PTE, see pfn_lists.h
+    ULONG standby_priority:3;
+    // Set by the modified writer on the pages it puts on standby, so a soft fault can tell it rescued a written page
+    ULONG written:1;
+    // Set on a frame vm_clone shared once its contents are written to its disc index for the PTEs that let go of it
+    // The frame holds the slot until the last PTE makes it private or frees it, see clone.h
+    ULONG shared_on_disc:1;
 }PFN_FLAGS/*, *PPFN_FLAGS*/;
 
 typedef struct {
     LIST_ENTRY entry;
     PPTE pte;
     PFN_FLAGS flags;
+    // The tick count when the page last went on the modified list, which the modified writer holds young pages back by
+    ULONG trim_tick;
     ULONG64 disc_index;
     // In the future, these locks will be made into single bits instead of massive CRITICAL_SECTIONS
     CRITICAL_SECTION lock;
@@ -31,6 +50,9 @@ extern PPFN pfn_end;
 extern ULONG_PTR highest_frame_number;
 extern ULONG_PTR lowest_frame_number;
 
+// When this is set every PFN between zero and the highest frame number is committed on large pages
+extern BOOLEAN pfns_on_large_pages;
+
 extern ULONG64 frame_number_from_pfn(PPFN pfn);
 extern PPFN pfn_from_frame_number(ULONG64 frame_number);
 
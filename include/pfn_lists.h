@@ -9,9 +9,47 @@ typedef struct {
     CRITICAL_SECTION lock;
 } PFN_LIST, *PPFN_LIST;
 
+// The modified list is split into shards by frame number so that trimmers and writers contend less on its locks
+#define NUMBER_OF_MODIFIED_SHARDS                8
+
+// The standby list is split by how much a page is worth keeping, and pages are repurposed from the lowest
+// Priority that has any. The priority is given to a page when it leaves its PTE, and it keeps it until it is mapped again
+#define NUMBER_OF_STANDBY_PRIORITIES             8
+
+// Pages that vm_advise was told are not needed
+#define STANDBY_PRIORITY_DONTNEED                0
+// Pages read ahead or prefetched that nobody has touched yet
+#define STANDBY_PRIORITY_PREFETCHED              1
+// Pages of sequential regions, which the scan has moved past
+#define STANDBY_PRIORITY_SEQUENTIAL              2
+// Pages that reached the oldest age before they were trimmed
+#define STANDBY_PRIORITY_OLD                     3
+#define STANDBY_PRIORITY_NORMAL                  5
+// Pages that were still young when they were trimmed, which are the likeliest to be wanted back
+#define STANDBY_PRIORITY_YOUNG                   6
+// Pages of regions advised as high priority
+#define STANDBY_PRIORITY_HIGH                    7
+
 extern PFN_LIST free_page_list;
-extern PFN_LIST modified_page_list;
-extern PFN_LIST standby_page_list;
+extern PFN_LIST modified_page_lists[NUMBER_OF_MODIFIED_SHARDS];
+extern PFN_LIST standby_page_lists[NUMBER_OF_STANDBY_PRIORITIES];
+
+// Soft faults that took a page back off each standby list, and pages repurposed from each
+extern volatile LONG64 standby_pages_rescued[NUMBER_OF_STANDBY_PRIORITIES];
+extern volatile LONG64 standby_pages_repurposed[NUMBER_OF_STANDBY_PRIORITIES];
+// Pages the modified writer wrote that a soft fault then took back off standby, so the write was not needed
+extern volatile LONG64 written_pages_rescued;
+
+extern ULONG modified_shard_from_pfn(PPFN pfn);
+extern PPFN_LIST modified_list_from_pfn(PPFN pfn);
+extern ULONG64 modified_page_count(VOID);
+
+extern PPFN_LIST standby_list_from_pfn(PPFN pfn);
+extern ULONG64 standby_page_count(VOID);
+extern VOID add_to_standby_list(PPFN pfn);
+extern PPFN pop_from_standby_lists(VOID);
+extern VOID record_standby_rescue(PPFN pfn);
+extern VOID print_standby_statistics(VOID);
 
 extern VOID remove_from_list(PPFN pfn);
 extern VOID add_to_list_tail(PPFN pfn, PPFN_LIST listhead);
@@ -0,0 +1,106 @@
+#ifndef VM_POLICY_H
+#define VM_POLICY_H
+#include <Windows.h>
+#include "pte.h"
+#include "pte_scan.h"
+#include "scheduler.h"
+
+// The replacement policies that can be chosen at startup
+#define POLICY_AGING                             0
+#define POLICY_CLOCK_PRO                         1
+#define POLICY_ARC                               2
+#define POLICY_MGLRU                             3
+#define NUMBER_OF_POLICIES                       4
+
+// The ways a fault can be resolved
+#define FAULT_FIRST_ACCESS                       0
+#define FAULT_SOFT                               1
+#define FAULT_HARD                               2
+
+// The ghost types a policy can leave in an invalid PTE. Zero means the PTE holds no ghost
+#define GHOST_NONE                               0
+#define GHOST_TYPE_1                             1
+#define GHOST_TYPE_2                             2
+#define NUMBER_OF_GHOST_TYPES                    3
+
+// Ghosts live for this many epochs, and an epoch ends once as many ghosts as there are physical pages were made
+// This bounds the ghosts the same way ARC bounds its ghost lists to the size of memory
+#define NUMBER_OF_GHOST_EPOCHS                   4
+#define GHOST_LIFETIME_IN_EPOCHS                 2
+
+// Returned by select_trim_candidate when a page should stay in memory
+#define NO_TRIM                                  NUMBER_OF_AGES
+
+// These are the points where the rest of the system hands decisions to the replacement policy
+// Every hook is called with the region lock of the PTE held
+typedef struct {
+    PCSTR name;
+
+    VOID (*initialize)(VOID);
+
+    // Called by every region walk for each valid PTE the scan kernel saw, after the kernel has handled its age
+    // This can be NULL for policies that only need the ages, which skips the extra walk entirely
+    VOID (*on_access)(PPTE pte, PTE contents, BOOLEAN accessed);
+
+    // Called when a fault is resolved with the PTE contents from before the fault
+    // Returns the policy bits the new valid PTE starts with
+    ULONG64 (*on_fault)(PTE old_contents, ULONG fault_type);
+
+    // Called by the trimmer for each valid PTE that was not just accessed
+    // Returns the age whose quota pays for trimming the page, or NO_TRIM to leave it in memory
+    ULONG (*select_trim_candidate)(PTE contents, PGLOBAL_AGE_COUNT trim_of_age);
+
+    // Called when a trimmed page leaves the working set on its way to the standby list
+    // Returns the ghost bits to keep in its transition PTE
+    ULONG64 (*on_evict)(PTE contents);
+
+    // Called when a valid PTE is zeroed instead of trimmed, as when its VA is freed, this can be NULL
+    // The page leaves the policy's counts like an evicted one, but it leaves no ghost as the PTE is gone
+    VOID (*on_forget)(PTE contents);
+
+    // Called by vm_advise for each valid PTE it marks as not needed, after moving it to the oldest age
+    // This can be NULL for policies that trim by age, as they already see the page as the oldest
+    VOID (*on_dontneed)(PPTE pte, PTE contents);
+
+    // Called by the aging coordinator before each walk over the regions, this can be NULL
+    VOID (*on_walk)(VOID);
+
+    // Called by the aging coordinator after a walk that visited every region and so saw every valid PTE
+    // This can be NULL
+    VOID (*on_full_walk)(VOID);
+
+    // If this is set, aging walks skip regions that the Bloom filter says produced no accessed bits last walk
+    BOOLEAN filter_region_walks;
+} REPLACEMENT_POLICY, *PREPLACEMENT_POLICY;
+
+typedef struct {
+    volatile LONG64 faults[FAULT_HARD + 1];
+    volatile LONG64 ghost_hits;
+} POLICY_STATS, *PPOLICY_STATS;
+
+extern PREPLACEMENT_POLICY replacement_policy;
+extern ULONG replacement_policy_in_use;
+extern POLICY_STATS policy_stats;
+
+extern REPLACEMENT_POLICY aging_policy;
+extern REPLACEMENT_POLICY clock_pro_policy;
+extern REPLACEMENT_POLICY arc_policy;
+extern REPLACEMENT_POLICY mglru_policy;
+
+extern VOID select_replacement_policy(PCSTR name);
+extern VOID initialize_replacement_policy(VOID);
+extern VOID policy_scan_region(PPTE first_pte, PPTE_SCAN_RESULT scan);
+extern ULONG64 policy_fault(PTE old_contents, ULONG fault_type);
+extern VOID policy_forget(PTE contents);
+extern VOID policy_dontneed(PPTE pte, PTE contents);
+extern VOID print_policy_statistics(VOID);
+
+// Helpers shared by the policies
+extern VOID update_policy_bits(PPTE pte, ULONG64 bits_to_clear, ULONG64 bits_to_set);
+extern ULONG find_trim_quota(PTE contents, PGLOBAL_AGE_COUNT trim_of_age);
+extern ULONG64 make_ghost(ULONG ghost_type);
+extern ULONG live_ghost_type(PTE contents);
+extern VOID consume_ghost(PTE contents);
+extern ULONG64 count_live_ghosts(ULONG ghost_type);
+
+#endif //VM_POLICY_H
@@ -0,0 +1,28 @@
+#ifndef VM_POPULATE_H
+#define VM_POPULATE_H
+#include <Windows.h>
+#include "hardware.h"
+#include "pte.h"
+
+// The benchmark faults in a buffer of this many pages through access_va, then populates one as large
+#define POPULATE_BENCHMARK_PAGES                 (DESIRED_NUMBER_OF_PHYSICAL_PAGES / 4)
+
+// Pages on disc are read in through this window, which holds a whole region's worth of pages at once
+extern PVOID populate_read_va;
+extern CRITICAL_SECTION populate_read_va_lock;
+
+extern volatile LONG64 pages_populated;
+extern volatile LONG64 pages_populated_from_disc;
+extern volatile LONG64 populate_waits;
+
+// The number of pages with PTE_PINNED_BIT set, vm_lock charges pages to this before it pins them
+extern volatile LONG64 pinned_page_count;
+
+extern VOID populate_va_range(PVOID virtual_address, ULONG64 num_pages);
+extern ULONG64 pin_va_range(PVOID virtual_address, ULONG64 num_pages);
+extern ULONG64 unpin_va_range(PVOID virtual_address, ULONG64 num_pages);
+extern VOID keep_pinned_ptes_young(PPTE first_pte, ULONG64 num_ptes, PPTE_REGION_AGE_COUNT age_count);
+extern VOID print_populate_statistics(VOID);
+extern VOID benchmark_populate(VOID);
+
+#endif //VM_POPULATE_H
@@ -0,0 +1,49 @@
+#ifndef VM_PRESSURE_H
+#define VM_PRESSURE_H
+#include <Windows.h>
+#include "hardware.h"
+
+// Once faulting threads spend more than this fraction of their time stalled, the lowest priority one is suspended
+#define STALL_SUSPEND_THRESHOLD                  0.5
+// Once they spend less than this fraction of their time stalled, a suspended thread is let back in
+#define STALL_RESUME_THRESHOLD                   0.1
+// The stall fraction has to stay above the threshold for this many seconds in a row before anyone is suspended
+#define STALL_SECONDS_BEFORE_SUSPEND             2
+
+#define MAX_ADMISSION_EVENTS                     256
+
+#define ADMISSION_SUSPEND                        0
+#define ADMISSION_RESUME                         1
+
+// Faulting threads are suspended cooperatively. They pass through a gate between accesses
+// And wait there while the admission controller has them suspended, so they never hold locks while suspended
+// Higher thread indices have lower priority and are suspended first
+typedef struct {
+    volatile LONG suspended;
+    volatile LONG finished;
+    HANDLE resume_event;
+    ULONG64 times_suspended;
+    DOUBLE time_suspended;
+} ADMISSION_STATE, *PADMISSION_STATE;
+
+typedef struct {
+    ULONG64 time_in_ms;
+    ULONG thread_index;
+    ULONG action;
+    DOUBLE stall_fraction;
+} ADMISSION_EVENT, *PADMISSION_EVENT;
+
+extern ADMISSION_STATE admission_states[NUMBER_OF_FAULTING_THREADS];
+extern volatile LONG faulting_threads_running;
+extern DOUBLE stall_fraction;
+
+extern VOID initialize_admission_control(VOID);
+extern VOID record_stall(DOUBLE duration);
+extern VOID wait_for_admission(ULONG thread_index);
+extern VOID faulting_thread_finished(ULONG thread_index);
+extern VOID update_admission_control(VOID);
+extern VOID mark_run_start(VOID);
+extern VOID mark_run_end(VOID);
+extern VOID print_admission_statistics(VOID);
+
+#endif //VM_PRESSURE_H
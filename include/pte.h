@@ -10,7 +10,18 @@
 #define BITS_PER_AGE                             (ULONG64) 3
 
 // With a region size of 512, we have 2MB of virtual memory per region
-#define NUMBER_OF_PTE_REGIONS                    ((DESIRED_NUMBER_OF_PHYSICAL_PAGES + NUMBER_OF_USER_DISC_PAGES) / PTE_REGION_SIZE)
+// The PTEs of one region fill exactly one page, which is the unit the page table is committed in
+// The PTEs and PTE regions are only reserved up front. The directory holds the state of each region,
+// And a region's page of PTEs and its PTE_REGION are committed the first time any of its PTEs are touched
+#define PTE_REGION_UNCOMMITTED                   0
+#define PTE_REGION_COMMITTING                    1
+#define PTE_REGION_COMMITTED                     2
+// A committed region whose PTEs are all zero or in disc format can have its page of PTEs written to the page file
+// And decommitted. Its PTE_REGION, and so its lock, stays resident, and the page is read back in under that lock
+#define PTE_REGION_PAGED_OUT                     3
+
+// A region has to be seen inactive and cold on this many aging walks in a row before its PTEs are paged out
+#define PTE_PAGE_OUT_COLD_WALKS                  4
 
 // We know that a PTE is in valid format if the valid bit is set
 typedef struct {
@@ -20,6 +31,62 @@ typedef struct {
     ULONG64 age:BITS_PER_AGE;
 } VALID_PTE /*, *PVALID_PTE*/;
 
+// These describe the memory format as raw bits so that PTEs can be processed as plain 64 bit words
+// They must be kept in sync with the VALID_PTE bitfields above
+#define PTE_VALID_BIT                            ((ULONG64) 1)
+#define PTE_ACCESSED_BIT                         ((ULONG64) 1 << 1)
+#define PTE_AGE_SHIFT                            ((ULONG64) 42)
+#define PTE_AGE_MASK                             ((NUMBER_OF_AGES - 1) << PTE_AGE_SHIFT)
+
+// The replacement policy in use owns these bits of a valid PTE. The aging policy leaves them clear
+#define PTE_POLICY_SHIFT                         ((ULONG64) 45)
+#define PTE_POLICY_BIT_0                         ((ULONG64) 1 << PTE_POLICY_SHIFT)
+#define PTE_POLICY_BIT_1                         ((ULONG64) 1 << (PTE_POLICY_SHIFT + 1))
+
+// Set by vm_discard on a valid PTE whose contents no longer need to be kept
+// The trimmer frees such a page instead of writing it out, unless it is touched again first
+#define PTE_DISCARD_BIT                          ((ULONG64) 1 << 47)
+
+// Set by vm_lock on a valid PTE that has to stay resident. The trimmers never take such a page, and
+// The aging walk keeps it at age 0 so that it never holds up the trim quotas of the older ages
+#define PTE_PINNED_BIT                           ((ULONG64) 1 << 48)
+
+// Set by vm_clone on a valid PTE whose frame may be shared with PTEs in another range, see clone.h
+// Writes through such a PTE take a private copy first, and the trimmers leave it alone while the frame is shared
+#define PTE_COPY_ON_WRITE_BIT                    ((ULONG64) 1 << 49)
+
+// Set on a valid PTE that maps a page of a section, see section.h. The PFN points at the section's prototype PTE
+#define PTE_SECTION_BIT                          ((ULONG64) 1 << 50)
+
+// Set by the simulated CPU on a valid PTE when its page is written. Only the pages of mapped files look at it,
+// To tell whether they have to be written back to their file when they are trimmed
+#define PTE_DIRTY_BIT                            ((ULONG64) 1 << 51)
+
+// Set by vm_advise with VM_ADVICE_DONTNEED on the valid PTEs it ages out. If the page is trimmed before it is touched
+// Again it goes on the lowest priority standby list, see pfn_lists.h
+#define PTE_DONTNEED_BIT                         ((ULONG64) 1 << 52)
+
+// Transition and disc format PTEs remember what the policy knew about a page after it leaves memory
+// These bits sit above always_zero2 and on_disc, so they survive a transition PTE being rewritten into disc format
+#define PTE_GHOST_TYPE_SHIFT                     ((ULONG64) 42)
+#define PTE_GHOST_TYPE_MASK                      ((ULONG64) 3 << PTE_GHOST_TYPE_SHIFT)
+#define PTE_GHOST_EPOCH_SHIFT                    ((ULONG64) 44)
+#define PTE_GHOST_EPOCH_MASK                     ((ULONG64) 3 << PTE_GHOST_EPOCH_SHIFT)
+
+// A disc format PTE whose page was repurposed off the standby list remembers when that happened
+// The stamp is the eviction clock divided by EVICTION_STAMP_GRANULARITY, kept modulo the width of the field
+#define PTE_EVICTION_STAMPED_BIT                 ((ULONG64) 1 << 46)
+#define PTE_EVICTION_STAMP_SHIFT                 ((ULONG64) 47)
+#define PTE_EVICTION_STAMP_BITS                  ((ULONG64) 14)
+#define PTE_EVICTION_STAMP_MASK                  ((((ULONG64) 1 << PTE_EVICTION_STAMP_BITS) - 1) << PTE_EVICTION_STAMP_SHIFT)
+
+// A disc format PTE whose disc index names a page of a mapped file rather than a page file slot, see mapped_file.h
+#define PTE_FILE_BIT                             ((ULONG64) 1 << 61)
+
+// Set on a zero or disc format prototype PTE while a fault reads its page in without the section lock, see section.h
+// Other faults on the same page wait for the bit to clear, faults on the section's other pages go ahead
+#define PTE_PROTOTYPE_IN_PROGRESS_BIT            ((ULONG64) 1 << 62)
+
 // We know that a PTE is in disc format if the valid bit is not set and on_disc is set
 typedef struct {
     ULONG64 always_zero:1;
@@ -60,6 +127,13 @@ typedef struct {
     CRITICAL_SECTION lock;
     PTE_REGION_AGE_COUNT age_count;
     ULONG active:1;
+    ULONG cold_walks:3;
+    // Set while the region is backed by one aligned run of frames, see large_page.h
+    ULONG large:1;
+    // The stored vm_advise hint for the region, see advise.h
+    ULONG advice:2;
+    // The number of the region's PTEs with PTE_PINNED_BIT set
+    ULONG pinned_pages:10;
 } PTE_REGION, *PPTE_REGION;
 
 extern PPTE pte_base;
@@ -70,11 +144,25 @@ extern PPTE_REGION pte_regions_end;
 
 extern PPTE_REGION_LIST pte_region_age_lists;
 
+extern volatile LONG *pte_directory;
+extern ULONG64 number_of_pte_regions;
+extern PULONG64 pte_page_disc_indices;
+
+
+extern volatile LONG64 pte_pages_paged_out;
+extern volatile LONG64 pte_pages_paged_in;
+
 extern PPTE pte_from_va(PVOID virtual_address);
 extern PVOID va_from_pte(PPTE pte);
 extern PPTE_REGION pte_region_from_pte(PPTE pte);
 extern PPTE pte_from_pte_region(PPTE_REGION pte_region);
 
+extern VOID commit_pte_region(ULONG64 region_index);
+extern VOID commit_pte_region_for_pte(PPTE pte);
+extern BOOLEAN is_pte_region_committed(ULONG64 region_index);
+extern BOOLEAN page_out_pte_page(ULONG64 region_index);
+extern VOID page_in_pte_page(ULONG64 region_index);
+
 extern VOID lock_pte(PPTE pte);
 extern VOID unlock_pte(PPTE pte);
 extern BOOLEAN try_lock_pte(PPTE pte);
@@ -0,0 +1,40 @@
+#ifndef VM_PTE_SCAN_H
+#define VM_PTE_SCAN_H
+#include <Windows.h>
+#include "pte.h"
+
+// Ages every valid PTE: accessed PTEs are reset to age 0, all others are aged by one (saturating)
+#define PTE_SCAN_AGE                             0
+// Only resets accessed PTEs to age 0, the ages of all other PTEs are left alone
+#define PTE_SCAN_RESET_ACCESSED                  1
+
+#define PTE_SCAN_BITMAP_SIZE                     (PTE_REGION_SIZE / 64)
+
+// The kernels in use, from slowest to fastest
+#define PTE_SCAN_SCALAR                          0
+#define PTE_SCAN_AVX2                            1
+#define PTE_SCAN_AVX512                          2
+
+// This is everything a region walk needs to know once the PTEs have been scanned
+// Bit i of each bitmap corresponds to the i-th PTE that was scanned
+typedef struct {
+    PTE_REGION_AGE_COUNT age_count;
+    ULONG64 valid_bitmap[PTE_SCAN_BITMAP_SIZE];
+    ULONG64 accessed_bitmap[PTE_SCAN_BITMAP_SIZE];
+    ULONG64 num_valid;
+} PTE_SCAN_RESULT, *PPTE_SCAN_RESULT;
+
+typedef VOID (*PTE_SCAN_KERNEL)(PPTE ptes, ULONG64 num_ptes, ULONG mode, PPTE_SCAN_RESULT result);
+
+// This is chosen at startup by initialize_pte_scan depending on what the CPU supports
+extern PTE_SCAN_KERNEL scan_pte_block;
+extern ULONG pte_scan_kernel_in_use;
+
+extern VOID initialize_pte_scan(VOID);
+extern VOID scan_pte_block_scalar(PPTE ptes, ULONG64 num_ptes, ULONG mode, PPTE_SCAN_RESULT result);
+extern VOID scan_pte_block_avx2(PPTE ptes, ULONG64 num_ptes, ULONG mode, PPTE_SCAN_RESULT result);
+extern VOID scan_pte_block_avx512(PPTE ptes, ULONG64 num_ptes, ULONG mode, PPTE_SCAN_RESULT result);
+
+extern VOID benchmark_pte_scan(VOID);
+
+#endif //VM_PTE_SCAN_H
@@ -40,8 +40,6 @@ extern ULONG64 trim_time_index;
 extern ULONG64 pages_consumed;
 
 extern HANDLE age_wake_event;
-extern HANDLE mw_wake_event;
-extern HANDLE trim_wake_event;
 
 extern ULONG64 num_mod_writes_global;
 extern ULONG64 num_ages_global;
@@ -0,0 +1,58 @@
+#ifndef VM_SECTION_H
+#define VM_SECTION_H
+#include <Windows.h>
+#include "pte.h"
+#include "pfn.h"
+
+// A section is a run of pages that can be mapped at several VAs at once, so that threads can share data without copying
+// Each page of a section is tracked by a prototype PTE owned by the section rather than by any one mapping
+// A prototype PTE uses the valid, transition and disc formats just like a real PTE. Valid means the page is resident
+// And mapped by at least one VA, and the PFN's share_count holds how many VAs map it
+// The PFN of a section page points back at its prototype PTE, so the modified writer and get_free_page
+// Move the prototype through transition and disc format without knowing that it belongs to a section
+
+// The PTEs of a mapping are zero until first touched, and go back to zero when trimmed, as the VAD already tells the
+// Fault handler which prototype PTE backs them. A mapped PTE has PTE_SECTION_BIT set, and trimming it only drops the
+// Mapping until it is the last one, which moves the page to the modified list with its prototype PTE in transition
+
+#define SECTION_NAME_LENGTH                      64
+
+typedef struct _SECTION {
+    struct _SECTION *next;
+    CHAR name[SECTION_NAME_LENGTH];
+    ULONG64 num_pages;
+    PPTE prototype_ptes;
+    // Every handle from vm_create_section or vm_open_section and every mapping holds a reference
+    volatile LONG references;
+    // Faults change the section's prototype PTEs under this lock. A page being read in is claimed with
+    // PTE_PROTOTYPE_IN_PROGRESS_BIT and the lock is let go of for the read, so faults on other pages are not held up
+    CRITICAL_SECTION lock;
+    // These are only set for the section behind a vm_map_file view, see mapped_file.h
+    HANDLE file;
+    PVOID file_view;
+    PUCHAR file_data;
+    ULONG64 file_bytes;
+    ULONG file_slot;
+    // A view of a file opened with VM_FILE_READ_ONLY refuses writes, as its pages could never be written back
+    BOOLEAN read_only;
+} SECTION, *PSECTION;
+
+extern PSECTION section_list;
+extern CRITICAL_SECTION section_list_lock;
+
+extern volatile LONG64 section_pages_mapped;
+extern volatile LONG64 section_pages_shared;
+
+// These are what programs use to share memory between threads
+extern PSECTION vm_create_section(PCSTR name, ULONG64 num_bytes);
+extern PSECTION vm_open_section(PCSTR name);
+extern VOID vm_close_section(PSECTION section);
+extern PVOID vm_map_section(PSECTION section);
+
+extern VOID initialize_sections(VOID);
+extern PPFN section_fault(PSECTION section, ULONG64 section_page, PULONG fault_type);
+extern VOID unmap_section_page(PPFN pfn, BOOLEAN dirty);
+extern VOID dereference_section(PSECTION section);
+extern VOID print_section_statistics(VOID);
+
+#endif //VM_SECTION_H
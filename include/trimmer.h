@@ -0,0 +1,42 @@
+#ifndef VM_TRIMMER_H
+#define VM_TRIMMER_H
+#include <Windows.h>
+#include "hardware.h"
+#include "pfn_lists.h"
+#include "pte.h"
+#include "scheduler.h"
+
+// A trim quota that takes every page of its age
+#define TRIM_ALL                                 MAXULONG64
+
+// Pages a trimmer has taken from one region that have not been put on the modified list yet
+// The batch is flushed once the region is let go of, as every PFN in it is locked, already in the modified state, and its PTE is already in transition format
+// The pages are kept sorted by the modified shard they belong to so that each shard is spliced in one lock hold
+typedef struct {
+    PFN_LIST lists[NUMBER_OF_MODIFIED_SHARDS];
+    ULONG64 num_pages;
+} TRIM_BATCH, *PTRIM_BATCH;
+
+typedef struct {
+    ULONG64 pages_trimmed;
+    ULONG64 regions_trimmed;
+    ULONG64 batches_flushed;
+    DOUBLE busy_time;
+} TRIMMER_STATS, *PTRIMMER_STATS;
+
+extern HANDLE trim_wake_events[NUMBER_OF_TRIMMING_THREADS];
+extern TRIMMER_STATS trimmer_stats[NUMBER_OF_TRIMMING_THREADS];
+
+// Pages marked by vm_discard that were freed when trimmed instead of being put on the modified list
+extern volatile LONG64 trimmed_pages_discarded;
+
+extern VOID initialize_trim_batch(PTRIM_BATCH batch);
+extern VOID compute_trim_quotas(ULONG64 desired_trims, PGLOBAL_AGE_COUNT trim_of_age);
+extern VOID flush_trim_batch(PTRIM_BATCH batch, PTRIMMER_STATS stats);
+extern BOOLEAN claim_region(PPTE_REGION region);
+extern ULONG64 trim_claimed_region(PPTE_REGION region, ULONG scan_mode, PGLOBAL_AGE_COUNT trim_of_age, PTRIM_BATCH batch,
+                                   PULONG64 ptes_scanned);
+extern VOID wake_trimmers(VOID);
+extern VOID print_trim_statistics(VOID);
+
+#endif //VM_TRIMMER_H
@@ -3,10 +3,25 @@
 #include "system.h"
 #include "hardware.h"
 #include "pte.h"
+#include "pte_scan.h"
+#include "policy.h"
+#include "large_page.h"
 #include "pfn.h"
 #include "pfn_lists.h"
 #include "pagefile.h"
 #include "console.h"
 #include "scheduler.h"
+#include "ager.h"
+#include "trimmer.h"
+#include "mod_writer.h"
+#include "workingset.h"
+#include "pressure.h"
+#include "api.h"
+#include "advise.h"
+#include "populate.h"
+#include "clone.h"
+#include "section.h"
+#include "mapped_file.h"
+#include "address_space.h"
 
 #endif //VM_VM_H
@@ -0,0 +1,29 @@
+#ifndef VM_WORKINGSET_H
+#define VM_WORKINGSET_H
+#include <Windows.h>
+#include "pte.h"
+
+// Each tick of the stamp kept in a disc format PTE covers this many evictions
+// With a 14 bit stamp this lets us measure refault distances up to 1M evictions, four times the size of memory
+#define EVICTION_STAMP_GRANULARITY_LOG2          6
+
+// Refault distances are counted in buckets by their base 2 logarithm
+#define REFAULT_HISTOGRAM_SIZE                   24
+
+// The trimmer never protects more ages than this, so there are always ages it can trim
+#define MAX_PROTECTED_AGES                       (NUMBER_OF_AGES - 2)
+
+// Every page repurposed off the standby list ticks the eviction clock
+extern volatile LONG64 eviction_clock;
+
+// Set by the scheduler every second from the refaults it saw. Ages younger than this are not trimmed
+extern volatile ULONG trim_protected_ages;
+// The fraction of last second's hard faults that were of pages which would have stayed with a slightly larger standby list
+extern DOUBLE workingset_refault_fraction;
+
+extern ULONG64 stamp_eviction(VOID);
+extern VOID record_refault(PTE old_contents);
+extern VOID update_workingset_protection(VOID);
+extern VOID print_refault_statistics(VOID);
+
+#endif //VM_WORKINGSET_H
@@ -0,0 +1,505 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <Windows.h>
+#include "../include/vm.h"
+#include "../include/debug.h"
+
+ADDRESS_SPACE address_spaces[MAX_ADDRESS_SPACES];
+CRITICAL_SECTION address_spaces_lock;
+
+PUCHAR region_address_spaces;
+
+VOID initialize_address_spaces(VOID)
+{
+    INITIALIZE_LOCK(address_spaces_lock);
+    memset(address_spaces, 0, sizeof(address_spaces));
+
+    // The trim locks live as long as the slots do, so a trimmer can never take the lock of a space being deleted
+    for (ULONG i = 0; i < MAX_ADDRESS_SPACES; i++)
+    {
+        INITIALIZE_LOCK(address_spaces[i].trim_lock);
+    }
+
+    region_address_spaces = (PUCHAR) calloc(number_of_pte_regions, sizeof(UCHAR));
+    NULL_CHECK(region_address_spaces, "initialize_address_spaces : could not allocate memory for the region map")
+}
+
+static ULONG64 pages_from_bytes(ULONG64 num_bytes)
+{
+    return (num_bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+// Carves a slice of num_bytes out of the VA space for a new address space, rounded up to whole PTE regions
+// The limits count resident pages in bytes, and zero means no limit
+// Returns NULL if every address space is in use or no free range of the VA space is big enough
+PADDRESS_SPACE vm_create_address_space(ULONG64 num_bytes, ULONG64 soft_limit_bytes, ULONG64 hard_limit_bytes)
+{
+    if (num_bytes == 0)
+    {
+        return NULL;
+    }
+
+    ULONG64 num_regions = (pages_from_bytes(num_bytes) + PTE_REGION_SIZE - 1) / PTE_REGION_SIZE;
+
+    EnterCriticalSection(&address_spaces_lock);
+
+    ULONG index = 0;
+    while (index < MAX_ADDRESS_SPACES && address_spaces[index].in_use)
+    {
+        index++;
+    }
+    if (index == MAX_ADDRESS_SPACES)
+    {
+        LeaveCriticalSection(&address_spaces_lock);
+        return NULL;
+    }
+
+    PADDRESS_SPACE space = &address_spaces[index];
+
+    PVOID start_va = reserve_address_space_va(space, num_regions * PTE_REGION_SIZE);
+    if (start_va == NULL)
+    {
+        LeaveCriticalSection(&address_spaces_lock);
+        return NULL;
+    }
+
+    space->start_va = start_va;
+    space->num_pages = num_regions * PTE_REGION_SIZE;
+    space->first_region = ((ULONG_PTR) start_va - (ULONG_PTR) va_base) / PAGE_SIZE / PTE_REGION_SIZE;
+    space->num_regions = num_regions;
+    space->vad_root = NULL;
+    space->soft_limit = pages_from_bytes(soft_limit_bytes);
+    space->hard_limit = pages_from_bytes(hard_limit_bytes);
+    space->resident_pages = 0;
+    space->pinned_pages = 0;
+    space->trim_cursor = 0;
+    space->pages_trimmed_over_soft_limit = 0;
+    space->pages_trimmed_over_hard_limit = 0;
+    space->hard_limit_faults = 0;
+    space->min_working_set = 0;
+    space->max_working_set = 0;
+    space->pages_accessed = 0;
+    space->working_set_pages = 0;
+    space->peak_working_set_pages = 0;
+    space->working_set_total = 0;
+    space->working_set_samples = 0;
+    space->pages_trimmed_over_max_working_set = 0;
+    space->protected_region_trims = 0;
+
+    for (ULONG64 i = 0; i < num_regions; i++)
+    {
+        region_address_spaces[space->first_region + i] = (UCHAR) (index + 1);
+    }
+
+    space->in_use = TRUE;
+
+    LeaveCriticalSection(&address_spaces_lock);
+
+    return space;
+}
+
+// Frees every allocation in the space along with its pages and disc slots, then gives its slice back
+VOID vm_delete_address_space(PADDRESS_SPACE space)
+{
+    release_address_space_va(space);
+
+    // Waiting for the trim lock means no trimmer is still walking the space's regions when they change hands
+    EnterCriticalSection(&address_spaces_lock);
+    EnterCriticalSection(&space->trim_lock);
+
+    for (ULONG64 i = 0; i < space->num_regions; i++)
+    {
+        region_address_spaces[space->first_region + i] = 0;
+    }
+    space->in_use = FALSE;
+
+    LeaveCriticalSection(&space->trim_lock);
+    LeaveCriticalSection(&address_spaces_lock);
+}
+
+// Reserves a range inside the space's slice. It is given back with vm_free like any other allocation
+// Returns NULL if no free range of the slice is big enough
+PVOID vm_alloc_in_space(PADDRESS_SPACE space, ULONG64 num_bytes)
+{
+    if (num_bytes == 0)
+    {
+        return NULL;
+    }
+
+    return allocate_va_range(space, pages_from_bytes(num_bytes), NULL);
+}
+
+// Lowering a limit below what the space has resident takes effect on its next fault or the next trimmer pass
+VOID vm_set_address_space_limits(PADDRESS_SPACE space, ULONG64 soft_limit_bytes, ULONG64 hard_limit_bytes)
+{
+    space->soft_limit = pages_from_bytes(soft_limit_bytes);
+    space->hard_limit = pages_from_bytes(hard_limit_bytes);
+
+    wake_trimmers();
+}
+
+// Returns the space owning the region, or NULL if the region is outside of every space
+PADDRESS_SPACE address_space_from_region(PPTE_REGION region)
+{
+    UCHAR slot = region_address_spaces[region - pte_regions];
+
+    if (slot == 0)
+    {
+        return NULL;
+    }
+
+    return &address_spaces[slot - 1];
+}
+
+// Called with the region locked whenever pages become valid in it or stop being valid
+VOID charge_address_space(PPTE_REGION region, LONG64 num_pages)
+{
+    if (num_pages == 0)
+    {
+        return;
+    }
+
+    PADDRESS_SPACE space = address_space_from_region(region);
+    if (space != NULL)
+    {
+        InterlockedAdd64(&space->resident_pages, num_pages);
+    }
+}
+
+// Charges pins to the space owning the region, or gives them back when num_pages is negative
+// Returns FALSE and charges nothing if the pins would take the space over its share of the pin quota
+// Memory outside of every space is only held to the global quota
+BOOLEAN charge_address_space_pins(PPTE_REGION region, LONG64 num_pages)
+{
+    PADDRESS_SPACE space = address_space_from_region(region);
+    if (space == NULL || num_pages == 0)
+    {
+        return TRUE;
+    }
+
+    if (InterlockedAdd64(&space->pinned_pages, num_pages) > (LONG64) MAX_PINNED_PAGES_PER_ADDRESS_SPACE && num_pages > 0)
+    {
+        InterlockedAdd64(&space->pinned_pages, 0 - num_pages);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// Trims up to target_trims pages from the regions of a space. The caller holds the space's trim lock
+// Every pass allows one more age to be trimmed, so the space gives up its oldest pages everywhere before any younger ones
+static ULONG64 trim_address_space(PADDRESS_SPACE space, ULONG64 target_trims, PTRIM_BATCH batch,
+                                  PTRIMMER_STATS stats)
+{
+    ULONG64 pages_trimmed = 0;
+    ULONG64 region_offset = 0;
+
+    for (LONG youngest_age = NUMBER_OF_AGES - 1; youngest_age >= 0 && pages_trimmed < target_trims; youngest_age--)
+    {
+        for (region_offset = 0; region_offset < space->num_regions && pages_trimmed < target_trims; region_offset++)
+        {
+            ULONG64 region_index = space->first_region + (space->trim_cursor + region_offset) % space->num_regions;
+
+            // A region that was never touched has no pages, and its PTE_REGION cannot even be read
+            if (is_pte_region_committed(region_index) == FALSE)
+            {
+                continue;
+            }
+
+            PPTE_REGION region = &pte_regions[region_index];
+
+            // Regions with nothing old enough for this pass are left for a later one
+            PTE_REGION_AGE_COUNT age_count = *(volatile PTE_REGION_AGE_COUNT *) &region->age_count;
+            BOOLEAN has_old_pages = FALSE;
+            for (ULONG age = youngest_age; age < NUMBER_OF_AGES; age++)
+            {
+                if (age_count.ages[age] != 0)
+                {
+                    has_old_pages = TRUE;
+                }
+            }
+            if (has_old_pages == FALSE || claim_region(region) == FALSE)
+            {
+                continue;
+            }
+
+            GLOBAL_AGE_COUNT trim_of_age;
+            memset(&trim_of_age, 0, sizeof(GLOBAL_AGE_COUNT));
+            for (ULONG age = youngest_age; age < NUMBER_OF_AGES; age++)
+            {
+                trim_of_age.pages_of_age[age] = target_trims - pages_trimmed;
+            }
+
+            // This takes the pages out of the space's resident count as it updates the age counts
+            pages_trimmed += trim_claimed_region(region, PTE_SCAN_RESET_ACCESSED, &trim_of_age, batch, NULL);
+
+            if (stats != NULL)
+            {
+                stats->regions_trimmed++;
+            }
+
+            // The pages stay locked until they are flushed, and a fault on one of them waits for its PFN lock
+            // While holding the region. Later passes claim the same regions again, so the batch cannot be held into them
+            flush_trim_batch(batch, stats);
+        }
+    }
+
+    space->trim_cursor = (space->trim_cursor + region_offset) % space->num_regions;
+
+    return pages_trimmed;
+}
+
+// Checks whether num_pages coming into the region have to wait for their address space to make room first
+// A space over its soft limit only has the trimmers woken, so this is only TRUE when they would pass the hard limit
+// This takes no locks, so the fault handler calls it with the faulting PTE locked
+BOOLEAN is_address_space_at_hard_limit(PPTE_REGION region, ULONG64 num_pages)
+{
+    PADDRESS_SPACE space = address_space_from_region(region);
+    if (space == NULL)
+    {
+        return FALSE;
+    }
+
+    ULONG64 soft_limit = space->soft_limit;
+    ULONG64 hard_limit = space->hard_limit;
+    LONG64 resident_pages = space->resident_pages;
+
+    if (soft_limit != 0 && resident_pages > (LONG64) soft_limit)
+    {
+        wake_trimmers();
+    }
+
+    return hard_limit != 0 && resident_pages + (LONG64) num_pages > (LONG64) hard_limit;
+}
+
+// Makes room for num_pages in a space at its hard limit, called with no region locked as trimming the space can
+// Take any of them. If the space has nothing left that can be trimmed, the pages come in over the limit rather than failing
+VOID enforce_address_space_limits(PPTE_REGION region, ULONG64 num_pages)
+{
+    PADDRESS_SPACE space = address_space_from_region(region);
+    if (space == NULL)
+    {
+        return;
+    }
+
+    ULONG64 hard_limit = space->hard_limit;
+    LONG64 resident_pages;
+
+    if (hard_limit == 0)
+    {
+        return;
+    }
+
+    InterlockedIncrement64(&space->hard_limit_faults);
+
+    TRIM_BATCH batch;
+    initialize_trim_batch(&batch);
+
+    EnterCriticalSection(&space->trim_lock);
+
+    // Another fault in the space may have made room while we waited for the lock
+    resident_pages = space->resident_pages;
+    if (resident_pages + (LONG64) num_pages > (LONG64) hard_limit)
+    {
+        ULONG64 target_trims = resident_pages + num_pages - hard_limit + ADDRESS_SPACE_TRIM_SLACK;
+        ULONG64 pages_trimmed = trim_address_space(space, target_trims, &batch, NULL);
+
+        InterlockedAdd64(&space->pages_trimmed_over_hard_limit, (LONG64) pages_trimmed);
+    }
+
+    LeaveCriticalSection(&space->trim_lock);
+
+    flush_trim_batch(&batch, NULL);
+}
+
+// Trims every space over its soft limit, or over its maximum working set, back down to it,
+// Taking no more than max_trims pages in all. Returns the number of pages trimmed
+static ULONG64 trim_address_spaces_over(BOOLEAN max_working_set, ULONG64 max_trims, PTRIM_BATCH batch,
+                                        PTRIMMER_STATS stats)
+{
+    ULONG64 total_pages_trimmed = 0;
+
+    for (ULONG i = 0; i < MAX_ADDRESS_SPACES && total_pages_trimmed < max_trims; i++)
+    {
+        PADDRESS_SPACE space = &address_spaces[i];
+        ULONG64 limit = max_working_set ? space->max_working_set : space->soft_limit;
+
+        if (*(volatile BOOLEAN *) &space->in_use == FALSE || limit == 0 ||
+            space->resident_pages <= (LONG64) limit)
+        {
+            continue;
+        }
+
+        // Another trimmer or a fault at the hard limit is already trimming this space
+        if (!TryEnterCriticalSection(&space->trim_lock))
+        {
+            continue;
+        }
+
+        LONG64 resident_pages = space->resident_pages;
+        if (space->in_use && resident_pages > (LONG64) limit)
+        {
+            ULONG64 target_trims = min(resident_pages - limit, max_trims - total_pages_trimmed);
+            ULONG64 pages_trimmed = trim_address_space(space, target_trims, batch, stats);
+
+            InterlockedAdd64(max_working_set ? &space->pages_trimmed_over_max_working_set :
+                             &space->pages_trimmed_over_soft_limit, (LONG64) pages_trimmed);
+            total_pages_trimmed += pages_trimmed;
+        }
+
+        LeaveCriticalSection(&space->trim_lock);
+    }
+
+    if (stats != NULL)
+    {
+        stats->pages_trimmed += total_pages_trimmed;
+    }
+
+    return total_pages_trimmed;
+}
+
+// The trimmers do this before any other trimming, so a space that outgrows its limit loses its own pages
+// Instead of its neighbours'
+ULONG64 trim_address_spaces_over_soft_limit(PTRIM_BATCH batch, PTRIMMER_STATS stats)
+{
+    return trim_address_spaces_over(FALSE, MAXULONG64, batch, stats);
+}
+
+// Unlike the soft limit, the maximum working set is only enforced when memory is needed, like a Windows working set
+// The trimmers take what they need from spaces over it before they trim by age across everything
+ULONG64 trim_address_spaces_over_max_working_set(ULONG64 max_trims, PTRIM_BATCH batch, PTRIMMER_STATS stats)
+{
+    return trim_address_spaces_over(TRUE, max_trims, batch, stats);
+}
+
+// Sets the working set targets of a space in bytes, zero meaning no target
+// The trimmers only take pages from a space under its minimum if they were discarded, and under pressure they take
+// Pages from a space over its maximum before anyone else
+VOID vm_set_working_set_limits(PADDRESS_SPACE space, ULONG64 min_working_set_bytes, ULONG64 max_working_set_bytes)
+{
+    space->min_working_set = pages_from_bytes(min_working_set_bytes);
+    space->max_working_set = pages_from_bytes(max_working_set_bytes);
+}
+
+// Returns the number of bytes the space touched during the last full aging walk
+ULONG64 vm_working_set_size(PADDRESS_SPACE space)
+{
+    return *(volatile ULONG64 *) &space->working_set_pages * PAGE_SIZE;
+}
+
+// Returns TRUE if the region's space is at or under its minimum working set, so age based trimming has to spare it
+BOOLEAN is_working_set_protected(PPTE_REGION region)
+{
+    PADDRESS_SPACE space = address_space_from_region(region);
+
+    if (space == NULL || space->min_working_set == 0 || space->resident_pages > (LONG64) space->min_working_set)
+    {
+        return FALSE;
+    }
+
+    InterlockedIncrement64(&space->protected_region_trims);
+    return TRUE;
+}
+
+// Called by the aging walk and the trimmers with the accessed bits they have just harvested, and reset, in a region
+VOID record_accessed_pages(PPTE_REGION region, PPTE_SCAN_RESULT scan)
+{
+    PADDRESS_SPACE space = address_space_from_region(region);
+    if (space == NULL)
+    {
+        return;
+    }
+
+    LONG64 num_accessed = 0;
+    for (ULONG word = 0; word < PTE_SCAN_BITMAP_SIZE; word++)
+    {
+        num_accessed += (LONG64) __popcnt64(scan->accessed_bitmap[word]);
+    }
+
+    if (num_accessed != 0)
+    {
+        InterlockedAdd64(&space->pages_accessed, num_accessed);
+    }
+}
+
+// Called by the aging coordinator once a walk has covered every region
+// Every page touched since the last walk had its accessed bit harvested by this walk or by a trimmer in between,
+// So what the space touched over that time is its working set
+VOID sample_working_sets(VOID)
+{
+    ULONG tick = GetTickCount();
+
+    EnterCriticalSection(&address_spaces_lock);
+
+    for (ULONG i = 0; i < MAX_ADDRESS_SPACES; i++)
+    {
+        PADDRESS_SPACE space = &address_spaces[i];
+        if (space->in_use == FALSE)
+        {
+            continue;
+        }
+
+        ULONG64 working_set_pages = (ULONG64) InterlockedExchange64(&space->pages_accessed, 0);
+
+        space->working_set_pages = working_set_pages;
+        space->peak_working_set_pages = max(space->peak_working_set_pages, working_set_pages);
+        space->working_set_total += working_set_pages;
+
+        PWORKING_SET_SAMPLE sample = &space->working_set_history[space->working_set_samples % WORKING_SET_HISTORY_SIZE];
+        sample->tick = tick;
+        sample->pages = working_set_pages;
+        space->working_set_samples++;
+    }
+
+    LeaveCriticalSection(&address_spaces_lock);
+}
+
+// Prints how the working set of a space moved over its most recent samples, for sizing its limits
+VOID print_working_set_history(PADDRESS_SPACE space)
+{
+    ULONG index = (ULONG) (space - address_spaces);
+    ULONG64 num_samples = space->working_set_samples;
+
+    if (num_samples == 0)
+    {
+        printf("address_space %lu : no aging walk finished while it was in use\n", index);
+        return;
+    }
+
+    printf("address_space %lu : working set %llu pages now, %llu at peak, %llu on average over %llu walks\n",
+           index, space->working_set_pages, space->peak_working_set_pages,
+           space->working_set_total / num_samples, num_samples);
+
+    ULONG64 first_sample = num_samples > WORKING_SET_HISTORY_SIZE ? num_samples - WORKING_SET_HISTORY_SIZE : 0;
+    ULONG first_tick = space->working_set_history[first_sample % WORKING_SET_HISTORY_SIZE].tick;
+
+    printf("address_space %lu : working set by ms since sampling began,", index);
+    for (ULONG64 i = first_sample; i < num_samples; i++)
+    {
+        PWORKING_SET_SAMPLE sample = &space->working_set_history[i % WORKING_SET_HISTORY_SIZE];
+        printf(" %lu:%llu", sample->tick - first_tick, sample->pages);
+    }
+    printf("\n");
+}
+
+VOID print_address_space_statistics(VOID)
+{
+    for (ULONG i = 0; i < MAX_ADDRESS_SPACES; i++)
+    {
+        PADDRESS_SPACE space = &address_spaces[i];
+        if (space->in_use == FALSE)
+        {
+            continue;
+        }
+
+        printf("address_space %lu : %lld pages resident, %lld pinned, %lld trimmed over the soft limit, "
+               "%lld trimmed over the hard limit in %lld faults\n",
+               i, space->resident_pages, space->pinned_pages, space->pages_trimmed_over_soft_limit,
+               space->pages_trimmed_over_hard_limit, space->hard_limit_faults);
+        printf("address_space %lu : %lld pages trimmed over the maximum working set, "
+               "regions spared %lld times for the minimum\n",
+               i, space->pages_trimmed_over_max_working_set, space->protected_region_trims);
+        print_working_set_history(space);
+    }
+}
@@ -0,0 +1,377 @@
+#include <stdio.h>
+#include <Windows.h>
+#include "../include/vm.h"
+#include "../include/debug.h"
+
+HANDLE prefetch_wake_event;
+
+// WILLNEED ranges wait here for the prefetch thread, which takes them from the head
+PREFETCH_REQUEST prefetch_queue[PREFETCH_QUEUE_SIZE];
+ULONG64 prefetch_queue_head;
+ULONG64 prefetch_queue_tail;
+CRITICAL_SECTION prefetch_queue_lock;
+
+volatile LONG64 pages_prefetched;
+volatile LONG64 pages_read_ahead;
+volatile LONG64 prefetch_requests_dropped;
+
+VOID initialize_advice(VOID)
+{
+    INITIALIZE_LOCK(prefetch_queue_lock);
+    prefetch_queue_head = 0;
+    prefetch_queue_tail = 0;
+
+    prefetch_wake_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    NULL_CHECK(prefetch_wake_event, "initialize_advice : could not initialize prefetch_wake_event")
+}
+
+static BOOLEAN prefetch_pages_available(VOID)
+{
+    ULONG64 available_pages = *(volatile ULONG_PTR *) &free_page_list.num_pages +
+                              standby_page_count();
+
+    return available_pages > PREFETCH_MIN_AVAILABLE_PAGES;
+}
+
+// Reads a disc format PTE's page into a free page and leaves it on the standby list, called with the region locked
+// The disc slot is kept, so the page can be repurposed without a write if it is never touched
+// The next access is then a soft fault. Returns FALSE if the PTE was not on disc or no page could be had
+BOOLEAN prefetch_disc_pte(PPTE pte)
+{
+    PTE local = read_pte(pte);
+    if (local.memory_format.valid == 1 || local.disc_format.on_disc == 0) {
+        return FALSE;
+    }
+
+    if (prefetch_pages_available() == FALSE) {
+        return FALSE;
+    }
+
+    // This returns the page locked, and it is on no list, so nobody else can see it while it is read into
+    PPFN pfn = get_free_page();
+    if (pfn == NULL) {
+        return FALSE;
+    }
+
+    ULONG64 disc_index = local.disc_format.disc_index;
+    read_disc_page(disc_index, pfn);
+
+    PFN pfn_contents = read_pfn(pfn);
+    pfn_contents.pte = pte;
+    pfn_contents.disc_index = disc_index;
+    pfn_contents.flags.state = STANDBY;
+    pfn_contents.flags.dirtied = 0;
+    pfn_contents.flags.standby_priority = STANDBY_PRIORITY_PREFETCHED;
+    write_pfn(pfn, pfn_contents);
+
+    // The ghost bits stay for the policy, but the page never left memory as far as refault distance is concerned
+    local.entire_format &= ~(PTE_EVICTION_STAMPED_BIT | PTE_EVICTION_STAMP_MASK);
+    local.transition_format.frame_number = frame_number_from_pfn(pfn);
+    local.transition_format.always_zero2 = 0;
+    write_pte(pte, local);
+
+    add_to_standby_list(pfn);
+
+    unlock_pfn(pfn);
+
+    return TRUE;
+}
+
+// Called by the fault handler after a hard fault in a sequential region, with the faulting PTE's region still locked
+// Readahead stops at the end of the region, as only this region's lock is held
+VOID read_ahead(PPTE pte)
+{
+    PPTE first_pte = pte_from_pte_region(pte_region_from_pte(pte));
+    PPTE last_pte = min(first_pte + PTE_REGION_SIZE, pte_end);
+    PPTE readahead_end = min(pte + 1 + READAHEAD_PAGES, last_pte);
+    ULONG64 num_read = 0;
+
+    for (PPTE current_pte = pte + 1; current_pte < readahead_end; current_pte++)
+    {
+        if (prefetch_pages_available() == FALSE) {
+            break;
+        }
+
+        if (prefetch_disc_pte(current_pte)) {
+            num_read++;
+        }
+    }
+
+    InterlockedAdd64(&pages_read_ahead, (LONG64) num_read);
+}
+
+// Moves valid, unpinned PTEs in a locked region to the oldest age and keeps the given age count in step with them
+// When only_unaccessed is set, PTEs the last walk found accessed keep their age, as they are where the scan is now
+// Otherwise their accessed bits are cleared too, so that the next walk does not bring them back to age 0
+VOID age_out_ptes(PPTE first_pte, ULONG64 num_ptes, BOOLEAN only_unaccessed, PPTE_REGION_AGE_COUNT age_count)
+{
+    for (ULONG64 i = 0; i < num_ptes; i++)
+    {
+        PPTE pte = first_pte + i;
+        BOOLEAN success = FALSE;
+
+        // The CPU stamps accessed bits without the region lock, so the new age has to be swapped in
+        while (success == FALSE)
+        {
+            PTE old_contents = read_pte(pte);
+            if (old_contents.memory_format.valid == 0) {
+                break;
+            }
+            // Pinned pages stay young however they are advised
+            if (old_contents.entire_format & PTE_PINNED_BIT) {
+                break;
+            }
+            if (only_unaccessed && old_contents.memory_format.age == 0) {
+                break;
+            }
+
+            // Pages advised as not needed are also marked, so they are the first to be repurposed once trimmed
+            PTE new_contents = old_contents;
+            new_contents.memory_format.age = NUMBER_OF_AGES - 1;
+            if (only_unaccessed == FALSE) {
+                new_contents.memory_format.accessed = 0;
+                new_contents.entire_format |= PTE_DONTNEED_BIT;
+            }
+            if (new_contents.entire_format == old_contents.entire_format) {
+                break;
+            }
+
+            success = InterlockedCompareExchange64((volatile LONG64 *) &pte->entire_format,
+                new_contents.entire_format, old_contents.entire_format) == (LONG64) old_contents.entire_format;
+            if (success) {
+                age_count->ages[old_contents.memory_format.age]--;
+                age_count->ages[NUMBER_OF_AGES - 1]++;
+
+                // Policies that do not trim by age are told as well, so the page is the next to go under them too
+                if (only_unaccessed == FALSE) {
+                    policy_dontneed(pte, new_contents);
+                }
+            }
+        }
+    }
+}
+
+// Writes a locked region's new age count back, fixing up the global age count and the region's place on the age lists
+static VOID update_region_age_count(PPTE_REGION region, PPTE_REGION_AGE_COUNT old_count,
+                                    PPTE_REGION_AGE_COUNT new_count)
+{
+    ULONG old_oldest_age = NUMBER_OF_AGES;
+    ULONG new_oldest_age = NUMBER_OF_AGES;
+
+    for (ULONG i = 0; i < NUMBER_OF_AGES; i++)
+    {
+        if (old_count->ages[i] != 0)
+        {
+            old_oldest_age = i;
+        }
+        if (new_count->ages[i] != 0)
+        {
+            new_oldest_age = i;
+        }
+
+        WriteUShortNoFence(&region->age_count.ages[i], new_count->ages[i]);
+        InterlockedAdd64((volatile LONG64 *) &global_age_count.pages_of_age[i],
+                         (LONG64) new_count->ages[i] - (LONG64) old_count->ages[i]);
+    }
+
+    // Aging pages out never empties a region, so it only ever moves to an older list
+    if (old_oldest_age != new_oldest_age && old_oldest_age != NUMBER_OF_AGES)
+    {
+        PPTE_REGION_LIST old_listhead = &pte_region_age_lists[old_oldest_age];
+        EnterCriticalSection(&old_listhead->lock);
+        remove_region_from_list(region, old_listhead);
+        LeaveCriticalSection(&old_listhead->lock);
+
+        PPTE_REGION_LIST new_listhead = &pte_region_age_lists[new_oldest_age];
+        EnterCriticalSection(&new_listhead->lock);
+        add_region_to_list(region, new_listhead);
+        LeaveCriticalSection(&new_listhead->lock);
+    }
+}
+
+static VOID queue_prefetch(PVOID virtual_address, ULONG64 num_pages)
+{
+    BOOLEAN queued = FALSE;
+
+    EnterCriticalSection(&prefetch_queue_lock);
+    if (prefetch_queue_tail - prefetch_queue_head < PREFETCH_QUEUE_SIZE)
+    {
+        PPREFETCH_REQUEST request = &prefetch_queue[prefetch_queue_tail % PREFETCH_QUEUE_SIZE];
+        request->virtual_address = virtual_address;
+        request->num_pages = num_pages;
+        prefetch_queue_tail++;
+        queued = TRUE;
+    }
+    LeaveCriticalSection(&prefetch_queue_lock);
+
+    // A hint that cannot be queued is simply not acted on
+    if (queued) {
+        SetEvent(prefetch_wake_event);
+    } else {
+        InterlockedIncrement64(&prefetch_requests_dropped);
+    }
+}
+
+static BOOLEAN dequeue_prefetch(PPREFETCH_REQUEST request)
+{
+    BOOLEAN took_request = FALSE;
+
+    EnterCriticalSection(&prefetch_queue_lock);
+    if (prefetch_queue_tail > prefetch_queue_head)
+    {
+        *request = prefetch_queue[prefetch_queue_head % PREFETCH_QUEUE_SIZE];
+        prefetch_queue_head++;
+        took_request = TRUE;
+    }
+    LeaveCriticalSection(&prefetch_queue_lock);
+
+    return took_request;
+}
+
+// Applies advice to the part of a range that falls in one region
+static VOID advise_region_range(ULONG64 region_index, PPTE first_pte, PPTE last_pte, ULONG advice)
+{
+    PPTE_REGION region = &pte_regions[region_index];
+
+    if (advice == VM_ADVICE_DONTNEED)
+    {
+        // Only a region with its PTEs in memory can have valid pages to age out
+        if (is_pte_region_committed(region_index) == FALSE) {
+            return;
+        }
+
+        lock_pte_region(region);
+
+        if (is_pte_region_committed(region_index) && is_region_active(region))
+        {
+            PTE_REGION_AGE_COUNT old_count = *(volatile PTE_REGION_AGE_COUNT *) &region->age_count;
+            PTE_REGION_AGE_COUNT new_count = old_count;
+
+            age_out_ptes(first_pte, (ULONG64) (last_pte - first_pte), FALSE, &new_count);
+            update_region_age_count(region, &old_count, &new_count);
+        }
+
+        unlock_pte_region(region);
+        return;
+    }
+
+    // The hint lives in the PTE_REGION, so a region that was never touched has to be brought into existence for it
+    commit_pte_region(region_index);
+
+    lock_pte_region(region);
+    region->advice = advice;
+    unlock_pte_region(region);
+}
+
+// Applies advice to every region a range of VA touches
+VOID advise_va_range(PVOID virtual_address, ULONG64 num_pages, ULONG advice)
+{
+    if (advice == VM_ADVICE_WILLNEED)
+    {
+        queue_prefetch(virtual_address, num_pages);
+        return;
+    }
+
+    PPTE pte = pte_from_va(virtual_address);
+    PPTE last_pte = pte + num_pages;
+
+    while (pte < last_pte)
+    {
+        ULONG64 region_index = (ULONG64) (pte - pte_base) / PTE_REGION_SIZE;
+        PPTE region_end = min(pte_base + (region_index + 1) * PTE_REGION_SIZE, last_pte);
+
+        advise_region_range(region_index, pte, region_end, advice);
+
+        pte = region_end;
+    }
+}
+
+// Reads the pages of a WILLNEED range that are on disc into standby, a few at a time so faults in the region can get in
+static VOID prefetch_va_range(PPREFETCH_REQUEST request)
+{
+    PPTE pte = pte_from_va(request->virtual_address);
+    PPTE last_pte = pte + request->num_pages;
+
+    while (pte < last_pte)
+    {
+        ULONG64 region_index = (ULONG64) (pte - pte_base) / PTE_REGION_SIZE;
+        PPTE region_end = min(pte_base + (region_index + 1) * PTE_REGION_SIZE, last_pte);
+
+        // A region that was never committed has nothing on disc
+        if (*(volatile LONG *) &pte_directory[region_index] == PTE_REGION_UNCOMMITTED)
+        {
+            pte = region_end;
+            continue;
+        }
+
+        commit_pte_region(region_index);
+
+        PPTE_REGION region = &pte_regions[region_index];
+        while (pte < region_end)
+        {
+            PPTE batch_end = min(pte + READAHEAD_PAGES, region_end);
+            ULONG64 num_read = 0;
+
+            lock_pte_region(region);
+
+            // Cold regions hold exactly the pages worth prefetching, so their PTEs are brought back in for it
+            page_in_pte_page(region_index);
+
+            for (; pte < batch_end; pte++)
+            {
+                if (prefetch_disc_pte(pte)) {
+                    num_read++;
+                }
+            }
+
+            unlock_pte_region(region);
+
+            InterlockedAdd64(&pages_prefetched, (LONG64) num_read);
+
+            // Speculative reads give way as soon as memory gets tight
+            if (prefetch_pages_available() == FALSE) {
+                return;
+            }
+        }
+    }
+}
+
+DWORD prefetch_thread(PVOID context)
+{
+    UNREFERENCED_PARAMETER(context);
+    PREFETCH_REQUEST request;
+
+    HANDLE handles[2];
+    handles[0] = system_exit_event;
+    handles[1] = prefetch_wake_event;
+
+    WaitForSingleObject(system_start_event, INFINITE);
+
+    while (TRUE)
+    {
+        ULONG index = WaitForMultipleObjects(ARRAYSIZE(handles), handles, FALSE, INFINITE);
+        if (index == 0)
+        {
+            break;
+        }
+
+        while (dequeue_prefetch(&request))
+        {
+            prefetch_va_range(&request);
+
+            if (WaitForSingleObject(system_exit_event, 0) == WAIT_OBJECT_0)
+            {
+                return 0;
+            }
+        }
+    }
+
+    return 0;
+}
+
+VOID print_advice_statistics(VOID)
+{
+    printf("advise : %lld pages prefetched for WILLNEED, %lld pages read ahead in sequential regions, "
+           "%lld prefetch requests dropped\n",
+           pages_prefetched, pages_read_ahead, prefetch_requests_dropped);
+}
@@ -1,18 +1,42 @@
+#include <stdio.h>
 #include "../include/vm.h"
+#include "../include/debug.h"
 
-ULONG64 age_pte_region(PPTE_REGION *current_region)
+// The number of full sweeps each worker count gets in the aging pool benchmark
+#define AGING_BENCHMARK_SWEEPS                   ((ULONG64) 16)
+
+PAGING_WORKER aging_workers;
+ULONG number_of_aging_workers;
+ULONG64 max_aging_tasks;
+
+CRITICAL_SECTION aging_round_lock;
+HANDLE aging_round_done_event;
+
+// These describe the round of aging currently being run by the pool
+volatile LONG64 aging_budget;
+volatile LONG64 aging_tasks_outstanding;
+volatile LONG64 first_unaged_position;
+
+// The task the next sweep starts at, so that the ager ages circularly
+ULONG64 aging_cursor_task;
+
+volatile LONG64 fused_trim_target;
+
+// Walks index these by their parity, the filter a walk reads is the one the walk before it filled
+volatile LONG64 bloom_filters[2][BLOOM_FILTER_SIZE_IN_WORDS];
+ULONG64 walk_number;
+BOOLEAN filtered_walk;
+
+// These describe how much trimming the current round does while it ages, both are zero when it only ages
+volatile LONG64 fused_trim_budget;
+ULONG64 fused_trims_per_task;
+
+ULONG64 age_pte_region(PPTE_REGION region, PLONG64 age_count_delta)
 {
     ULONG64 ptes_aged = 0;
     TIME_COUNTER time_counter;
     start_counter(&time_counter);
 
-    // Check if the current region is active
-    PPTE_REGION region = *current_region;
-    if (!is_region_active(region))
-    {
-        region = get_next_active_region(region);
-    }
-
     lock_pte_region(region);
     // Find the list its in from the age count
     ULONG region_age = NUMBER_OF_AGES + 1;
@@ -35,54 +59,49 @@ ULONG64 age_pte_region(PPTE_REGION *current_region)
 
     // Because accessing the PTEs in this region will mess up the age count, we need to recount
     PTE_REGION_AGE_COUNT old_count = *(volatile PTE_REGION_AGE_COUNT *) &region->age_count;
-    PTE_REGION_AGE_COUNT local_count = {0};
 
     // Grab the first PTE in the region
-    PPTE current_pte = pte_from_pte_region(region);
+    PPTE first_pte = pte_from_pte_region(region);
+    ULONG64 num_ptes = min(PTE_REGION_SIZE, (ULONG64) (pte_end - first_pte));
+
+    // Age the entire region at once, the scan kernel also recounts the ages for us
+    PTE_SCAN_RESULT scan;
+    scan_pte_block(first_pte, num_ptes, PTE_SCAN_AGE, &scan);
 
-    // Iterate over the entire region aging it
-    for (ULONG64 index = 0; index < PTE_REGION_SIZE; index++)
+    PTE_REGION_AGE_COUNT local_count = scan.age_count;
+    ptes_aged = scan.num_valid;
+
+    record_accessed_pages(region, &scan);
+
+    // Pages a sequential scan has moved past are not coming back, so they are made the first to be trimmed
+    if (region->advice == VM_ADVICE_SEQUENTIAL)
     {
-        if (current_pte == pte_end)
-        {
-            break;
-        }
+        age_out_ptes(first_pte, num_ptes, TRUE, &local_count);
+    }
 
-        PTE local = read_pte(current_pte);
-        if (local.memory_format.valid)
-        {
-            ULONG age = local.memory_format.age;
-            if (local.memory_format.accessed)
-            {
-                // If the PTE is accessed, we reset its age
-                local.memory_format.age = 0;
-                local.memory_format.accessed = 0;
-                age = 0;
-            }
-            // Age the PTE if possible, but not if it has just had its accessed bit reset
-            else if (local.memory_format.age < NUMBER_OF_AGES - 1)
-            {
-                age++;
-            }
-            local.memory_format.age = age;
+    if (region->pinned_pages != 0)
+    {
+        keep_pinned_ptes_young(first_pte, num_ptes, &local_count);
+    }
 
-            write_pte(current_pte, local);
-            increase_age_count(&local_count, age);
-            ptes_aged++;
-        }
-        current_pte++;
+    policy_scan_region(first_pte, &scan);
+
+#if LARGE_PAGE_PROMOTION
+    if (num_ptes == PTE_REGION_SIZE)
+    {
+        try_promote_region(region, &scan);
     }
+#endif
 
     for (ULONG i = 0; i < NUMBER_OF_AGES; i++)
     {
         WriteUShortNoFence(&region->age_count.ages[i], local_count.ages[i]);
     }
 
-    // Use the old and new counts to update the global age count
+    // Use the old and new counts to update this worker's share of the global age count
     for (ULONG i = 0; i < NUMBER_OF_AGES; i++)
     {
-        InterlockedAdd64((volatile LONG64 *) &global_age_count.pages_of_age[i],
-                         local_count.ages[i] - old_count.ages[i]);
+        age_count_delta[i] += (LONG64) local_count.ages[i] - (LONG64) old_count.ages[i];
     }
 
     // Find the oldest age to insert the region back into the age lists
@@ -110,12 +129,6 @@ ULONG64 age_pte_region(PPTE_REGION *current_region)
 
     unlock_pte_region(region);
 
-    // Increment the current region and check for wrap around
-    *current_region++;
-    if (*current_region >= pte_regions + NUMBER_OF_PTE_REGIONS) {
-        *current_region = pte_regions;
-    }
-
     stop_counter(&time_counter);
     DOUBLE duration = get_counter_duration(&time_counter);
 
@@ -125,6 +138,471 @@ ULONG64 age_pte_region(PPTE_REGION *current_region)
     return ptes_aged;
 }
 
+// Hashes a region index to a bit of the filter. Each hash uses a different odd multiplier
+static ULONG64 bloom_filter_bit(ULONG64 region_index, ULONG hash)
+{
+    static const ULONG64 multipliers[BLOOM_FILTER_HASHES] = {0x9E3779B97F4A7C15, 0xC2B2AE3D27D4EB4F};
+    return (region_index * multipliers[hash]) >> (64 - BLOOM_FILTER_SIZE_LOG2);
+}
+
+// Marks a region in the filter the next walk will read. Faulting threads and region walks both call this
+VOID bloom_filter_insert_region(PPTE_REGION region)
+{
+    ULONG64 region_index = (ULONG64) (region - pte_regions);
+    volatile LONG64 *filter = bloom_filters[(walk_number + 1) % 2];
+
+    for (ULONG hash = 0; hash < BLOOM_FILTER_HASHES; hash++)
+    {
+        ULONG64 bit = bloom_filter_bit(region_index, hash);
+        LONG64 mask = (LONG64) ((ULONG64) 1 << (bit % 64));
+
+        // Most inserts are for regions that are already in the filter, so only write when the bit is clear
+        if ((filter[bit / 64] & mask) == 0) {
+            InterlockedOr64(&filter[bit / 64], mask);
+        }
+    }
+}
+
+static BOOLEAN bloom_filter_may_contain(PPTE_REGION region)
+{
+    ULONG64 region_index = (ULONG64) (region - pte_regions);
+    volatile LONG64 *filter = bloom_filters[walk_number % 2];
+
+    for (ULONG hash = 0; hash < BLOOM_FILTER_HASHES; hash++)
+    {
+        ULONG64 bit = bloom_filter_bit(region_index, hash);
+        if ((filter[bit / 64] & ((LONG64) 1 << (bit % 64))) == 0) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+// Called by the coordinator at the start of every walk
+// The filter filled during the last walk becomes the one this walk reads, and the other is cleared for filling
+static VOID start_walk(VOID)
+{
+    walk_number++;
+    memset((PVOID) bloom_filters[(walk_number + 1) % 2], 0, sizeof(bloom_filters[0]));
+
+    // The first walk has no filter to go by, and every so often every region is walked to find regions that woke up
+    // Walks that also trim under pressure visit every region as well
+    filtered_walk = replacement_policy->filter_region_walks && walk_number % FULL_WALK_INTERVAL != 0
+                    && walk_number > 1 && fused_trims_per_task == 0;
+
+    if (replacement_policy->on_walk != NULL) {
+        replacement_policy->on_walk();
+    }
+}
+
+// Ages a region and trims its eligible pages in a single walk of its PTEs
+// Regions with no valid pages are counted cold on every walk that finds them that way
+// Once they have been cold for long enough, their page of PTEs is written out, which fails while transition PTEs remain
+static VOID page_out_cold_region(ULONG64 region_index, PPTE_REGION region)
+{
+    if (try_lock_pte_region(region) == FALSE)
+    {
+        return;
+    }
+
+    if (is_region_active(region) == FALSE && is_pte_region_committed(region_index))
+    {
+        if (region->cold_walks < PTE_PAGE_OUT_COLD_WALKS)
+        {
+            region->cold_walks++;
+        }
+        else
+        {
+            page_out_pte_page(region_index);
+        }
+    }
+
+    unlock_pte_region(region);
+}
+
+// Returns the number of PTEs that were aged
+ULONG64 age_and_trim_pte_region(PAGING_WORKER worker, PPTE_REGION region, PGLOBAL_AGE_COUNT trim_of_age)
+{
+    ULONG64 ptes_aged = 0;
+
+    // Take the region off its age list so that it is claimed just like a region a trimmer pops
+    if (!claim_region(region))
+    {
+        return 0;
+    }
+
+    // A space under its minimum working set only has the region aged
+    GLOBAL_AGE_COUNT no_trims;
+    if (is_working_set_protected(region))
+    {
+        memset(&no_trims, 0, sizeof(GLOBAL_AGE_COUNT));
+        trim_of_age = &no_trims;
+    }
+
+    // This puts the region back on the age lists, updates the global age count and unlocks the region
+    ULONG64 pages_trimmed = trim_claimed_region(region, PTE_SCAN_AGE, trim_of_age, &worker->trim_batch, &ptes_aged);
+
+    worker->pages_trimmed += pages_trimmed;
+    InterlockedAdd64(&fused_trim_budget, 0 - (LONG64) pages_trimmed);
+
+    // The trimmed pages are locked, so they go on the modified list before the worker moves on to another region
+    flush_trim_batch(&worker->trim_batch, NULL);
+
+    return ptes_aged;
+}
+
+// Adds a task to the tail of a worker's deque. Only the coordinator does this, while no round is running
+static VOID push_aging_task(PAGING_WORKER worker, PAGING_TASK task)
+{
+    EnterCriticalSection(&worker->lock);
+    assert(worker->tail < max_aging_tasks)
+    worker->tasks[worker->tail] = *task;
+    worker->tail++;
+    LeaveCriticalSection(&worker->lock);
+}
+
+// The owner takes from the head of its own deque, so its block is aged in sweep order
+// A round that runs out of budget then leaves the end of the block unaged, which is where the next round's cursor goes
+static BOOLEAN pop_aging_task(PAGING_WORKER worker, PAGING_TASK task)
+{
+    BOOLEAN took_task = FALSE;
+
+    EnterCriticalSection(&worker->lock);
+    if (worker->tail > worker->head)
+    {
+        *task = worker->tasks[worker->head];
+        worker->head++;
+        took_task = TRUE;
+    }
+    LeaveCriticalSection(&worker->lock);
+
+    return took_task;
+}
+
+// Thieves take from the tail, which keeps them away from the tasks the owner is about to run
+static BOOLEAN steal_aging_task(PAGING_WORKER victim, PAGING_TASK task)
+{
+    BOOLEAN took_task = FALSE;
+
+    // Don't bother taking the lock on a deque that looks empty
+    if (*(volatile ULONG64 *) &victim->tail <= *(volatile ULONG64 *) &victim->head)
+    {
+        return FALSE;
+    }
+
+    EnterCriticalSection(&victim->lock);
+    if (victim->tail > victim->head)
+    {
+        victim->tail--;
+        *task = victim->tasks[victim->tail];
+        took_task = TRUE;
+    }
+    LeaveCriticalSection(&victim->lock);
+
+    return took_task;
+}
+
+static BOOLEAN take_aging_task(ULONG worker_index, PAGING_TASK task)
+{
+    PAGING_WORKER worker = &aging_workers[worker_index];
+
+    if (pop_aging_task(worker, task))
+    {
+        return TRUE;
+    }
+
+    // Our own deque is empty, so look for work on everyone else's
+    for (ULONG i = 1; i < number_of_aging_workers; i++)
+    {
+        PAGING_WORKER victim = &aging_workers[(worker_index + i) % number_of_aging_workers];
+        if (steal_aging_task(victim, task))
+        {
+            worker->tasks_stolen++;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+// Remembers the earliest point in the sweep that was left unaged so the next round starts there
+static VOID record_unaged_position(ULONG64 sweep_position)
+{
+    LONG64 current = first_unaged_position;
+
+    while ((ULONG64) current > sweep_position)
+    {
+        LONG64 result = InterlockedCompareExchange64(&first_unaged_position, (LONG64) sweep_position, current);
+        if (result == current)
+        {
+            break;
+        }
+        current = result;
+    }
+}
+
+static VOID run_aging_task(PAGING_WORKER worker, PAGING_TASK task)
+{
+    GLOBAL_AGE_COUNT trim_of_age;
+    BOOLEAN fused = FALSE;
+    TIME_COUNTER time_counter;
+    start_counter(&time_counter);
+
+    // Under pressure each task trims its share of the round's target, oldest pages first
+    LONG64 trim_budget = *(volatile LONG64 *) &fused_trim_budget;
+    if (fused_trims_per_task != 0 && trim_budget > 0)
+    {
+        compute_trim_quotas(min(fused_trims_per_task, (ULONG64) trim_budget), &trim_of_age);
+        fused = TRUE;
+    }
+
+    for (ULONG64 i = 0; i < task->num_regions; i++)
+    {
+        // Once the budget for this round is spent, the rest of the task is left for the next round
+        if (*(volatile LONG64 *) &aging_budget <= 0)
+        {
+            record_unaged_position(task->sweep_position);
+            break;
+        }
+
+        // Regions that were never touched have no PTEs or PTE_REGION behind them yet
+        if (is_pte_region_committed(task->first_region + i) == FALSE)
+        {
+            continue;
+        }
+
+        PPTE_REGION region = &pte_regions[task->first_region + i];
+        if (!is_region_active(region))
+        {
+            page_out_cold_region(task->first_region + i, region);
+            continue;
+        }
+
+        // Regions that produced no accessed bits last walk are skipped, as there is nothing new to learn from them
+        if (filtered_walk && bloom_filter_may_contain(region) == FALSE)
+        {
+            worker->regions_skipped++;
+            continue;
+        }
+
+        ULONG64 ptes_aged;
+        if (fused)
+        {
+            ptes_aged = age_and_trim_pte_region(worker, region, &trim_of_age);
+        }
+        else
+        {
+            ptes_aged = age_pte_region(region, worker->age_count_delta);
+        }
+        InterlockedAdd64(&aging_budget, 0 - (LONG64) ptes_aged);
+        worker->pages_aged += ptes_aged;
+    }
+
+    // Merge this task's age count changes into the global count
+    for (ULONG i = 0; i < NUMBER_OF_AGES; i++)
+    {
+        if (worker->age_count_delta[i] != 0)
+        {
+            InterlockedAdd64((volatile LONG64 *) &global_age_count.pages_of_age[i], worker->age_count_delta[i]);
+            worker->age_count_delta[i] = 0;
+        }
+    }
+
+    worker->tasks_run++;
+
+    stop_counter(&time_counter);
+    worker->busy_time += get_counter_duration(&time_counter);
+}
+
+// Sweeps the PTE regions once, starting where the last sweep left off, with the first num_workers workers
+// The sweep ends early once num_pte_ages PTEs have been aged
+// Returns the number of PTEs that were aged
+ULONG64 age_regions_in_parallel(ULONG64 num_pte_ages, ULONG num_workers)
+{
+    AGING_TASK task;
+    ULONG64 pages_aged_before = 0;
+    ULONG64 pages_aged_after = 0;
+
+    EnterCriticalSection(&aging_round_lock);
+
+    ULONG64 num_regions = (ULONG64) (pte_regions_end - pte_regions);
+    ULONG64 num_tasks = (num_regions + REGIONS_PER_AGING_TASK - 1) / REGIONS_PER_AGING_TASK;
+    num_workers = max(1, min(num_workers, number_of_aging_workers));
+
+    if (num_tasks == 0)
+    {
+        LeaveCriticalSection(&aging_round_lock);
+        return 0;
+    }
+
+    for (ULONG i = 0; i < number_of_aging_workers; i++)
+    {
+        pages_aged_before += aging_workers[i].pages_aged;
+
+        // A worker may still be stealing from the last round, so it must never see head and tail half reset
+        EnterCriticalSection(&aging_workers[i].lock);
+        aging_workers[i].head = 0;
+        aging_workers[i].tail = 0;
+        LeaveCriticalSection(&aging_workers[i].lock);
+    }
+
+    aging_budget = (LONG64) min(num_pte_ages, (ULONG64) MAXLONG64);
+
+    // The trim target is split evenly over the tasks so that every worker trims as it goes
+    LONG64 trim_target = *(volatile LONG64 *) &fused_trim_target;
+    fused_trim_budget = trim_target;
+    fused_trims_per_task = trim_target > 0 ? ((ULONG64) trim_target + num_tasks - 1) / num_tasks : 0;
+
+    start_walk();
+    aging_tasks_outstanding = (LONG64) num_tasks;
+    first_unaged_position = MAXLONG64;
+
+    // Deal each worker a contiguous block of the sweep so that workers start out on separate regions
+    ULONG64 tasks_per_worker = (num_tasks + num_workers - 1) / num_workers;
+    for (ULONG64 position = 0; position < num_tasks; position++)
+    {
+        ULONG64 task_index = (aging_cursor_task + position) % num_tasks;
+
+        task.first_region = task_index * REGIONS_PER_AGING_TASK;
+        task.num_regions = min(REGIONS_PER_AGING_TASK, num_regions - task.first_region);
+        task.sweep_position = position;
+
+        push_aging_task(&aging_workers[position / tasks_per_worker], &task);
+    }
+
+    ResetEvent(aging_round_done_event);
+    for (ULONG i = 0; i < num_workers; i++)
+    {
+        SetEvent(aging_workers[i].wake_event);
+    }
+
+    HANDLE handles[2];
+    handles[0] = system_exit_event;
+    handles[1] = aging_round_done_event;
+    WaitForMultipleObjects(ARRAYSIZE(handles), handles, FALSE, INFINITE);
+
+    // If the budget ran out part way through, the next sweep picks up from the first task that was left unaged
+    if ((ULONG64) first_unaged_position < num_tasks)
+    {
+        aging_cursor_task = (aging_cursor_task + (ULONG64) first_unaged_position) % num_tasks;
+    }
+    // Only a sweep that visited every region has seen every accessed bit, so only it can measure the working sets
+    else if (filtered_walk == FALSE)
+    {
+        sample_working_sets();
+
+        if (replacement_policy->on_full_walk != NULL) {
+            replacement_policy->on_full_walk();
+        }
+    }
+
+    for (ULONG i = 0; i < number_of_aging_workers; i++)
+    {
+        pages_aged_after += aging_workers[i].pages_aged;
+    }
+
+    LeaveCriticalSection(&aging_round_lock);
+
+    return pages_aged_after - pages_aged_before;
+}
+
+// Each worker runs tasks from its own deque, then steals until every deque is empty
+DWORD aging_worker_thread(PVOID context)
+{
+    ULONG worker_index = (ULONG) (ULONG_PTR) context;
+    PAGING_WORKER worker = &aging_workers[worker_index];
+    AGING_TASK task;
+
+    HANDLE handles[2];
+    handles[0] = system_exit_event;
+    handles[1] = worker->wake_event;
+
+    WaitForSingleObject(system_start_event, INFINITE);
+
+    while (TRUE)
+    {
+        ULONG index = WaitForMultipleObjects(ARRAYSIZE(handles), handles, FALSE, INFINITE);
+        if (index == 0)
+        {
+            break;
+        }
+
+        while (take_aging_task(worker_index, &task))
+        {
+            run_aging_task(worker, &task);
+
+            // The last task of the round wakes the coordinator
+            if (InterlockedDecrement64(&aging_tasks_outstanding) == 0)
+            {
+                SetEvent(aging_round_done_event);
+            }
+        }
+    }
+
+    return 0;
+}
+
+VOID print_aging_statistics(VOID)
+{
+    ULONG64 total_pages_aged = 0;
+    ULONG64 total_pages_trimmed = 0;
+    ULONG64 total_regions_skipped = 0;
+    DOUBLE total_busy_time = 0;
+
+    for (ULONG i = 0; i < number_of_aging_workers; i++)
+    {
+        PAGING_WORKER worker = &aging_workers[i];
+        DOUBLE rate = worker->busy_time > 0 ? (DOUBLE) worker->pages_aged / worker->busy_time : 0;
+
+        printf("aging_worker %lu : aged %llu pages in %llu tasks (%llu stolen), %.0f pages per busy second, "
+               "trimmed %llu pages while aging\n",
+               i, worker->pages_aged, worker->tasks_run, worker->tasks_stolen, rate, worker->pages_trimmed);
+
+        total_pages_aged += worker->pages_aged;
+        total_pages_trimmed += worker->pages_trimmed;
+        total_regions_skipped += worker->regions_skipped;
+        total_busy_time += worker->busy_time;
+    }
+
+    printf("aging_pool : %lu workers aged %llu pages and trimmed %llu pages using %.3f seconds of CPU time\n",
+           number_of_aging_workers, total_pages_aged, total_pages_trimmed, total_busy_time);
+    printf("aging_pool : %llu walks, %llu region visits skipped by the Bloom filter\n",
+           walk_number, total_regions_skipped);
+    printf("aging_pool : %lld pages of PTEs paged out, %lld paged back in\n",
+           pte_pages_paged_out, pte_pages_paged_in);
+}
+
+// Runs full sweeps over every active region with 1 to N workers and reports how the aging rate scales
+VOID benchmark_aging_pool(VOID)
+{
+    TIME_COUNTER time_counter;
+    DOUBLE single_worker_rate = 0;
+
+    for (ULONG num_workers = 1; num_workers <= number_of_aging_workers; num_workers++)
+    {
+        ULONG64 pages_aged = 0;
+
+        start_counter(&time_counter);
+        for (ULONG64 sweep = 0; sweep < AGING_BENCHMARK_SWEEPS; sweep++)
+        {
+            pages_aged += age_regions_in_parallel(MAXULONG64, num_workers);
+        }
+        stop_counter(&time_counter);
+
+        DOUBLE duration = get_counter_duration(&time_counter);
+        DOUBLE rate = (DOUBLE) pages_aged / duration;
+        if (num_workers == 1)
+        {
+            single_worker_rate = rate;
+        }
+
+        printf("benchmark_aging_pool : %lu workers aged %.0f pages per second (%.2fx)\n",
+               num_workers, rate, single_worker_rate > 0 ? rate / single_worker_rate : 0);
+    }
+}
+
+// This thread decides how much aging to do and hands it to the pool of aging workers
 DWORD aging_thread(PVOID context)
 {
     UNREFERENCED_PARAMETER(context);
@@ -136,9 +614,6 @@ DWORD aging_thread(PVOID context)
     WaitForSingleObject(system_start_event, INFINITE);
     // TODO add a status for this thread
 
-    // Keep track of the last aged region so the ager can age circularly
-    PPTE_REGION current_region = pte_regions;
-
     while (TRUE)
     {
         ULONG index = WaitForMultipleObjects(ARRAYSIZE(handles), handles,
@@ -150,16 +625,10 @@ DWORD aging_thread(PVOID context)
         }
 
         ULONG64 num_pte_ages = *(volatile ULONG64 *) (&num_ages_global);
-        while (num_pte_ages > 0)
+        if (num_pte_ages > 0)
         {
-            // Age the PTE region
-            ULONG64 ptes_aged = age_pte_region(&current_region);
-            if (ptes_aged >= num_pte_ages)
-            {
-               break;
-            }
-            num_pte_ages -= ptes_aged;
+            age_regions_in_parallel(num_pte_ages, number_of_aging_workers);
         }
     }
     return 0;
-}
\ No newline at end of file
+}
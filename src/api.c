@@ -0,0 +1,957 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <Windows.h>
+#include "../include/vm.h"
+#include "../include/debug.h"
+
+PVAD vad_root;
+CRITICAL_SECTION vad_tree_lock;
+
+volatile LONG64 vm_pages_released;
+volatile LONG64 vm_disc_slots_released;
+volatile LONG64 vm_pages_discarded;
+
+VOID initialize_vad_tree(VOID)
+{
+    INITIALIZE_LOCK(vad_tree_lock);
+    vad_root = NULL;
+}
+
+// These keep the VAD tree balanced so that finding the VAD for a VA stays O(log n)
+static LONG vad_height(PVAD vad)
+{
+    return vad == NULL ? 0 : vad->height;
+}
+
+static VOID update_vad_height(PVAD vad)
+{
+    vad->height = 1 + max(vad_height(vad->left), vad_height(vad->right));
+}
+
+static PVAD rotate_vad_right(PVAD vad)
+{
+    PVAD left = vad->left;
+    vad->left = left->right;
+    left->right = vad;
+    update_vad_height(vad);
+    update_vad_height(left);
+    return left;
+}
+
+static PVAD rotate_vad_left(PVAD vad)
+{
+    PVAD right = vad->right;
+    vad->right = right->left;
+    right->left = vad;
+    update_vad_height(vad);
+    update_vad_height(right);
+    return right;
+}
+
+static PVAD rebalance_vad(PVAD vad)
+{
+    update_vad_height(vad);
+    LONG balance = vad_height(vad->left) - vad_height(vad->right);
+
+    if (balance > 1)
+    {
+        if (vad_height(vad->left->left) < vad_height(vad->left->right))
+        {
+            vad->left = rotate_vad_left(vad->left);
+        }
+        return rotate_vad_right(vad);
+    }
+
+    if (balance < -1)
+    {
+        if (vad_height(vad->right->right) < vad_height(vad->right->left))
+        {
+            vad->right = rotate_vad_right(vad->right);
+        }
+        return rotate_vad_left(vad);
+    }
+
+    return vad;
+}
+
+static PVAD insert_vad(PVAD root, PVAD vad)
+{
+    if (root == NULL)
+    {
+        vad->left = NULL;
+        vad->right = NULL;
+        vad->height = 1;
+        return vad;
+    }
+
+    if ((ULONG_PTR) vad->start_va < (ULONG_PTR) root->start_va)
+    {
+        root->left = insert_vad(root->left, vad);
+    }
+    else
+    {
+        root->right = insert_vad(root->right, vad);
+    }
+
+    return rebalance_vad(root);
+}
+
+static PVAD remove_smallest_vad(PVAD root, PVAD *smallest)
+{
+    if (root->left == NULL)
+    {
+        *smallest = root;
+        return root->right;
+    }
+
+    root->left = remove_smallest_vad(root->left, smallest);
+    return rebalance_vad(root);
+}
+
+// Takes the VAD starting exactly at start_va out of the tree and hands it back through removed
+static PVAD remove_vad(PVAD root, PVOID start_va, PVAD *removed)
+{
+    if (root == NULL)
+    {
+        return NULL;
+    }
+
+    if ((ULONG_PTR) start_va < (ULONG_PTR) root->start_va)
+    {
+        root->left = remove_vad(root->left, start_va, removed);
+    }
+    else if ((ULONG_PTR) start_va > (ULONG_PTR) root->start_va)
+    {
+        root->right = remove_vad(root->right, start_va, removed);
+    }
+    else
+    {
+        *removed = root;
+        if (root->left == NULL)
+        {
+            return root->right;
+        }
+        if (root->right == NULL)
+        {
+            return root->left;
+        }
+
+        PVAD successor;
+        PVAD right = remove_smallest_vad(root->right, &successor);
+        successor->left = root->left;
+        successor->right = right;
+        return rebalance_vad(successor);
+    }
+
+    return rebalance_vad(root);
+}
+
+static ULONG_PTR vad_end(PVAD vad)
+{
+    return (ULONG_PTR) vad->start_va + vad->num_pages * PAGE_SIZE;
+}
+
+static PVAD find_vad_in_tree(PVAD root, PVOID virtual_address)
+{
+    PVAD vad = root;
+
+    while (vad != NULL)
+    {
+        if ((ULONG_PTR) virtual_address < (ULONG_PTR) vad->start_va)
+        {
+            vad = vad->left;
+        }
+        else if ((ULONG_PTR) virtual_address >= vad_end(vad))
+        {
+            vad = vad->right;
+        }
+        else
+        {
+            return vad;
+        }
+    }
+
+    return NULL;
+}
+
+// Returns the VAD covering the VA, or NULL if the VA is not allocated
+// The slice of an address space is not an allocation itself, so a VA inside one is looked up in the space's own tree
+// The caller must hold vad_tree_lock for as long as it uses the VAD
+PVAD find_vad(PVOID virtual_address)
+{
+    PVAD vad = find_vad_in_tree(vad_root, virtual_address);
+
+    if (vad != NULL && vad->space != NULL)
+    {
+        vad = find_vad_in_tree(vad->space->vad_root, virtual_address);
+    }
+
+    return vad;
+}
+
+// Returns TRUE if the pages from first_va up to last_va all lie inside a single allocation
+// Private only turns away section mappings, whose pages belong to the section rather than the allocation
+static BOOLEAN is_range_in_allocation(ULONG_PTR first_va, ULONG_PTR last_va, BOOLEAN private_only)
+{
+    EnterCriticalSection(&vad_tree_lock);
+    PVAD vad = find_vad((PVOID) first_va);
+    BOOLEAN inside = vad != NULL && last_va <= vad_end(vad) && (private_only == FALSE || vad->section == NULL);
+    LeaveCriticalSection(&vad_tree_lock);
+
+    return inside;
+}
+
+BOOLEAN is_va_allocated(PVOID virtual_address)
+{
+    EnterCriticalSection(&vad_tree_lock);
+    BOOLEAN allocated = find_vad(virtual_address) != NULL;
+    LeaveCriticalSection(&vad_tree_lock);
+
+    return allocated;
+}
+
+// Returns FALSE if the VA is not allocated. Otherwise section is set to the section mapped at the VA,
+// Or NULL for private memory, and section_page to the page of the section the VA falls on
+BOOLEAN find_va_section(PVOID virtual_address, PSECTION *section, PULONG64 section_page)
+{
+    EnterCriticalSection(&vad_tree_lock);
+
+    PVAD vad = find_vad(virtual_address);
+    if (vad != NULL)
+    {
+        *section = vad->section;
+        *section_page = ((ULONG_PTR) virtual_address - (ULONG_PTR) vad->start_va) / PAGE_SIZE;
+    }
+
+    LeaveCriticalSection(&vad_tree_lock);
+
+    return vad != NULL;
+}
+
+// Walks the VADs in address order and stops at the first gap before a VAD that fits the allocation
+// The cursor is left at the end of the last VAD when no gap between VADs fits
+static BOOLEAN find_gap_between_vads(PVAD vad, PULONG_PTR cursor, ULONG64 num_bytes, ULONG64 alignment)
+{
+    if (vad == NULL)
+    {
+        return FALSE;
+    }
+
+    if (find_gap_between_vads(vad->left, cursor, num_bytes, alignment))
+    {
+        return TRUE;
+    }
+
+    ULONG_PTR aligned_cursor = (*cursor + alignment - 1) & ~(alignment - 1);
+    if (aligned_cursor + num_bytes <= (ULONG_PTR) vad->start_va)
+    {
+        *cursor = aligned_cursor;
+        return TRUE;
+    }
+    *cursor = vad_end(vad);
+
+    return find_gap_between_vads(vad->right, cursor, num_bytes, alignment);
+}
+
+// Finds room for an allocation in a tree whose VADs all lie between range_start and range_end
+static PVOID find_free_va_range(PVAD root, ULONG_PTR range_start, ULONG_PTR range_end, ULONG64 num_bytes,
+                                ULONG64 alignment)
+{
+    ULONG_PTR cursor = range_start;
+
+    if (find_gap_between_vads(root, &cursor, num_bytes, alignment))
+    {
+        return (PVOID) cursor;
+    }
+
+    cursor = (cursor + alignment - 1) & ~(alignment - 1);
+    if (cursor + num_bytes <= range_end)
+    {
+        return (PVOID) cursor;
+    }
+
+    return NULL;
+}
+
+// Reserves a range of our VA space for private memory, or for a mapping of the given section
+// The range is taken from the slice of the given address space, or from the rest of the VA space if it is NULL
+// Ranges of a large page or more start on a large page boundary, so their regions can be promoted
+// Returns NULL if no free range is big enough
+PVOID allocate_va_range(PADDRESS_SPACE space, ULONG64 num_pages, PSECTION section)
+{
+    ULONG64 num_bytes = num_pages * PAGE_SIZE;
+    PVAD *root = &vad_root;
+    ULONG_PTR range_start = (ULONG_PTR) va_base;
+    ULONG_PTR range_end = (ULONG_PTR) va_base + virtual_address_size;
+
+    if (space != NULL)
+    {
+        root = &space->vad_root;
+        range_start = (ULONG_PTR) space->start_va;
+        range_end = range_start + space->num_pages * PAGE_SIZE;
+    }
+
+    PVAD vad = (PVAD) malloc(sizeof(VAD));
+    NULL_CHECK(vad, "allocate_va_range : could not allocate memory for a vad")
+
+    EnterCriticalSection(&vad_tree_lock);
+
+    PVOID start_va = NULL;
+    if (num_pages >= FRAMES_PER_LARGE_PAGE)
+    {
+        start_va = find_free_va_range(*root, range_start, range_end, num_bytes, LARGE_PAGE_SIZE);
+    }
+    if (start_va == NULL)
+    {
+        start_va = find_free_va_range(*root, range_start, range_end, num_bytes, PAGE_SIZE);
+    }
+
+    if (start_va == NULL)
+    {
+        LeaveCriticalSection(&vad_tree_lock);
+        free(vad);
+        return NULL;
+    }
+
+    vad->start_va = start_va;
+    vad->num_pages = num_pages;
+    vad->section = section;
+    vad->space = NULL;
+    *root = insert_vad(*root, vad);
+
+    LeaveCriticalSection(&vad_tree_lock);
+
+    return start_va;
+}
+
+// Reserves the slice of an address space. It starts on a region boundary and covers whole regions,
+// So that no PTE region is ever shared between two spaces
+// Returns NULL if no free range is big enough
+PVOID reserve_address_space_va(PADDRESS_SPACE space, ULONG64 num_pages)
+{
+    PVAD vad = (PVAD) malloc(sizeof(VAD));
+    NULL_CHECK(vad, "reserve_address_space_va : could not allocate memory for a vad")
+
+    EnterCriticalSection(&vad_tree_lock);
+
+    PVOID start_va = find_free_va_range(vad_root, (ULONG_PTR) va_base, (ULONG_PTR) va_base + virtual_address_size,
+                                        num_pages * PAGE_SIZE, PTE_REGION_SIZE * PAGE_SIZE);
+    if (start_va == NULL)
+    {
+        LeaveCriticalSection(&vad_tree_lock);
+        free(vad);
+        return NULL;
+    }
+
+    vad->start_va = start_va;
+    vad->num_pages = num_pages;
+    vad->section = NULL;
+    vad->space = space;
+    vad_root = insert_vad(vad_root, vad);
+
+    LeaveCriticalSection(&vad_tree_lock);
+
+    return start_va;
+}
+
+// Frees every allocation left in an address space and then gives back its slice
+VOID release_address_space_va(PADDRESS_SPACE space)
+{
+    while (TRUE)
+    {
+        PVAD removed = NULL;
+
+        EnterCriticalSection(&vad_tree_lock);
+        if (space->vad_root != NULL)
+        {
+            space->vad_root = remove_smallest_vad(space->vad_root, &removed);
+        }
+        LeaveCriticalSection(&vad_tree_lock);
+
+        if (removed == NULL)
+        {
+            break;
+        }
+
+        release_va_range(removed->start_va, removed->num_pages);
+        if (removed->section != NULL)
+        {
+            dereference_section(removed->section);
+        }
+        free(removed);
+    }
+
+    PVAD slice = NULL;
+
+    EnterCriticalSection(&vad_tree_lock);
+    vad_root = remove_vad(vad_root, space->start_va, &slice);
+    LeaveCriticalSection(&vad_tree_lock);
+
+    free(slice);
+}
+
+// Reserves a range of our VA space. No pages are given to it until it is touched
+// Returns NULL if no free range is big enough
+PVOID vm_alloc(ULONG64 num_bytes)
+{
+    if (num_bytes == 0)
+    {
+        return NULL;
+    }
+
+    return allocate_va_range(NULL, (num_bytes + PAGE_SIZE - 1) / PAGE_SIZE, NULL);
+}
+
+// Gives back an allocation made by vm_alloc or vm_map_section along with every page and disc slot behind it
+// Returns FALSE if virtual_address is not the start of an allocation
+BOOLEAN vm_free(PVOID virtual_address)
+{
+    PVAD removed = NULL;
+
+    // Once the VAD is gone, a first touch anywhere in the range is an access violation,
+    // So no new pages can appear behind our back while we release the old ones
+    // An allocation inside an address space comes out of the space's tree, and the slice itself is never freed here
+    EnterCriticalSection(&vad_tree_lock);
+    PVAD slice = find_vad_in_tree(vad_root, virtual_address);
+    if (slice != NULL && slice->space != NULL)
+    {
+        slice->space->vad_root = remove_vad(slice->space->vad_root, virtual_address, &removed);
+    }
+    else
+    {
+        vad_root = remove_vad(vad_root, virtual_address, &removed);
+    }
+    LeaveCriticalSection(&vad_tree_lock);
+
+    if (removed == NULL)
+    {
+        return FALSE;
+    }
+
+    release_va_range(removed->start_va, removed->num_pages);
+
+    // Freeing a section mapping unmaps it, and the section keeps its pages for its other mappings
+    if (removed->section != NULL)
+    {
+        dereference_section(removed->section);
+    }
+    free(removed);
+
+    return TRUE;
+}
+
+// Releases the pages and disc slots behind part of an allocation, which stays allocated and reads as zero afterwards
+// A section mapping would find the section's data again on the next fault, so it cannot be decommitted
+// Returns FALSE if the range is not inside a single private allocation
+BOOLEAN vm_decommit(PVOID virtual_address, ULONG64 num_bytes)
+{
+    ULONG_PTR first_va = (ULONG_PTR) virtual_address & ~(PAGE_SIZE - 1);
+    ULONG_PTR last_va = ((ULONG_PTR) virtual_address + num_bytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    if (last_va == first_va || is_range_in_allocation(first_va, last_va, TRUE) == FALSE)
+    {
+        return FALSE;
+    }
+
+    release_va_range((PVOID) first_va, (last_va - first_va) / PAGE_SIZE);
+    return TRUE;
+}
+
+// Tells the system that the contents of a range no longer matter, without giving up the range
+// Pages that are not in memory are released right away and read as zero when next touched
+// Pages in memory keep their contents for now, but are freed rather than written out when trimmed
+// Touching one of them again before that cancels the discard for that page, like MEM_RESET_UNDO
+// Only whole pages inside the range are discarded. Returns FALSE if the range is not inside a single private allocation
+BOOLEAN vm_discard(PVOID virtual_address, ULONG64 num_bytes)
+{
+    ULONG_PTR first_va = ((ULONG_PTR) virtual_address + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    ULONG_PTR last_va = ((ULONG_PTR) virtual_address + num_bytes) & ~(PAGE_SIZE - 1);
+
+    if (last_va <= first_va)
+    {
+        return FALSE;
+    }
+
+    if (is_range_in_allocation(first_va, last_va, TRUE) == FALSE)
+    {
+        return FALSE;
+    }
+
+    discard_va_range((PVOID) first_va, (last_va - first_va) / PAGE_SIZE);
+    return TRUE;
+}
+
+// Brings every page of a range into memory up front, like MAP_POPULATE, instead of one fault per page
+// This waits for pages when memory is short, so it only returns once the whole range is valid
+// Returns FALSE if the range is not inside a single private allocation
+BOOLEAN vm_populate(PVOID virtual_address, ULONG64 num_bytes)
+{
+    ULONG_PTR first_va = (ULONG_PTR) virtual_address & ~(PAGE_SIZE - 1);
+    ULONG_PTR last_va = ((ULONG_PTR) virtual_address + num_bytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    if (last_va == first_va)
+    {
+        return FALSE;
+    }
+
+    if (is_range_in_allocation(first_va, last_va, TRUE) == FALSE)
+    {
+        return FALSE;
+    }
+
+    populate_va_range((PVOID) first_va, (last_va - first_va) / PAGE_SIZE);
+    return TRUE;
+}
+
+// Pins a range in memory like VirtualLock. Every page is brought in and then kept from the trimmers until it is
+// Unlocked or freed. Pinning a page twice only pins it once
+// Returns FALSE if the range is not inside a single private allocation or pinning it would go over MAX_PINNED_PAGES,
+// Or over MAX_PINNED_PAGES_PER_ADDRESS_SPACE for the address space the allocation is in
+BOOLEAN vm_lock(PVOID virtual_address, ULONG64 num_bytes)
+{
+    ULONG_PTR first_va = (ULONG_PTR) virtual_address & ~(PAGE_SIZE - 1);
+    ULONG_PTR last_va = ((ULONG_PTR) virtual_address + num_bytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    ULONG64 num_pages = (last_va - first_va) / PAGE_SIZE;
+
+    if (last_va == first_va)
+    {
+        return FALSE;
+    }
+
+    if (is_range_in_allocation(first_va, last_va, TRUE) == FALSE)
+    {
+        return FALSE;
+    }
+
+    // The whole range is charged up front, so that concurrent callers cannot go over the quota between them
+    // Pages that turn out to be pinned already are given back afterwards
+    if (InterlockedAdd64(&pinned_page_count, (LONG64) num_pages) > (LONG64) MAX_PINNED_PAGES)
+    {
+        InterlockedAdd64(&pinned_page_count, 0 - (LONG64) num_pages);
+        return FALSE;
+    }
+
+    // An allocation never spans address spaces, so its first region tells which space pays for the pins
+    PPTE_REGION first_region = pte_region_from_pte(pte_from_va((PVOID) first_va));
+    if (charge_address_space_pins(first_region, (LONG64) num_pages) == FALSE)
+    {
+        InterlockedAdd64(&pinned_page_count, 0 - (LONG64) num_pages);
+        return FALSE;
+    }
+
+    ULONG64 num_pinned = pin_va_range((PVOID) first_va, num_pages);
+    InterlockedAdd64(&pinned_page_count, 0 - (LONG64) (num_pages - num_pinned));
+    charge_address_space_pins(first_region, 0 - (LONG64) (num_pages - num_pinned));
+
+    return TRUE;
+}
+
+// Lets the trimmers have a pinned range again. Returns FALSE if the range is not inside a single allocation
+BOOLEAN vm_unlock(PVOID virtual_address, ULONG64 num_bytes)
+{
+    ULONG_PTR first_va = (ULONG_PTR) virtual_address & ~(PAGE_SIZE - 1);
+    ULONG_PTR last_va = ((ULONG_PTR) virtual_address + num_bytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    if (last_va == first_va)
+    {
+        return FALSE;
+    }
+
+    if (is_range_in_allocation(first_va, last_va, FALSE) == FALSE)
+    {
+        return FALSE;
+    }
+
+    unpin_va_range((PVOID) first_va, (last_va - first_va) / PAGE_SIZE);
+    return TRUE;
+}
+
+// Tells the system how a range is going to be used, see advise.h for what each piece of advice does
+// Stored advice is kept per PTE region, so it also applies to the rest of every region the range touches
+// Returns FALSE if the advice is unknown or the range is not inside a single private allocation
+BOOLEAN vm_advise(PVOID virtual_address, ULONG64 num_bytes, ULONG advice)
+{
+    ULONG_PTR first_va = (ULONG_PTR) virtual_address & ~(PAGE_SIZE - 1);
+    ULONG_PTR last_va = ((ULONG_PTR) virtual_address + num_bytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    if (advice > VM_ADVICE_DONTNEED || last_va == first_va)
+    {
+        return FALSE;
+    }
+
+    if (is_range_in_allocation(first_va, last_va, TRUE) == FALSE)
+    {
+        return FALSE;
+    }
+
+    advise_va_range((PVOID) first_va, (last_va - first_va) / PAGE_SIZE, advice);
+    return TRUE;
+}
+
+// Makes a range read the same as another without copying it, see clone.h for how the pages are shared
+// Whatever the destination held before is released first. Both addresses must be page aligned
+// Returns FALSE if either range is not inside a single private allocation or the two ranges overlap
+BOOLEAN vm_clone(PVOID source_va, PVOID destination_va, ULONG64 num_bytes)
+{
+    ULONG_PTR source = (ULONG_PTR) source_va;
+    ULONG_PTR destination = (ULONG_PTR) destination_va;
+    ULONG64 num_pages = (num_bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+    ULONG64 range_size = num_pages * PAGE_SIZE;
+
+    if (((source | destination) & (PAGE_SIZE - 1)) != 0 || num_pages == 0)
+    {
+        return FALSE;
+    }
+
+    if (source < destination + range_size && destination < source + range_size)
+    {
+        return FALSE;
+    }
+
+    if (is_range_in_allocation(source, source + range_size, TRUE) == FALSE ||
+        is_range_in_allocation(destination, destination + range_size, TRUE) == FALSE)
+    {
+        return FALSE;
+    }
+
+    release_va_range(destination_va, num_pages);
+    clone_va_range(source_va, destination_va, num_pages);
+    return TRUE;
+}
+
+// Returns a PFN that is locked and no longer referenced by any PTE to the free state
+// Pages the modified writer is in the middle of writing are marked released instead, and it frees them when done
+static BOOLEAN release_pfn(PPFN pfn)
+{
+    PFN pfn_contents = read_pfn(pfn);
+    pfn_contents.pte = NULL;
+
+    if (pfn_contents.flags.reference != 0)
+    {
+        pfn_contents.flags.released = 1;
+        write_pfn(pfn, pfn_contents);
+        unlock_pfn(pfn);
+        return FALSE;
+    }
+
+    // A shared frame that was written out for the PTEs that let go of it gives up its hold on that slot
+    if (pfn_contents.flags.shared_on_disc == 1)
+    {
+        free_disc_index(pfn_contents.disc_index);
+        pfn_contents.flags.shared_on_disc = 0;
+    }
+
+    pfn_contents.flags.state = FREE;
+    pfn_contents.flags.dirtied = 0;
+    pfn_contents.flags.share_count = 0;
+    pfn_contents.flags.file_backed = 0;
+    pfn_contents.flags.file_dirty = 0;
+    pfn_contents.flags.written = 0;
+    pfn_contents.disc_index = 0;
+    write_pfn(pfn, pfn_contents);
+    return TRUE;
+}
+
+// Releases the page or disc slot behind a PTE in transition or disc format
+// The caller holds whatever lock keeps the PTE from being faulted in, the region lock or the section's
+// Returns the page to put on the free list, still locked, or NULL if there is none
+PPFN release_invalid_pte(PPTE pte, PULONG64 disc_slots_released)
+{
+    PTE pte_contents = read_pte(pte);
+
+    // The page of a mapped file on disc is in the file, which has no slot to give back
+    if (pte_contents.disc_format.on_disc == 1)
+    {
+        if ((pte_contents.entire_format & PTE_FILE_BIT) == 0)
+        {
+            free_disc_index(pte_contents.disc_format.disc_index);
+            (*disc_slots_released)++;
+        }
+        return NULL;
+    }
+
+    PPFN pfn = pfn_from_frame_number(pte_contents.transition_format.frame_number);
+    lock_pfn(pfn);
+
+    // Exactly as in the fault handler, the page may have been repurposed before we got its lock
+    pte_contents = read_pte(pte);
+    if (pte_contents.disc_format.on_disc == 1)
+    {
+        unlock_pfn(pfn);
+        if ((pte_contents.entire_format & PTE_FILE_BIT) == 0)
+        {
+            free_disc_index(pte_contents.disc_format.disc_index);
+            (*disc_slots_released)++;
+        }
+        return NULL;
+    }
+
+    if (pfn->flags.reference != 0)
+    {
+        // The modified writer has this page, it will see the released bit once the write finishes
+        release_pfn(pfn);
+        return NULL;
+    }
+
+    if (pfn->flags.state == MODIFIED)
+    {
+        PPFN_LIST modified_list = modified_list_from_pfn(pfn);
+        EnterCriticalSection(&modified_list->lock);
+        remove_from_list(pfn);
+        LeaveCriticalSection(&modified_list->lock);
+    }
+    else
+    {
+        PPFN_LIST standby_list = standby_list_from_pfn(pfn);
+        EnterCriticalSection(&standby_list->lock);
+        remove_from_list(pfn);
+        LeaveCriticalSection(&standby_list->lock);
+
+        if (pfn->flags.file_backed == 0)
+        {
+            free_disc_index(pfn->disc_index);
+            (*disc_slots_released)++;
+        }
+    }
+
+    zero_frame(frame_number_from_pfn(pfn));
+    release_pfn(pfn);
+    return pfn;
+}
+
+// Releases the pages behind [first_pte, last_pte), which all lie in the given region
+// When discarding, valid pages are only marked with the discard bit and everything else is released as usual
+static VOID release_region_range(PPTE_REGION region, PPTE first_pte, PPTE last_pte, BOOLEAN discard)
+{
+    PVOID unmap_vas[PTE_REGION_SIZE];
+    PPFN freed_pfns[PTE_REGION_SIZE];
+    PPFN section_pfns[PTE_REGION_SIZE];
+    BOOLEAN section_dirty[PTE_REGION_SIZE];
+    ULONG64 num_unmaps = 0;
+    ULONG64 num_freed = 0;
+    ULONG64 num_section_pages = 0;
+    ULONG64 disc_slots_released = 0;
+    ULONG64 pages_discarded = 0;
+    ULONG64 pages_unpinned = 0;
+
+    lock_pte_region(region);
+
+    // Disc format PTEs hold disc slots, so a paged out page of PTEs has to come back before it can be released
+    page_in_pte_page((ULONG64) (first_pte - pte_base) / PTE_REGION_SIZE);
+
+    PTE_REGION_AGE_COUNT old_count = region->age_count;
+    PTE_REGION_AGE_COUNT local_count = old_count;
+
+    for (PPTE pte = first_pte; pte < last_pte; pte++)
+    {
+        PTE pte_contents = read_pte(pte);
+        PPFN pfn;
+
+        if (pte_contents.entire_format == 0)
+        {
+            continue;
+        }
+
+        // Pinned pages keep their contents until they are unlocked, so discarding skips them
+        if (pte_contents.memory_format.valid == 1 && discard && (pte_contents.entire_format & PTE_PINNED_BIT))
+        {
+            continue;
+        }
+
+        if (pte_contents.memory_format.valid == 1 && discard)
+        {
+            // Clearing the accessed bit lets cpu_stamp see the next touch, which takes the discard back
+            PTE new_contents;
+            do {
+                pte_contents = read_pte(pte);
+                new_contents = pte_contents;
+                new_contents.entire_format |= PTE_DISCARD_BIT;
+                new_contents.memory_format.accessed = 0;
+            } while (InterlockedCompareExchange64((volatile LONG64 *) &pte->entire_format,
+                     new_contents.entire_format, pte_contents.entire_format) != pte_contents.entire_format);
+
+            pages_discarded++;
+            continue;
+        }
+
+        if (pte_contents.memory_format.valid == 1)
+        {
+            pfn = pfn_from_frame_number(pte_contents.memory_format.frame_number);
+            lock_pfn(pfn);
+
+            local_count.ages[pte_contents.memory_format.age]--;
+            policy_forget(pte_contents);
+
+            // Freeing a pinned page gives its share of the pin quota back
+            if (pte_contents.entire_format & PTE_PINNED_BIT)
+            {
+                pages_unpinned++;
+            }
+
+            // A section page belongs to the section, so it is only unmapped here and dropped once the VA is gone
+            if (pte_contents.entire_format & PTE_SECTION_BIT)
+            {
+                unmap_vas[num_unmaps] = va_from_pte(pte);
+                num_unmaps++;
+                section_pfns[num_section_pages] = pfn;
+                section_dirty[num_section_pages] = (pte_contents.entire_format & PTE_DIRTY_BIT) != 0;
+                num_section_pages++;
+            }
+            // A frame other PTEs still map only loses one of its sharers, and its contents are left alone
+            else if ((pte_contents.entire_format & PTE_COPY_ON_WRITE_BIT) && pfn->flags.share_count > 1)
+            {
+                PFN pfn_contents = read_pfn(pfn);
+                pfn_contents.flags.share_count--;
+                write_pfn(pfn, pfn_contents);
+                unlock_pfn(pfn);
+
+                unmap_vas[num_unmaps] = va_from_pte(pte);
+                num_unmaps++;
+            }
+            else
+            {
+                // The page is still mapped, so it is zeroed through its own VA before it is unmapped
+                PVOID virtual_address = va_from_pte(pte);
+                memset(virtual_address, 0, PAGE_SIZE);
+                unmap_vas[num_unmaps] = virtual_address;
+                num_unmaps++;
+
+                if (release_pfn(pfn))
+                {
+                    freed_pfns[num_freed] = pfn;
+                    num_freed++;
+                }
+            }
+        }
+        else
+        {
+            pfn = release_invalid_pte(pte, &disc_slots_released);
+            if (pfn != NULL)
+            {
+                freed_pfns[num_freed] = pfn;
+                num_freed++;
+            }
+        }
+
+        PTE zero_pte;
+        zero_pte.entire_format = 0;
+        write_pte(pte, zero_pte);
+    }
+
+    region->pinned_pages -= pages_unpinned;
+    charge_address_space_pins(region, 0 - (LONG64) pages_unpinned);
+
+    if (num_unmaps != 0)
+    {
+        unmap_pages_scatter(unmap_vas, num_unmaps);
+        demote_region(region);
+    }
+
+    // The section pages stayed locked until no VA of ours mapped them, so no other mapping could drop them first
+    for (ULONG64 i = 0; i < num_section_pages; i++)
+    {
+        unmap_section_page(section_pfns[i], section_dirty[i]);
+    }
+
+    if (num_freed != 0)
+    {
+        EnterCriticalSection(&free_page_list.lock);
+        for (ULONG64 i = 0; i < num_freed; i++)
+        {
+            add_to_list_tail(freed_pfns[i], &free_page_list);
+            unlock_pfn(freed_pfns[i]);
+        }
+        LeaveCriticalSection(&free_page_list.lock);
+    }
+
+    // The region leaves the age list of its old oldest age, and rejoins the one for its new oldest age if it has any
+    ULONG old_oldest_age = NUMBER_OF_AGES;
+    ULONG new_oldest_age = NUMBER_OF_AGES;
+    LONG64 resident_change = 0;
+    for (ULONG i = 0; i < NUMBER_OF_AGES; i++)
+    {
+        if (old_count.ages[i] != 0)
+        {
+            old_oldest_age = i;
+        }
+        if (local_count.ages[i] != 0)
+        {
+            new_oldest_age = i;
+        }
+
+        WriteUShortNoFence(&region->age_count.ages[i], local_count.ages[i]);
+        InterlockedAdd64((volatile LONG64 *) &global_age_count.pages_of_age[i],
+                         (LONG64) local_count.ages[i] - (LONG64) old_count.ages[i]);
+        resident_change += (LONG64) local_count.ages[i] - (LONG64) old_count.ages[i];
+    }
+    charge_address_space(region, resident_change);
+
+    if (old_oldest_age != new_oldest_age && old_oldest_age != NUMBER_OF_AGES)
+    {
+        PPTE_REGION_LIST old_listhead = &pte_region_age_lists[old_oldest_age];
+        EnterCriticalSection(&old_listhead->lock);
+        remove_region_from_list(region, old_listhead);
+        LeaveCriticalSection(&old_listhead->lock);
+
+        if (new_oldest_age == NUMBER_OF_AGES)
+        {
+            make_region_inactive(region);
+        }
+        else
+        {
+            PPTE_REGION_LIST new_listhead = &pte_region_age_lists[new_oldest_age];
+            EnterCriticalSection(&new_listhead->lock);
+            add_region_to_list(region, new_listhead);
+            LeaveCriticalSection(&new_listhead->lock);
+        }
+    }
+
+    unlock_pte_region(region);
+
+    InterlockedAdd64(&vm_pages_released, (LONG64) num_freed);
+    InterlockedAdd64(&vm_disc_slots_released, (LONG64) disc_slots_released);
+    InterlockedAdd64(&vm_pages_discarded, (LONG64) pages_discarded);
+    InterlockedAdd64(&pinned_page_count, 0 - (LONG64) pages_unpinned);
+}
+
+static VOID release_or_discard_va_range(PVOID virtual_address, ULONG64 num_pages, BOOLEAN discard)
+{
+    PPTE pte = pte_from_va(virtual_address);
+    PPTE last_pte = pte + num_pages;
+
+    while (pte < last_pte)
+    {
+        ULONG64 region_index = (ULONG64) (pte - pte_base) / PTE_REGION_SIZE;
+        PPTE region_end = min(pte_base + (region_index + 1) * PTE_REGION_SIZE, last_pte);
+
+        // A region that was never committed never had a page behind it
+        LONG state = *(volatile LONG *) &pte_directory[region_index];
+        if (state == PTE_REGION_COMMITTED || state == PTE_REGION_PAGED_OUT)
+        {
+            release_region_range(&pte_regions[region_index], pte, region_end, discard);
+        }
+
+        pte = region_end;
+    }
+
+    SetEvent(pages_available_event);
+}
+
+// Releases every page and disc slot behind a range of VA one region at a time and zeroes its PTEs
+VOID release_va_range(PVOID virtual_address, ULONG64 num_pages)
+{
+    release_or_discard_va_range(virtual_address, num_pages, FALSE);
+}
+
+VOID discard_va_range(PVOID virtual_address, ULONG64 num_pages)
+{
+    release_or_discard_va_range(virtual_address, num_pages, TRUE);
+}
+
+VOID print_api_statistics(VOID)
+{
+    printf("api : %lld pages and %lld disc slots released by vm_free, vm_decommit and vm_discard\n",
+           vm_pages_released, vm_disc_slots_released);
+    printf("api : %lld pages in memory marked for discard, %lld of them freed by the trimmer without a write\n",
+           vm_pages_discarded, trimmed_pages_discarded);
+}
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <Windows.h>
+#include "../include/vm.h"
+#include "../include/debug.h"
+
+// ARC splits resident pages into T1, pages seen once recently, and T2, pages seen at least twice
+// Pages trimmed from T1 and T2 leave ghosts for B1 and B2. Refaulting on a B1 ghost means T1 was too small,
+// And refaulting on a B2 ghost means T2 was too small. The target size of T1 moves toward whichever list missed
+// Pages are trimmed from T1 while it is larger than its target, and from T2 otherwise
+#define ARC_T2_BIT                               PTE_POLICY_BIT_0
+
+#define ARC_B1_GHOST                             GHOST_TYPE_1
+#define ARC_B2_GHOST                             GHOST_TYPE_2
+
+volatile LONG64 arc_t1_pages;
+volatile LONG64 arc_t2_pages;
+// This is the p of the ARC paper, the number of pages T1 should hold
+volatile LONG64 arc_t1_target;
+
+VOID arc_initialize(VOID)
+{
+    arc_t1_pages = 0;
+    arc_t2_pages = 0;
+    arc_t1_target = 0;
+}
+
+// A page in T1 that is used again moves to T2
+VOID arc_on_access(PPTE pte, PTE contents, BOOLEAN accessed)
+{
+    if (accessed && (contents.entire_format & ARC_T2_BIT) == 0) {
+        update_policy_bits(pte, 0, ARC_T2_BIT);
+        InterlockedDecrement64(&arc_t1_pages);
+        InterlockedIncrement64(&arc_t2_pages);
+    }
+}
+
+ULONG64 arc_on_fault(PTE old_contents, ULONG fault_type)
+{
+    ULONG ghost_type = fault_type == FAULT_FIRST_ACCESS ? GHOST_NONE : live_ghost_type(old_contents);
+
+    if (ghost_type == GHOST_NONE) {
+        InterlockedIncrement64(&arc_t1_pages);
+        return 0;
+    }
+
+    consume_ghost(old_contents);
+
+    LONG64 b1_ghosts = max(1, (LONG64) count_live_ghosts(ARC_B1_GHOST));
+    LONG64 b2_ghosts = max(1, (LONG64) count_live_ghosts(ARC_B2_GHOST));
+    LONG64 target = arc_t1_target;
+
+    // The target moves further the smaller the list that missed, exactly as in the paper
+    if (ghost_type == ARC_B1_GHOST) {
+        target = min((LONG64) physical_page_count, target + max(1, b2_ghosts / b1_ghosts));
+    } else {
+        target = max(0, target - max(1, b1_ghosts / b2_ghosts));
+    }
+    InterlockedExchange64(&arc_t1_target, target);
+
+    // Either way the page has now been seen twice
+    InterlockedIncrement64(&arc_t2_pages);
+    return ARC_T2_BIT;
+}
+
+ULONG arc_select_trim_candidate(PTE contents, PGLOBAL_AGE_COUNT trim_of_age)
+{
+    BOOLEAN in_t2 = (contents.entire_format & ARC_T2_BIT) != 0;
+    LONG64 t1_pages = arc_t1_pages;
+
+    // Take from T1 while it is over its target, unless T2 is empty and there is nothing else to take
+    BOOLEAN trim_t1 = (t1_pages > arc_t1_target && t1_pages > 0) || arc_t2_pages <= 0;
+
+    if (in_t2 == trim_t1) {
+        return NO_TRIM;
+    }
+    return find_trim_quota(contents, trim_of_age);
+}
+
+ULONG64 arc_on_evict(PTE contents)
+{
+    if (contents.entire_format & ARC_T2_BIT) {
+        InterlockedDecrement64(&arc_t2_pages);
+        return make_ghost(ARC_B2_GHOST);
+    }
+
+    InterlockedDecrement64(&arc_t1_pages);
+    return make_ghost(ARC_B1_GHOST);
+}
+
+VOID arc_on_forget(PTE contents)
+{
+    if (contents.entire_format & ARC_T2_BIT) {
+        InterlockedDecrement64(&arc_t2_pages);
+    } else {
+        InterlockedDecrement64(&arc_t1_pages);
+    }
+}
+
+REPLACEMENT_POLICY arc_policy = {
+    "arc",
+    arc_initialize,
+    arc_on_access,
+    arc_on_fault,
+    arc_select_trim_candidate,
+    arc_on_evict,
+    arc_on_forget,
+    NULL,
+    NULL,
+    NULL,
+    FALSE
+};
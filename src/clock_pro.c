@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <Windows.h>
+#include "../include/vm.h"
+#include "../include/debug.h"
+
+// CLOCK-Pro sorts resident pages into hot and cold pages by how soon they are reused
+// The region walks stand in for the clock hands, as they already sweep every valid PTE
+// A cold page starts a test period when it is brought in, and if it is reused during that period it becomes hot
+// Cold pages are trimmed first. A cold page trimmed during its test period leaves a ghost behind,
+// And refaulting on that ghost means memory was too small for it, so the cold target grows
+#define CLOCK_PRO_HOT_BIT                        PTE_POLICY_BIT_0
+#define CLOCK_PRO_TEST_BIT                       PTE_POLICY_BIT_1
+
+#define CLOCK_PRO_TEST_GHOST                     GHOST_TYPE_1
+
+volatile LONG64 clock_pro_resident_pages;
+volatile LONG64 clock_pro_hot_pages;
+// The number of resident pages CLOCK-Pro wants to keep cold, which adapts to the workload
+volatile LONG64 clock_pro_cold_target;
+
+VOID clock_pro_initialize(VOID)
+{
+    clock_pro_resident_pages = 0;
+    clock_pro_hot_pages = 0;
+    // Start with a small cold area, as the paper does, and let the ghosts grow it
+    clock_pro_cold_target = max(1, (LONG64) physical_page_count / 100);
+}
+
+VOID clock_pro_on_access(PPTE pte, PTE contents, BOOLEAN accessed)
+{
+    BOOLEAN hot = (contents.entire_format & CLOCK_PRO_HOT_BIT) != 0;
+    BOOLEAN in_test = (contents.entire_format & CLOCK_PRO_TEST_BIT) != 0;
+
+    if (accessed) {
+        // A cold page reused during its test period has a short reuse distance and becomes hot
+        if (hot == FALSE && in_test) {
+            update_policy_bits(pte, CLOCK_PRO_TEST_BIT, CLOCK_PRO_HOT_BIT);
+            InterlockedIncrement64(&clock_pro_hot_pages);
+        }
+        // Otherwise a reused cold page starts a new test period
+        else if (hot == FALSE) {
+            update_policy_bits(pte, 0, CLOCK_PRO_TEST_BIT);
+        }
+        return;
+    }
+
+    if (hot) {
+        // The hot hand demotes unused hot pages while there are more hot pages than the cold target allows
+        LONG64 hot_target = clock_pro_resident_pages - clock_pro_cold_target;
+        if (clock_pro_hot_pages > hot_target) {
+            update_policy_bits(pte, CLOCK_PRO_HOT_BIT, 0);
+            InterlockedDecrement64(&clock_pro_hot_pages);
+        }
+    }
+    else if (in_test) {
+        // A whole sweep passed without a reuse, so the test period ends and the cold area was too big for it
+        update_policy_bits(pte, CLOCK_PRO_TEST_BIT, 0);
+        if (clock_pro_cold_target > 1) {
+            InterlockedDecrement64(&clock_pro_cold_target);
+        }
+    }
+}
+
+ULONG64 clock_pro_on_fault(PTE old_contents, ULONG fault_type)
+{
+    InterlockedIncrement64(&clock_pro_resident_pages);
+
+    if (fault_type != FAULT_FIRST_ACCESS && live_ghost_type(old_contents) == CLOCK_PRO_TEST_GHOST) {
+        consume_ghost(old_contents);
+
+        // The page came back during its test period, so it is hot and the cold area should grow
+        if (clock_pro_cold_target < clock_pro_resident_pages) {
+            InterlockedIncrement64(&clock_pro_cold_target);
+        }
+        InterlockedIncrement64(&clock_pro_hot_pages);
+        return CLOCK_PRO_HOT_BIT;
+    }
+
+    // Every new page is cold and in its test period
+    return CLOCK_PRO_TEST_BIT;
+}
+
+// Only cold pages are trimmed
+ULONG clock_pro_select_trim_candidate(PTE contents, PGLOBAL_AGE_COUNT trim_of_age)
+{
+    if (contents.entire_format & CLOCK_PRO_HOT_BIT) {
+        return NO_TRIM;
+    }
+    return find_trim_quota(contents, trim_of_age);
+}
+
+ULONG64 clock_pro_on_evict(PTE contents)
+{
+    InterlockedDecrement64(&clock_pro_resident_pages);
+
+    if (contents.entire_format & CLOCK_PRO_HOT_BIT) {
+        InterlockedDecrement64(&clock_pro_hot_pages);
+        return 0;
+    }
+
+    // Cold pages still in their test period are remembered until the ghost expires
+    if (contents.entire_format & CLOCK_PRO_TEST_BIT) {
+        return make_ghost(CLOCK_PRO_TEST_GHOST);
+    }
+    return 0;
+}
+
+VOID clock_pro_on_forget(PTE contents)
+{
+    InterlockedDecrement64(&clock_pro_resident_pages);
+
+    if (contents.entire_format & CLOCK_PRO_HOT_BIT) {
+        InterlockedDecrement64(&clock_pro_hot_pages);
+    }
+}
+
+REPLACEMENT_POLICY clock_pro_policy = {
+    "clock-pro",
+    clock_pro_initialize,
+    clock_pro_on_access,
+    clock_pro_on_fault,
+    clock_pro_select_trim_candidate,
+    clock_pro_on_evict,
+    clock_pro_on_forget,
+    NULL,
+    NULL,
+    NULL,
+    FALSE
+};
@@ -0,0 +1,479 @@
+#include <stdio.h>
+#include <Windows.h>
+#include "../include/vm.h"
+#include "../include/debug.h"
+
+PVOID clone_copy_va;
+CRITICAL_SECTION clone_copy_va_lock;
+
+volatile LONG64 pages_shared_by_clone;
+volatile LONG64 disc_slots_shared_by_clone;
+volatile LONG64 pages_copied_by_clone;
+volatile LONG64 copy_on_write_faults;
+volatile LONG64 copy_on_write_copies;
+volatile LONG64 copy_on_write_ptes_unshared;
+
+// The CPU stamps valid PTEs without the region lock, so the copy on write bit is swapped in and out
+static VOID set_copy_on_write(PPTE pte, BOOLEAN copy_on_write)
+{
+    PTE old_contents;
+    PTE new_contents;
+
+    do {
+        old_contents = read_pte(pte);
+        new_contents = old_contents;
+        if (copy_on_write) {
+            new_contents.entire_format |= PTE_COPY_ON_WRITE_BIT;
+        } else {
+            new_contents.entire_format &= ~PTE_COPY_ON_WRITE_BIT;
+        }
+    } while (InterlockedCompareExchange64((volatile LONG64 *) &pte->entire_format,
+             new_contents.entire_format, old_contents.entire_format) != (LONG64) old_contents.entire_format);
+}
+
+// Copies one frame into another, neither of which is mapped anywhere else we could copy through
+static VOID copy_frame(ULONG_PTR source_frame, ULONG_PTR destination_frame)
+{
+    ULONG_PTR frames[2];
+    frames[0] = source_frame;
+    frames[1] = destination_frame;
+
+    EnterCriticalSection(&clone_copy_va_lock);
+
+    map_pages(clone_copy_va, 2, frames);
+    memcpy((PVOID) ((ULONG_PTR) clone_copy_va + PAGE_SIZE), clone_copy_va, PAGE_SIZE);
+    unmap_pages(clone_copy_va, 2);
+
+    LeaveCriticalSection(&clone_copy_va_lock);
+}
+
+// Locks both regions, lowest address first so that two clones running the other way round cannot deadlock
+static VOID lock_region_pair(PPTE_REGION first, PPTE_REGION second)
+{
+    if (first == second) {
+        lock_pte_region(first);
+    } else if (first < second) {
+        lock_pte_region(first);
+        lock_pte_region(second);
+    } else {
+        lock_pte_region(second);
+        lock_pte_region(first);
+    }
+}
+
+static VOID unlock_region_pair(PPTE_REGION first, PPTE_REGION second)
+{
+    unlock_pte_region(first);
+    if (first != second) {
+        unlock_pte_region(second);
+    }
+}
+
+// Hands a locked frame that only one PTE still maps to that PTE as its private page
+// The disc slot the frame held for the PTEs that let go of it is given up, a private page is written out afresh
+static VOID make_frame_private(PPFN pfn, PPTE pte)
+{
+    PFN pfn_contents = read_pfn(pfn);
+    if (pfn_contents.flags.shared_on_disc == 1) {
+        free_disc_index(pfn_contents.disc_index);
+        pfn_contents.flags.shared_on_disc = 0;
+        pfn_contents.disc_index = 0;
+    }
+    pfn_contents.pte = pte;
+    pfn_contents.flags.share_count = 0;
+    write_pfn(pfn, pfn_contents);
+
+    set_copy_on_write(pte, FALSE);
+}
+
+// A PTE that holds a page in memory which nothing else maps any more is made an ordinary private PTE again
+// Called with the PTE's region locked. Returns FALSE if the page is still shared
+BOOLEAN make_copy_on_write_private(PPTE pte)
+{
+    PPFN pfn = pfn_from_frame_number(read_pte(pte).memory_format.frame_number);
+    lock_pfn(pfn);
+
+    if (pfn->flags.share_count > 1) {
+        unlock_pfn(pfn);
+        return FALSE;
+    }
+
+    make_frame_private(pfn, pte);
+
+    unlock_pfn(pfn);
+    return TRUE;
+}
+
+// Lets one PTE go of a frame that other PTEs still share, leaving it in disc format on a share of the frame's slot
+// Nothing can write a shared frame, so the frame is written to disc once and that copy stays good for every PTE after
+// Called with the PTE's region locked. Returns FALSE if the frame is no longer shared or there was no disc slot to be had
+BOOLEAN unshare_copy_on_write_pte(PPTE pte)
+{
+    PTE old_contents = read_pte(pte);
+    PPFN pfn = pfn_from_frame_number(old_contents.memory_format.frame_number);
+    PVOID page_va = va_from_pte(pte);
+    lock_pfn(pfn);
+
+    if (pfn->flags.share_count <= 1) {
+        unlock_pfn(pfn);
+        return FALSE;
+    }
+
+    PFN pfn_contents = read_pfn(pfn);
+
+    if (pfn_contents.flags.shared_on_disc == 0) {
+        ULONG64 disc_index;
+        if (get_disc_indices(&disc_index, 1) != 1) {
+            unlock_pfn(pfn);
+            return FALSE;
+        }
+
+        // The page is still mapped at this PTE's VA, so it is written straight from there
+        write_to_pagefile(disc_index, page_va);
+        pfn_contents.disc_index = disc_index;
+        pfn_contents.flags.shared_on_disc = 1;
+    }
+
+    share_disc_index(pfn_contents.disc_index);
+
+    unmap_pages(page_va, 1);
+
+    // The mapping leaves the working set like a trimmed page, so the policy can leave a ghost in the disc PTE
+    PTE disc_contents;
+    disc_contents.entire_format = replacement_policy->on_evict(old_contents);
+    disc_contents.disc_format.on_disc = 1;
+    disc_contents.disc_format.disc_index = pfn_contents.disc_index;
+    write_pte(pte, disc_contents);
+
+    pfn_contents.flags.share_count--;
+    write_pfn(pfn, pfn_contents);
+
+    unlock_pfn(pfn);
+
+    InterlockedIncrement64(&copy_on_write_ptes_unshared);
+    return TRUE;
+}
+
+// Gives a destination PTE its own copy of a locked source page, mapped nowhere yet. The source page is unlocked
+// Returns NULL if there was no page to copy into
+static PPFN clone_by_copy(PPFN pfn, PPTE destination)
+{
+    PPFN copy = get_free_page();
+    if (copy == NULL)
+    {
+        unlock_pfn(pfn);
+        return NULL;
+    }
+
+    copy_frame(frame_number_from_pfn(pfn), frame_number_from_pfn(copy));
+    unlock_pfn(pfn);
+
+    PFN copy_contents = read_pfn(copy);
+    copy_contents.pte = destination;
+    copy_contents.disc_index = 0;
+    copy_contents.flags.state = ACTIVE;
+    copy_contents.flags.dirtied = 0;
+    copy_contents.flags.share_count = 0;
+    write_pfn(copy, copy_contents);
+
+    // The new mapping is charged to the policy like a page brought in by a soft fault
+    PTE destination_contents;
+    destination_contents.entire_format = policy_fault(read_pte(destination), FAULT_SOFT);
+    destination_contents.memory_format.valid = 1;
+    destination_contents.memory_format.frame_number = frame_number_from_pfn(copy);
+    write_pte(destination, destination_contents);
+
+    unlock_pfn(copy);
+    return copy;
+}
+
+// Clones num_ptes source PTEs that all lie in one region onto destination PTEs that all lie in one region
+// Returns the number of PTEs done, which is less than num_ptes if we ran out of pages to copy modified pages into
+static ULONG64 clone_region_range(PPTE source_pte, PPTE destination_pte, ULONG64 num_ptes)
+{
+    ULONG64 source_index = (ULONG64) (source_pte - pte_base) / PTE_REGION_SIZE;
+    ULONG64 destination_index = (ULONG64) (destination_pte - pte_base) / PTE_REGION_SIZE;
+    PPTE_REGION source_region = &pte_regions[source_index];
+    PPTE_REGION destination_region = &pte_regions[destination_index];
+
+    PVOID virtual_addresses[PTE_REGION_SIZE];
+    ULONG_PTR frame_numbers[PTE_REGION_SIZE];
+    ULONG64 num_mapped = 0;
+    ULONG64 num_shared = 0;
+    ULONG64 num_disc_shared = 0;
+    ULONG64 num_copied = 0;
+    ULONG64 i;
+
+    // A source region that was never touched has nothing to clone, and the destination was already emptied
+    if (*(volatile LONG *) &pte_directory[source_index] == PTE_REGION_UNCOMMITTED) {
+        return num_ptes;
+    }
+
+    commit_pte_region(destination_index);
+
+    lock_region_pair(source_region, destination_region);
+
+    page_in_pte_page(source_index);
+    page_in_pte_page(destination_index);
+
+    for (i = 0; i < num_ptes; i++)
+    {
+        PPTE source = source_pte + i;
+        PPTE destination = destination_pte + i;
+        PTE local = read_pte(source);
+        PTE destination_contents;
+        destination_contents.entire_format = 0;
+
+        // Destination pages touched since the range was emptied belong to whoever touched them
+        if (local.entire_format == 0 || read_pte(destination).entire_format != 0) {
+            continue;
+        }
+
+        if (local.memory_format.valid == 1)
+        {
+            PPFN pfn = pfn_from_frame_number(local.memory_format.frame_number);
+            lock_pfn(pfn);
+
+            // A frame shared as many times as its count can hold is copied for the clone instead
+            if (pfn->flags.share_count == MAX_FRAME_SHARERS)
+            {
+                PPFN copy = clone_by_copy(pfn, destination);
+                if (copy == NULL)
+                {
+                    break;
+                }
+
+                virtual_addresses[num_mapped] = va_from_pte(destination);
+                frame_numbers[num_mapped] = frame_number_from_pfn(copy);
+                num_mapped++;
+                num_copied++;
+                continue;
+            }
+
+            PFN pfn_contents = read_pfn(pfn);
+            pfn_contents.flags.share_count = max(pfn_contents.flags.share_count, 1) + 1;
+            write_pfn(pfn, pfn_contents);
+
+            set_copy_on_write(source, TRUE);
+
+            // The new mapping is charged to the policy like a page brought in by a soft fault
+            destination_contents.entire_format = policy_fault(destination_contents, FAULT_SOFT);
+            destination_contents.memory_format.valid = 1;
+            destination_contents.memory_format.frame_number = local.memory_format.frame_number;
+            destination_contents.entire_format |= PTE_COPY_ON_WRITE_BIT;
+            write_pte(destination, destination_contents);
+
+            unlock_pfn(pfn);
+
+            virtual_addresses[num_mapped] = va_from_pte(destination);
+            frame_numbers[num_mapped] = local.memory_format.frame_number;
+            num_mapped++;
+            num_shared++;
+            continue;
+        }
+
+        ULONG64 disc_index;
+
+        if (local.disc_format.on_disc == 1)
+        {
+            disc_index = local.disc_format.disc_index;
+        }
+        else
+        {
+            PPFN pfn = pfn_from_frame_number(local.transition_format.frame_number);
+            lock_pfn(pfn);
+
+            // The page can be repurposed before we get its lock, exactly as in the fault handler
+            local = read_pte(source);
+            if (local.disc_format.on_disc == 1)
+            {
+                unlock_pfn(pfn);
+                disc_index = local.disc_format.disc_index;
+            }
+            // Standby pages already have their contents on disc, so the clone can share the slot
+            else if (pfn->flags.state == STANDBY && pfn->flags.reference == 0)
+            {
+                disc_index = pfn->disc_index;
+                share_disc_index(disc_index);
+                unlock_pfn(pfn);
+
+                destination_contents.disc_format.on_disc = 1;
+                destination_contents.disc_format.disc_index = disc_index;
+                write_pte(destination, destination_contents);
+                num_disc_shared++;
+                continue;
+            }
+            // Modified pages have no copy on disc yet, so the clone gets its own copy of the page now
+            else
+            {
+                PPFN copy = clone_by_copy(pfn, destination);
+                if (copy == NULL)
+                {
+                    break;
+                }
+
+                virtual_addresses[num_mapped] = va_from_pte(destination);
+                frame_numbers[num_mapped] = frame_number_from_pfn(copy);
+                num_mapped++;
+                num_copied++;
+                continue;
+            }
+        }
+
+        share_disc_index(disc_index);
+        destination_contents.disc_format.on_disc = 1;
+        destination_contents.disc_format.disc_index = disc_index;
+        write_pte(destination, destination_contents);
+        num_disc_shared++;
+    }
+
+    if (num_mapped != 0) {
+        map_pages_scatter(virtual_addresses, num_mapped, frame_numbers);
+
+        if (!is_region_active(destination_region)) {
+            make_region_active(destination_region);
+            EnterCriticalSection(&pte_region_age_lists[0].lock);
+            add_region_to_list(destination_region, &pte_region_age_lists[0]);
+            LeaveCriticalSection(&pte_region_age_lists[0].lock);
+        }
+
+        if (replacement_policy->filter_region_walks) {
+            bloom_filter_insert_region(destination_region);
+        }
+
+        destination_region->age_count.ages[0] += (USHORT) num_mapped;
+        InterlockedAdd64((volatile LONG64 *) &global_age_count.pages_of_age[0], (LONG64) num_mapped);
+        charge_address_space(destination_region, (LONG64) num_mapped);
+    }
+
+    unlock_region_pair(source_region, destination_region);
+
+    InterlockedAdd64(&pages_shared_by_clone, (LONG64) num_shared);
+    InterlockedAdd64(&disc_slots_shared_by_clone, (LONG64) num_disc_shared);
+    InterlockedAdd64(&pages_copied_by_clone, (LONG64) num_copied);
+
+    return i;
+}
+
+// Makes the destination range read the same as the source range, the destination must already be empty
+// The range is cut into pieces that lie in one source region and one destination region
+VOID clone_va_range(PVOID source_va, PVOID destination_va, ULONG64 num_pages)
+{
+    PPTE source_pte = pte_from_va(source_va);
+    PPTE destination_pte = pte_from_va(destination_va);
+    ULONG64 pages_done = 0;
+
+    while (pages_done < num_pages)
+    {
+        ULONG64 source_room = PTE_REGION_SIZE - (ULONG64) (source_pte - pte_base) % PTE_REGION_SIZE;
+        ULONG64 destination_room = PTE_REGION_SIZE - (ULONG64) (destination_pte - pte_base) % PTE_REGION_SIZE;
+        ULONG64 num_ptes = min(num_pages - pages_done, min(source_room, destination_room));
+
+        // The pages mapped into the destination count against the hard limit of its address space,
+        // Which trims itself first with no region locked, just as a fault would
+        PPTE_REGION destination_region = &pte_regions[(ULONG64) (destination_pte - pte_base) / PTE_REGION_SIZE];
+        if (is_address_space_at_hard_limit(destination_region, num_ptes)) {
+            enforce_address_space_limits(destination_region, num_ptes);
+        }
+
+        ULONG64 ptes_done = clone_region_range(source_pte, destination_pte, num_ptes);
+
+        source_pte += ptes_done;
+        destination_pte += ptes_done;
+        pages_done += ptes_done;
+
+        // We ran out of pages to copy modified pages into, so we wait for more without any locks held
+        if (ptes_done < num_ptes) {
+            wait_for_pages();
+        }
+    }
+}
+
+// Gives the writer of a copy on write page its own copy of it, or the page itself if nothing else maps it any more
+// The caller checks again afterwards, as this returns without a copy when it had to wait for a page
+VOID copy_on_write_fault(PVOID virtual_address)
+{
+    PPTE pte = pte_from_va(virtual_address);
+    NULL_CHECK(pte, "copy_on_write_fault : could not get pte from va")
+
+    lock_pte(pte);
+
+    PTE local = read_pte(pte);
+    if (local.memory_format.valid == 0 || (local.entire_format & PTE_COPY_ON_WRITE_BIT) == 0) {
+        unlock_pte(pte);
+        return;
+    }
+
+    InterlockedIncrement64(&copy_on_write_faults);
+
+    PPFN pfn = pfn_from_frame_number(local.memory_format.frame_number);
+    lock_pfn(pfn);
+
+    // Every other PTE has let go of the page already, so the write can go straight to it
+    if (pfn->flags.share_count <= 1) {
+        make_frame_private(pfn, pte);
+
+        unlock_pfn(pfn);
+        unlock_pte(pte);
+        return;
+    }
+
+    // The shared page is active and on no list, so holding its lock here cannot block get_free_page
+    PPFN copy = get_free_page();
+    if (copy == NULL) {
+        unlock_pfn(pfn);
+        unlock_pte(pte);
+        wait_for_pages();
+        return;
+    }
+
+    ULONG_PTR copy_frame_number = frame_number_from_pfn(copy);
+    PVOID page_va = va_from_pte(pte);
+
+    // The shared page is still mapped at our own VA, so it is copied straight from there
+    EnterCriticalSection(&clone_copy_va_lock);
+    map_pages(clone_copy_va, 1, &copy_frame_number);
+    memcpy(clone_copy_va, page_va, PAGE_SIZE);
+    unmap_pages(clone_copy_va, 1);
+    LeaveCriticalSection(&clone_copy_va_lock);
+
+    PFN pfn_contents = read_pfn(pfn);
+    pfn_contents.flags.share_count--;
+    write_pfn(pfn, pfn_contents);
+
+    PFN copy_contents = read_pfn(copy);
+    copy_contents.pte = pte;
+    copy_contents.disc_index = 0;
+    copy_contents.flags.state = ACTIVE;
+    copy_contents.flags.dirtied = 0;
+    copy_contents.flags.share_count = 0;
+    write_pfn(copy, copy_contents);
+
+    // Only the frame and the copy on write bit change, the age and accessed bits are the CPU's to keep
+    PTE old_contents;
+    PTE new_contents;
+    do {
+        old_contents = read_pte(pte);
+        new_contents = old_contents;
+        new_contents.memory_format.frame_number = copy_frame_number;
+        new_contents.entire_format &= ~PTE_COPY_ON_WRITE_BIT;
+    } while (InterlockedCompareExchange64((volatile LONG64 *) &pte->entire_format,
+             new_contents.entire_format, old_contents.entire_format) != (LONG64) old_contents.entire_format);
+
+    map_pages(page_va, 1, &copy_frame_number);
+
+    unlock_pfn(copy);
+    unlock_pfn(pfn);
+    unlock_pte(pte);
+
+    InterlockedIncrement64(&copy_on_write_copies);
+}
+
+VOID print_clone_statistics(VOID)
+{
+    printf("clone : %lld pages shared, %lld disc slots shared and %lld modified pages copied by vm_clone\n",
+           pages_shared_by_clone, disc_slots_shared_by_clone, pages_copied_by_clone);
+    printf("clone : %lld copy on write faults, %lld of them needed a copy\n",
+           copy_on_write_faults, copy_on_write_copies);
+    printf("clone : %lld PTEs let go of a shared page when trimmed\n", copy_on_write_ptes_unshared);
+}
@@ -145,7 +145,8 @@ VOID log_access(ULONG is_pte, PVOID ppte_or_fn, ULONG operation)
     else {
         log_entry.pte_ptr = pte;
         log_entry.pte_val = *pte;
-        log_entry.virtual_address = va_from_pte(pte);
+        // The prototype PTEs of sections live outside of the page table and have no VA of their own
+        log_entry.virtual_address = (pte >= pte_base && pte < pte_end) ? va_from_pte(pte) : NULL;
     }
 
     log_entry.pfn_ptr = pfn;
@@ -175,6 +176,14 @@ VOID print_va_access_rate(VOID)
     PPTE pte = pte_base;
     while (pte != pte_end)
     {
+        // Skip whole regions that were never touched, as their PTEs are not committed
+        if ((pte - pte_base) % PTE_REGION_SIZE == 0 &&
+            is_pte_region_committed((ULONG64) (pte - pte_base) / PTE_REGION_SIZE) == FALSE)
+        {
+            pte = min(pte + PTE_REGION_SIZE, pte_end);
+            continue;
+        }
+
         if (pte->entire_format != 0)
         {
             accessed_ptes++;
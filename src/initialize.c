@@ -22,6 +22,10 @@ PFAULT_STATS fault_stats;
 PHANDLE system_handles;
 PULONG system_thread_ids;
 
+// These are handles to the pool of threads that age PTE regions for the aging thread
+PHANDLE aging_worker_handles;
+PULONG aging_worker_thread_ids;
+
 HANDLE physical_page_handle;
 
 // These are handles to our events, which are used to signal between threads
@@ -34,7 +38,6 @@ HANDLE system_start_event;
 HANDLE shared_memory_section;
 
 // These are the locks used in our system
-CRITICAL_SECTION modified_write_va_lock;
 CRITICAL_SECTION modified_read_va_lock;
 CRITICAL_SECTION repurpose_zero_va_lock;
 
@@ -125,13 +128,22 @@ HANDLE CreateSharedMemorySection(VOID) {
 VOID initialize_locks(VOID)
 {
     set_initialize_status("initialize_system", "setting up locks");
-    INITIALIZE_LOCK(modified_write_va_lock);
     INITIALIZE_LOCK(modified_read_va_lock);
     INITIALIZE_LOCK(repurpose_zero_va_lock);
+    INITIALIZE_LOCK(populate_read_va_lock);
+    INITIALIZE_LOCK(clone_copy_va_lock);
 
     INITIALIZE_LOCK(free_page_list.lock);
-    INITIALIZE_LOCK(standby_page_list.lock);
-    INITIALIZE_LOCK(modified_page_list.lock);
+    for (ULONG i = 0; i < NUMBER_OF_STANDBY_PRIORITIES; i++)
+    {
+        INITIALIZE_LOCK(standby_page_lists[i].lock);
+    }
+    for (ULONG i = 0; i < NUMBER_OF_MODIFIED_SHARDS; i++)
+    {
+        INITIALIZE_LOCK(modified_page_lists[i].lock);
+    }
+
+    INITIALIZE_LOCK(aging_round_lock);
 }
 
 // This function is used to initialize all the events used in the system
@@ -139,14 +151,23 @@ VOID initialize_events(VOID)
 {
     set_initialize_status("initialize_system", "setting up events");
     // Synchronization Events
-    mw_wake_event = CreateEvent(NULL, FALSE, FALSE, NULL);
-    NULL_CHECK(mw_wake_event, "initialize_events : could not initialize modified_writing_event")
+    for (ULONG i = 0; i < NUMBER_OF_MODIFIED_WRITERS; i++)
+    {
+        mw_wake_events[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
+        NULL_CHECK(mw_wake_events[i], "initialize_events : could not initialize modified_writing_event")
+    }
 
     age_wake_event = CreateEvent(NULL, FALSE, FALSE, NULL);
     NULL_CHECK(age_wake_event, "initialize_events : could not initialize age_wake_event")
 
-    trim_wake_event = CreateEvent(NULL, FALSE, FALSE, NULL);
-    NULL_CHECK(trim_wake_event, "initialize_events : could not initialize trim_wake_event")
+    for (ULONG i = 0; i < NUMBER_OF_TRIMMING_THREADS; i++)
+    {
+        trim_wake_events[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
+        NULL_CHECK(trim_wake_events[i], "initialize_events : could not initialize trim_wake_event")
+    }
+
+    aging_round_done_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    NULL_CHECK(aging_round_done_event, "initialize_events : could not initialize aging_round_done_event")
 
     pages_available_event = CreateEvent(NULL, FALSE, FALSE, NULL);
     NULL_CHECK(pages_available_event, "initialize_events : could not initialize pages_available_event")
@@ -185,6 +206,7 @@ VOID initialize_threads(VOID)
     // Initialize faulting thread stat counters
     for (ULONG i = 0; i < NUMBER_OF_FAULTING_THREADS; i++)
     {
+        fault_stats[i].num_accesses = 0;
         fault_stats[i].num_faults = 0;
         fault_stats[i].num_first_accesses = 0;
         fault_stats[i].num_reaccesses = 0;
@@ -197,21 +219,51 @@ VOID initialize_threads(VOID)
     system_thread_ids = (PULONG) malloc(NUMBER_OF_SYSTEM_THREADS * sizeof(ULONG));
     NULL_CHECK(system_thread_ids, "initialize_threads : could not allocate memory for system_thread_ids")
 
-    system_handles[0] = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)
-    trimming_thread,(LPVOID) (ULONG_PTR) 0, 0, &system_thread_ids[0]);
-    NULL_CHECK(system_handles[0], "initialize_threads : could not initialize thread handle for trimming_thread")
+    // The first system threads are the trimmers, each one is told its own index
+    for (ULONG i = 0; i < NUMBER_OF_TRIMMING_THREADS; i++)
+    {
+        system_handles[i] = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)
+        trimming_thread,(LPVOID) (ULONG_PTR) i, 0, &system_thread_ids[i]);
+        NULL_CHECK(system_handles[i], "initialize_threads : could not initialize thread handle for trimming_thread")
+    }
+
+    ULONG index = NUMBER_OF_TRIMMING_THREADS;
+
+    // The modified writers come next, and are told their writer index rather than their system thread index
+    for (ULONG i = 0; i < NUMBER_OF_MODIFIED_WRITERS; i++)
+    {
+        system_handles[index] = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)
+        modified_write_thread,(LPVOID) (ULONG_PTR) i, 0, &system_thread_ids[index]);
+        NULL_CHECK(system_handles[index], "initialize_threads : could not initialize thread handle for modified_write_thread")
+        index++;
+    }
+
+    system_handles[index] = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)
+    task_scheduling_thread,(LPVOID) (ULONG_PTR) index, 0, &system_thread_ids[index]);
+    NULL_CHECK(system_handles[index], "initialize_threads : could not initialize thread handle for task_scheduling_thread")
+    index++;
 
-    system_handles[1] = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)
-    modified_write_thread,(LPVOID) (ULONG_PTR) 1, 0, &system_thread_ids[1]);
-    NULL_CHECK(system_handles[1], "initialize_threads : could not initialize thread handle for modified_write_thread")
+    system_handles[index] = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)
+    aging_thread,(LPVOID) (ULONG_PTR) index, 0, &system_thread_ids[index]);
+    NULL_CHECK(system_handles[index], "initialize_threads : could not initialize thread handle for aging_thread");
+    index++;
 
-    system_handles[2] = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)
-    task_scheduling_thread,(LPVOID) (ULONG_PTR) 2, 0, &system_thread_ids[2]);
-    NULL_CHECK(system_handles[2], "initialize_threads : could not initialize thread handle for task_scheduling_thread")
+    system_handles[index] = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)
+    prefetch_thread,(LPVOID) (ULONG_PTR) index, 0, &system_thread_ids[index]);
+    NULL_CHECK(system_handles[index], "initialize_threads : could not initialize thread handle for prefetch_thread")
 
-    system_handles[3] = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)
-    aging_thread,(LPVOID) (ULONG_PTR) 3, 0, &system_thread_ids[3]);
-    NULL_CHECK(system_handles[3], "initialize_threads : could not initialize thread handle for aging_thread");
+    aging_worker_handles = (PHANDLE) malloc(number_of_aging_workers * sizeof(HANDLE));
+    NULL_CHECK(aging_worker_handles, "initialize_threads : could not allocate memory for aging_worker_handles")
+
+    aging_worker_thread_ids = (PULONG) malloc(number_of_aging_workers * sizeof(ULONG));
+    NULL_CHECK(aging_worker_thread_ids, "initialize_threads : could not allocate memory for aging_worker_thread_ids")
+
+    for (ULONG i = 0; i < number_of_aging_workers; i++)
+    {
+        aging_worker_handles[i] = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)
+        aging_worker_thread,(LPVOID) (ULONG_PTR) i, 0, &aging_worker_thread_ids[i]);
+        NULL_CHECK(aging_worker_handles[i], "initialize_threads : could not initialize thread handle for aging_worker_thread")
+    }
 }
 
 
@@ -309,6 +361,10 @@ VOID initialize_page_file_bitmap(VOID)
     NULL_CHECK(freed_spaces, "malloc failed to allocate memory for the freed spaces array");
     freed_spaces_size = 0;
 
+    // No slot is shared until vm_clone shares one
+    disc_slot_sharers = (volatile LONG *) malloc(NUMBER_OF_DISC_PAGES * sizeof(LONG));
+    NULL_CHECK(disc_slot_sharers, "malloc failed to allocate memory for the disc slot sharers");
+    memset((PVOID) disc_slot_sharers, 0, NUMBER_OF_DISC_PAGES * sizeof(LONG));
 }
 
 // This function initializes our page lists
@@ -319,11 +375,17 @@ VOID initialize_page_lists(VOID)
     initialize_listhead(&free_page_list);
     free_page_list.num_pages = 0;
 
-    initialize_listhead(&modified_page_list);
-    modified_page_list.num_pages = 0;
+    for (ULONG i = 0; i < NUMBER_OF_MODIFIED_SHARDS; i++)
+    {
+        initialize_listhead(&modified_page_lists[i]);
+        modified_page_lists[i].num_pages = 0;
+    }
 
-    initialize_listhead(&standby_page_list);
-    standby_page_list.num_pages = 0;
+    for (ULONG i = 0; i < NUMBER_OF_STANDBY_PRIORITIES; i++)
+    {
+        initialize_listhead(&standby_page_lists[i]);
+        standby_page_lists[i].num_pages = 0;
+    }
 
 }
 
@@ -338,9 +400,18 @@ VOID initialize_system_va_space(VOID)
 
     set_initialize_status("initialize_system", "setting up system VAs");
 
-    modified_write_va = VirtualAlloc2(NULL, NULL, PAGE_SIZE * MAX_MOD_BATCH, MEM_RESERVE | MEM_PHYSICAL,
-                                    PAGE_READWRITE, &parameter, 1);
-    NULL_CHECK(modified_write_va, "initialize_system_va_space : could not reserve memory for modified write va")
+    // Every modified writer gets a private window so that writers never wait on each other to map pages
+    for (ULONG i = 0; i < NUMBER_OF_MODIFIED_WRITERS; i++)
+    {
+        modified_writers[i].write_va = VirtualAlloc2(NULL, NULL, PAGE_SIZE * MAX_MOD_BATCH, MEM_RESERVE | MEM_PHYSICAL,
+                                        PAGE_READWRITE, &parameter, 1);
+        NULL_CHECK(modified_writers[i].write_va, "initialize_system_va_space : could not reserve memory for modified write va")
+
+        // Writers start on different shards and search different parts of the page file bitmap
+        modified_writers[i].home_shard = i % NUMBER_OF_MODIFIED_SHARDS;
+        modified_writers[i].next_shard = modified_writers[i].home_shard;
+        modified_writers[i].first_disc_region = i * BITMAP_SIZE_IN_REGIONS / NUMBER_OF_MODIFIED_WRITERS;
+    }
 
     modified_read_va = VirtualAlloc2(NULL, NULL, PAGE_SIZE, MEM_RESERVE | MEM_PHYSICAL,
                                     PAGE_READWRITE, &parameter, 1);
@@ -349,6 +420,27 @@ VOID initialize_system_va_space(VOID)
     repurpose_zero_va = VirtualAlloc2(NULL, NULL, PAGE_SIZE, MEM_RESERVE | MEM_PHYSICAL,
                                     PAGE_READWRITE, &parameter, 1);
     NULL_CHECK(repurpose_zero_va, "initialize_system_va_space : could not reserve memory for repurpose zero va")
+
+    populate_read_va = VirtualAlloc2(NULL, NULL, PAGE_SIZE * PTE_REGION_SIZE, MEM_RESERVE | MEM_PHYSICAL,
+                                     PAGE_READWRITE, &parameter, 1);
+    NULL_CHECK(populate_read_va, "initialize_system_va_space : could not reserve memory for populate read va")
+
+    clone_copy_va = VirtualAlloc2(NULL, NULL, PAGE_SIZE * 2, MEM_RESERVE | MEM_PHYSICAL,
+                                  PAGE_READWRITE, &parameter, 1);
+    NULL_CHECK(clone_copy_va, "initialize_system_va_space : could not reserve memory for clone copy va")
+
+    // Promotion needs two large pages to copy between, the large page benchmark uses all of it
+    MEM_ADDRESS_REQUIREMENTS requirements = { 0 };
+    requirements.Alignment = LARGE_PAGE_SIZE;
+
+    MEM_EXTENDED_PARAMETER aligned_parameters[2] = { 0 };
+    aligned_parameters[0] = parameter;
+    aligned_parameters[1].Type = MemExtendedParameterAddressRequirements;
+    aligned_parameters[1].Pointer = &requirements;
+
+    large_page_copy_va = VirtualAlloc2(NULL, NULL, max(2, LARGE_PAGE_BENCHMARK_RUNS) * LARGE_PAGE_SIZE,
+                                       MEM_RESERVE | MEM_PHYSICAL, PAGE_READWRITE, aligned_parameters, 2);
+    NULL_CHECK(large_page_copy_va, "initialize_system_va_space : could not reserve memory for large page copy va")
 }
 
 // This function initializes our virtual address space
@@ -368,12 +460,18 @@ VOID initialize_user_va_space(VOID)
     virtual_address_size &= ~(PAGE_SIZE - 1);
 
     // TODO make global
-    MEM_EXTENDED_PARAMETER parameter = { 0 };
-    parameter.Type = MemExtendedParameterUserPhysicalHandle;
-    parameter.Handle = shared_memory_section;
+    MEM_EXTENDED_PARAMETER parameters[2] = { 0 };
+    parameters[0].Type = MemExtendedParameterUserPhysicalHandle;
+    parameters[0].Handle = shared_memory_section;
+
+    // Aligning the base to a large page lines every PTE region up with a large page of VA
+    MEM_ADDRESS_REQUIREMENTS requirements = { 0 };
+    requirements.Alignment = LARGE_PAGE_SIZE;
+    parameters[1].Type = MemExtendedParameterAddressRequirements;
+    parameters[1].Pointer = &requirements;
 
     va_base = VirtualAlloc2(NULL, NULL, virtual_address_size, MEM_RESERVE | MEM_PHYSICAL,
-                            PAGE_READWRITE, &parameter, 1);
+                            PAGE_READWRITE, parameters, 2);
 
     // va_base = VirtualAlloc(NULL, virtual_address_size,MEM_RESERVE | MEM_PHYSICAL,
     //                        PAGE_READWRITE);
@@ -382,20 +480,45 @@ VOID initialize_user_va_space(VOID)
     //va__end = va_base + virtual_address_size;
 }
 
-VOID initialize_pte_regions(VOID) {
-    // Initialize the locks for the PTE regions
-    // Add PTE_REGION_SIZE - 1 to virtual_address_size to round up in case of an uneven division
-    ULONG64 num_pte_regions = (virtual_address_size + PTE_REGION_SIZE - 1) / PTE_REGION_COVERAGE_IN_BYTES;
-    pte_regions = malloc(num_pte_regions * sizeof(PTE_REGION));
-    pte_regions_end = pte_regions + num_pte_regions;
-    NULL_CHECK(pte_regions, "initialize_pte_regions : could not allocate memory for pte regions");
-    memset(pte_regions, 0, num_pte_regions * sizeof(PTE_REGION));
+// This reserves the PFN array, putting it on large pages when LARGE_PAGE_METADATA is set and the OS has them
+// Large pages need the lock memory privilege, which we already hold for AWE, and are committed in full right away
+// So they are only used when the array is not much bigger than the used_bytes of it we will actually commit
+// Otherwise, or if they cannot be had, the array is only reserved and its PFNs are committed in 4KB pieces as before
+// The PTEs and PTE regions are never put on large pages, as they are committed lazily and paged out while cold
+PVOID reserve_metadata(ULONG64 num_bytes, ULONG64 used_bytes, PBOOLEAN on_large_pages)
+{
+    *on_large_pages = FALSE;
 
-    for (ULONG64 i = 0; i < num_pte_regions; i++) {
-        // No need to update age counts as this only applies to active pages
-        // Initialize the critical section for the PTE region
-        InitializeCriticalSection(&pte_regions[i].lock);
+#if LARGE_PAGE_METADATA
+    ULONG64 large_page_minimum = GetLargePageMinimum();
+    if (large_page_minimum != 0)
+    {
+        ULONG64 rounded_bytes = (num_bytes + large_page_minimum - 1) & ~(large_page_minimum - 1);
+        ULONG64 rounded_used_bytes = (used_bytes + large_page_minimum - 1) & ~(large_page_minimum - 1);
+
+        // Committing the whole span only pays when our frames fill most of it
+        if (rounded_bytes <= rounded_used_bytes * LARGE_PAGE_METADATA_MAX_OVERCOMMIT)
+        {
+            PVOID result = VirtualAlloc(NULL, rounded_bytes, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                                        PAGE_READWRITE);
+            if (result != NULL)
+            {
+                *on_large_pages = TRUE;
+                return result;
+            }
+        }
     }
+#endif
+
+    return VirtualAlloc(NULL, num_bytes, MEM_RESERVE, PAGE_READWRITE);
+}
+
+VOID initialize_pte_regions(VOID) {
+    // The PTE regions are only reserved here, each one is committed and has its lock initialized on first touch
+    // Like the PFNs, this keeps the lookup between a PTE and its region O(1) without paying for untouched VA
+    pte_regions = VirtualAlloc(NULL, number_of_pte_regions * sizeof(PTE_REGION), MEM_RESERVE, PAGE_READWRITE);
+    NULL_CHECK(pte_regions, "initialize_pte_regions : could not reserve memory for pte regions");
+    pte_regions_end = pte_regions + number_of_pte_regions;
 
     pte_region_age_lists = malloc(NUMBER_OF_AGES * sizeof(PTE_REGION_LIST));
     NULL_CHECK(pte_region_age_lists, "initialize_pte_regions : could not allocate memory for pte region age lists");
@@ -417,13 +540,24 @@ VOID initialize_pte_metadata(VOID)
 {
     set_initialize_status("initialize_system", "creating PTEs");
 
-    ULONG_PTR num_pte_bytes = virtual_address_size / PAGE_SIZE * sizeof(PTE);
+    ULONG_PTR num_ptes = virtual_address_size / PAGE_SIZE;
+
+    // Round up to a whole number of regions so that every region has a full page of PTEs to commit
+    number_of_pte_regions = (num_ptes + PTE_REGION_SIZE - 1) / PTE_REGION_SIZE;
 
-    pte_base = malloc(num_pte_bytes);
-    NULL_CHECK(pte_base, "initialize_pte_metadata : could not allocate memory for pte metadata")
-    pte_end = pte_base + num_pte_bytes / sizeof(PTE);
+    // The PTEs are only reserved. Each region's page of PTEs is committed when a fault first lands in it,
+    // So the page table only takes memory for the VA that is actually used
+    pte_base = VirtualAlloc(NULL, number_of_pte_regions * PTE_REGION_COVERAGE_IN_BYTES, MEM_RESERVE, PAGE_READWRITE);
+    NULL_CHECK(pte_base, "initialize_pte_metadata : could not reserve memory for pte metadata")
+    pte_end = pte_base + num_ptes;
 
-    memset(pte_base, 0, num_pte_bytes);
+    // The directory is committed up front, but the OS only backs the pages of it that are written
+    pte_directory = VirtualAlloc(NULL, number_of_pte_regions * sizeof(LONG), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    NULL_CHECK(pte_directory, "initialize_pte_metadata : could not allocate memory for the pte directory")
+
+    // Only the entries of regions that actually get paged out are ever written
+    pte_page_disc_indices = VirtualAlloc(NULL, number_of_pte_regions * sizeof(ULONG64), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    NULL_CHECK(pte_page_disc_indices, "initialize_pte_metadata : could not allocate memory for the pte page disc indices")
 }
 
 VOID insert_tail_list(PLIST_ENTRY listhead, PLIST_ENTRY entry) {
@@ -451,7 +585,7 @@ VOID initialize_pfn_metadata(VOID)
     // For example, we could have frame numbers 2, 7, and 10, but not 3, 4, 5, 6, 8, or 9
     // We will only commit memory for the PFNs that we actually have in our page pool
     // While reserving memory for all of them in order to have a O(1) lookup time between a frame number and its pfn
-    pfn_base = VirtualAlloc(NULL, num_pfn_bytes, MEM_RESERVE, PAGE_READWRITE);
+    pfn_base = reserve_metadata(num_pfn_bytes, physical_page_count * sizeof(PFN), &pfns_on_large_pages);
     NULL_CHECK(pfn_base, "initialize_pfn_metadata : could not reserve memory for pfn metadata")
 
     // pfn_base -= lowest_frame_number * sizeof(PFN);
@@ -472,31 +606,34 @@ VOID initialize_pfn_metadata(VOID)
         // Calculate the offset for the current frame number
         ULONG_PTR offset = frame_number * sizeof(PFN);
 
+        // Large pages come committed and zeroed, so the pfn only needs initializing
+        if (pfns_on_large_pages == FALSE) {
 #ifdef PFN_SIZE_NOT_DIVISIBLE_BY_PAGE_SIZE
-        // Check if the PFN stretches between two 4K virtual addresses
-        if ((offset / PAGE_SIZE) != ((offset + sizeof(PFN) - 1) / PAGE_SIZE))
-        {
-            // Commit memory for the next page as well
-            LPVOID result = VirtualAlloc((BYTE*)pfn_base + offset, sizeof(PFN) + PAGE_SIZE, MEM_COMMIT, PAGE_READWRITE);
-            //NULL_CHECK(result, "initialize_pfn_metadata : could not commit memory for pfn metadata")
-            if (result == NULL) {
-                DebugBreak();
+            // Check if the PFN stretches between two 4K virtual addresses
+            if ((offset / PAGE_SIZE) != ((offset + sizeof(PFN) - 1) / PAGE_SIZE))
+            {
+                // Commit memory for the next page as well
+                LPVOID result = VirtualAlloc((BYTE*)pfn_base + offset, sizeof(PFN) + PAGE_SIZE, MEM_COMMIT, PAGE_READWRITE);
+                //NULL_CHECK(result, "initialize_pfn_metadata : could not commit memory for pfn metadata")
+                if (result == NULL) {
+                    DebugBreak();
+                }
             }
-        }
-        else
+            else
 #endif
-        {
-            // Commit memory for the pfn inside our reserved chunk
-            LPVOID result = VirtualAlloc((BYTE*) pfn_base + offset, sizeof(PFN), MEM_COMMIT, PAGE_READWRITE);
-            NULL_CHECK(result, "initialize_pfn_metadata : could not commit memory for pfn metadata")
-        }
+            {
+                // Commit memory for the pfn inside our reserved chunk
+                LPVOID result = VirtualAlloc((BYTE*) pfn_base + offset, sizeof(PFN), MEM_COMMIT, PAGE_READWRITE);
+                NULL_CHECK(result, "initialize_pfn_metadata : could not commit memory for pfn metadata")
+            }
 
-        // Commits memory for the pfn inside our reserved chunk
-        LPVOID result = VirtualAlloc(pfn_base + physical_page_numbers[i], sizeof(PFN),
-                                     MEM_COMMIT, PAGE_READWRITE);
+            // Commits memory for the pfn inside our reserved chunk
+            LPVOID result = VirtualAlloc(pfn_base + physical_page_numbers[i], sizeof(PFN),
+                                         MEM_COMMIT, PAGE_READWRITE);
 
-        // If we could not commit memory for the pfn, we need to exit
-        NULL_CHECK(result, "initialize_pfn_metadata : could not commit memory for pfn metadata")
+            // If we could not commit memory for the pfn, we need to exit
+            NULL_CHECK(result, "initialize_pfn_metadata : could not commit memory for pfn metadata")
+        }
 
         // Initializes the pfn
         memset(pfn_base + physical_page_numbers[i], 0, sizeof(PFN));
@@ -574,6 +711,38 @@ VOID initialize_time_measures(VOID) {
                &age_time_index, AGE_TIMES_TO_TRACK);
 }
 
+// This sizes the aging pool to the cores left over by the faulting and system threads
+// And gives each worker a deque large enough to hold every task of a sweep
+VOID initialize_aging_pool(VOID)
+{
+    set_initialize_status("initialize_system", "creating the aging pool");
+
+    SYSTEM_INFO system_info;
+    GetSystemInfo(&system_info);
+
+    LONG spare_cores = (LONG) system_info.dwNumberOfProcessors - NUMBER_OF_FAULTING_THREADS - NUMBER_OF_SYSTEM_THREADS;
+    number_of_aging_workers = (ULONG) max(1, min(spare_cores, MAX_NUMBER_OF_AGING_THREADS));
+
+    ULONG64 num_regions = (ULONG64) (pte_regions_end - pte_regions);
+    max_aging_tasks = (num_regions + REGIONS_PER_AGING_TASK - 1) / REGIONS_PER_AGING_TASK;
+
+    aging_workers = (PAGING_WORKER) malloc(number_of_aging_workers * sizeof(AGING_WORKER));
+    NULL_CHECK(aging_workers, "initialize_aging_pool : could not allocate memory for the aging workers")
+    memset(aging_workers, 0, number_of_aging_workers * sizeof(AGING_WORKER));
+
+    for (ULONG i = 0; i < number_of_aging_workers; i++)
+    {
+        aging_workers[i].tasks = (PAGING_TASK) malloc(max_aging_tasks * sizeof(AGING_TASK));
+        NULL_CHECK(aging_workers[i].tasks, "initialize_aging_pool : could not allocate memory for an aging deque")
+
+        INITIALIZE_LOCK(aging_workers[i].lock);
+        initialize_trim_batch(&aging_workers[i].trim_batch);
+
+        aging_workers[i].wake_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+        NULL_CHECK(aging_workers[i].wake_event, "initialize_aging_pool : could not initialize an aging wake event")
+    }
+}
+
 void initialize_console(void) {
     InitializeCriticalSection(&console_lock);
 
@@ -594,11 +763,25 @@ void initialize_console(void) {
 VOID run_system(VOID)
 {
     // This sets the event to start the system
+    mark_run_start();
     SetEvent(system_start_event);
 
     // This waits for the tests to finish running before exiting the function
     // Our controlling thread will wait for this function to finish before exiting the test and reporting stats
     WaitForMultipleObjects(NUMBER_OF_FAULTING_THREADS, faulting_handles, TRUE, INFINITE);
+    mark_run_end();
+
+#if AGING_POOL_BENCHMARK
+    benchmark_aging_pool();
+#endif
+
+#if METADATA_WALK_BENCHMARK
+    benchmark_metadata_walks();
+#endif
+
+#if POPULATE_BENCHMARK
+    benchmark_populate();
+#endif
 }
 
 // This function fully initializes our system
@@ -630,12 +813,34 @@ VOID initialize_system (VOID) {
 
     initialize_system_va_space();
 
+    initialize_large_pages();
+
+#if LARGE_PAGE_BENCHMARK
+    benchmark_large_pages();
+#endif
+
     initialize_pte_metadata();
 
     initialize_pte_regions();
 
+    initialize_vad_tree();
+    initialize_address_spaces();
+
+    initialize_advice();
+    initialize_sections();
+    initialize_mapped_files();
+
+    initialize_aging_pool();
+
     initialize_time_measures();
 
+    set_initialize_status("initialize_system", "selecting the PTE scan kernel");
+    initialize_pte_scan();
+
+    initialize_replacement_policy();
+
+    initialize_admission_control();
+
     set_initialize_status("initialize_system", "system successfully initialized, running tests");
 
     initialize_threads();
@@ -655,14 +860,43 @@ VOID deinitialize_system (VOID)
     // We need to close all system threads and wait for them to exit before proceeding
     // This happens so that no thread tries to access a data structure that we have freed
     SetEvent(system_exit_event);
-    WaitForMultipleObjects(NUMBER_OF_FAULTING_THREADS, system_handles, TRUE, INFINITE);
+    WaitForMultipleObjects(NUMBER_OF_SYSTEM_THREADS, system_handles, TRUE, INFINITE);
+    WaitForMultipleObjects(number_of_aging_workers, aging_worker_handles, TRUE, INFINITE);
+
+    print_aging_statistics();
+    print_trim_statistics();
+    print_modified_write_statistics();
+    print_standby_statistics();
+    print_policy_statistics();
+    print_refault_statistics();
+    print_admission_statistics();
+    print_large_page_statistics();
+    print_api_statistics();
+    print_advice_statistics();
+    print_populate_statistics();
+    print_clone_statistics();
+    print_section_statistics();
+    print_mapped_file_statistics();
+    print_address_space_statistics();
 
     // Now that we're done with our memory, we are able to free it
-    free(pte_base);
+    VirtualFree(pte_base, 0, MEM_RELEASE);
+    VirtualFree(pte_regions, 0, MEM_RELEASE);
+    VirtualFree((PVOID) pte_directory, 0, MEM_RELEASE);
+    VirtualFree(pte_page_disc_indices, 0, MEM_RELEASE);
     VirtualFree(modified_read_va, PAGE_SIZE, MEM_RELEASE);
-    VirtualFree(modified_write_va, PAGE_SIZE, MEM_RELEASE);
+    VirtualFree(large_page_copy_va, 0, MEM_RELEASE);
+    VirtualFree(populate_read_va, 0, MEM_RELEASE);
+    VirtualFree(clone_copy_va, 0, MEM_RELEASE);
+    free(large_page_runs);
+    for (ULONG i = 0; i < NUMBER_OF_MODIFIED_WRITERS; i++)
+    {
+        VirtualFree(modified_writers[i].write_va, 0, MEM_RELEASE);
+    }
     VirtualFree(va_base, virtual_address_size, MEM_RELEASE);
     free(page_file_bitmap);
+    free((PVOID) disc_slot_sharers);
+    free(region_address_spaces);
     delete_pagefile();
 
     VirtualFree(pfn_base, physical_page_numbers[physical_page_count - 1] * sizeof(PFN),
@@ -678,6 +912,8 @@ VOID deinitialize_system (VOID)
     free(fault_stats);
     free(system_handles);
     free(system_thread_ids);
+    free(aging_worker_handles);
+    free(aging_worker_thread_ids);
 
     set_initialize_status("deinitialize_system", "tests finished, system successfully deinitialized");
 }
\ No newline at end of file
@@ -0,0 +1,449 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <Windows.h>
+#include "../include/vm.h"
+#include "../include/debug.h"
+
+PULONG64 large_page_runs;
+ULONG64 number_of_large_page_runs;
+
+PVOID large_page_copy_va;
+CRITICAL_SECTION large_page_copy_va_lock;
+
+volatile LONG64 regions_promoted;
+volatile LONG64 regions_demoted;
+volatile LONG64 promotions_without_run;
+volatile LONG64 promotions_with_referenced_pages;
+
+// Runs are handed out round-robin so that the allocator does not keep retrying the same busy runs first
+volatile ULONG64 next_large_page_run;
+
+static int compare_frame_numbers(const void *first, const void *second)
+{
+    ULONG_PTR first_frame = *(const ULONG_PTR *) first;
+    ULONG_PTR second_frame = *(const ULONG_PTR *) second;
+
+    if (first_frame < second_frame) {
+        return -1;
+    }
+    return first_frame > second_frame;
+}
+
+// Finds every aligned run of FRAMES_PER_LARGE_PAGE frames among the pages the OS gave us
+// The OS hands out pages in no particular order, so they are sorted first
+VOID initialize_large_pages(VOID)
+{
+    set_initialize_status("initialize_system", "finding contiguous runs of frames");
+
+    INITIALIZE_LOCK(large_page_copy_va_lock);
+
+    PULONG_PTR sorted_frames = (PULONG_PTR) malloc(physical_page_count * sizeof(ULONG_PTR));
+    NULL_CHECK(sorted_frames, "initialize_large_pages : could not allocate memory for the sorted frame numbers")
+    memcpy(sorted_frames, physical_page_numbers, physical_page_count * sizeof(ULONG_PTR));
+    qsort(sorted_frames, physical_page_count, sizeof(ULONG_PTR), compare_frame_numbers);
+
+    large_page_runs = (PULONG64) malloc((physical_page_count / FRAMES_PER_LARGE_PAGE + 1) * sizeof(ULONG64));
+    NULL_CHECK(large_page_runs, "initialize_large_pages : could not allocate memory for the large page runs")
+    number_of_large_page_runs = 0;
+
+    ULONG64 i = 0;
+    while (i + FRAMES_PER_LARGE_PAGE <= physical_page_count)
+    {
+        ULONG_PTR first_frame = sorted_frames[i];
+
+        // The frames are sorted and unique, so the run is contiguous exactly when its last frame is where it should be
+        // Frame zero is never a valid frame number, so a run cannot start there
+        if (first_frame != 0 && first_frame % FRAMES_PER_LARGE_PAGE == 0 &&
+            sorted_frames[i + FRAMES_PER_LARGE_PAGE - 1] == first_frame + FRAMES_PER_LARGE_PAGE - 1)
+        {
+            large_page_runs[number_of_large_page_runs] = first_frame;
+            number_of_large_page_runs++;
+            i += FRAMES_PER_LARGE_PAGE;
+        }
+        else
+        {
+            i++;
+        }
+    }
+
+    free(sorted_frames);
+}
+
+// Takes a whole run of free frames off the free list and returns them locked in frame_numbers
+// Runs that are partly in use or have a page locked by someone else are skipped
+BOOLEAN allocate_large_page_run(PULONG_PTR frame_numbers)
+{
+    if (number_of_large_page_runs == 0 ||
+        *(volatile ULONG_PTR *) &free_page_list.num_pages < FRAMES_PER_LARGE_PAGE)
+    {
+        return FALSE;
+    }
+
+    EnterCriticalSection(&free_page_list.lock);
+
+    for (ULONG64 attempt = 0; attempt < number_of_large_page_runs; attempt++)
+    {
+        ULONG64 run = (next_large_page_run + attempt) % number_of_large_page_runs;
+        ULONG_PTR first_frame = large_page_runs[run];
+        ULONG64 locked_pages = 0;
+
+        // The free list lock comes before the PFN locks, exactly as when popping from it
+        for (; locked_pages < FRAMES_PER_LARGE_PAGE; locked_pages++)
+        {
+            PPFN pfn = pfn_from_frame_number(first_frame + locked_pages);
+            if (try_lock_pfn(pfn) == FALSE)
+            {
+                break;
+            }
+            if (pfn->flags.state != FREE)
+            {
+                unlock_pfn(pfn);
+                break;
+            }
+        }
+
+        if (locked_pages != FRAMES_PER_LARGE_PAGE)
+        {
+            for (ULONG64 i = 0; i < locked_pages; i++)
+            {
+                unlock_pfn(pfn_from_frame_number(first_frame + i));
+            }
+            continue;
+        }
+
+        for (ULONG64 i = 0; i < FRAMES_PER_LARGE_PAGE; i++)
+        {
+            remove_from_list(pfn_from_frame_number(first_frame + i));
+            frame_numbers[i] = first_frame + i;
+        }
+
+        next_large_page_run = run + 1;
+        LeaveCriticalSection(&free_page_list.lock);
+        return TRUE;
+    }
+
+    LeaveCriticalSection(&free_page_list.lock);
+    return FALSE;
+}
+
+// Puts locked, free frames back on the free list and unlocks them
+VOID free_large_page_run(PULONG_PTR frame_numbers)
+{
+    EnterCriticalSection(&free_page_list.lock);
+    for (ULONG64 i = 0; i < FRAMES_PER_LARGE_PAGE; i++)
+    {
+        PPFN pfn = pfn_from_frame_number(frame_numbers[i]);
+        add_to_list_tail(pfn, &free_page_list);
+        unlock_pfn(pfn);
+    }
+    LeaveCriticalSection(&free_page_list.lock);
+}
+
+// Moves a region whose every page is valid and was accessed since the last walk onto one aligned run of frames
+// The region must be locked. Its VA is unmapped while the data moves, so faulting threads wait on the region lock
+// AWE can only map 4KB pages into a MEM_PHYSICAL reservation, so the run is mapped with one call of 512 pages
+// A large page mapping needs nothing more than this run and the alignment of the region's VA
+BOOLEAN try_promote_region(PPTE_REGION region, PPTE_SCAN_RESULT scan)
+{
+    ULONG_PTR old_frames[FRAMES_PER_LARGE_PAGE];
+    ULONG_PTR new_frames[FRAMES_PER_LARGE_PAGE];
+
+    if (region->large == 1 || scan->num_valid != PTE_REGION_SIZE)
+    {
+        return FALSE;
+    }
+
+    for (ULONG i = 0; i < PTE_SCAN_BITMAP_SIZE; i++)
+    {
+        if (scan->accessed_bitmap[i] != MAXULONG64)
+        {
+            return FALSE;
+        }
+    }
+
+    PPTE first_pte = pte_from_pte_region(region);
+    PVOID first_va = va_from_pte(first_pte);
+    if (((ULONG_PTR) first_va & (LARGE_PAGE_SIZE - 1)) != 0)
+    {
+        return FALSE;
+    }
+
+    // Frames shared by vm_clone or a section are mapped elsewhere too, so they cannot be swapped for a new run
+    for (ULONG64 i = 0; i < FRAMES_PER_LARGE_PAGE; i++)
+    {
+        if (read_pte(&first_pte[i]).entire_format & (PTE_COPY_ON_WRITE_BIT | PTE_SECTION_BIT))
+        {
+            return FALSE;
+        }
+    }
+
+    if (allocate_large_page_run(new_frames) == FALSE)
+    {
+        InterlockedIncrement64(&promotions_without_run);
+        return FALSE;
+    }
+
+    // Valid PTEs only become invalid under the region lock, so the frames we read here stay ours
+    // A frame the modified writer still holds from an earlier trim is in its batch, so it cannot be moved or freed
+    for (ULONG64 i = 0; i < FRAMES_PER_LARGE_PAGE; i++)
+    {
+        old_frames[i] = read_pte(&first_pte[i]).memory_format.frame_number;
+        PPFN old_pfn = pfn_from_frame_number(old_frames[i]);
+        lock_pfn(old_pfn);
+
+        if (old_pfn->flags.reference != 0)
+        {
+            unlock_pfn(old_pfn);
+            for (ULONG64 j = 0; j < i; j++)
+            {
+                unlock_pfn(pfn_from_frame_number(old_frames[j]));
+            }
+            free_large_page_run(new_frames);
+
+            InterlockedIncrement64(&promotions_with_referenced_pages);
+            return FALSE;
+        }
+    }
+
+    unmap_pages(first_va, FRAMES_PER_LARGE_PAGE);
+
+    EnterCriticalSection(&large_page_copy_va_lock);
+
+    PVOID source_va = large_page_copy_va;
+    PVOID destination_va = (PVOID) ((ULONG_PTR) large_page_copy_va + LARGE_PAGE_SIZE);
+    map_pages(source_va, FRAMES_PER_LARGE_PAGE, old_frames);
+    map_pages(destination_va, FRAMES_PER_LARGE_PAGE, new_frames);
+
+    memcpy(destination_va, source_va, LARGE_PAGE_SIZE);
+
+    // The old frames go back on the free list, so they must not carry this region's data with them
+    memset(source_va, 0, LARGE_PAGE_SIZE);
+
+    unmap_pages(source_va, FRAMES_PER_LARGE_PAGE);
+    unmap_pages(destination_va, FRAMES_PER_LARGE_PAGE);
+
+    LeaveCriticalSection(&large_page_copy_va_lock);
+
+    map_pages(first_va, FRAMES_PER_LARGE_PAGE, new_frames);
+
+    for (ULONG64 i = 0; i < FRAMES_PER_LARGE_PAGE; i++)
+    {
+        // cpu_stamp may be setting the accessed bit at the same time, so only the frame number is swapped in
+        PTE old_contents;
+        PTE new_contents;
+        do {
+            old_contents = read_pte(&first_pte[i]);
+            new_contents = old_contents;
+            new_contents.memory_format.frame_number = new_frames[i];
+        } while (InterlockedCompareExchange64((volatile LONG64 *) &first_pte[i].entire_format,
+                 new_contents.entire_format, old_contents.entire_format) != old_contents.entire_format);
+
+        PPFN old_pfn = pfn_from_frame_number(old_frames[i]);
+        PPFN new_pfn = pfn_from_frame_number(new_frames[i]);
+
+        new_pfn->pte = old_pfn->pte;
+        new_pfn->flags = old_pfn->flags;
+        new_pfn->disc_index = old_pfn->disc_index;
+        unlock_pfn(new_pfn);
+
+        // Nothing of the page's past may follow the frame onto the free list
+        old_pfn->pte = NULL;
+        old_pfn->disc_index = 0;
+        old_pfn->flags.state = FREE;
+        old_pfn->flags.dirtied = 0;
+        old_pfn->flags.released = 0;
+        old_pfn->flags.file_backed = 0;
+        old_pfn->flags.file_dirty = 0;
+        old_pfn->flags.standby_priority = 0;
+        old_pfn->flags.written = 0;
+    }
+
+    free_large_page_run(old_frames);
+
+    region->large = 1;
+    InterlockedIncrement64(&regions_promoted);
+    return TRUE;
+}
+
+// Splits a promoted region back into 4KB pages so that the trimmer can take them one at a time
+// The region must be locked. Its frames are already mapped individually, so only the bookkeeping changes
+VOID demote_region(PPTE_REGION region)
+{
+    if (region->large == 0)
+    {
+        return;
+    }
+
+    region->large = 0;
+    InterlockedIncrement64(&regions_demoted);
+}
+
+VOID print_large_page_statistics(VOID)
+{
+    printf("large_pages : %llu aligned runs of %llu frames, %lld regions promoted, %lld demoted, "
+           "%lld promotions found no free run, %lld found a page still held by the modified writer\n",
+           number_of_large_page_runs, FRAMES_PER_LARGE_PAGE, regions_promoted, regions_demoted,
+           promotions_without_run, promotions_with_referenced_pages);
+}
+
+// Reads one word from a pseudo-random page on every access, so nearly every access needs a different translation
+static DOUBLE time_random_page_reads(PVOID base, ULONG64 num_pages)
+{
+    TIME_COUNTER time_counter;
+    ULONG64 state = 0x9E3779B97F4A7C15;
+    volatile ULONG64 sum = 0;
+
+    start_counter(&time_counter);
+    for (ULONG64 i = 0; i < LARGE_PAGE_BENCHMARK_ACCESSES; i++)
+    {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        ULONG64 page = (state >> 33) % num_pages;
+        sum += *(PULONG64) ((ULONG_PTR) base + page * PAGE_SIZE);
+    }
+    stop_counter(&time_counter);
+
+    return get_counter_duration(&time_counter) * 1e9 / LARGE_PAGE_BENCHMARK_ACCESSES;
+}
+
+// Compares random page reads over memory mapped from contiguous runs against the same amount of scattered frames
+// This runs before the system threads start, so it borrows the copy window and the free list without contention
+VOID benchmark_large_pages(VOID)
+{
+    ULONG64 num_runs = 0;
+    ULONG64 num_scattered = 0;
+    PULONG_PTR contiguous_frames = (PULONG_PTR) malloc(LARGE_PAGE_BENCHMARK_RUNS * FRAMES_PER_LARGE_PAGE * sizeof(ULONG_PTR));
+    PULONG_PTR scattered_frames = (PULONG_PTR) malloc(LARGE_PAGE_BENCHMARK_RUNS * FRAMES_PER_LARGE_PAGE * sizeof(ULONG_PTR));
+    NULL_CHECK(contiguous_frames, "benchmark_large_pages : could not allocate memory for the contiguous frames")
+    NULL_CHECK(scattered_frames, "benchmark_large_pages : could not allocate memory for the scattered frames")
+
+    while (num_runs < LARGE_PAGE_BENCHMARK_RUNS &&
+           allocate_large_page_run(&contiguous_frames[num_runs * FRAMES_PER_LARGE_PAGE]))
+    {
+        num_runs++;
+    }
+
+    if (num_runs == 0)
+    {
+        printf("benchmark_large_pages : the OS gave us no aligned runs of %llu frames\n", FRAMES_PER_LARGE_PAGE);
+        free(contiguous_frames);
+        free(scattered_frames);
+        return;
+    }
+
+    ULONG64 num_pages = num_runs * FRAMES_PER_LARGE_PAGE;
+    while (num_scattered < num_pages)
+    {
+        PPFN pfn = pop_from_list_head(&free_page_list);
+        if (pfn == NULL)
+        {
+            break;
+        }
+        scattered_frames[num_scattered] = frame_number_from_pfn(pfn);
+        num_scattered++;
+    }
+
+    // Shuffle the scattered frames so that neighboring pages never sit in neighboring frames
+    srand(1);
+    for (ULONG64 i = num_scattered - 1; i > 0; i--)
+    {
+        ULONG64 j = ((ULONG64) rand() * ((ULONG64) RAND_MAX + 1) + rand()) % (i + 1);
+        ULONG_PTR frame = scattered_frames[i];
+        scattered_frames[i] = scattered_frames[j];
+        scattered_frames[j] = frame;
+    }
+
+    map_pages(large_page_copy_va, num_pages, contiguous_frames);
+    time_random_page_reads(large_page_copy_va, num_pages);
+    DOUBLE contiguous_time = time_random_page_reads(large_page_copy_va, num_pages);
+    unmap_pages(large_page_copy_va, num_pages);
+
+    DOUBLE scattered_time = 0;
+    if (num_scattered == num_pages)
+    {
+        map_pages(large_page_copy_va, num_pages, scattered_frames);
+        time_random_page_reads(large_page_copy_va, num_pages);
+        scattered_time = time_random_page_reads(large_page_copy_va, num_pages);
+        unmap_pages(large_page_copy_va, num_pages);
+    }
+
+    printf("benchmark_large_pages : %llu MB in %llu contiguous runs, %.2f ns per random page read\n",
+           num_pages * PAGE_SIZE / MB(1), num_runs, contiguous_time);
+    printf("benchmark_large_pages : %llu MB in scattered frames, %.2f ns per random page read (%.2fx)\n",
+           num_pages * PAGE_SIZE / MB(1), scattered_time, contiguous_time > 0 ? scattered_time / contiguous_time : 0);
+
+    for (ULONG64 i = 0; i < num_runs; i++)
+    {
+        free_large_page_run(&contiguous_frames[i * FRAMES_PER_LARGE_PAGE]);
+    }
+
+    EnterCriticalSection(&free_page_list.lock);
+    for (ULONG64 i = 0; i < num_scattered; i++)
+    {
+        PPFN pfn = pfn_from_frame_number(scattered_frames[i]);
+        add_to_list_tail(pfn, &free_page_list);
+        unlock_pfn(pfn);
+    }
+    LeaveCriticalSection(&free_page_list.lock);
+
+    free(contiguous_frames);
+    free(scattered_frames);
+}
+
+// Times the two ways the system threads reach into the metadata at random: looking up PFNs by frame number, and
+// Reading a whole region's PTEs along with its PTE_REGION the way the ager does
+// This runs while the system threads are still up, so regions are locked while they are read
+VOID benchmark_metadata_walks(VOID)
+{
+    TIME_COUNTER time_counter;
+    ULONG64 state = 0x9E3779B97F4A7C15;
+    ULONG64 sum = 0;
+    ULONG64 regions_walked = 0;
+
+    start_counter(&time_counter);
+    for (ULONG64 i = 0; i < METADATA_BENCHMARK_PFN_READS; i++)
+    {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        ULONG_PTR frame_number = physical_page_numbers[(state >> 33) % physical_page_count];
+        if (frame_number == 0)
+        {
+            continue;
+        }
+        sum += pfn_from_frame_number(frame_number)->flags.state;
+    }
+    stop_counter(&time_counter);
+    DOUBLE pfn_time = get_counter_duration(&time_counter) * 1e9 / METADATA_BENCHMARK_PFN_READS;
+
+    start_counter(&time_counter);
+    for (ULONG64 i = 0; i < METADATA_BENCHMARK_REGION_WALKS; i++)
+    {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        ULONG64 region_index = (state >> 33) % number_of_pte_regions;
+        if (is_pte_region_committed(region_index) == FALSE)
+        {
+            continue;
+        }
+
+        PPTE_REGION region = &pte_regions[region_index];
+        lock_pte_region(region);
+        // The ager could have paged the region's PTEs out between the check and the lock
+        if (is_pte_region_committed(region_index))
+        {
+            PPTE first_pte = pte_from_pte_region(region);
+            ULONG64 num_ptes = min(PTE_REGION_SIZE, (ULONG64) (pte_end - first_pte));
+            for (ULONG64 j = 0; j < num_ptes; j++)
+            {
+                sum += first_pte[j].entire_format;
+            }
+            sum += region->age_count.ages[0];
+            regions_walked++;
+        }
+        unlock_pte_region(region);
+    }
+    stop_counter(&time_counter);
+    DOUBLE region_time = regions_walked > 0 ? get_counter_duration(&time_counter) * 1e9 / regions_walked : 0;
+
+    printf("benchmark_metadata_walks : PFNs %s (checksum %llu)\n",
+           pfns_on_large_pages ? "on large pages" : "on 4KB pages", sum);
+    printf("benchmark_metadata_walks : %.2f ns per random PFN lookup, %.2f ns per random region walk over %llu regions\n",
+           pfn_time, region_time, regions_walked);
+}
@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <string.h>
+#include <Windows.h>
+#include "../include/vm.h"
+#include "../include/debug.h"
+
+PSECTION mapped_files[MAX_MAPPED_FILES];
+CRITICAL_SECTION mapped_files_lock;
+
+volatile LONG64 file_pages_read;
+volatile LONG64 file_pages_written;
+volatile LONG64 clean_file_pages_trimmed;
+
+VOID initialize_mapped_files(VOID)
+{
+    INITIALIZE_LOCK(mapped_files_lock);
+    memset(mapped_files, 0, sizeof(mapped_files));
+}
+
+ULONG64 file_disc_index(PSECTION section, ULONG64 section_page)
+{
+    return ((ULONG64) section->file_slot << MAPPED_FILE_PAGE_BITS) | section_page;
+}
+
+// The last page of a view can run past the end of the file, only the bytes before it are read and written
+static ULONG64 file_bytes_in_page(PSECTION section, ULONG64 section_page)
+{
+    return min(PAGE_SIZE, section->file_bytes - section_page * PAGE_SIZE);
+}
+
+// Like the page file, the file is reached through a view of it, which stands in for a disc driver
+// This reads a page of the file into a page that is not on any list
+VOID read_file_page(PSECTION section, ULONG64 section_page, PPFN pfn)
+{
+    ULONG_PTR frame_number = frame_number_from_pfn(pfn);
+    ULONG64 num_bytes = file_bytes_in_page(section, section_page);
+
+    EnterCriticalSection(&modified_read_va_lock);
+
+    map_pages(modified_read_va, 1, &frame_number);
+
+    memcpy(modified_read_va, section->file_data + section_page * PAGE_SIZE, num_bytes);
+    memset((PUCHAR) modified_read_va + num_bytes, 0, PAGE_SIZE - num_bytes);
+
+    unmap_pages(modified_read_va, 1);
+
+    LeaveCriticalSection(&modified_read_va_lock);
+
+    InterlockedIncrement64(&file_pages_read);
+}
+
+// Writes a file backed page back to its file from wherever the caller has it mapped
+// The caller holds a reference on the page or its lock, so its section cannot go away underneath us
+VOID write_file_page(PPFN pfn, PVOID source_va)
+{
+    PSECTION section = mapped_files[pfn->disc_index >> MAPPED_FILE_PAGE_BITS];
+    ULONG64 section_page = pfn->disc_index & MAPPED_FILE_PAGE_MASK;
+    PUCHAR destination = section->file_data + section_page * PAGE_SIZE;
+    ULONG64 num_bytes = file_bytes_in_page(section, section_page);
+
+    memcpy(destination, source_va, num_bytes);
+
+    if (!FlushViewOfFile(destination, num_bytes)) {
+        fatal_error("write_file_page : failed to flush view of file");
+    }
+
+    InterlockedIncrement64(&file_pages_written);
+}
+
+// Maps part of a file, which must already exist. The offset must be page aligned, and a length of zero maps up to
+// The end of the file. With VM_FILE_READ_WRITE writes to the view reach the file when its pages are written back,
+// Which happens when they are trimmed or at the latest when the view is freed with vm_free. With VM_FILE_READ_ONLY
+// The file only has to be readable, and the view cannot be written to
+// Returns NULL if the file cannot be opened, the range is not inside the file, or MAX_MAPPED_FILES are mapped
+PVOID vm_map_file(PCSTR path, ULONG64 offset, ULONG64 num_bytes, ULONG protection)
+{
+    if ((offset & (PAGE_SIZE - 1)) != 0 ||
+        (protection != VM_FILE_READ_ONLY && protection != VM_FILE_READ_WRITE))
+    {
+        return NULL;
+    }
+
+    BOOLEAN read_only = (protection == VM_FILE_READ_ONLY);
+
+    // Other processes may keep writing to the file, what they write is only seen by pages we have not read in yet
+    HANDLE file = CreateFileA(path, read_only ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return NULL;
+    }
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || offset >= (ULONG64) file_size.QuadPart)
+    {
+        CloseHandle(file);
+        return NULL;
+    }
+
+    if (num_bytes == 0)
+    {
+        num_bytes = (ULONG64) file_size.QuadPart - offset;
+    }
+
+    if (offset + num_bytes > (ULONG64) file_size.QuadPart ||
+        (num_bytes + PAGE_SIZE - 1) / PAGE_SIZE > MAPPED_FILE_PAGE_MASK)
+    {
+        CloseHandle(file);
+        return NULL;
+    }
+
+    // Views have to start on an allocation granularity boundary, so ours can start a little before the offset
+    SYSTEM_INFO system_info;
+    GetSystemInfo(&system_info);
+    ULONG64 view_start = offset - offset % system_info.dwAllocationGranularity;
+
+    HANDLE file_mapping = CreateFileMapping(file, NULL, read_only ? PAGE_READONLY : PAGE_READWRITE, 0, 0, NULL);
+    if (file_mapping == NULL)
+    {
+        CloseHandle(file);
+        return NULL;
+    }
+
+    PVOID file_view = MapViewOfFile(file_mapping, read_only ? FILE_MAP_READ : FILE_MAP_ALL_ACCESS, (DWORD) (view_start >> 32),
+                                    (DWORD) view_start, offset - view_start + num_bytes);
+    CloseHandle(file_mapping);
+
+    if (file_view == NULL)
+    {
+        CloseHandle(file);
+        return NULL;
+    }
+
+    PSECTION section = vm_create_section(NULL, num_bytes);
+    if (section == NULL)
+    {
+        UnmapViewOfFile(file_view);
+        CloseHandle(file);
+        return NULL;
+    }
+
+    EnterCriticalSection(&mapped_files_lock);
+
+    ULONG slot = 0;
+    while (slot < MAX_MAPPED_FILES && mapped_files[slot] != NULL)
+    {
+        slot++;
+    }
+    if (slot < MAX_MAPPED_FILES)
+    {
+        mapped_files[slot] = section;
+    }
+
+    LeaveCriticalSection(&mapped_files_lock);
+
+    if (slot == MAX_MAPPED_FILES)
+    {
+        vm_close_section(section);
+        UnmapViewOfFile(file_view);
+        CloseHandle(file);
+        return NULL;
+    }
+
+    section->file = file;
+    section->file_view = file_view;
+    section->file_data = (PUCHAR) file_view + (offset - view_start);
+    section->file_bytes = num_bytes;
+    section->file_slot = slot;
+    section->read_only = read_only;
+
+    // Every page starts out on disc in the file, nothing has been read yet
+    for (ULONG64 i = 0; i < section->num_pages; i++)
+    {
+        PTE prototype_contents;
+        prototype_contents.entire_format = 0;
+        prototype_contents.disc_format.on_disc = 1;
+        prototype_contents.disc_format.disc_index = file_disc_index(section, i);
+        prototype_contents.entire_format |= PTE_FILE_BIT;
+        write_pte(&section->prototype_ptes[i], prototype_contents);
+    }
+
+    // The view holds the only reference, so freeing it deletes the section and closes the file
+    PVOID virtual_address = vm_map_section(section);
+    vm_close_section(section);
+
+    return virtual_address;
+}
+
+// Writes every modified page of a mapped file back to it before its section is deleted
+// Nothing maps the section any more, so its prototype PTEs are in transition or disc format
+// Pages the modified writer holds are waited for, as the file is closed once we are done
+VOID flush_mapped_file(PSECTION section)
+{
+    for (ULONG64 i = 0; i < section->num_pages; i++)
+    {
+        PPTE prototype = &section->prototype_ptes[i];
+
+        while (TRUE)
+        {
+            PTE local = read_pte(prototype);
+            if (local.disc_format.on_disc == 1)
+            {
+                break;
+            }
+
+            PPFN pfn = pfn_from_frame_number(local.transition_format.frame_number);
+            lock_pfn(pfn);
+
+            // Exactly as in the fault handler, the page may have been repurposed before we got its lock
+            if (read_pte(prototype).entire_format != local.entire_format)
+            {
+                unlock_pfn(pfn);
+                continue;
+            }
+
+            if (pfn->flags.reference != 0)
+            {
+                unlock_pfn(pfn);
+                Sleep(1);
+                continue;
+            }
+
+            // The page moves to the standby list once written, where it is as good as a clean page
+            if (pfn->flags.state == MODIFIED)
+            {
+                PPFN_LIST modified_list = modified_list_from_pfn(pfn);
+                EnterCriticalSection(&modified_list->lock);
+                remove_from_list(pfn);
+                LeaveCriticalSection(&modified_list->lock);
+
+                ULONG_PTR frame_number = frame_number_from_pfn(pfn);
+                EnterCriticalSection(&modified_read_va_lock);
+                map_pages(modified_read_va, 1, &frame_number);
+                write_file_page(pfn, modified_read_va);
+                unmap_pages(modified_read_va, 1);
+                LeaveCriticalSection(&modified_read_va_lock);
+
+                PFN pfn_contents = read_pfn(pfn);
+                pfn_contents.flags.state = STANDBY;
+                write_pfn(pfn, pfn_contents);
+
+                add_to_standby_list(pfn);
+            }
+
+            unlock_pfn(pfn);
+            break;
+        }
+    }
+}
+
+// Gives up the file of a section whose pages are all released
+VOID close_mapped_file(PSECTION section)
+{
+    EnterCriticalSection(&mapped_files_lock);
+    mapped_files[section->file_slot] = NULL;
+    LeaveCriticalSection(&mapped_files_lock);
+
+    UnmapViewOfFile(section->file_view);
+    CloseHandle(section->file);
+}
+
+VOID print_mapped_file_statistics(VOID)
+{
+    printf("mapped_file : %lld file pages read, %lld written back, %lld clean pages trimmed without a write\n",
+           file_pages_read, file_pages_written, clean_file_pages_trimmed);
+}
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <Windows.h>
+#include "../include/vm.h"
+#include "../include/debug.h"
+
+// The multi-generational LRU puts every resident page in one of a few generations
+// The youngest generation is max_seq and the oldest is min_seq. Each aging walk opens a new youngest generation,
+// And pages the walk finds accessed move into it. Trimming only takes pages from the oldest generation,
+// And once the oldest generation is empty min_seq moves up to the next one
+// A page keeps max_seq modulo the number of generations in its policy bits
+// The counts are only a guide. A walk that visits every region sees every page, so a generation it found no page in
+// Is retired whatever its count says, and a count that would go below zero stays at zero
+#define MGLRU_GENERATION_MASK                    (PTE_POLICY_BIT_0 | PTE_POLICY_BIT_1)
+#define MGLRU_MAX_GENERATIONS                    4
+
+volatile LONG64 mglru_min_seq;
+volatile LONG64 mglru_max_seq;
+volatile LONG64 mglru_generation_pages[MGLRU_MAX_GENERATIONS];
+// Set for each generation the current walk found a page in, cleared at the start of every walk
+volatile LONG mglru_generation_seen[MGLRU_MAX_GENERATIONS];
+
+static ULONG64 generation_bits(LONG64 seq)
+{
+    return ((ULONG64) seq % MGLRU_MAX_GENERATIONS) << PTE_POLICY_SHIFT;
+}
+
+static ULONG generation_of(PTE contents)
+{
+    return (ULONG) ((contents.entire_format & MGLRU_GENERATION_MASK) >> PTE_POLICY_SHIFT);
+}
+
+// A page leaving a generation never takes its count below zero, so a count that was missed once cannot go negative
+static VOID remove_from_generation(ULONG generation)
+{
+    LONG64 pages = mglru_generation_pages[generation];
+    while (pages > 0) {
+        LONG64 result = InterlockedCompareExchange64(&mglru_generation_pages[generation], pages - 1, pages);
+        if (result == pages) {
+            break;
+        }
+        pages = result;
+    }
+}
+
+// Most pages are in a generation that was already seen, so the flag is only written the first time
+static VOID mark_generation_seen(ULONG generation)
+{
+    if (mglru_generation_seen[generation] == 0) {
+        InterlockedExchange(&mglru_generation_seen[generation], 1);
+    }
+}
+
+VOID mglru_initialize(VOID)
+{
+    mglru_min_seq = 0;
+    mglru_max_seq = 0;
+    for (ULONG i = 0; i < MGLRU_MAX_GENERATIONS; i++)
+    {
+        mglru_generation_pages[i] = 0;
+        mglru_generation_seen[i] = 0;
+    }
+}
+
+// Each walk opens a new youngest generation, as long as that does not wrap onto the oldest one
+VOID mglru_on_walk(VOID)
+{
+    for (ULONG i = 0; i < MGLRU_MAX_GENERATIONS; i++)
+    {
+        InterlockedExchange(&mglru_generation_seen[i], 0);
+    }
+
+    LONG64 max_seq = mglru_max_seq;
+    if (max_seq - mglru_min_seq + 1 < MGLRU_MAX_GENERATIONS) {
+        InterlockedCompareExchange64(&mglru_max_seq, max_seq + 1, max_seq);
+    }
+}
+
+// A walk that saw every valid PTE and found none in the oldest generation proves it empty, even if a release path
+// Left its count behind. Retiring it here keeps one lost count from holding min_seq, and so all trimming, forever
+VOID mglru_on_full_walk(VOID)
+{
+    LONG64 min_seq = mglru_min_seq;
+
+    while (min_seq < mglru_max_seq && mglru_generation_seen[(ULONG64) min_seq % MGLRU_MAX_GENERATIONS] == 0) {
+        InterlockedExchange64(&mglru_generation_pages[(ULONG64) min_seq % MGLRU_MAX_GENERATIONS], 0);
+        if (InterlockedCompareExchange64(&mglru_min_seq, min_seq + 1, min_seq) != min_seq) {
+            break;
+        }
+        min_seq++;
+    }
+}
+
+// Accessed pages are promoted to the youngest generation
+VOID mglru_on_access(PPTE pte, PTE contents, BOOLEAN accessed)
+{
+    ULONG old_generation = generation_of(contents);
+
+    if (accessed == FALSE) {
+        mark_generation_seen(old_generation);
+        return;
+    }
+
+    LONG64 max_seq = mglru_max_seq;
+    ULONG new_generation = (ULONG) ((ULONG64) max_seq % MGLRU_MAX_GENERATIONS);
+    mark_generation_seen(new_generation);
+
+    if (old_generation != new_generation) {
+        update_policy_bits(pte, MGLRU_GENERATION_MASK, generation_bits(max_seq));
+        remove_from_generation(old_generation);
+        InterlockedIncrement64(&mglru_generation_pages[new_generation]);
+    }
+}
+
+// Pages advised as not needed move straight to the oldest generation, so they are the next ones trimmed
+// The generation is marked seen, as the walk may already have passed the page and would otherwise retire it
+VOID mglru_on_dontneed(PPTE pte, PTE contents)
+{
+    LONG64 min_seq = mglru_min_seq;
+    ULONG old_generation = generation_of(contents);
+    ULONG new_generation = (ULONG) ((ULONG64) min_seq % MGLRU_MAX_GENERATIONS);
+    mark_generation_seen(new_generation);
+
+    if (old_generation != new_generation) {
+        update_policy_bits(pte, MGLRU_GENERATION_MASK, generation_bits(min_seq));
+        remove_from_generation(old_generation);
+        InterlockedIncrement64(&mglru_generation_pages[new_generation]);
+    }
+}
+
+// Every faulted page starts in the youngest generation
+ULONG64 mglru_on_fault(PTE old_contents, ULONG fault_type)
+{
+    UNREFERENCED_PARAMETER(old_contents);
+    UNREFERENCED_PARAMETER(fault_type);
+
+    LONG64 max_seq = mglru_max_seq;
+    InterlockedIncrement64(&mglru_generation_pages[(ULONG64) max_seq % MGLRU_MAX_GENERATIONS]);
+    return generation_bits(max_seq);
+}
+
+ULONG mglru_select_trim_candidate(PTE contents, PGLOBAL_AGE_COUNT trim_of_age)
+{
+    LONG64 min_seq = mglru_min_seq;
+
+    // Retire empty oldest generations so that trimming moves on to the next one
+    while (min_seq < mglru_max_seq &&
+           mglru_generation_pages[(ULONG64) min_seq % MGLRU_MAX_GENERATIONS] <= 0) {
+        InterlockedCompareExchange64(&mglru_min_seq, min_seq + 1, min_seq);
+        min_seq = mglru_min_seq;
+    }
+
+    if (generation_of(contents) != (ULONG) ((ULONG64) min_seq % MGLRU_MAX_GENERATIONS)) {
+        return NO_TRIM;
+    }
+    return find_trim_quota(contents, trim_of_age);
+}
+
+ULONG64 mglru_on_evict(PTE contents)
+{
+    remove_from_generation(generation_of(contents));
+    return 0;
+}
+
+VOID mglru_on_forget(PTE contents)
+{
+    remove_from_generation(generation_of(contents));
+}
+
+REPLACEMENT_POLICY mglru_policy = {
+    "mglru",
+    mglru_initialize,
+    mglru_on_access,
+    mglru_on_fault,
+    mglru_select_trim_candidate,
+    mglru_on_evict,
+    mglru_on_forget,
+    mglru_on_dontneed,
+    mglru_on_walk,
+    mglru_on_full_walk,
+    TRUE
+};
@@ -3,7 +3,96 @@
 #include "../include/vm.h"
 #include "../include/debug.h"
 
-VOID write_pages_to_disc(PULONG64 target_writes)
+MODIFIED_WRITER modified_writers[NUMBER_OF_MODIFIED_WRITERS];
+HANDLE mw_wake_events[NUMBER_OF_MODIFIED_WRITERS];
+
+// Pages are added to the tail of a shard as they are trimmed, so the pages past the rescue window are all at its head
+// This counts how many of up to target_pages there are, called with the shard locked
+// The trim ticks are read without the PFN locks, as they only decide which pages we try to take
+static ULONG64 count_pages_past_rescue_window(PPFN_LIST modified_list, ULONG64 target_pages)
+{
+    ULONG now = GetTickCount();
+    ULONG64 num_pages = 0;
+
+    for (PLIST_ENTRY entry = modified_list->entry.Flink;
+         entry != &modified_list->entry && num_pages < target_pages;
+         entry = entry->Flink)
+    {
+        PPFN pfn = CONTAINING_RECORD(entry, PFN, entry);
+        if (now - *(volatile ULONG *) &pfn->trim_tick < MODIFIED_RESCUE_WINDOW_MS)
+        {
+            break;
+        }
+        num_pages++;
+    }
+
+    return num_pages;
+}
+
+// Pops up to target_pages from one modified shard and adds them to the end of the batch
+// Unless the writer is in a hurry, pages still inside the rescue window are left for the faults that may take them back
+ULONG64 take_pages_from_shard(ULONG shard, PPFN_LIST batch_list, ULONG64 target_pages, BOOLEAN hurry)
+{
+    PFN_LIST shard_list;
+    PPFN_LIST modified_list = &modified_page_lists[shard];
+
+    // Skip shards that look empty without touching their lock
+    if (*(volatile ULONG_PTR *) (&modified_list->num_pages) == 0)
+    {
+        return 0;
+    }
+
+    EnterCriticalSection(&modified_list->lock);
+
+    if (hurry == FALSE)
+    {
+        target_pages = count_pages_past_rescue_window(modified_list, target_pages);
+    }
+
+    if (target_pages == 0)
+    {
+        LeaveCriticalSection(&modified_list->lock);
+        return 0;
+    }
+
+    batch_pop_from_list_head(modified_list, &shard_list, target_pages, TRUE);
+    LeaveCriticalSection(&modified_list->lock);
+
+    if (shard_list.num_pages == 0)
+    {
+        return 0;
+    }
+
+    // The list head lives on our stack, so it cannot be left on the pages once they are spliced onto the batch
+    link_list_to_tail(batch_list, &shard_list);
+
+    return shard_list.num_pages;
+}
+
+// Fills the batch from the writer's home shard first, then steals from the other shards round-robin
+ULONG64 take_modified_pages(PMODIFIED_WRITER writer, PPFN_LIST batch_list, ULONG64 target_pages, BOOLEAN hurry)
+{
+    ULONG64 num_pages = take_pages_from_shard(writer->home_shard, batch_list, target_pages, hurry);
+
+    for (ULONG i = 0; i < NUMBER_OF_MODIFIED_SHARDS && num_pages < target_pages; i++)
+    {
+        ULONG shard = writer->next_shard;
+        writer->next_shard = (writer->next_shard + 1) % NUMBER_OF_MODIFIED_SHARDS;
+
+        if (shard == writer->home_shard)
+        {
+            continue;
+        }
+
+        ULONG64 stolen_pages = take_pages_from_shard(shard, batch_list, target_pages - num_pages, hurry);
+        writer->pages_stolen += stolen_pages;
+        num_pages += stolen_pages;
+    }
+
+    return num_pages;
+}
+
+VOID write_pages_to_disc(PMODIFIED_WRITER writer, PULONG64 target_writes, BOOLEAN hurry)
 {
     ULONG64 target_pages;
     PFN_LIST batch_list;
@@ -23,83 +112,160 @@ VOID write_pages_to_disc(PULONG64 target_writes)
         target_pages = *target_writes;
     }
 
-    // Get as many disc indices as we can
-    ULONG64 disc_indices[MAX_MOD_BATCH];
-    ULONG num_returned_indices = get_disc_indices(disc_indices, target_pages);
-    if (num_returned_indices == 0)
-    {
-        // TODO Figure out if we want to track this
-        return;
-    }
-
-    // Bound the number of pages to pull off the modified list by the number of disc indices we have
-    target_pages = num_returned_indices;
-
     // Initialize the list of pages to write to disc
     initialize_listhead(&batch_list);
     batch_list.num_pages = 0;
 
-    // Lock the list of modified pages
-    EnterCriticalSection(&modified_page_list.lock);
+    // Pop the modified pages. If every shard is empty, or only has pages inside the rescue window,
+    // We can return straight away
+    target_pages = take_modified_pages(writer, &batch_list, target_pages, hurry);
 
-    // Check the count of the list. If the list is empty, we can return after freeing the disc indices
-    if (modified_page_list.num_pages == 0)
+    if (target_pages == 0)
     {
-        LeaveCriticalSection(&modified_page_list.lock);
-        free_disc_indices(disc_indices, num_returned_indices, 0);
-        return;
-    }
-
-    // Pop the modified pages
-    batch_pop_from_list_head(&modified_page_list, &batch_list, target_pages, TRUE);
-    LeaveCriticalSection(&modified_page_list.lock);
-
-    target_pages = batch_list.num_pages;
-
-    if (batch_list.num_pages == 0)
-    {
-        free_disc_indices(disc_indices, num_returned_indices, 0);
+        // Make sure the caller stops asking for writes, as there is nothing left to write
+        *target_writes = 0;
         return;
     }
 
-    // Find the frame numbers associated with the PFNs
+    // Find the frame numbers associated with the PFNs, and count the pages that go to the page file
+    // Pages of mapped files are written back to their own file, so they never need a page file slot
+    // Our reference keeps the page's section and file alive, so the flag cannot change under us
     ULONG64 frame_numbers[MAX_MOD_BATCH];
+    BOOLEAN file_backed_pages[MAX_MOD_BATCH];
+    ULONG64 num_pagefile_pages = 0;
     PLIST_ENTRY entry = batch_list.entry.Flink;
     for (ULONG64 i = 0; i < target_pages; i++)
     {
         pfn = CONTAINING_RECORD(entry, PFN, entry);
         frame_numbers[i] = frame_number_from_pfn(pfn);
+        file_backed_pages[i] = (BOOLEAN) pfn->flags.file_backed;
+        if (file_backed_pages[i] == FALSE)
+        {
+            num_pagefile_pages++;
+        }
         entry = entry->Flink;
     }
 
-    // Free any extra disc indices
-    if (batch_list.num_pages < num_returned_indices)
+    // Get as many disc indices as we can for the page file pages
+    ULONG64 disc_indices[MAX_MOD_BATCH];
+    ULONG64 num_returned_indices = 0;
+    if (num_pagefile_pages != 0)
     {
-        free_disc_indices(disc_indices, num_returned_indices, batch_list.num_pages);
+        num_returned_indices = get_disc_indices_from_region(disc_indices, num_pagefile_pages, &writer->first_disc_region);
     }
 
+    // Hand out the disc indices in batch order. Page file pages past the last index are not written,
+    // And go back to their modified list to wait for a later batch
+    ULONG64 page_disc_indices[MAX_MOD_BATCH];
+    ULONG64 next_disc_index = 0;
+    ULONG64 num_pages_written = 0;
+    for (ULONG64 i = 0; i < target_pages; i++)
+    {
+        if (file_backed_pages[i])
+        {
+            page_disc_indices[i] = DISC_INDEX_FAIL_CODE;
+            num_pages_written++;
+        }
+        else if (next_disc_index < num_returned_indices)
+        {
+            page_disc_indices[i] = disc_indices[next_disc_index];
+            next_disc_index++;
+            num_pages_written++;
+        }
+        else
+        {
+            page_disc_indices[i] = DISC_INDEX_FAIL_CODE;
+        }
+    }
+
+    // Page file pages we could not write stay locked here until they are back on their modified lists
+    PPFN requeued_pfns[MAX_MOD_BATCH];
+    ULONG64 num_requeued = 0;
+
     // Map the pages to our private VA space
-    map_pages(modified_write_va, target_pages, frame_numbers);
+    map_pages(writer->write_va, target_pages, frame_numbers);
 
     // For each page, copy the contents to the paging file according to its corresponding disc index
     for (ULONG64 i = 0; i < target_pages; i++)
     {
-        // Write the page to the page file
-        write_to_pagefile(disc_indices[i], modified_write_va);
+        PVOID page_va = (PVOID) ((ULONG_PTR) writer->write_va + i * PAGE_SIZE);
+        pfn = pfn_from_frame_number(frame_numbers[i]);
+
+        // Pages of mapped files are written back to their own file and keep their disc index
+        // Our reference keeps the page's section and file alive while we write it
+        BOOLEAN file_backed = file_backed_pages[i];
+        BOOLEAN written = file_backed || page_disc_indices[i] != DISC_INDEX_FAIL_CODE;
+        if (file_backed) {
+            write_file_page(pfn, page_va);
+        } else if (written) {
+            // Write the page to the page file
+            write_to_pagefile(page_disc_indices[i], page_va);
+        }
 
         // Lock the PFN. Change is possible as we are writing to the page file
-        pfn = pfn_from_frame_number(frame_numbers[i]);
         lock_pfn(pfn);
         local = read_pfn(pfn);
 
+        // If the VA was freed while we wrote the page, the write was for nothing
+        // The page leaves the batch and goes straight to the free list
+        if (local.flags.released == 1) {
+            if (!file_backed && written) {
+                free_disc_index(page_disc_indices[i]);
+            }
+
+            local.flags.reference -= 1;
+            local.flags.released = 0;
+            local.flags.dirtied = 0;
+            local.flags.file_backed = 0;
+            local.flags.state = FREE;
+            local.disc_index = 0;
+            write_pfn(pfn, local);
+
+            pfn->entry.Blink->Flink = pfn->entry.Flink;
+            pfn->entry.Flink->Blink = pfn->entry.Blink;
+            batch_list.num_pages--;
+
+            // It is still mapped into our write window, so it can be zeroed here
+            memset((PVOID) ((ULONG_PTR) writer->write_va + i * PAGE_SIZE), 0, PAGE_SIZE);
+
+            EnterCriticalSection(&free_page_list.lock);
+            add_to_list_tail(pfn, &free_page_list);
+            LeaveCriticalSection(&free_page_list.lock);
+            unlock_pfn(pfn);
+
+            frame_numbers[i] = 0;
+        }
+        // A page file page we had no slot for was never written, so it goes back to its modified list as it is
+        // If a fault took the page back while we held it, it is no longer in our batch and stays where it is
+        else if (!written) {
+            local.flags.reference -= 1;
+            local.flags.dirtied = 0;
+            write_pfn(pfn, local);
+
+            if (local.flags.state == MODIFIED) {
+                pfn->entry.Blink->Flink = pfn->entry.Flink;
+                pfn->entry.Flink->Blink = pfn->entry.Blink;
+                batch_list.num_pages--;
+
+                requeued_pfns[num_requeued] = pfn;
+                num_requeued++;
+            } else {
+                unlock_pfn(pfn);
+            }
+
+            frame_numbers[i] = 0;
+        }
         // The dirtied bit allows us to tell whether the page was changed during the write
         // Without the bit a page that went to active and then back to modified could not be differentiated
         // From one that was never touched. If a page was written to, it could be written twice
         // And its first page file write would be stale data
-        if (local.flags.dirtied == 0) {
-            local.disc_index = disc_indices[i];
+        else if (local.flags.dirtied == 0) {
+            if (!file_backed) {
+                local.disc_index = page_disc_indices[i];
+            }
             local.flags.state = STANDBY;
             local.flags.reference -= 1;
+            local.flags.written = 1;
             write_pfn(pfn, local);
         }
         // In this case we know that the page in memory was written during our page file write
@@ -116,20 +282,60 @@ VOID write_pages_to_disc(PULONG64 target_writes)
             //remove_from_list(pfn);
 
             frame_numbers[i] = 0;
-            free_disc_index(disc_indices[i]);
+            if (!file_backed) {
+                free_disc_index(page_disc_indices[i]);
+            }
         }
         // Once reads are implemented, the write is still good, and we should keep the copy on the disc.
         // We just decrement our reference count
     }
 
-    unmap_pages(modified_write_va, target_pages);
+    unmap_pages(writer->write_va, target_pages);
 
-    EnterCriticalSection(&standby_page_list.lock);
+    // The pages came off the heads of their shards and are older than anything trimmed since, so they go back on the
+    // Heads in their old order. Shards stay sorted by trim tick, which the rescue window count relies on
+    for (ULONG64 i = num_requeued; i > 0; i--)
+    {
+        pfn = requeued_pfns[i - 1];
+        PPFN_LIST modified_list = modified_list_from_pfn(pfn);
 
-    // Add the pages to the standby list
-    link_list_to_tail(&standby_page_list, &batch_list);
+        EnterCriticalSection(&modified_list->lock);
+        add_to_list_head(pfn, modified_list);
+        LeaveCriticalSection(&modified_list->lock);
 
-    LeaveCriticalSection(&standby_page_list.lock);
+        unlock_pfn(pfn);
+    }
+
+    // Every page in the batch could have been freed while it was written
+    // The rest are sorted by the priority they were trimmed with, so each standby list is joined in one lock hold
+    if (batch_list.num_pages != 0)
+    {
+        PFN_LIST priority_lists[NUMBER_OF_STANDBY_PRIORITIES];
+        for (ULONG priority = 0; priority < NUMBER_OF_STANDBY_PRIORITIES; priority++)
+        {
+            initialize_listhead(&priority_lists[priority]);
+        }
+
+        entry = batch_list.entry.Flink;
+        while (entry != &batch_list.entry)
+        {
+            pfn = CONTAINING_RECORD(entry, PFN, entry);
+            entry = entry->Flink;
+            add_to_list_tail(pfn, &priority_lists[pfn->flags.standby_priority]);
+        }
+
+        for (ULONG priority = 0; priority < NUMBER_OF_STANDBY_PRIORITIES; priority++)
+        {
+            if (priority_lists[priority].num_pages == 0)
+            {
+                continue;
+            }
+
+            EnterCriticalSection(&standby_page_lists[priority].lock);
+            link_list_to_tail(&standby_page_lists[priority], &priority_lists[priority]);
+            LeaveCriticalSection(&standby_page_lists[priority].lock);
+        }
+    }
 
     for (ULONG64 i = 0; i < target_pages; i++)
     {
@@ -147,30 +353,82 @@ VOID write_pages_to_disc(PULONG64 target_writes)
     stop_counter(&time_counter);
     DOUBLE duration = get_counter_duration(&time_counter);
 
-    track_time(duration, target_pages, mod_write_times,
+    track_time(duration, num_pages_written, mod_write_times,
                &mod_write_time_index, MOD_WRITE_TIMES_TO_TRACK);
 
+    writer->pages_written += num_pages_written;
+    if (hurry) {
+        writer->pages_written_in_hurry += num_pages_written;
+    }
+    writer->batches_written++;
+    writer->busy_time += duration;
+
+    // The page file is full and the batch held no file pages, so asking again would only take the same pages back
+    if (num_pages_written == 0) {
+        *target_writes = 0;
+        return;
+    }
+
     // Decrease the target writes by the number of pages we wrote
-    if (*target_writes < target_pages) {
+    if (*target_writes < num_pages_written) {
         *target_writes = 0;
     }
     else {
-        *target_writes -= target_pages;
+        *target_writes -= num_pages_written;
+    }
+}
+
+VOID wake_modified_writers(VOID)
+{
+    for (ULONG i = 0; i < NUMBER_OF_MODIFIED_WRITERS; i++)
+    {
+        SetEvent(mw_wake_events[i]);
     }
 }
 
+VOID print_modified_write_statistics(VOID)
+{
+    ULONG64 total_pages_written = 0;
+    ULONG64 total_pages_written_in_hurry = 0;
+    DOUBLE longest_busy_time = 0;
+
+    for (ULONG i = 0; i < NUMBER_OF_MODIFIED_WRITERS; i++)
+    {
+        PMODIFIED_WRITER writer = &modified_writers[i];
+        DOUBLE rate = writer->busy_time > 0 ? (DOUBLE) writer->pages_written / writer->busy_time : 0;
+
+        printf("modified_write_thread %lu : wrote %llu pages in %llu batches, %llu stolen from other shards, %.0f pages per busy second\n",
+               i, writer->pages_written, writer->batches_written, writer->pages_stolen, rate);
+
+        total_pages_written += writer->pages_written;
+        total_pages_written_in_hurry += writer->pages_written_in_hurry;
+        longest_busy_time = max(longest_busy_time, writer->busy_time);
+    }
+
+    printf("modified writing : %d writers wrote %llu pages, %.0f pages per second combined\n",
+           NUMBER_OF_MODIFIED_WRITERS, total_pages_written,
+           longest_busy_time > 0 ? (DOUBLE) total_pages_written / longest_busy_time : 0);
+
+    // A written page that is faulted back before it is repurposed was a wasted write, which is what the window is for
+    // Building with a window of zero gives the rate without it to compare against
+    printf("modified writing : %llu pages written in a hurry, %lld written pages rescued from standby (%.1f%% of writes) with a %lu ms rescue window\n",
+           total_pages_written_in_hurry, written_pages_rescued,
+           total_pages_written > 0 ? 100.0 * (DOUBLE) written_pages_rescued / (DOUBLE) total_pages_written : 0,
+           (ULONG) MODIFIED_RESCUE_WINDOW_MS);
+}
 
 // This controls the thread that constantly writes pages to disc when prompted by other threads
 // In the future this should use a fraction of the CPU if the system cannot give it a full core
 DWORD modified_write_thread(PVOID context)
 {
-    UNREFERENCED_PARAMETER(context);
+    ULONG writer_index = (ULONG) (ULONG_PTR) context;
+    PMODIFIED_WRITER writer = &modified_writers[writer_index];
 
     // This thread needs to be able to react to handles for waking as well as exiting
     HANDLE handles[2];
 
     handles[0] = system_exit_event;
-    handles[1] = mw_wake_event;
+    handles[1] = mw_wake_events[writer_index];
 
     // This waits for the system to start before doing anything
     WaitForSingleObject(system_start_event, INFINITE);
@@ -183,7 +441,7 @@ DWORD modified_write_thread(PVOID context)
         ULONG64 average_page_consumption = average_page_consumption_global;
 
         ULONG64 consumable_pages = *(volatile ULONG_PTR *) (&free_page_list.num_pages) +
-                                         *(volatile ULONG_PTR *) (&standby_page_list.num_pages);
+                                         standby_page_count();
 
         DOUBLE time_until_no_pages = (DOUBLE) consumable_pages / (DOUBLE) average_page_consumption;
 
@@ -194,12 +452,16 @@ DWORD modified_write_thread(PVOID context)
         DOUBLE mw_per_page_cost = mw_average.duration / (DOUBLE) mw_average.num_pages;
 
         // Find how long it will take us to empty our modified list completely and convert to seconds
-        ULONG64 modified_pages = *(volatile ULONG64 *) (&modified_page_list.num_pages);
-        DOUBLE time_to_mw = (DOUBLE) modified_pages * mw_per_page_cost;
+        // The writers empty it side by side, so each one only has its share to write
+        ULONG64 modified_pages = modified_page_count();
+        DOUBLE time_to_mw = (DOUBLE) modified_pages * mw_per_page_cost / NUMBER_OF_MODIFIED_WRITERS;
+
+        // Pages inside the rescue window are only written when free and standby would run out before they come of age
+        BOOLEAN hurry = time_until_no_pages * 1000 < MODIFIED_RESCUE_WINDOW_MS;
 
         if (time_until_no_pages < time_to_mw) {
             // If we don't have enough time to empty the modified list, write constantly
-            num_mod_writes = modified_pages;
+            num_mod_writes = (modified_pages + NUMBER_OF_MODIFIED_WRITERS - 1) / NUMBER_OF_MODIFIED_WRITERS;
         } else {
             // Wait for the events only if we've actively checked if we need to write modified pages
             ULONG index = WaitForMultipleObjects(ARRAYSIZE(handles), handles, FALSE, 1000);
@@ -210,8 +472,21 @@ DWORD modified_write_thread(PVOID context)
             }
         }
 
+        ULONG64 pages_written = writer->pages_written;
+
         while (num_mod_writes > 0) {
-            write_pages_to_disc(&num_mod_writes);
+            write_pages_to_disc(writer, &num_mod_writes, hurry);
+        }
+
+        // If every modified page is still inside the rescue window, we wait for them to come of age instead of spinning
+        if (num_mod_writes == 0 && writer->pages_written == pages_written && hurry == FALSE && modified_pages != 0)
+        {
+            ULONG index = WaitForMultipleObjects(ARRAYSIZE(handles), handles, FALSE, MODIFIED_RESCUE_WINDOW_MS / 4 + 1);
+            if (index == 0)
+            {
+                set_modified_status("modified write thread exited");
+                break;
+            }
         }
     }
 
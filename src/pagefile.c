@@ -16,6 +16,8 @@ volatile LONG64 freed_spaces_size;
 
 volatile LONG64 last_checked_index;
 
+volatile LONG *disc_slot_sharers;
+
 
 ULONG64 add_freed_index(ULONG64 disc_index);
 ULONG64 get_freed_index();
@@ -67,7 +69,7 @@ VOID search_chunk_for_free_spots(PULONG64 disc_spot, ULONG64 first_index, PULONG
             if (*count < num_indices) {
                 // Add the index to disc_indices
                 disc_indices[*count] = first_index + bit;
-                count++;
+                (*count)++;
             } else{
                 add_result = add_freed_index(first_index + bit);
                 if (add_result == DISC_INDEX_FAIL_CODE) {
@@ -116,7 +118,9 @@ VOID search_region_for_free_spots(ULONG64 region, PULONG count, PULONG64 disc_in
 }
 
 
-ULONG64 get_disc_indices(PULONG64 disc_indices, ULONG64 num_indices)
+// This searches the bitmap starting at *search_region and leaves the region it stopped in there for the next call
+// Modified writers each keep their own search region so that they do not fight over the same bitmap chunks
+ULONG64 get_disc_indices_from_region(PULONG64 disc_indices, ULONG64 num_indices, PULONG64 search_region)
 {
     ULONG count = 0;
     ULONG64 return_index;
@@ -155,15 +159,16 @@ ULONG64 get_disc_indices(PULONG64 disc_indices, ULONG64 num_indices)
     }
 
     // Iterate over each bitmap region looking for free spots
-    ULONG64 first_bitmap_region = disc_index_to_region(last_checked_index);
+    ULONG64 first_bitmap_region = *search_region % BITMAP_SIZE_IN_REGIONS;
 
     for (ULONG64 region = 0; region < BITMAP_SIZE_IN_REGIONS; region++)
     {
-        ULONG64 search_region = (first_bitmap_region + region) % BITMAP_SIZE_IN_REGIONS;
-        search_region_for_free_spots(search_region, &count, disc_indices, num_indices);
+        ULONG64 current_region = (first_bitmap_region + region) % BITMAP_SIZE_IN_REGIONS;
+        search_region_for_free_spots(current_region, &count, disc_indices, num_indices);
         if (count == num_indices)
         {
             // We have found enough indices, break
+            *search_region = current_region;
             break;
         }
     }
@@ -174,13 +179,48 @@ ULONG64 get_disc_indices(PULONG64 disc_indices, ULONG64 num_indices)
     return count;
 }
 
+ULONG64 get_disc_indices(PULONG64 disc_indices, ULONG64 num_indices)
+{
+    ULONG64 search_region = disc_index_to_region(last_checked_index);
+    return get_disc_indices_from_region(disc_indices, num_indices, &search_region);
+}
+
 // This function will double insert a disc index if it is called twice with the same index
 // Currently this is not a problem, as this function is only called with locks held that prevent this from happening
+// Adds a holder to a disc slot that is already in use
+VOID share_disc_index(ULONG64 disc_index)
+{
+    InterlockedIncrement(&disc_slot_sharers[disc_index]);
+}
+
+// Takes one holder off a shared disc slot. Returns FALSE if the caller was the only holder left
+static BOOLEAN release_disc_share(ULONG64 disc_index)
+{
+    LONG sharers = disc_slot_sharers[disc_index];
+
+    while (sharers > 0)
+    {
+        LONG result = InterlockedCompareExchange(&disc_slot_sharers[disc_index], sharers - 1, sharers);
+        if (result == sharers)
+        {
+            return TRUE;
+        }
+        sharers = result;
+    }
+
+    return FALSE;
+}
+
 VOID free_disc_index(ULONG64 disc_index)
 {
     PULONG64 disc_spot;
     ULONG64 index_in_cluster;
 
+    // A slot that vm_clone shared stays in use until its last holder frees it
+    if (release_disc_share(disc_index)) {
+        return;
+    }
+
     // Add the disc index to freed_spaces if there is space
     if (add_freed_index(disc_index) == DISC_INDEX_FAIL_CODE) {
         // This grabs the actual chunk (ULONG64) that holds the bit we need to change
@@ -6,6 +6,7 @@ PPFN pfn_base;
 PPFN pfn_end;
 ULONG_PTR highest_frame_number = 0;
 ULONG_PTR lowest_frame_number = MAXULONG_PTR;
+BOOLEAN pfns_on_large_pages;
 
 PPFN pfn_from_frame_number(ULONG64 frame_number)
 {
@@ -46,6 +47,7 @@ VOID write_pfn(PPFN pfn, PFN local)
 {
     pfn->pte = local.pte;
     pfn->flags = local.flags;
+    pfn->trim_tick = local.trim_tick;
     pfn->disc_index = local.disc_index;
 
     #if READWRITE_LOGGING
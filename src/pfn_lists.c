@@ -4,8 +4,12 @@
 #include "../include/debug.h"
 
 PFN_LIST free_page_list;
-PFN_LIST modified_page_list;
-PFN_LIST standby_page_list;
+PFN_LIST modified_page_lists[NUMBER_OF_MODIFIED_SHARDS];
+PFN_LIST standby_page_lists[NUMBER_OF_STANDBY_PRIORITIES];
+
+volatile LONG64 standby_pages_rescued[NUMBER_OF_STANDBY_PRIORITIES];
+volatile LONG64 standby_pages_repurposed[NUMBER_OF_STANDBY_PRIORITIES];
+volatile LONG64 written_pages_rescued;
 
 VOID initialize_listhead(PPFN_LIST listhead)
 {
@@ -13,6 +17,97 @@ VOID initialize_listhead(PPFN_LIST listhead)
     listhead->num_pages = 0;
 }
 
+// Frame numbers are handed out by the OS in no particular order, so they spread pages evenly over the shards
+ULONG modified_shard_from_pfn(PPFN pfn)
+{
+    return (ULONG) (frame_number_from_pfn(pfn) % NUMBER_OF_MODIFIED_SHARDS);
+}
+
+PPFN_LIST modified_list_from_pfn(PPFN pfn)
+{
+    return &modified_page_lists[modified_shard_from_pfn(pfn)];
+}
+
+// This adds up the counts of every shard without their locks, so it is only a snapshot
+ULONG64 modified_page_count(VOID)
+{
+    ULONG64 count = 0;
+    for (ULONG i = 0; i < NUMBER_OF_MODIFIED_SHARDS; i++)
+    {
+        count += *(volatile ULONG_PTR *) (&modified_page_lists[i].num_pages);
+    }
+    return count;
+}
+
+PPFN_LIST standby_list_from_pfn(PPFN pfn)
+{
+    return &standby_page_lists[pfn->flags.standby_priority];
+}
+
+// Like modified_page_count, this is only a snapshot
+ULONG64 standby_page_count(VOID)
+{
+    ULONG64 count = 0;
+    for (ULONG i = 0; i < NUMBER_OF_STANDBY_PRIORITIES; i++)
+    {
+        count += *(volatile ULONG_PTR *) (&standby_page_lists[i].num_pages);
+    }
+    return count;
+}
+
+// Puts a locked page on the tail of the standby list for its priority
+VOID add_to_standby_list(PPFN pfn)
+{
+    PPFN_LIST standby_list = standby_list_from_pfn(pfn);
+
+    EnterCriticalSection(&standby_list->lock);
+    add_to_list_tail(pfn, standby_list);
+    LeaveCriticalSection(&standby_list->lock);
+}
+
+// Returns a locked page from the lowest priority standby list that has any, or NULL if they are all empty
+// Within a priority the oldest page goes first, as before
+PPFN pop_from_standby_lists(VOID)
+{
+    for (ULONG priority = 0; priority < NUMBER_OF_STANDBY_PRIORITIES; priority++)
+    {
+        if (*(volatile ULONG_PTR *) (&standby_page_lists[priority].num_pages) == 0)
+        {
+            continue;
+        }
+
+        PPFN pfn = pop_from_list_head(&standby_page_lists[priority]);
+        if (pfn != NULL)
+        {
+            InterlockedIncrement64(&standby_pages_repurposed[priority]);
+            pfn->flags.written = 0;
+            return pfn;
+        }
+    }
+
+    return NULL;
+}
+
+// Called with the page locked when a fault takes it back off its standby list
+VOID record_standby_rescue(PPFN pfn)
+{
+    InterlockedIncrement64(&standby_pages_rescued[pfn->flags.standby_priority]);
+
+    if (pfn->flags.written) {
+        InterlockedIncrement64(&written_pages_rescued);
+        pfn->flags.written = 0;
+    }
+}
+
+VOID print_standby_statistics(VOID)
+{
+    for (ULONG i = 0; i < NUMBER_OF_STANDBY_PRIORITIES; i++)
+    {
+        printf("standby : priority %lu had %lld pages rescued by soft faults and %lld repurposed\n",
+               i, standby_pages_rescued[i], standby_pages_repurposed[i]);
+    }
+}
+
 BOOLEAN is_list_empty(PPFN_LIST listhead)
 {
     ULONG64 empty_count = listhead->num_pages == 0;
@@ -27,16 +122,19 @@ VOID remove_from_list(PPFN pfn)
     PPFN_LIST listhead;
 
     // Finds the list based on the page's state
-    // There is no active state, and we never remove free pages in this way
-    // So we know that this is either a modified or standby page
+    // There is no active state, and only the large page allocator removes free pages in this way
     if (pfn->flags.state == MODIFIED) {
 
-        listhead = &modified_page_list;
+        listhead = modified_list_from_pfn(pfn);
 
     } else if (pfn->flags.state == STANDBY) {
 
-        // This is on the standby list
-        listhead = &standby_page_list;
+        // This is on the standby list of its priority
+        listhead = standby_list_from_pfn(pfn);
+
+    } else if (pfn->flags.state == FREE) {
+
+        listhead = &free_page_list;
 
     } else {
         fatal_error("remove_from_list : tried to remove a page from list when it was on none");
@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <string.h>
+#include <Windows.h>
+#include "../include/vm.h"
+#include "../include/debug.h"
+
+PREPLACEMENT_POLICY replacement_policy = &aging_policy;
+ULONG replacement_policy_in_use = POLICY_AGING;
+POLICY_STATS policy_stats;
+
+// Indexed by the POLICY_ values so that the names given at startup line up with them
+PREPLACEMENT_POLICY replacement_policies[NUMBER_OF_POLICIES] = {
+    &aging_policy,
+    &clock_pro_policy,
+    &arc_policy,
+    &mglru_policy
+};
+
+volatile LONG64 ghost_epoch;
+volatile LONG64 ghosts_this_epoch;
+volatile LONG64 ghost_counts[NUMBER_OF_GHOST_TYPES][NUMBER_OF_GHOST_EPOCHS];
+
+// The aging policy only trims a page out of the quota of its own age, oldest ages first
+// This is exactly how the trimmer chose pages before policies could be swapped
+ULONG aging_select_trim_candidate(PTE contents, PGLOBAL_AGE_COUNT trim_of_age)
+{
+    ULONG age = (ULONG) contents.memory_format.age;
+
+    if (trim_of_age->pages_of_age[age] == 0) {
+        return NO_TRIM;
+    }
+    return age;
+}
+
+ULONG64 aging_on_fault(PTE old_contents, ULONG fault_type)
+{
+    UNREFERENCED_PARAMETER(old_contents);
+    UNREFERENCED_PARAMETER(fault_type);
+    return 0;
+}
+
+ULONG64 aging_on_evict(PTE contents)
+{
+    UNREFERENCED_PARAMETER(contents);
+    return 0;
+}
+
+// The scan kernels already age the PTEs, so the aging policy needs no walk of its own
+REPLACEMENT_POLICY aging_policy = {
+    "aging",
+    NULL,
+    NULL,
+    aging_on_fault,
+    aging_select_trim_candidate,
+    aging_on_evict,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    FALSE
+};
+
+VOID select_replacement_policy(PCSTR name)
+{
+    if (name == NULL) {
+        return;
+    }
+
+    for (ULONG i = 0; i < NUMBER_OF_POLICIES; i++)
+    {
+        if (_stricmp(name, replacement_policies[i]->name) == 0) {
+            replacement_policy = replacement_policies[i];
+            replacement_policy_in_use = i;
+            return;
+        }
+    }
+
+    printf("select_replacement_policy : unknown policy %s, using %s. The policies are", name, replacement_policy->name);
+    for (ULONG i = 0; i < NUMBER_OF_POLICIES; i++)
+    {
+        printf(" %s", replacement_policies[i]->name);
+    }
+    printf("\n");
+}
+
+VOID initialize_replacement_policy(VOID)
+{
+    memset(&policy_stats, 0, sizeof(POLICY_STATS));
+
+    if (replacement_policy->initialize != NULL) {
+        replacement_policy->initialize();
+    }
+}
+
+// Hands every valid PTE a region walk saw to the policy, along with whether it was accessed since the last walk
+// Called with the region lock held, after the scan kernel has cleared the accessed bits
+VOID policy_scan_region(PPTE first_pte, PPTE_SCAN_RESULT scan)
+{
+    // Regions that produced accessed bits are remembered so that the next filtered walk visits them
+    if (replacement_policy->filter_region_walks) {
+        for (ULONG word = 0; word < PTE_SCAN_BITMAP_SIZE; word++) {
+            if (scan->accessed_bitmap[word] != 0) {
+                bloom_filter_insert_region(pte_region_from_pte(first_pte));
+                break;
+            }
+        }
+    }
+
+    if (replacement_policy->on_access == NULL) {
+        return;
+    }
+
+    for (ULONG word = 0; word < PTE_SCAN_BITMAP_SIZE; word++) {
+        ULONG64 valid = scan->valid_bitmap[word];
+        ULONG bit;
+
+        while (_BitScanForward64(&bit, valid)) {
+            valid &= valid - 1;
+            PPTE pte = first_pte + word * 64 + bit;
+
+            PTE contents = read_pte(pte);
+            BOOLEAN accessed = (scan->accessed_bitmap[word] & ((ULONG64) 1 << bit)) != 0;
+            replacement_policy->on_access(pte, contents, accessed);
+        }
+    }
+}
+
+// Called by the fault handler with the PTE lock held, returns the policy bits the new valid PTE starts with
+ULONG64 policy_fault(PTE old_contents, ULONG fault_type)
+{
+    InterlockedIncrement64(&policy_stats.faults[fault_type]);
+    return replacement_policy->on_fault(old_contents, fault_type);
+}
+
+// Called with the PTE's region locked for every valid PTE that is zeroed rather than trimmed
+VOID policy_forget(PTE contents)
+{
+    if (replacement_policy->on_forget != NULL) {
+        replacement_policy->on_forget(contents);
+    }
+}
+
+// Called with the PTE's region locked for every valid PTE that vm_advise marks as not needed
+VOID policy_dontneed(PPTE pte, PTE contents)
+{
+    if (replacement_policy->on_dontneed != NULL) {
+        replacement_policy->on_dontneed(pte, contents);
+    }
+}
+
+// Changes the policy bits of a valid PTE without losing an accessed bit the CPU stamps at the same time
+VOID update_policy_bits(PPTE pte, ULONG64 bits_to_clear, ULONG64 bits_to_set)
+{
+    PTE old_contents;
+    PTE new_contents;
+
+    do {
+        old_contents = read_pte(pte);
+        if (old_contents.memory_format.valid == 0) {
+            return;
+        }
+        new_contents.entire_format = (old_contents.entire_format & ~bits_to_clear) | bits_to_set;
+    } while (InterlockedCompareExchange64((volatile LONG64 *) &pte->entire_format,
+        (LONG64) new_contents.entire_format, (LONG64) old_contents.entire_format) != (LONG64) old_contents.entire_format);
+}
+
+// Policies that do not choose pages by age still have to respect how many pages the trimmer was told to trim
+// This finds the quota of the page's own age, or the oldest age that still has quota left
+ULONG find_trim_quota(PTE contents, PGLOBAL_AGE_COUNT trim_of_age)
+{
+    ULONG age = (ULONG) contents.memory_format.age;
+    if (trim_of_age->pages_of_age[age] != 0) {
+        return age;
+    }
+
+    for (LONG i = NUMBER_OF_AGES - 1; i >= 0; i--)
+    {
+        if (trim_of_age->pages_of_age[i] != 0) {
+            return (ULONG) i;
+        }
+    }
+
+    return NO_TRIM;
+}
+
+static VOID advance_ghost_epoch(LONG64 expected_epoch)
+{
+    LONG64 next_epoch = expected_epoch + 1;
+
+    // Only one thread gets to end the epoch, and it clears the counts of the slot the new epoch reuses
+    if (InterlockedCompareExchange64(&ghost_epoch, next_epoch, expected_epoch) == expected_epoch) {
+        for (ULONG type = 0; type < NUMBER_OF_GHOST_TYPES; type++)
+        {
+            InterlockedExchange64(&ghost_counts[type][next_epoch % NUMBER_OF_GHOST_EPOCHS], 0);
+        }
+        InterlockedExchange64(&ghosts_this_epoch, 0);
+    }
+}
+
+// Returns the ghost bits for an evicted page, stamped with the current epoch
+ULONG64 make_ghost(ULONG ghost_type)
+{
+    if (ghost_type == GHOST_NONE) {
+        return 0;
+    }
+
+    LONG64 epoch = ghost_epoch;
+    ULONG64 slot = (ULONG64) epoch % NUMBER_OF_GHOST_EPOCHS;
+
+    InterlockedIncrement64(&ghost_counts[ghost_type][slot]);
+    if ((ULONG64) InterlockedIncrement64(&ghosts_this_epoch) >= physical_page_count) {
+        advance_ghost_epoch(epoch);
+    }
+
+    return ((ULONG64) ghost_type << PTE_GHOST_TYPE_SHIFT) | (slot << PTE_GHOST_EPOCH_SHIFT);
+}
+
+// Returns the ghost type of an invalid PTE, or GHOST_NONE if it has none or its ghost has expired
+ULONG live_ghost_type(PTE contents)
+{
+    ULONG ghost_type = (ULONG) ((contents.entire_format & PTE_GHOST_TYPE_MASK) >> PTE_GHOST_TYPE_SHIFT);
+    if (ghost_type == GHOST_NONE) {
+        return GHOST_NONE;
+    }
+
+    ULONG64 slot = (contents.entire_format & PTE_GHOST_EPOCH_MASK) >> PTE_GHOST_EPOCH_SHIFT;
+    ULONG64 current_slot = (ULONG64) ghost_epoch % NUMBER_OF_GHOST_EPOCHS;
+    ULONG64 epochs_old = (current_slot + NUMBER_OF_GHOST_EPOCHS - slot) % NUMBER_OF_GHOST_EPOCHS;
+
+    if (epochs_old >= GHOST_LIFETIME_IN_EPOCHS) {
+        return GHOST_NONE;
+    }
+    return ghost_type;
+}
+
+// A refaulted page takes its ghost back out of the count
+VOID consume_ghost(PTE contents)
+{
+    ULONG ghost_type = live_ghost_type(contents);
+    if (ghost_type == GHOST_NONE) {
+        return;
+    }
+
+    ULONG64 slot = (contents.entire_format & PTE_GHOST_EPOCH_MASK) >> PTE_GHOST_EPOCH_SHIFT;
+    InterlockedDecrement64(&ghost_counts[ghost_type][slot]);
+    InterlockedIncrement64(&policy_stats.ghost_hits);
+}
+
+ULONG64 count_live_ghosts(ULONG ghost_type)
+{
+    LONG64 epoch = ghost_epoch;
+    LONG64 count = 0;
+
+    for (LONG64 i = 0; i < GHOST_LIFETIME_IN_EPOCHS && i <= epoch; i++)
+    {
+        count += ghost_counts[ghost_type][(epoch - i) % NUMBER_OF_GHOST_EPOCHS];
+    }
+
+    return count > 0 ? (ULONG64) count : 0;
+}
+
+VOID print_policy_statistics(VOID)
+{
+    ULONG64 accesses = 0;
+    for (ULONG i = 0; i < NUMBER_OF_FAULTING_THREADS; i++)
+    {
+        accesses += fault_stats[i].num_accesses;
+    }
+
+    ULONG64 first_accesses = policy_stats.faults[FAULT_FIRST_ACCESS];
+    ULONG64 soft_faults = policy_stats.faults[FAULT_SOFT];
+    ULONG64 hard_faults = policy_stats.faults[FAULT_HARD];
+    ULONG64 faults = first_accesses + soft_faults + hard_faults;
+
+    // First accesses fault under every policy, so the reaccess hit rate is what tells the policies apart
+    ULONG64 reaccesses = accesses > first_accesses ? accesses - first_accesses : 0;
+    DOUBLE hit_rate = accesses > 0 ? (DOUBLE) (accesses - min(accesses, faults)) / (DOUBLE) accesses : 0;
+    DOUBLE reaccess_hit_rate = reaccesses > 0 ?
+        (DOUBLE) (reaccesses - min(reaccesses, soft_faults + hard_faults)) / (DOUBLE) reaccesses : 0;
+
+    printf("replacement policy %s : %llu accesses, %llu first accesses, %llu soft faults, %llu hard faults, %llu ghost hits\n",
+           replacement_policy->name, accesses, first_accesses, soft_faults, hard_faults, (ULONG64) policy_stats.ghost_hits);
+    printf("replacement policy %s : hit rate %.4f, reaccess hit rate %.4f\n",
+           replacement_policy->name, hit_rate, reaccess_hit_rate);
+}
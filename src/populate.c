@@ -0,0 +1,464 @@
+#include <stdio.h>
+#include <Windows.h>
+#include "../include/vm.h"
+#include "../include/userapp.h"
+#include "../include/debug.h"
+
+PVOID populate_read_va;
+CRITICAL_SECTION populate_read_va_lock;
+
+volatile LONG64 pages_populated;
+volatile LONG64 pages_populated_from_disc;
+volatile LONG64 populate_waits;
+
+volatile LONG64 pinned_page_count;
+
+// Takes a transition PTE's page off the modified or standby list, just as a soft fault does
+// Returns the page locked, or NULL if the page became disc format or the modified writer has it
+static PPFN take_transition_page(PPTE pte, PPTE old_contents)
+{
+    PPFN pfn = pfn_from_frame_number(old_contents->transition_format.frame_number);
+    lock_pfn(pfn);
+
+    // The page can be repurposed before we get its lock, exactly as in the fault handler
+    *old_contents = read_pte(pte);
+    if (old_contents->disc_format.on_disc == 1) {
+        unlock_pfn(pfn);
+        return NULL;
+    }
+
+    // Pages being written are left for a fault to pick up once the write is done
+    if (pfn->flags.reference != 0) {
+        unlock_pfn(pfn);
+        return NULL;
+    }
+
+    if (pfn->flags.state == MODIFIED) {
+        PPFN_LIST modified_list = modified_list_from_pfn(pfn);
+        EnterCriticalSection(&modified_list->lock);
+        remove_from_list(pfn);
+        LeaveCriticalSection(&modified_list->lock);
+    } else {
+        PPFN_LIST standby_list = standby_list_from_pfn(pfn);
+        EnterCriticalSection(&standby_list->lock);
+        remove_from_list(pfn);
+        free_disc_index(pfn->disc_index);
+        LeaveCriticalSection(&standby_list->lock);
+        record_standby_rescue(pfn);
+    }
+
+    return pfn;
+}
+
+// Reads the pages of every disc format PTE that was given a page, mapping them all into our window at once
+static VOID read_disc_pages(PULONG_PTR frame_numbers, PULONG64 disc_indices, ULONG64 num_pages)
+{
+    if (num_pages == 0) {
+        return;
+    }
+
+    EnterCriticalSection(&populate_read_va_lock);
+
+    map_pages(populate_read_va, num_pages, frame_numbers);
+
+    for (ULONG64 i = 0; i < num_pages; i++)
+    {
+        read_from_pagefile(disc_indices[i], (PVOID) ((ULONG_PTR) populate_read_va + i * PAGE_SIZE));
+    }
+
+    unmap_pages(populate_read_va, num_pages);
+
+    LeaveCriticalSection(&populate_read_va_lock);
+
+    for (ULONG64 i = 0; i < num_pages; i++)
+    {
+        free_disc_index(disc_indices[i]);
+    }
+}
+
+// Sets the pinned bit on the valid PTEs of a locked region that do not have it yet and returns how many it set
+static ULONG64 pin_ptes(PPTE first_pte, PPTE last_pte)
+{
+    ULONG64 num_pinned = 0;
+
+    for (PPTE pte = first_pte; pte < last_pte; pte++)
+    {
+        PTE old_contents;
+        PTE new_contents;
+
+        // The CPU stamps valid PTEs without the region lock, so the bit is swapped in
+        do {
+            old_contents = read_pte(pte);
+            if (old_contents.memory_format.valid == 0 || (old_contents.entire_format & PTE_PINNED_BIT)) {
+                break;
+            }
+            new_contents = old_contents;
+            new_contents.entire_format |= PTE_PINNED_BIT;
+        } while (InterlockedCompareExchange64((volatile LONG64 *) &pte->entire_format,
+                 new_contents.entire_format, old_contents.entire_format) != (LONG64) old_contents.entire_format);
+
+        if (old_contents.memory_format.valid == 1 && (old_contents.entire_format & PTE_PINNED_BIT) == 0) {
+            num_pinned++;
+        }
+    }
+
+    return num_pinned;
+}
+
+// Makes every PTE in [first_pte, last_pte), which all lie in one region, valid under a single hold of the region lock
+// Pages for first accesses and disc PTEs are taken from the free list in one batch, then from standby one at a time
+// When pin is set, every valid PTE in the range is also pinned before the lock is let go, and num_pinned is added to
+// Returns the number of PTEs that were left invalid because we ran out of pages or the modified writer had them
+static ULONG64 populate_region_range(ULONG64 region_index, PPTE first_pte, PPTE last_pte, BOOLEAN pin,
+                                     PULONG64 num_pinned)
+{
+    PPTE_REGION region = &pte_regions[region_index];
+
+    // These PTEs need a page of their own, their old contents tell first accesses from disc PTEs
+    PPTE needy_ptes[PTE_REGION_SIZE];
+    ULONG64 num_needy = 0;
+
+    // Pages the modified writer is in the middle of writing, which we have to come back for
+    ULONG64 num_being_written = 0;
+
+    // Everything we make valid, with the PTE contents it had and the kind of fault it stands in for
+    PPTE populated_ptes[PTE_REGION_SIZE];
+    PTE old_contents[PTE_REGION_SIZE];
+    PPFN populated_pfns[PTE_REGION_SIZE];
+    ULONG fault_types[PTE_REGION_SIZE];
+    ULONG64 num_populated = 0;
+
+    ULONG_PTR read_frames[PTE_REGION_SIZE];
+    ULONG64 read_disc_indices[PTE_REGION_SIZE];
+    ULONG64 num_reads = 0;
+
+    PVOID virtual_addresses[PTE_REGION_SIZE];
+    ULONG_PTR frame_numbers[PTE_REGION_SIZE];
+    PFN_LIST page_batch;
+
+    commit_pte_region(region_index);
+
+    lock_pte_region(region);
+
+    page_in_pte_page(region_index);
+
+    for (PPTE pte = first_pte; pte < last_pte; pte++)
+    {
+        PTE local = read_pte(pte);
+
+        if (local.memory_format.valid == 1) {
+            continue;
+        }
+
+        if (local.entire_format == 0 || local.disc_format.on_disc == 1) {
+            needy_ptes[num_needy] = pte;
+            num_needy++;
+            continue;
+        }
+
+        PPFN pfn = take_transition_page(pte, &local);
+        if (pfn == NULL) {
+            if (local.disc_format.on_disc == 1) {
+                needy_ptes[num_needy] = pte;
+                num_needy++;
+            } else {
+                num_being_written++;
+            }
+            continue;
+        }
+
+        populated_ptes[num_populated] = pte;
+        old_contents[num_populated] = local;
+        populated_pfns[num_populated] = pfn;
+        fault_types[num_populated] = FAULT_SOFT;
+        num_populated++;
+    }
+
+    // The free list is taken in one lock hold, every page comes back locked
+    initialize_listhead(&page_batch);
+    if (num_needy != 0) {
+        EnterCriticalSection(&free_page_list.lock);
+        batch_pop_from_list_head(&free_page_list, &page_batch, num_needy, FALSE);
+        LeaveCriticalSection(&free_page_list.lock);
+
+        InterlockedAdd64((volatile LONG64 *) &pages_consumed, (LONG64) page_batch.num_pages);
+    }
+
+    PLIST_ENTRY batch_entry = page_batch.entry.Flink;
+    ULONG64 num_batched = page_batch.num_pages;
+    ULONG64 num_given = 0;
+
+    for (; num_given < num_needy; num_given++)
+    {
+        PPFN pfn;
+
+        if (num_given < num_batched) {
+            pfn = CONTAINING_RECORD(batch_entry, PFN, entry);
+            batch_entry = batch_entry->Flink;
+        } else {
+            // This repurposes standby pages, which can rewrite transition PTEs but never the ones we are populating
+            pfn = get_free_page();
+            if (pfn == NULL) {
+                break;
+            }
+        }
+
+        PPTE pte = needy_ptes[num_given];
+        PTE local = read_pte(pte);
+
+        populated_ptes[num_populated] = pte;
+        old_contents[num_populated] = local;
+        populated_pfns[num_populated] = pfn;
+
+        if (local.entire_format == 0) {
+            fault_types[num_populated] = FAULT_FIRST_ACCESS;
+        } else {
+            fault_types[num_populated] = FAULT_HARD;
+            read_frames[num_reads] = frame_number_from_pfn(pfn);
+            read_disc_indices[num_reads] = local.disc_format.disc_index;
+            num_reads++;
+        }
+        num_populated++;
+    }
+
+    read_disc_pages(read_frames, read_disc_indices, num_reads);
+
+    for (ULONG64 i = 0; i < num_populated; i++)
+    {
+        PPTE pte = populated_ptes[i];
+        PPFN pfn = populated_pfns[i];
+
+        if (fault_types[i] == FAULT_HARD) {
+            record_refault(old_contents[i]);
+        }
+
+        // The valid PTE is built from the policy's bits alone, as in the fault handler
+        PTE pte_contents;
+        pte_contents.entire_format = policy_fault(old_contents[i], fault_types[i]);
+        pte_contents.memory_format.frame_number = frame_number_from_pfn(pfn);
+        pte_contents.memory_format.valid = 1;
+        pte_contents.memory_format.age = 0;
+        write_pte(pte, pte_contents);
+
+        PFN pfn_contents = read_pfn(pfn);
+        pfn_contents.pte = pte;
+        pfn_contents.flags.state = ACTIVE;
+        pfn_contents.flags.dirtied = pfn->flags.reference != 0;
+        write_pfn(pfn, pfn_contents);
+
+        virtual_addresses[i] = va_from_pte(pte);
+        frame_numbers[i] = frame_number_from_pfn(pfn);
+    }
+
+    if (num_populated != 0) {
+        // Every mapping in the region is installed with one call
+        map_pages_scatter(virtual_addresses, num_populated, frame_numbers);
+
+        if (!is_region_active(region)) {
+            make_region_active(region);
+            EnterCriticalSection(&pte_region_age_lists[0].lock);
+            add_region_to_list(region, &pte_region_age_lists[0]);
+            LeaveCriticalSection(&pte_region_age_lists[0].lock);
+        }
+
+        if (replacement_policy->filter_region_walks) {
+            bloom_filter_insert_region(region);
+        }
+
+        region->age_count.ages[0] += (USHORT) num_populated;
+        InterlockedAdd64((volatile LONG64 *) &global_age_count.pages_of_age[0], (LONG64) num_populated);
+        charge_address_space(region, (LONG64) num_populated);
+    }
+
+    for (ULONG64 i = 0; i < num_populated; i++)
+    {
+        unlock_pfn(populated_pfns[i]);
+    }
+
+    // Pages that could not be brought in are pinned on the retry that brings them in
+    if (pin) {
+        ULONG64 newly_pinned = pin_ptes(first_pte, last_pte);
+        region->pinned_pages += newly_pinned;
+        *num_pinned += newly_pinned;
+    }
+
+    unlock_pte_region(region);
+
+    InterlockedAdd64(&pages_populated, (LONG64) num_populated);
+    InterlockedAdd64(&pages_populated_from_disc, (LONG64) num_reads);
+
+    return num_needy - num_given + num_being_written;
+}
+
+// Makes every page of a range valid, one region at a time, pinning them as it goes if asked to
+// When a region runs out of pages we wait for more without its lock held and then finish the region
+// The same wait covers pages the modified writer holds, as it signals that pages are available once it lets them go
+// Returns the number of pages that were newly pinned
+static ULONG64 populate_range(PVOID virtual_address, ULONG64 num_pages, BOOLEAN pin)
+{
+    PPTE pte = pte_from_va(virtual_address);
+    PPTE last_pte = pte + num_pages;
+    ULONG64 num_pinned = 0;
+
+    while (pte < last_pte)
+    {
+        ULONG64 region_index = (ULONG64) (pte - pte_base) / PTE_REGION_SIZE;
+        PPTE region_end = min(pte_base + (region_index + 1) * PTE_REGION_SIZE, last_pte);
+
+        // Like a fault, populating counts against the hard limit of the address space, which trims itself first
+        // With no region locked. Every PTE of the piece is counted, as the ones already valid are not known yet
+        ULONG64 num_ptes = (ULONG64) (region_end - pte);
+        if (is_address_space_at_hard_limit(&pte_regions[region_index], num_ptes))
+        {
+            enforce_address_space_limits(&pte_regions[region_index], num_ptes);
+        }
+
+        while (populate_region_range(region_index, pte, region_end, pin, &num_pinned) != 0)
+        {
+            InterlockedIncrement64(&populate_waits);
+            wait_for_pages();
+        }
+
+        pte = region_end;
+    }
+
+    return num_pinned;
+}
+
+VOID populate_va_range(PVOID virtual_address, ULONG64 num_pages)
+{
+    populate_range(virtual_address, num_pages, FALSE);
+}
+
+// Faults a range in and pins every page of it. The caller has already charged the whole range to the pin quota
+// Returns the number of pages that were not pinned before, the rest of the charge has to be given back
+ULONG64 pin_va_range(PVOID virtual_address, ULONG64 num_pages)
+{
+    return populate_range(virtual_address, num_pages, TRUE);
+}
+
+// Clears the pinned bit on every page of a range and returns the number of pages that were pinned
+ULONG64 unpin_va_range(PVOID virtual_address, ULONG64 num_pages)
+{
+    PPTE pte = pte_from_va(virtual_address);
+    PPTE last_pte = pte + num_pages;
+    ULONG64 total_unpinned = 0;
+
+    while (pte < last_pte)
+    {
+        ULONG64 region_index = (ULONG64) (pte - pte_base) / PTE_REGION_SIZE;
+        PPTE region_end = min(pte_base + (region_index + 1) * PTE_REGION_SIZE, last_pte);
+        PPTE_REGION region = &pte_regions[region_index];
+
+        // Pinned pages are valid, so their region is committed and its PTEs are in memory
+        if (is_pte_region_committed(region_index) == FALSE || region->pinned_pages == 0)
+        {
+            pte = region_end;
+            continue;
+        }
+
+        lock_pte_region(region);
+
+        ULONG64 num_unpinned = 0;
+        for (; pte < region_end; pte++)
+        {
+            PTE old_contents;
+            PTE new_contents;
+
+            do {
+                old_contents = read_pte(pte);
+                if ((old_contents.entire_format & PTE_PINNED_BIT) == 0) {
+                    break;
+                }
+                new_contents = old_contents;
+                new_contents.entire_format &= ~PTE_PINNED_BIT;
+            } while (InterlockedCompareExchange64((volatile LONG64 *) &pte->entire_format,
+                     new_contents.entire_format, old_contents.entire_format) != (LONG64) old_contents.entire_format);
+
+            if (old_contents.entire_format & PTE_PINNED_BIT) {
+                num_unpinned++;
+            }
+        }
+
+        region->pinned_pages -= num_unpinned;
+        charge_address_space_pins(region, 0 - (LONG64) num_unpinned);
+        unlock_pte_region(region);
+
+        total_unpinned += num_unpinned;
+    }
+
+    InterlockedAdd64(&pinned_page_count, 0 - (LONG64) total_unpinned);
+    return total_unpinned;
+}
+
+// Pinned pages stay at age 0 whatever the walk did to them, and the given age count of the locked region follows
+VOID keep_pinned_ptes_young(PPTE first_pte, ULONG64 num_ptes, PPTE_REGION_AGE_COUNT age_count)
+{
+    for (ULONG64 i = 0; i < num_ptes; i++)
+    {
+        PPTE pte = first_pte + i;
+        PTE old_contents;
+        PTE new_contents;
+
+        do {
+            old_contents = read_pte(pte);
+            if ((old_contents.entire_format & PTE_PINNED_BIT) == 0 || old_contents.memory_format.age == 0) {
+                break;
+            }
+            new_contents = old_contents;
+            new_contents.memory_format.age = 0;
+        } while (InterlockedCompareExchange64((volatile LONG64 *) &pte->entire_format,
+                 new_contents.entire_format, old_contents.entire_format) != (LONG64) old_contents.entire_format);
+
+        if ((old_contents.entire_format & PTE_PINNED_BIT) && old_contents.memory_format.age != 0) {
+            age_count->ages[old_contents.memory_format.age]--;
+            age_count->ages[0]++;
+        }
+    }
+}
+
+VOID print_populate_statistics(VOID)
+{
+    printf("populate : %lld pages populated, %lld of them read from disc, %lld waits for pages\n",
+           pages_populated, pages_populated_from_disc, populate_waits);
+    printf("populate : %lld pages pinned at exit, the quota is %llu pages\n",
+           pinned_page_count, MAX_PINNED_PAGES);
+}
+
+// Compares bringing a fresh buffer in one access_va at a time against populating it in one call
+// This runs once the faulting threads have freed their memory, while the system threads are still up
+VOID benchmark_populate(VOID)
+{
+    TIME_COUNTER time_counter;
+    ULONG64 num_bytes = POPULATE_BENCHMARK_PAGES * PAGE_SIZE;
+
+    PVOID buffer = vm_alloc(num_bytes);
+    NULL_CHECK(buffer, "benchmark_populate : could not allocate the buffer to fault in")
+
+    start_counter(&time_counter);
+    for (ULONG64 i = 0; i < POPULATE_BENCHMARK_PAGES; i++)
+    {
+        access_va((PULONG_PTR) ((ULONG_PTR) buffer + i * PAGE_SIZE));
+    }
+    stop_counter(&time_counter);
+    DOUBLE access_time = get_counter_duration(&time_counter);
+
+    vm_free(buffer);
+
+    buffer = vm_alloc(num_bytes);
+    NULL_CHECK(buffer, "benchmark_populate : could not allocate the buffer to populate")
+
+    start_counter(&time_counter);
+    vm_populate(buffer, num_bytes);
+    stop_counter(&time_counter);
+    DOUBLE populate_time = get_counter_duration(&time_counter);
+
+    vm_free(buffer);
+
+    DOUBLE access_rate = access_time > 0 ? (DOUBLE) POPULATE_BENCHMARK_PAGES / access_time : 0;
+    DOUBLE populate_rate = populate_time > 0 ? (DOUBLE) POPULATE_BENCHMARK_PAGES / populate_time : 0;
+
+    printf("benchmark_populate : access_va brought in %.0f pages per second\n", access_rate);
+    printf("benchmark_populate : vm_populate brought in %.0f pages per second (%.2fx)\n",
+           populate_rate, access_rate > 0 ? populate_rate / access_rate : 0);
+}
@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <Windows.h>
+#include "../include/vm.h"
+#include "../include/debug.h"
+
+ADMISSION_STATE admission_states[NUMBER_OF_FAULTING_THREADS];
+volatile LONG faulting_threads_running;
+DOUBLE stall_fraction;
+
+// Stalls are added up in microseconds so that every faulting thread can add to them with one interlocked add
+volatile LONG64 stall_microseconds;
+ULONG consecutive_stalled_seconds;
+
+ADMISSION_EVENT admission_events[MAX_ADMISSION_EVENTS];
+ULONG64 number_of_admission_events;
+
+ULONG64 run_start_tick;
+ULONG64 run_end_tick;
+
+VOID initialize_admission_control(VOID)
+{
+    for (ULONG i = 0; i < NUMBER_OF_FAULTING_THREADS; i++)
+    {
+        admission_states[i].suspended = FALSE;
+        admission_states[i].finished = FALSE;
+        admission_states[i].times_suspended = 0;
+        admission_states[i].time_suspended = 0;
+
+        // This is a manual reset event that stays set while the thread is admitted
+        admission_states[i].resume_event = CreateEvent(NULL, TRUE, TRUE, NULL);
+        NULL_CHECK(admission_states[i].resume_event, "initialize_admission_control : could not create a resume event")
+    }
+
+    faulting_threads_running = NUMBER_OF_FAULTING_THREADS;
+    stall_microseconds = 0;
+    consecutive_stalled_seconds = 0;
+    number_of_admission_events = 0;
+}
+
+// Called by the fault handler for every wait on pages or on the page file
+VOID record_stall(DOUBLE duration)
+{
+    InterlockedAdd64(&stall_microseconds, (LONG64) (duration * 1000000.0));
+}
+
+// Called by a faulting thread between accesses. This holds no locks, so it is safe to wait here
+VOID wait_for_admission(ULONG thread_index)
+{
+    PADMISSION_STATE state = &admission_states[thread_index];
+
+    if (*(volatile LONG *) &state->suspended == FALSE) {
+        return;
+    }
+
+    TIME_COUNTER time_counter;
+    start_counter(&time_counter);
+
+    WaitForSingleObject(state->resume_event, INFINITE);
+
+    stop_counter(&time_counter);
+    state->time_suspended += get_counter_duration(&time_counter);
+}
+
+VOID faulting_thread_finished(ULONG thread_index)
+{
+    InterlockedExchange(&admission_states[thread_index].finished, TRUE);
+    InterlockedDecrement(&faulting_threads_running);
+}
+
+static VOID record_admission_event(ULONG thread_index, ULONG action)
+{
+    if (number_of_admission_events >= MAX_ADMISSION_EVENTS) {
+        return;
+    }
+
+    PADMISSION_EVENT event = &admission_events[number_of_admission_events];
+    event->time_in_ms = GetTickCount64() - run_start_tick;
+    event->thread_index = thread_index;
+    event->action = action;
+    event->stall_fraction = stall_fraction;
+    number_of_admission_events++;
+}
+
+static VOID suspend_faulting_thread(ULONG thread_index)
+{
+    PADMISSION_STATE state = &admission_states[thread_index];
+
+    ResetEvent(state->resume_event);
+    InterlockedExchange(&state->suspended, TRUE);
+    state->times_suspended++;
+
+    record_admission_event(thread_index, ADMISSION_SUSPEND);
+}
+
+static VOID resume_faulting_thread(ULONG thread_index)
+{
+    PADMISSION_STATE state = &admission_states[thread_index];
+
+    InterlockedExchange(&state->suspended, FALSE);
+    SetEvent(state->resume_event);
+
+    record_admission_event(thread_index, ADMISSION_RESUME);
+}
+
+// Called by the scheduler once a second
+// Only the scheduler suspends and resumes threads, so the suspended flags need no lock here
+VOID update_admission_control(VOID)
+{
+    LONG64 stalled = InterlockedExchange64(&stall_microseconds, 0);
+
+    ULONG suspended_threads = 0;
+    for (ULONG i = 0; i < NUMBER_OF_FAULTING_THREADS; i++)
+    {
+        suspended_threads += admission_states[i].suspended ? 1 : 0;
+    }
+
+    LONG running = *(volatile LONG *) &faulting_threads_running;
+    LONG admitted = running - (LONG) suspended_threads;
+
+    // This is the share of the admitted threads' wall time that was spent stalled
+    DOUBLE available_microseconds = (DOUBLE) max(1, admitted) * WAKEUP_INTERVAL_IN_MS * 1000.0;
+    stall_fraction = min(1.0, (DOUBLE) stalled / available_microseconds);
+
+    if (stall_fraction > STALL_SUSPEND_THRESHOLD) {
+        consecutive_stalled_seconds++;
+    } else {
+        consecutive_stalled_seconds = 0;
+    }
+
+    // Suspend the lowest priority admitted thread that has not finished, as long as one other keeps running
+    if (consecutive_stalled_seconds >= STALL_SECONDS_BEFORE_SUSPEND && admitted > 1) {
+        for (LONG i = NUMBER_OF_FAULTING_THREADS - 1; i >= 0; i--)
+        {
+            if (admission_states[i].suspended == FALSE && admission_states[i].finished == FALSE) {
+                suspend_faulting_thread((ULONG) i);
+                consecutive_stalled_seconds = 0;
+                break;
+            }
+        }
+        return;
+    }
+
+    // Let the highest priority suspended thread back in once things calm down, or once nobody else is left running
+    if (suspended_threads != 0 && (stall_fraction < STALL_RESUME_THRESHOLD || admitted <= 0)) {
+        for (ULONG i = 0; i < NUMBER_OF_FAULTING_THREADS; i++)
+        {
+            if (admission_states[i].suspended) {
+                resume_faulting_thread(i);
+                break;
+            }
+        }
+    }
+}
+
+VOID mark_run_start(VOID)
+{
+    run_start_tick = GetTickCount64();
+}
+
+VOID mark_run_end(VOID)
+{
+    run_end_tick = GetTickCount64();
+}
+
+VOID print_admission_statistics(VOID)
+{
+    ULONG64 accesses = 0;
+    for (ULONG i = 0; i < NUMBER_OF_FAULTING_THREADS; i++)
+    {
+        accesses += fault_stats[i].num_accesses;
+    }
+
+    ULONG64 run_time_in_ms = max(1, run_end_tick - run_start_tick);
+    printf("admission control : %llu accesses in %llu ms, %.0f accesses per second\n",
+           accesses, run_time_in_ms, (DOUBLE) accesses * 1000.0 / (DOUBLE) run_time_in_ms);
+
+    for (ULONG i = 0; i < NUMBER_OF_FAULTING_THREADS; i++)
+    {
+        printf("admission control : faulting thread %lu was suspended %llu times for %.3f s\n",
+               i, admission_states[i].times_suspended, admission_states[i].time_suspended);
+    }
+
+    for (ULONG64 i = 0; i < number_of_admission_events; i++)
+    {
+        PADMISSION_EVENT event = &admission_events[i];
+        printf("admission control : %8llu ms %s faulting thread %lu at stall fraction %.2f\n",
+               event->time_in_ms, event->action == ADMISSION_SUSPEND ? "suspended" : "resumed  ",
+               event->thread_index, event->stall_fraction);
+    }
+}
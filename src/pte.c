@@ -10,6 +10,12 @@ PPTE_REGION pte_regions_end;
 
 PPTE_REGION_LIST pte_region_age_lists;
 
+volatile LONG *pte_directory;
+ULONG64 number_of_pte_regions;
+PULONG64 pte_page_disc_indices;
+
+volatile LONG64 pte_pages_paged_out;
+volatile LONG64 pte_pages_paged_in;
 
 // These functions convert between matching linear structures (pte and va)
 PPTE pte_from_va(PVOID virtual_address)
@@ -67,7 +73,7 @@ PPTE_REGION pte_region_from_pte(PPTE pte)
 PPTE pte_from_pte_region(PPTE_REGION pte_region)
 {
     NULL_CHECK(pte_region, "pte_from_pte_region : pte_region is null")
-    if (pte_region < pte_regions || pte_region >= &pte_regions[NUMBER_OF_PTE_REGIONS])
+    if (pte_region < pte_regions || pte_region >= pte_regions_end)
     {
         fatal_error("pte_from_pte_region : pte_region is out of valid range");
     }
@@ -78,6 +84,116 @@ PPTE pte_from_pte_region(PPTE_REGION pte_region)
     return &pte_base[index];
 }
 
+// Reading the directory is all it takes to know whether a region's PTEs and PTE_REGION can be touched
+BOOLEAN is_pte_region_committed(ULONG64 region_index)
+{
+    return *(volatile LONG *) &pte_directory[region_index] == PTE_REGION_COMMITTED;
+}
+
+// Commits the page of PTEs and the PTE_REGION for a region the first time it is touched
+// Only the thread that moves the region from uncommitted to committing does the work, anyone else waits for it
+VOID commit_pte_region(ULONG64 region_index)
+{
+    // A paged out region was committed before, so there is nothing to do here. It is paged back in under its lock
+    LONG state = *(volatile LONG *) &pte_directory[region_index];
+    if (state == PTE_REGION_COMMITTED || state == PTE_REGION_PAGED_OUT) {
+        return;
+    }
+
+    if (InterlockedCompareExchange(&pte_directory[region_index], PTE_REGION_COMMITTING,
+                                   PTE_REGION_UNCOMMITTED) == PTE_REGION_UNCOMMITTED) {
+        PPTE first_pte = pte_base + region_index * PTE_REGION_SIZE;
+        PVOID result = VirtualAlloc(first_pte, PTE_REGION_COVERAGE_IN_BYTES, MEM_COMMIT, PAGE_READWRITE);
+        NULL_CHECK(result, "commit_pte_region : could not commit memory for a page of PTEs")
+
+        // A PTE_REGION can share its page with its neighbors, committing an already committed page keeps its contents
+        PPTE_REGION pte_region = &pte_regions[region_index];
+        result = VirtualAlloc(pte_region, sizeof(PTE_REGION), MEM_COMMIT, PAGE_READWRITE);
+        NULL_CHECK(result, "commit_pte_region : could not commit memory for a pte region")
+
+        // Freshly committed memory is zeroed by the OS, so only the lock needs initializing
+        InitializeCriticalSection(&pte_region->lock);
+
+        InterlockedExchange(&pte_directory[region_index], PTE_REGION_COMMITTED);
+        return;
+    }
+
+    while (*(volatile LONG *) &pte_directory[region_index] == PTE_REGION_COMMITTING) {
+        YieldProcessor();
+    }
+}
+
+// Writes a region's page of PTEs to the page file and decommits it, if every PTE in it is zero or in disc format
+// The region must be locked and inactive. Valid and transition PTEs are reached through their PFNs without the
+// Region lock, so a page holding any of them has to stay resident
+BOOLEAN page_out_pte_page(ULONG64 region_index)
+{
+    PPTE first_pte = pte_base + region_index * PTE_REGION_SIZE;
+    BOOLEAN all_zero = TRUE;
+
+    for (ULONG64 i = 0; i < PTE_REGION_SIZE; i++) {
+        PTE pte_contents = read_pte(&first_pte[i]);
+        if (pte_contents.entire_format == 0) {
+            continue;
+        }
+        if (pte_contents.memory_format.valid == 1 || pte_contents.disc_format.on_disc == 0) {
+            return FALSE;
+        }
+        all_zero = FALSE;
+    }
+
+    // A page of untouched PTEs does not need a disc slot, recommitting it brings it back zeroed
+    ULONG64 disc_index = DISC_INDEX_FAIL_CODE;
+    if (all_zero == FALSE) {
+        // The system disc pages are kept for user data, the page table only uses disc space beyond them
+        if (*(volatile LONG64 *) &free_disc_spot_count <= (LONG64) NUMBER_OF_SYSTEM_DISC_PAGES) {
+            return FALSE;
+        }
+        if (get_disc_indices(&disc_index, 1) != 1) {
+            return FALSE;
+        }
+        write_to_pagefile(disc_index, first_pte);
+    }
+    pte_page_disc_indices[region_index] = disc_index;
+
+    // The state is published before the page disappears so that cpu_stamp stops reading it first
+    InterlockedExchange(&pte_directory[region_index], PTE_REGION_PAGED_OUT);
+
+    BOOL result = VirtualFree(first_pte, PTE_REGION_COVERAGE_IN_BYTES, MEM_DECOMMIT);
+    if (result == FALSE) {
+        fatal_error("page_out_pte_page : could not decommit a page of PTEs");
+    }
+
+    InterlockedIncrement64(&pte_pages_paged_out);
+    return TRUE;
+}
+
+// Brings a paged out page of PTEs back in. The region must be locked
+VOID page_in_pte_page(ULONG64 region_index)
+{
+    if (*(volatile LONG *) &pte_directory[region_index] != PTE_REGION_PAGED_OUT) {
+        return;
+    }
+
+    PPTE first_pte = pte_base + region_index * PTE_REGION_SIZE;
+    PVOID result = VirtualAlloc(first_pte, PTE_REGION_COVERAGE_IN_BYTES, MEM_COMMIT, PAGE_READWRITE);
+    NULL_CHECK(result, "page_in_pte_page : could not commit memory for a page of PTEs")
+
+    ULONG64 disc_index = pte_page_disc_indices[region_index];
+    if (disc_index != DISC_INDEX_FAIL_CODE) {
+        read_from_pagefile(disc_index, first_pte);
+        free_disc_index(disc_index);
+    }
+
+    InterlockedExchange(&pte_directory[region_index], PTE_REGION_COMMITTED);
+    InterlockedIncrement64(&pte_pages_paged_in);
+}
+
+VOID commit_pte_region_for_pte(PPTE pte)
+{
+    commit_pte_region((ULONG64) (pte - pte_base) / PTE_REGION_SIZE);
+}
+
 // These functions are used to read and write PTEs and PFNs in a way that doesn't conflict with other threads
 PTE read_pte(PPTE pte)
 {
@@ -230,6 +346,7 @@ BOOLEAN is_region_active(PPTE_REGION pte_region) {
 VOID make_region_active(PPTE_REGION pte_region) {
     // This makes the region active
     pte_region->active = 1;
+    pte_region->cold_walks = 0;
 }
 
 VOID make_region_inactive(PPTE_REGION pte_region) {
@@ -264,7 +381,8 @@ PPTE_REGION get_next_active_region(PPTE_REGION pte_region) {
         if (pte_region >= pte_regions_end) {
             pte_region = pte_regions;
         }
-    } while (is_region_active(pte_region) == FALSE);
+    } while (is_pte_region_committed((ULONG64) (pte_region - pte_regions)) == FALSE ||
+             is_region_active(pte_region) == FALSE);
 
     return pte_region;
 }
@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <Windows.h>
+#include <intrin.h>
+#include <immintrin.h>
+#include "../include/vm.h"
+#include "../include/debug.h"
+
+// The number of times each kernel walks a full region in the benchmark
+#define PTE_SCAN_BENCHMARK_ITERATIONS            ((ULONG64) 100000)
+
+// CPUID and XCR0 bits used to find out which kernels this machine can run
+#define CPUID_ECX_OSXSAVE                        (1 << 27)
+#define CPUID_ECX_AVX                            (1 << 28)
+#define CPUID_EBX_AVX2                           (1 << 5)
+#define CPUID_EBX_AVX512F                        (1 << 16)
+// The OS has to save the YMM registers for AVX2, and the opmask/ZMM registers as well for AVX-512
+#define XCR0_AVX_STATE                           ((ULONG64) 0x06)
+#define XCR0_AVX512_STATE                        ((ULONG64) 0xE6)
+
+PTE_SCAN_KERNEL scan_pte_block = scan_pte_block_scalar;
+ULONG pte_scan_kernel_in_use = PTE_SCAN_SCALAR;
+
+// The scalar kernel is the reference implementation. Every vector kernel must give exactly the same results
+VOID scan_pte_block_scalar(PPTE ptes, ULONG64 num_ptes, ULONG mode, PPTE_SCAN_RESULT result)
+{
+    memset(result, 0, sizeof(PTE_SCAN_RESULT));
+
+    for (ULONG64 index = 0; index < num_ptes; index++)
+    {
+        PTE local = read_pte(&ptes[index]);
+        if (local.memory_format.valid == 0)
+        {
+            continue;
+        }
+
+        ULONG64 bit = (ULONG64) 1 << (index % 64);
+        result->valid_bitmap[index / 64] |= bit;
+        result->num_valid++;
+
+        ULONG age = local.memory_format.age;
+        if (local.memory_format.accessed)
+        {
+            // If the PTE is accessed, we reset its age
+            result->accessed_bitmap[index / 64] |= bit;
+            local.memory_format.accessed = 0;
+            age = 0;
+        }
+        // Age the PTE if possible, but not if it has just had its accessed bit reset
+        else if (mode == PTE_SCAN_AGE && age < NUMBER_OF_AGES - 1)
+        {
+            age++;
+        }
+
+        // Only write PTEs that actually change, as writes can race with the CPU stamping accessed bits
+        if (age != local.memory_format.age || (result->accessed_bitmap[index / 64] & bit))
+        {
+            local.memory_format.age = age;
+            write_pte(&ptes[index], local);
+        }
+
+        result->age_count.ages[age]++;
+    }
+}
+
+// Folds the scan of the leftover PTEs at the end of a block into the result of the vector kernel
+// The tail is always shorter than one vector, so it never straddles two bitmap words
+static VOID merge_tail_scan(PPTE_SCAN_RESULT result, PPTE_SCAN_RESULT tail, ULONG64 first_index)
+{
+    result->valid_bitmap[first_index / 64] |= tail->valid_bitmap[0] << (first_index % 64);
+    result->accessed_bitmap[first_index / 64] |= tail->accessed_bitmap[0] << (first_index % 64);
+    result->num_valid += tail->num_valid;
+
+    for (ULONG age = 0; age < NUMBER_OF_AGES; age++)
+    {
+        result->age_count.ages[age] += tail->age_count.ages[age];
+    }
+}
+
+// Processes 4 PTEs per instruction
+// Invalid PTEs are never written, as transition PTEs can be changed to disc format under just a PFN lock
+VOID scan_pte_block_avx2(PPTE ptes, ULONG64 num_ptes, ULONG mode, PPTE_SCAN_RESULT result)
+{
+    const __m256i valid_bit = _mm256_set1_epi64x(PTE_VALID_BIT);
+    const __m256i accessed_bit = _mm256_set1_epi64x(PTE_ACCESSED_BIT);
+    const __m256i age_mask = _mm256_set1_epi64x(PTE_AGE_MASK);
+    const __m256i kept_bits = _mm256_set1_epi64x(~(PTE_ACCESSED_BIT | PTE_AGE_MASK));
+    const __m256i oldest_age = _mm256_set1_epi64x(NUMBER_OF_AGES - 1);
+    const __m256i one = _mm256_set1_epi64x(1);
+    ULONG64 age_totals[NUMBER_OF_AGES] = {0};
+    ULONG64 index;
+
+    memset(result, 0, sizeof(PTE_SCAN_RESULT));
+
+    for (index = 0; index + 4 <= num_ptes; index += 4)
+    {
+        __m256i old_ptes = _mm256_loadu_si256((__m256i *) &ptes[index]);
+        __m256i valid = _mm256_cmpeq_epi64(_mm256_and_si256(old_ptes, valid_bit), valid_bit);
+
+        ULONG valid_lanes = (ULONG) _mm256_movemask_pd(_mm256_castsi256_pd(valid));
+        if (valid_lanes == 0)
+        {
+            continue;
+        }
+
+        __m256i accessed = _mm256_cmpeq_epi64(_mm256_and_si256(old_ptes, accessed_bit), accessed_bit);
+        __m256i ages = _mm256_srli_epi64(_mm256_and_si256(old_ptes, age_mask), (int) PTE_AGE_SHIFT);
+
+        if (mode == PTE_SCAN_AGE)
+        {
+            // The compare gives -1 in lanes that are already the oldest age, which cancels out the increment
+            __m256i saturated = _mm256_cmpeq_epi64(ages, oldest_age);
+            ages = _mm256_add_epi64(_mm256_add_epi64(ages, one), saturated);
+        }
+        // Accessed PTEs go back to age 0
+        ages = _mm256_andnot_si256(accessed, ages);
+
+        __m256i new_ptes = _mm256_or_si256(_mm256_and_si256(old_ptes, kept_bits),
+                                           _mm256_slli_epi64(ages, (int) PTE_AGE_SHIFT));
+
+        __m256i changed = _mm256_andnot_si256(_mm256_cmpeq_epi64(new_ptes, old_ptes), valid);
+        _mm256_maskstore_epi64((LONG64 *) &ptes[index], changed, new_ptes);
+
+        ULONG accessed_lanes = (ULONG) _mm256_movemask_pd(_mm256_castsi256_pd(accessed)) & valid_lanes;
+        result->valid_bitmap[index / 64] |= (ULONG64) valid_lanes << (index % 64);
+        result->accessed_bitmap[index / 64] |= (ULONG64) accessed_lanes << (index % 64);
+        result->num_valid += __popcnt(valid_lanes);
+
+        // Build the histogram by comparing every lane against each age and counting the matching valid lanes
+        for (ULONG age = 0; age < NUMBER_OF_AGES; age++)
+        {
+            __m256i match = _mm256_cmpeq_epi64(ages, _mm256_set1_epi64x(age));
+            ULONG match_lanes = (ULONG) _mm256_movemask_pd(_mm256_castsi256_pd(match)) & valid_lanes;
+            age_totals[age] += __popcnt(match_lanes);
+        }
+    }
+
+    for (ULONG age = 0; age < NUMBER_OF_AGES; age++)
+    {
+        result->age_count.ages[age] = (USHORT) age_totals[age];
+    }
+
+    if (index < num_ptes)
+    {
+        PTE_SCAN_RESULT tail;
+        scan_pte_block_scalar(&ptes[index], num_ptes - index, mode, &tail);
+        merge_tail_scan(result, &tail, index);
+    }
+}
+
+// Processes 8 PTEs per instruction, using opmask registers instead of compare vectors
+VOID scan_pte_block_avx512(PPTE ptes, ULONG64 num_ptes, ULONG mode, PPTE_SCAN_RESULT result)
+{
+    const __m512i valid_bit = _mm512_set1_epi64(PTE_VALID_BIT);
+    const __m512i accessed_bit = _mm512_set1_epi64(PTE_ACCESSED_BIT);
+    const __m512i age_mask = _mm512_set1_epi64(PTE_AGE_MASK);
+    const __m512i kept_bits = _mm512_set1_epi64(~(PTE_ACCESSED_BIT | PTE_AGE_MASK));
+    const __m512i oldest_age = _mm512_set1_epi64(NUMBER_OF_AGES - 1);
+    const __m512i one = _mm512_set1_epi64(1);
+    ULONG64 age_totals[NUMBER_OF_AGES] = {0};
+    ULONG64 index;
+
+    memset(result, 0, sizeof(PTE_SCAN_RESULT));
+
+    for (index = 0; index + 8 <= num_ptes; index += 8)
+    {
+        __m512i old_ptes = _mm512_loadu_si512((void *) &ptes[index]);
+        __mmask8 valid = _mm512_test_epi64_mask(old_ptes, valid_bit);
+        if (valid == 0)
+        {
+            continue;
+        }
+
+        __mmask8 accessed = _mm512_mask_test_epi64_mask(valid, old_ptes, accessed_bit);
+        __m512i ages = _mm512_srli_epi64(_mm512_and_si512(old_ptes, age_mask), (unsigned int) PTE_AGE_SHIFT);
+
+        if (mode == PTE_SCAN_AGE)
+        {
+            ages = _mm512_min_epu64(_mm512_add_epi64(ages, one), oldest_age);
+        }
+        // Accessed PTEs go back to age 0
+        ages = _mm512_maskz_mov_epi64((__mmask8) ~accessed, ages);
+
+        __m512i new_ptes = _mm512_or_si512(_mm512_and_si512(old_ptes, kept_bits),
+                                           _mm512_slli_epi64(ages, (unsigned int) PTE_AGE_SHIFT));
+
+        __mmask8 changed = _mm512_mask_cmpneq_epi64_mask(valid, new_ptes, old_ptes);
+        _mm512_mask_storeu_epi64((void *) &ptes[index], changed, new_ptes);
+
+        result->valid_bitmap[index / 64] |= (ULONG64) valid << (index % 64);
+        result->accessed_bitmap[index / 64] |= (ULONG64) accessed << (index % 64);
+        result->num_valid += __popcnt((ULONG) valid);
+
+        for (ULONG age = 0; age < NUMBER_OF_AGES; age++)
+        {
+            __mmask8 match = _mm512_mask_cmpeq_epi64_mask(valid, ages, _mm512_set1_epi64(age));
+            age_totals[age] += __popcnt((ULONG) match);
+        }
+    }
+
+    for (ULONG age = 0; age < NUMBER_OF_AGES; age++)
+    {
+        result->age_count.ages[age] = (USHORT) age_totals[age];
+    }
+
+    if (index < num_ptes)
+    {
+        PTE_SCAN_RESULT tail;
+        scan_pte_block_scalar(&ptes[index], num_ptes - index, mode, &tail);
+        merge_tail_scan(result, &tail, index);
+    }
+}
+
+// Finds the widest kernel that both the CPU and the OS support
+static ULONG detect_pte_scan_kernel(VOID)
+{
+    int info[4];
+
+    __cpuid(info, 0);
+    if (info[0] < 7)
+    {
+        return PTE_SCAN_SCALAR;
+    }
+
+    __cpuid(info, 1);
+    if ((info[2] & CPUID_ECX_OSXSAVE) == 0 || (info[2] & CPUID_ECX_AVX) == 0)
+    {
+        return PTE_SCAN_SCALAR;
+    }
+
+    ULONG64 xcr0 = _xgetbv(0);
+    if ((xcr0 & XCR0_AVX_STATE) != XCR0_AVX_STATE)
+    {
+        return PTE_SCAN_SCALAR;
+    }
+
+    __cpuidex(info, 7, 0);
+    if ((info[1] & CPUID_EBX_AVX512F) && (xcr0 & XCR0_AVX512_STATE) == XCR0_AVX512_STATE)
+    {
+        return PTE_SCAN_AVX512;
+    }
+    if (info[1] & CPUID_EBX_AVX2)
+    {
+        return PTE_SCAN_AVX2;
+    }
+
+    return PTE_SCAN_SCALAR;
+}
+
+VOID initialize_pte_scan(VOID)
+{
+    pte_scan_kernel_in_use = detect_pte_scan_kernel();
+
+    switch (pte_scan_kernel_in_use)
+    {
+        case PTE_SCAN_AVX512:
+            scan_pte_block = scan_pte_block_avx512;
+            break;
+        case PTE_SCAN_AVX2:
+            scan_pte_block = scan_pte_block_avx2;
+            break;
+        default:
+            scan_pte_block = scan_pte_block_scalar;
+            break;
+    }
+}
+
+// Fills a region's worth of PTEs with a random mix of valid, accessed and invalid entries of every age
+static VOID fill_benchmark_ptes(PPTE ptes)
+{
+    srand(1);
+
+    for (ULONG64 i = 0; i < PTE_REGION_SIZE; i++)
+    {
+        PTE local;
+        local.entire_format = 0;
+
+        if (rand() % 4 != 0)
+        {
+            local.memory_format.valid = 1;
+            local.memory_format.accessed = (rand() % 4 == 0);
+            local.memory_format.frame_number = (ULONG64) rand() + 1;
+            local.memory_format.age = rand() % NUMBER_OF_AGES;
+        }
+        else
+        {
+            local.transition_format.frame_number = (ULONG64) rand() + 1;
+        }
+        ptes[i] = local;
+    }
+}
+
+// Times each kernel this machine supports over the same region and checks it against the scalar kernel
+VOID benchmark_pte_scan(VOID)
+{
+    static const char *kernel_names[] = {"scalar", "avx2", "avx512"};
+    PTE_SCAN_KERNEL kernels[] = {scan_pte_block_scalar, scan_pte_block_avx2, scan_pte_block_avx512};
+    PTE_SCAN_RESULT result;
+    PTE_SCAN_RESULT expected_result;
+    TIME_COUNTER time_counter;
+
+    initialize_pte_scan();
+
+    PPTE pristine_ptes = malloc(PTE_REGION_SIZE * sizeof(PTE));
+    NULL_CHECK(pristine_ptes, "benchmark_pte_scan : could not allocate memory for the pristine ptes")
+    PPTE expected_ptes = malloc(PTE_REGION_SIZE * sizeof(PTE));
+    NULL_CHECK(expected_ptes, "benchmark_pte_scan : could not allocate memory for the expected ptes")
+    PPTE ptes = malloc(PTE_REGION_SIZE * sizeof(PTE));
+    NULL_CHECK(ptes, "benchmark_pte_scan : could not allocate memory for the benchmark ptes")
+
+    fill_benchmark_ptes(pristine_ptes);
+
+    memcpy(expected_ptes, pristine_ptes, PTE_REGION_SIZE * sizeof(PTE));
+    scan_pte_block_scalar(expected_ptes, PTE_REGION_SIZE, PTE_SCAN_AGE, &expected_result);
+
+    // Every iteration restores the region first, so the cost of the copy is measured and taken out
+    start_counter(&time_counter);
+    for (ULONG64 i = 0; i < PTE_SCAN_BENCHMARK_ITERATIONS; i++)
+    {
+        memcpy(ptes, pristine_ptes, PTE_REGION_SIZE * sizeof(PTE));
+    }
+    stop_counter(&time_counter);
+    DOUBLE copy_duration = get_counter_duration(&time_counter);
+
+    printf("benchmark_pte_scan : %llu scans of %llu PTEs, kernel in use is %s\n",
+           PTE_SCAN_BENCHMARK_ITERATIONS, PTE_REGION_SIZE, kernel_names[pte_scan_kernel_in_use]);
+
+    for (ULONG kernel = PTE_SCAN_SCALAR; kernel <= pte_scan_kernel_in_use; kernel++)
+    {
+        start_counter(&time_counter);
+        for (ULONG64 i = 0; i < PTE_SCAN_BENCHMARK_ITERATIONS; i++)
+        {
+            memcpy(ptes, pristine_ptes, PTE_REGION_SIZE * sizeof(PTE));
+            kernels[kernel](ptes, PTE_REGION_SIZE, PTE_SCAN_AGE, &result);
+        }
+        stop_counter(&time_counter);
+
+        DOUBLE duration = get_counter_duration(&time_counter) - copy_duration;
+        DOUBLE ns_per_pte = duration * 1e9 / (DOUBLE) (PTE_SCAN_BENCHMARK_ITERATIONS * PTE_REGION_SIZE);
+
+        BOOLEAN matches = memcmp(ptes, expected_ptes, PTE_REGION_SIZE * sizeof(PTE)) == 0 &&
+                          memcmp(&result, &expected_result, sizeof(PTE_SCAN_RESULT)) == 0;
+
+        printf("benchmark_pte_scan : %-6s %.3f ns per PTE (%.1f million PTEs aged per second) %s\n",
+               kernel_names[kernel], ns_per_pte, 1e3 / ns_per_pte, matches ? "" : "MISMATCH");
+        assert(matches)
+    }
+
+    free(pristine_ptes);
+    free(expected_ptes);
+    free(ptes);
+}
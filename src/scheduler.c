@@ -7,12 +7,9 @@
 #include "debug.h"
 
 HANDLE age_wake_event;
-HANDLE mw_wake_event;
-HANDLE trim_wake_event;
 
 ULONG64 num_mod_writes_global;
 ULONG64 num_ages_global;
-ULONG64 num_trims_global;
 
 GLOBAL_AGE_COUNT global_age_count;
 
@@ -75,9 +72,10 @@ TIME_MEASURE average_tracked_times(TIME_MEASURE *times, USHORT array_size)
 
 VOID track_time(DOUBLE duration, ULONG64 num_pages, TIME_MEASURE *times, ULONG64 *index, ULONG64 times_to_track)
 {
-    times[*index].duration = duration;
-    times[*index].num_pages = num_pages;
-    *index = (*index + 1) % times_to_track;
+    // Several threads can track the same kind of work at once, so each one claims its own slot
+    ULONG64 slot = ((ULONG64) InterlockedIncrement64((volatile LONG64 *) index) - 1) % times_to_track;
+    times[slot].duration = duration;
+    times[slot].num_pages = num_pages;
 }
 
 VOID track_consumed_pages(ULONG64 prev_pages_consumed)
@@ -133,12 +131,18 @@ DWORD task_scheduling_thread(PVOID context)
         // This count could be totally broken, as the counts of free and standby page counts are from different times
         // We can trust them both individually at that time but not together
         ULONG64 consumable_pages = *(volatile ULONG_PTR *) (&free_page_list.num_pages) +
-                                 *(volatile ULONG_PTR *) (&standby_page_list.num_pages);
+                                 standby_page_count();
         ULONG64 prev_pages_consumed = *(volatile ULONG64 *) (&pages_consumed);
 
         // Reset the pages consumed count for the next second
         InterlockedExchange64((volatile LONG64 *) &pages_consumed, 0);
 
+        // Decide how much of the active set to protect from the refaults of the last second
+        update_workingset_protection();
+
+        // Suspend or resume faulting threads depending on how much of last second they spent stalled
+        update_admission_control();
+
         // Track the current number of available pages
         track_consumed_pages(prev_pages_consumed);
 
@@ -164,10 +168,16 @@ DWORD task_scheduling_thread(PVOID context)
         for (ULONG i = 0; i < NUMBER_OF_AGES; i++) {
             total_active_pages += age_count_snapshot.pages_of_age[i];
         }
+
+        // Pinned pages cannot be trimmed, so they are left out of what the trimming and aging is sized by
+        LONG64 pinned_pages = *(volatile LONG64 *) &pinned_page_count;
+        total_active_pages -= min(total_active_pages, (ULONG64) max(0, pinned_pages));
         if (total_active_pages == 0) {
             // If there are no active pages, we can skip aging
-            SetEvent(mw_wake_event);
-            SetEvent(trim_wake_event);
+            // The trimmers must not keep acting on a fused target left over from an earlier cycle
+            InterlockedExchange64(&fused_trim_target, 0);
+            wake_modified_writers();
+            wake_trimmers();
             continue;
         }
 
@@ -182,8 +192,9 @@ DWORD task_scheduling_thread(PVOID context)
 
         // Find how long it will take to age all the pages we need to age
         ULONG64 total_num_pages_to_age = total_active_pages * NUMBER_OF_AGES;
-        DOUBLE time_to_age_all = (DOUBLE) total_num_pages_to_age * age_per_page_cost;;
-        ULONG64 max_possible_ages = (ULONG64) (1.0 / age_per_page_cost);
+        DOUBLE time_to_age_all = (DOUBLE) total_num_pages_to_age * age_per_page_cost / number_of_aging_workers;
+        // Every worker in the aging pool can age this many pages a second on its own
+        ULONG64 max_possible_ages = (ULONG64) (1.0 / age_per_page_cost) * number_of_aging_workers;
 
         // If we have enough time we want to calculate the fraction of each second that we should be aging
         // And multiply it by the max number of batches we can age in a second
@@ -195,9 +206,15 @@ DWORD task_scheduling_thread(PVOID context)
             DOUBLE fraction_used = (DOUBLE) time_to_age_all / (DOUBLE) time_until_no_pages;
             assert(fraction_used <= 1.0);
             num_ages_local = (ULONG64) ((DOUBLE) max_possible_ages * fraction_used);
+
+            InterlockedExchange64(&fused_trim_target, 0);
         } else {
             // Otherwise, we can age constantly
             num_ages_local = max_possible_ages;
+
+            // We are under pressure, so the aging workers trim what is consumed in a second while they age
+            // Instead of the trimmers walking the same regions a second time
+            InterlockedExchange64(&fused_trim_target, (LONG64) max(1, average_page_consumption));
         }
 
         *(volatile ULONG64 *)(&num_ages_global) = num_ages_local;
@@ -205,8 +222,8 @@ DWORD task_scheduling_thread(PVOID context)
         SetEvent(age_wake_event);
 
         // Wake the trimmer mod writer do their own checks
-        SetEvent(mw_wake_event);
-        SetEvent(trim_wake_event);
+        wake_modified_writers();
+        wake_trimmers();
     }
 
     return 0;
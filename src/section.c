@@ -0,0 +1,391 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <Windows.h>
+#include "../include/vm.h"
+#include "../include/debug.h"
+
+PSECTION section_list;
+CRITICAL_SECTION section_list_lock;
+
+volatile LONG64 section_pages_mapped;
+volatile LONG64 section_pages_shared;
+
+VOID initialize_sections(VOID)
+{
+    INITIALIZE_LOCK(section_list_lock);
+    section_list = NULL;
+}
+
+// The caller must hold section_list_lock
+static PSECTION find_section(PCSTR name)
+{
+    for (PSECTION section = section_list; section != NULL; section = section->next)
+    {
+        if (section->name[0] != '\0' && strcmp(section->name, name) == 0)
+        {
+            return section;
+        }
+    }
+
+    return NULL;
+}
+
+// Creates a section of zero pages. Named sections can be opened by name, unnamed ones are only shared by handle
+// Returns NULL if a section with the same name already exists
+PSECTION vm_create_section(PCSTR name, ULONG64 num_bytes)
+{
+    if (num_bytes == 0 || (name != NULL && strlen(name) >= SECTION_NAME_LENGTH))
+    {
+        return NULL;
+    }
+
+    PSECTION section = (PSECTION) malloc(sizeof(SECTION));
+    NULL_CHECK(section, "vm_create_section : could not allocate memory for a section")
+
+    section->num_pages = (num_bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+    section->references = 1;
+    section->file = NULL;
+    section->read_only = FALSE;
+    section->name[0] = '\0';
+    if (name != NULL)
+    {
+        strcpy(section->name, name);
+    }
+
+    // Zero prototype PTEs are pages that were never touched, exactly as with real PTEs
+    section->prototype_ptes = (PPTE) calloc(section->num_pages, sizeof(PTE));
+    NULL_CHECK(section->prototype_ptes, "vm_create_section : could not allocate memory for prototype ptes")
+
+    INITIALIZE_LOCK(section->lock);
+
+    EnterCriticalSection(&section_list_lock);
+
+    if (name != NULL && find_section(name) != NULL)
+    {
+        LeaveCriticalSection(&section_list_lock);
+        DeleteCriticalSection(&section->lock);
+        free(section->prototype_ptes);
+        free(section);
+        return NULL;
+    }
+
+    section->next = section_list;
+    section_list = section;
+
+    LeaveCriticalSection(&section_list_lock);
+
+    return section;
+}
+
+// Returns a new handle to an existing named section, or NULL if there is none by that name
+PSECTION vm_open_section(PCSTR name)
+{
+    if (name == NULL)
+    {
+        return NULL;
+    }
+
+    EnterCriticalSection(&section_list_lock);
+
+    PSECTION section = find_section(name);
+    if (section != NULL)
+    {
+        InterlockedIncrement(&section->references);
+    }
+
+    LeaveCriticalSection(&section_list_lock);
+
+    return section;
+}
+
+// Gives back a handle. The section goes away once every handle is closed and every mapping is freed
+VOID vm_close_section(PSECTION section)
+{
+    dereference_section(section);
+}
+
+// Maps the whole section at a new VA, which is given back with vm_free like any other allocation
+// Returns NULL if no free range is big enough
+PVOID vm_map_section(PSECTION section)
+{
+    InterlockedIncrement(&section->references);
+
+    PVOID virtual_address = allocate_va_range(NULL, section->num_pages, section);
+    if (virtual_address == NULL)
+    {
+        dereference_section(section);
+    }
+
+    return virtual_address;
+}
+
+// Frees everything the prototype PTEs of a section still hold. Nothing maps the section any more,
+// So every prototype PTE is zero, in transition or on disc
+static VOID delete_section(PSECTION section)
+{
+    ULONG64 disc_slots_released = 0;
+
+    if (section->file != NULL)
+    {
+        flush_mapped_file(section);
+    }
+
+    for (ULONG64 i = 0; i < section->num_pages; i++)
+    {
+        PPTE prototype = &section->prototype_ptes[i];
+        if (read_pte(prototype).entire_format == 0)
+        {
+            continue;
+        }
+
+        PPFN pfn = release_invalid_pte(prototype, &disc_slots_released);
+        if (pfn != NULL)
+        {
+            EnterCriticalSection(&free_page_list.lock);
+            add_to_list_tail(pfn, &free_page_list);
+            LeaveCriticalSection(&free_page_list.lock);
+            unlock_pfn(pfn);
+        }
+    }
+
+    if (section->file != NULL)
+    {
+        close_mapped_file(section);
+    }
+
+    DeleteCriticalSection(&section->lock);
+    free(section->prototype_ptes);
+    free(section);
+}
+
+// The last reference is only dropped under the list lock, so vm_open_section cannot find a section being deleted
+VOID dereference_section(PSECTION section)
+{
+    EnterCriticalSection(&section_list_lock);
+
+    if (InterlockedDecrement(&section->references) != 0)
+    {
+        LeaveCriticalSection(&section_list_lock);
+        return;
+    }
+
+    PSECTION *link = &section_list;
+    while (*link != section)
+    {
+        link = &(*link)->next;
+    }
+    *link = section->next;
+
+    LeaveCriticalSection(&section_list_lock);
+
+    delete_section(section);
+}
+
+// Finds the page behind a section page for a fault on one of its mappings, called with the faulting PTE's region locked
+// The page comes back locked and counted in share_count, with its prototype PTE valid and pfn->pte pointing at it
+// Returns NULL if a page was needed and none could be had, in which case the caller waits for pages
+PPFN section_fault(PSECTION section, ULONG64 section_page, PULONG fault_type)
+{
+    PPTE prototype = &section->prototype_ptes[section_page];
+    PPFN pfn;
+
+    EnterCriticalSection(&section->lock);
+
+    while (TRUE)
+    {
+        PTE local = read_pte(prototype);
+
+        // Another mapping's fault is reading the page in, so we wait for it to finish without the section lock
+        if (local.entire_format & PTE_PROTOTYPE_IN_PROGRESS_BIT)
+        {
+            LeaveCriticalSection(&section->lock);
+            Sleep(0);
+            EnterCriticalSection(&section->lock);
+            continue;
+        }
+
+        // Another mapping has the page in memory already, so all we do is map it too
+        if (local.memory_format.valid == 1)
+        {
+            pfn = pfn_from_frame_number(local.memory_format.frame_number);
+            lock_pfn(pfn);
+
+            // The last mapping may have been trimmed before we got the PFN lock
+            if (read_pte(prototype).entire_format != local.entire_format)
+            {
+                unlock_pfn(pfn);
+                continue;
+            }
+
+            PFN pfn_contents = read_pfn(pfn);
+            pfn_contents.flags.share_count++;
+            write_pfn(pfn, pfn_contents);
+
+            *fault_type = FAULT_SOFT;
+            InterlockedIncrement64(&section_pages_shared);
+            break;
+        }
+
+        // Only faults change zero and disc format prototype PTEs, so once we claim this one it is ours to fill in
+        // The section lock is let go of while we get a page and read it, and taken back to publish the page
+        if (local.entire_format == 0 || local.disc_format.on_disc == 1)
+        {
+            PTE claimed_contents = local;
+            claimed_contents.entire_format |= PTE_PROTOTYPE_IN_PROGRESS_BIT;
+            write_pte(prototype, claimed_contents);
+
+            LeaveCriticalSection(&section->lock);
+
+            pfn = get_free_page();
+            if (pfn == NULL)
+            {
+                EnterCriticalSection(&section->lock);
+                write_pte(prototype, local);
+                LeaveCriticalSection(&section->lock);
+                return NULL;
+            }
+
+            if (local.entire_format == 0)
+            {
+                *fault_type = FAULT_FIRST_ACCESS;
+            }
+            // The pages of a mapped file are read from the file itself, which keeps them
+            else if (local.entire_format & PTE_FILE_BIT)
+            {
+                read_file_page(section, section_page, pfn);
+                *fault_type = FAULT_HARD;
+            }
+            else
+            {
+                read_disc_page(local.disc_format.disc_index, pfn);
+                free_disc_index(local.disc_format.disc_index);
+                *fault_type = FAULT_HARD;
+            }
+
+            EnterCriticalSection(&section->lock);
+        }
+        else
+        {
+            pfn = pfn_from_frame_number(local.transition_format.frame_number);
+            lock_pfn(pfn);
+
+            // Exactly as in the fault handler, the page may have been repurposed before we got its lock
+            if (read_pte(prototype).entire_format != local.entire_format)
+            {
+                unlock_pfn(pfn);
+                continue;
+            }
+
+            if (pfn->flags.state == MODIFIED)
+            {
+                PPFN_LIST modified_list = modified_list_from_pfn(pfn);
+                EnterCriticalSection(&modified_list->lock);
+                remove_from_list(pfn);
+                LeaveCriticalSection(&modified_list->lock);
+
+                // The page still has to reach its file, even if none of its next mappings write it
+                pfn->flags.file_dirty = pfn->flags.file_backed;
+            }
+            else
+            {
+                PPFN_LIST standby_list = standby_list_from_pfn(pfn);
+                EnterCriticalSection(&standby_list->lock);
+                remove_from_list(pfn);
+                if (pfn->flags.file_backed == 0)
+                {
+                    free_disc_index(pfn->disc_index);
+                }
+                LeaveCriticalSection(&standby_list->lock);
+                record_standby_rescue(pfn);
+            }
+
+            *fault_type = FAULT_SOFT;
+        }
+
+        PFN pfn_contents = read_pfn(pfn);
+        pfn_contents.pte = prototype;
+        pfn_contents.flags.share_count = 1;
+        if (section->file != NULL)
+        {
+            pfn_contents.disc_index = file_disc_index(section, section_page);
+            pfn_contents.flags.file_backed = 1;
+        }
+        write_pfn(pfn, pfn_contents);
+
+        PTE prototype_contents;
+        prototype_contents.entire_format = 0;
+        prototype_contents.memory_format.valid = 1;
+        prototype_contents.memory_format.frame_number = frame_number_from_pfn(pfn);
+        write_pte(prototype, prototype_contents);
+        break;
+    }
+
+    LeaveCriticalSection(&section->lock);
+
+    InterlockedIncrement64(&section_pages_mapped);
+    return pfn;
+}
+
+// Drops one mapping of a section page, called with the PFN locked once the VA no longer maps it
+// The page stays resident while other VAs map it. The last mapping to go leaves it on the modified list,
+// With its prototype PTE in transition so that the next fault on any mapping can take it back
+// A page of a mapped file that no mapping wrote goes on the standby list instead, as the file already has it
+VOID unmap_section_page(PPFN pfn, BOOLEAN dirty)
+{
+    PFN pfn_contents = read_pfn(pfn);
+
+    if (dirty && pfn_contents.flags.file_backed)
+    {
+        pfn_contents.flags.file_dirty = 1;
+    }
+
+    if (pfn_contents.flags.share_count > 1)
+    {
+        pfn_contents.flags.share_count--;
+        write_pfn(pfn, pfn_contents);
+        unlock_pfn(pfn);
+        return;
+    }
+
+    PTE prototype_contents;
+    prototype_contents.entire_format = 0;
+    prototype_contents.transition_format.frame_number = frame_number_from_pfn(pfn);
+    write_pte(pfn_contents.pte, prototype_contents);
+
+    pfn_contents.flags.share_count = 0;
+    pfn_contents.flags.standby_priority = STANDBY_PRIORITY_NORMAL;
+
+    if (pfn_contents.flags.file_backed && pfn_contents.flags.file_dirty == 0)
+    {
+        pfn_contents.flags.state = STANDBY;
+        write_pfn(pfn, pfn_contents);
+
+        add_to_standby_list(pfn);
+
+        unlock_pfn(pfn);
+
+        InterlockedIncrement64(&clean_file_pages_trimmed);
+        SetEvent(pages_available_event);
+        return;
+    }
+
+    // The modified writer is what makes the page clean again
+    pfn_contents.flags.file_dirty = 0;
+    pfn_contents.flags.state = MODIFIED;
+    pfn_contents.trim_tick = GetTickCount();
+    write_pfn(pfn, pfn_contents);
+
+    PPFN_LIST modified_list = modified_list_from_pfn(pfn);
+    EnterCriticalSection(&modified_list->lock);
+    add_to_list_tail(pfn, modified_list);
+    LeaveCriticalSection(&modified_list->lock);
+
+    unlock_pfn(pfn);
+}
+
+VOID print_section_statistics(VOID)
+{
+    printf("section : %lld section pages mapped, %lld of them already in memory for another mapping\n",
+           section_pages_mapped, section_pages_shared);
+}
@@ -3,181 +3,441 @@
 #include "../include/vm.h"
 #include "../include/debug.h"
 
-#define TRIM_ALL      MAXULONG64
+HANDLE trim_wake_events[NUMBER_OF_TRIMMING_THREADS];
+TRIMMER_STATS trimmer_stats[NUMBER_OF_TRIMMING_THREADS];
 
-// TODO don't put everything in modified, reference has to be zero. still trim the page make it dangling state
-VOID trim_pte_region(PULONG64 target_trims) {
-    PFN_LIST batch_list;
-    ULONG trim_batch_size = 0;
-    PTE_REGION_AGE_COUNT local_count = {0};
-    PVOID virtual_addresses[PTE_REGION_SIZE];
-    PPFN pfn;
-    PPTE_REGION region;
-
-    TIME_COUNTER time_counter;
-    start_counter(&time_counter);
+volatile LONG64 trimmed_pages_discarded;
 
+// Splits the number of pages we want to trim into how many we want to take from each age, oldest first
+VOID compute_trim_quotas(ULONG64 desired_trims, PGLOBAL_AGE_COUNT trim_of_age)
+{
     GLOBAL_AGE_COUNT age_snapshot = *(volatile GLOBAL_AGE_COUNT *) &global_age_count;
-    ULONG64 desired_trims = *target_trims;
-    GLOBAL_AGE_COUNT trim_of_age = {0};
 
-    for (LONG i = NUMBER_OF_AGES - 1; i >= 0; i--) {
+    memset(trim_of_age, 0, sizeof(GLOBAL_AGE_COUNT));
+
+    // Pinned pages are kept at age 0 and can never be trimmed, so they are not counted as trimmable
+    LONG64 pinned_pages = *(volatile LONG64 *) &pinned_page_count;
+    age_snapshot.pages_of_age[0] -= min(age_snapshot.pages_of_age[0], (ULONG64) max(0, pinned_pages));
+
+    // When pages are refaulting from inside the active set, the youngest ages are left alone
+    LONG youngest_age = (LONG) *(volatile ULONG *) &trim_protected_ages;
+
+    for (LONG i = NUMBER_OF_AGES - 1; i >= youngest_age; i--) {
         // If we want to trim more pages than we have in this age, we will take all the pages of this age
         if (desired_trims > age_snapshot.pages_of_age[i]) {
-            trim_of_age.pages_of_age[i] = TRIM_ALL;
+            trim_of_age->pages_of_age[i] = TRIM_ALL;
             desired_trims -= age_snapshot.pages_of_age[i];
         }
         // Otherwise we only want to trim the number of pages we want and break
         else {
-            trim_of_age.pages_of_age[i] = desired_trims;
+            trim_of_age->pages_of_age[i] = desired_trims;
             break;
         }
     }
+}
+
+VOID initialize_trim_batch(PTRIM_BATCH batch)
+{
+    for (ULONG i = 0; i < NUMBER_OF_MODIFIED_SHARDS; i++)
+    {
+        initialize_listhead(&batch->lists[i]);
+    }
+    batch->num_pages = 0;
+}
+
+// Puts every page a trimmer has collected onto the modified shards, holding each shard's lock once
+VOID flush_trim_batch(PTRIM_BATCH batch, PTRIMMER_STATS stats)
+{
+    if (batch->num_pages == 0) {
+        return;
+    }
+
+    for (ULONG shard = 0; shard < NUMBER_OF_MODIFIED_SHARDS; shard++)
+    {
+        PPFN_LIST shard_batch = &batch->lists[shard];
+        ULONG64 num_pages = shard_batch->num_pages;
+        if (num_pages == 0) {
+            continue;
+        }
+
+        PLIST_ENTRY entry = shard_batch->entry.Flink;
+
+        EnterCriticalSection(&modified_page_lists[shard].lock);
+        link_list_to_tail(&modified_page_lists[shard], shard_batch);
+        LeaveCriticalSection(&modified_page_lists[shard].lock);
+
+        // Our pages stay contiguous on the modified list, as nobody can remove a page without its lock
+        // And pages are only ever added to the tail
+        for (ULONG64 i = 0; i < num_pages; i++) {
+            PPFN pfn = CONTAINING_RECORD(entry, PFN, entry);
+            entry = entry->Flink;
+            unlock_pfn(pfn);
+        }
+
+        initialize_listhead(shard_batch);
+    }
+
+    batch->num_pages = 0;
 
-    // Try to find how man
-    LONG age = NUMBER_OF_AGES - 1;
-    while (age >= 0) {
-        // TODO don't take off the list just yet
+    if (stats != NULL) {
+        stats->batches_flushed++;
+    }
+}
+
+// Decides which standby list a page being trimmed goes on once it is written, from its valid PTE and its region
+static ULONG standby_priority_from_pte(PTE pte_contents, PPTE_REGION region)
+{
+    ULONG age = (ULONG) pte_contents.memory_format.age;
+
+    if (pte_contents.entire_format & PTE_DONTNEED_BIT) {
+        return STANDBY_PRIORITY_DONTNEED;
+    }
+    if (region->advice == VM_ADVICE_HIGH_PRIORITY) {
+        return STANDBY_PRIORITY_HIGH;
+    }
+    if (region->advice == VM_ADVICE_SEQUENTIAL) {
+        return STANDBY_PRIORITY_SEQUENTIAL;
+    }
+    if (age == NUMBER_OF_AGES - 1) {
+        return STANDBY_PRIORITY_OLD;
+    }
+    if (age < NUMBER_OF_AGES / 2) {
+        return STANDBY_PRIORITY_YOUNG;
+    }
+    return STANDBY_PRIORITY_NORMAL;
+}
+
+// Pops the region with the oldest pages off the age lists. The region is returned locked
+PPTE_REGION claim_oldest_region(VOID)
+{
+    PPTE_REGION region = NULL;
+
+    // Regions are claimed by removing them from their list with their lock held
+    // This is what keeps concurrent trimmers on disjoint regions
+    for (LONG age = NUMBER_OF_AGES - 1; age >= 0; age--) {
         EnterCriticalSection(&pte_region_age_lists[age].lock);
         region = pop_region_from_list(&pte_region_age_lists[age]);
         LeaveCriticalSection(&pte_region_age_lists[age].lock);
 
-        if (region == NULL) {
-            age--;
-            continue;
+        if (region != NULL) {
+            break;
         }
-        break;
     }
 
-    // No regions to trim, return 0
-    if (region == NULL) {
-        return;
+    return region;
+}
+
+// Takes a particular region off the age lists, the way claim_oldest_region takes the oldest one
+// Returns FALSE, with the region unlocked, if it has no active pages and so is on no list. Otherwise it is returned locked
+BOOLEAN claim_region(PPTE_REGION region)
+{
+    lock_pte_region(region);
+
+    // Find the list its in from the age count, exactly as age_pte_region does
+    ULONG region_age = NUMBER_OF_AGES + 1;
+    for (ULONG i = 0; i < NUMBER_OF_AGES; i++)
+    {
+        if (region->age_count.ages[i] != 0)
+        {
+            region_age = i;
+        }
+    }
+    if (region_age == NUMBER_OF_AGES + 1)
+    {
+        unlock_pte_region(region);
+        return FALSE;
     }
 
+    PPTE_REGION_LIST listhead = &pte_region_age_lists[region_age];
+    EnterCriticalSection(&listhead->lock);
+    remove_region_from_list(region, listhead);
+    LeaveCriticalSection(&listhead->lock);
+
+    return TRUE;
+}
+
+// Trims the pages allowed by trim_of_age from a locked region that is on none of the age lists
+// The scan mode decides whether the region is aged in the same pass, which is how the aging workers trim under pressure
+// The trimmed pages are added to the batch still locked. The region is put back on the age lists and unlocked
+// Returns the number of pages trimmed, and the number of valid PTEs scanned in ptes_scanned if it is given
+ULONG64 trim_claimed_region(PPTE_REGION region, ULONG scan_mode, PGLOBAL_AGE_COUNT trim_of_age, PTRIM_BATCH batch,
+                            PULONG64 ptes_scanned)
+{
+    PFN_LIST region_list;
+    ULONG trim_batch_size = 0;
+    PTE_REGION_AGE_COUNT local_count;
+    PVOID virtual_addresses[PTE_REGION_SIZE];
+    PVOID discard_addresses[PTE_REGION_SIZE];
+    PPFN discard_pfns[PTE_REGION_SIZE];
+    ULONG num_discards = 0;
+    ULONG num_discards_freed = 0;
+    PVOID section_addresses[PTE_REGION_SIZE];
+    PPFN section_pfns[PTE_REGION_SIZE];
+    ULONG num_section_unmaps = 0;
+    ULONG num_unshared = 0;
+    PPFN pfn;
+
+    TIME_COUNTER time_counter;
+    start_counter(&time_counter);
+
     PTE_REGION_AGE_COUNT old_count = *(volatile PTE_REGION_AGE_COUNT *) &region->age_count;
 
-    initialize_listhead(&batch_list);
+    initialize_listhead(&region_list);
 
     // Grab the first PTE in the region
-    PPTE current_pte = pte_from_pte_region(region);
-    for (ULONG index = 0; index < PTE_REGION_SIZE; index++) {
-        // Break early if we reach the end of the PTEs
-        // TODO just make the last region full so we don't have to check this
-        if (current_pte == pte_end)
-        {
-            break;
-        }
-        // Check the valid bit of the PTE
-        if (current_pte->memory_format.valid == 1) {
-            if (current_pte->memory_format.accessed == 1) {
-                // If the PTE is accessed, we reset its age
-                PTE local = read_pte(current_pte);
-                local.memory_format.age = 0;
-                local.memory_format.accessed = 0;
-                write_pte(current_pte, local);
-                increase_age_count(&local_count, 0);
-                current_pte++;
+    PPTE first_pte = pte_from_pte_region(region);
+    ULONG64 num_ptes = min(PTE_REGION_SIZE, (ULONG64) (pte_end - first_pte));
+    PPTE current_pte;
+
+    // Reset the ages of accessed PTEs and count the ages of the region in one pass
+    // Pages we trim are taken back out of the count below
+    PTE_SCAN_RESULT scan;
+    scan_pte_block(first_pte, num_ptes, scan_mode, &scan);
+    local_count = scan.age_count;
+
+    // The accessed bits are reset by the scan, so the working set of the region's address space has to hear of them now
+    record_accessed_pages(region, &scan);
+
+    if (ptes_scanned != NULL) {
+        *ptes_scanned = scan.num_valid;
+    }
+
+    // When the aging workers trim, sequential regions lose the pages behind the scan first, as age_pte_region does
+    if (scan_mode == PTE_SCAN_AGE && region->advice == VM_ADVICE_SEQUENTIAL) {
+        age_out_ptes(first_pte, num_ptes, TRUE, &local_count);
+    }
+
+    if (region->pinned_pages != 0) {
+        keep_pinned_ptes_young(first_pte, num_ptes, &local_count);
+    }
+
+    // Let the replacement policy see what was accessed before it picks the pages to trim
+    policy_scan_region(first_pte, &scan);
+
+    // Only visit the PTEs that were valid and not just accessed, as no others can be trimmed
+    for (ULONG word = 0; word < PTE_SCAN_BITMAP_SIZE; word++) {
+        ULONG64 candidates = scan.valid_bitmap[word] & ~scan.accessed_bitmap[word];
+        ULONG bit;
+
+        while (_BitScanForward64(&bit, candidates)) {
+            candidates &= candidates - 1;
+            current_pte = first_pte + word * 64 + bit;
+
+            PTE local = read_pte(current_pte);
+            ULONG age = (ULONG) local.memory_format.age;
+
+            // A page touched since the scan has been reset to age 0 by cpu_stamp, while the count still has it under
+            // The age the scan saw. It is in use again anyway, so it is left for the next scan to count
+            if (local.memory_format.accessed == 1) {
                 continue;
             }
-            // If the thread is allowed to trim this PTE, we will do so
-            if (trim_of_age.pages_of_age[current_pte->memory_format.age] > 0) {
-                pfn = pfn_from_frame_number(current_pte->memory_format.frame_number);
+
+            // Pinned pages are never trimmed, whatever else is true of them
+            if (local.entire_format & PTE_PINNED_BIT) {
+                continue;
+            }
+
+            // A shared frame cannot be trimmed out from under the other PTEs mapping it, only this PTE can let go of it
+            BOOLEAN shared = FALSE;
+            if (local.entire_format & PTE_COPY_ON_WRITE_BIT) {
+                if (make_copy_on_write_private(current_pte)) {
+                    local = read_pte(current_pte);
+                } else {
+                    shared = TRUE;
+                }
+            }
+
+            // Discarded pages are taken whatever the policy thinks, as freeing them costs no write
+            if ((local.entire_format & PTE_DISCARD_BIT) && shared == FALSE) {
+                pfn = pfn_from_frame_number(local.memory_format.frame_number);
                 lock_pfn(pfn);
 
                 if (pfn->flags.reference != 0) {
-                    // If the PFN is referenced, we cannot trim it
                     unlock_pfn(pfn);
-                    increase_age_count(&local_count, current_pte->memory_format.age);
-                    current_pte++;
                     continue;
                 }
-                // Add it to the list of pages to unmap and trim
-                add_to_list_head(pfn, &batch_list);
-                virtual_addresses[trim_batch_size] = va_from_pte(current_pte);
-                NULL_CHECK(virtual_addresses[trim_batch_size], "trim : could not get the va connected to the pte")
-                trim_batch_size++;
-                trim_of_age.pages_of_age[current_pte->memory_format.age]--;
 
+                discard_addresses[num_discards] = va_from_pte(current_pte);
+                discard_pfns[num_discards] = pfn;
+                num_discards++;
+                local_count.ages[age]--;
+                continue;
             }
-            // Otherwise, it stays active, and the thread needs to recount its age for the PTE region
-            else {
-                increase_age_count(&local_count, current_pte->memory_format.age);
+
+            // A high priority region only gives up pages that have gone unused for as long as we track
+            if (region->advice == VM_ADVICE_HIGH_PRIORITY && age < NUMBER_OF_AGES - 1) {
+                continue;
             }
+
+            // If the policy does not pick this PTE, it stays active and keeps its place in the count
+            ULONG quota_age = replacement_policy->select_trim_candidate(local, trim_of_age);
+            if (quota_age == NO_TRIM) {
+                continue;
+            }
+
+            if (shared) {
+                if (unshare_copy_on_write_pte(current_pte)) {
+                    num_unshared++;
+                    trim_of_age->pages_of_age[quota_age]--;
+                    local_count.ages[age]--;
+                }
+                continue;
+            }
+
+            pfn = pfn_from_frame_number(local.memory_format.frame_number);
+            lock_pfn(pfn);
+
+            if (pfn->flags.reference != 0) {
+                // If the PFN is referenced, we cannot trim it
+                unlock_pfn(pfn);
+                continue;
+            }
+
+            // Trimming a section page only drops this mapping, and the section decides where the page goes
+            // Once the last one is gone. Clean pages of mapped files skip the modified list, so they are not batched
+            if (local.entire_format & PTE_SECTION_BIT) {
+                section_addresses[num_section_unmaps] = va_from_pte(current_pte);
+                section_pfns[num_section_unmaps] = pfn;
+                num_section_unmaps++;
+                trim_of_age->pages_of_age[quota_age]--;
+                local_count.ages[age]--;
+                continue;
+            }
+            // Add it to the list of pages to unmap and trim
+            add_to_list_tail(pfn, &region_list);
+            virtual_addresses[trim_batch_size] = va_from_pte(current_pte);
+            NULL_CHECK(virtual_addresses[trim_batch_size], "trim : could not get the va connected to the pte")
+            trim_batch_size++;
+            trim_of_age->pages_of_age[quota_age]--;
+            local_count.ages[age]--;
         }
-        current_pte++;
     }
 
-    assert(trim_batch_size == batch_list.num_pages)
-    // If we did not trim any pages, we can skip the rest of the processing and break out
-    // We only expect this to happen in edge cases where the ages of every trimmable page in the region
-    // Are reset by memory accesses
-    if (trim_batch_size == 0) {
-        for (ULONG i = 0; i < NUMBER_OF_AGES; i++)
+    if (num_discards != 0) {
+        demote_region(region);
+
+        // The pages are unmapped before their discard bits are looked at again, so no write can land on them after
+        unmap_pages_scatter(discard_addresses, num_discards);
+
+        for (ULONG i = 0; i < num_discards; i++)
         {
-            WriteUShortNoFence(&region->age_count.ages[i], local_count.ages[i]);
-        }
-        // Find the oldest age to insert the region back into the age lists
-        // Set oldest age to a value that is larger than any possible age
-        // If it stays that way, it means that no active pages remain in the region
-        ULONG oldest_age = NUMBER_OF_AGES;
-        for (ULONG i = 0; i < NUMBER_OF_AGES; i++) {
-            if (local_count.ages[i] != 0) {
-                oldest_age = i;
+            current_pte = pte_from_va(discard_addresses[i]);
+            PTE old_contents = read_pte(current_pte);
+            PTE zero_pte;
+            zero_pte.entire_format = 0;
+
+            // A touch since the scan clears the discard bit in cpu_stamp before any write, so the contents are wanted
+            // Again and the page is trimmed like any other. The exchange keeps the bit from being cleared as we zero it
+            // The next touch of a discarded VA is a first access and gets a fresh zero page
+            if ((old_contents.entire_format & PTE_DISCARD_BIT) == 0 ||
+                InterlockedCompareExchange64((volatile LONG64 *) &current_pte->entire_format, zero_pte.entire_format,
+                                             old_contents.entire_format) != old_contents.entire_format) {
+                add_to_list_tail(discard_pfns[i], &region_list);
+                virtual_addresses[trim_batch_size] = discard_addresses[i];
+                trim_batch_size++;
+                continue;
             }
-        }
 
-        // If there are no active pages left in the region, we can make it inactive, unlock, and return
-        if (oldest_age == NUMBER_OF_AGES) {
-            make_region_inactive(region);
-        } else {
-            PPTE_REGION_LIST new_listhead = &pte_region_age_lists[oldest_age];
+            // The page leaves the policy's counts, with no ghost as its PTE is zero now
+            policy_forget(old_contents);
+
+            // The contents are dead, and the frame is mapped nowhere now, so it is cleared through our zeroing VA
+            zero_frame(frame_number_from_pfn(discard_pfns[i]));
+
+            PFN pfn_contents = read_pfn(discard_pfns[i]);
+            pfn_contents.pte = NULL;
+            pfn_contents.flags.state = FREE;
+            pfn_contents.flags.dirtied = 0;
+            pfn_contents.disc_index = 0;
+            write_pfn(discard_pfns[i], pfn_contents);
 
-            EnterCriticalSection(&new_listhead->lock);
-            add_region_to_list(region, new_listhead);
-            LeaveCriticalSection(&new_listhead->lock);
+            discard_pfns[num_discards_freed] = discard_pfns[i];
+            num_discards_freed++;
         }
-        unlock_pte_region(region);
 
-        // TODO do we actually want to track this?
-        stop_counter(&time_counter);
-        DOUBLE duration = get_counter_duration(&time_counter);
-        track_time(duration, trim_batch_size, trim_times,
-                  &trim_time_index, TRIM_TIMES_TO_TRACK);
+        if (num_discards_freed != 0) {
+            EnterCriticalSection(&free_page_list.lock);
+            for (ULONG i = 0; i < num_discards_freed; i++)
+            {
+                add_to_list_tail(discard_pfns[i], &free_page_list);
+                unlock_pfn(discard_pfns[i]);
+            }
+            LeaveCriticalSection(&free_page_list.lock);
 
-        return;
+            InterlockedAdd64(&trimmed_pages_discarded, num_discards_freed);
+            SetEvent(pages_available_event);
+        }
     }
 
-    // Unmap the pages with the Windows API
-    unmap_pages_scatter(virtual_addresses, trim_batch_size);
+    assert(trim_batch_size == region_list.num_pages)
 
-    EnterCriticalSection(&modified_page_list.lock);
+    if (num_section_unmaps != 0) {
+        unmap_pages_scatter(section_addresses, num_section_unmaps);
 
-    link_list_to_tail(&modified_page_list, &batch_list);
+        // The PTEs go back to zero, the next touch finds the page through the prototype PTE again
+        // The dirty bit is only read now, as a write could still land on the page until it was unmapped
+        for (ULONG i = 0; i < num_section_unmaps; i++)
+        {
+            current_pte = pte_from_va(section_addresses[i]);
+            PTE old_contents = read_pte(current_pte);
+            BOOLEAN dirty = (old_contents.entire_format & PTE_DIRTY_BIT) != 0;
 
-    LeaveCriticalSection(&modified_page_list.lock);
+            PTE zero_pte;
+            zero_pte.entire_format = 0;
+            write_pte(current_pte, zero_pte);
 
-    // Iterate over each PFN we captured and change its state along with its PTE
-    pfn = CONTAINING_RECORD(batch_list.entry.Flink, PFN, entry);
-    for (ULONG i = 0; i < trim_batch_size; i++)
-    {
-        // Update the PFN to make it modified
-        PFN pfn_contents = read_pfn(pfn);
-        pfn_contents.flags.state = MODIFIED;
-        write_pfn(pfn, pfn_contents);
-
-        PPFN next_pfn = CONTAINING_RECORD(pfn->entry.Flink, PFN, entry);
-
-        // Zero the valid bit and make the PTE a transition PTE
-        current_pte = pte_from_va(virtual_addresses[i]);
-        PTE pte_contents = read_pte(current_pte);
-        pte_contents.entire_format = 0;
-        pte_contents.transition_format.always_zero = 0;
-        pte_contents.transition_format.frame_number = frame_number_from_pfn(pfn);
-        pte_contents.transition_format.always_zero2 = 0;
-        write_pte(current_pte, pte_contents);
-
-        unlock_pfn(pfn);
-        pfn = next_pfn;
+            // The mapping leaves the policy's counts. A zero PTE cannot hold a ghost, so it is forgotten rather than evicted
+            policy_forget(old_contents);
+
+            unmap_section_page(section_pfns[i], dirty);
+        }
+    }
+
+    if (trim_batch_size != 0) {
+        // A promoted region goes back to 4KB pages as soon as any of its pages are trimmed
+        demote_region(region);
+
+        // Unmap the pages with the Windows API
+        unmap_pages_scatter(virtual_addresses, trim_batch_size);
+
+        // Iterate over each PFN we captured and change its state along with its PTE
+        ULONG trim_tick = GetTickCount();
+        pfn = CONTAINING_RECORD(region_list.entry.Flink, PFN, entry);
+        for (ULONG i = 0; i < trim_batch_size; i++)
+        {
+            // Zero the valid bit and make the PTE a transition PTE
+            current_pte = pte_from_va(virtual_addresses[i]);
+            PTE pte_contents = read_pte(current_pte);
+
+            // Update the PFN to make it modified, deciding now what it is worth once it reaches standby
+            PFN pfn_contents = read_pfn(pfn);
+            pfn_contents.flags.state = MODIFIED;
+            pfn_contents.flags.standby_priority = standby_priority_from_pte(pte_contents, region);
+            pfn_contents.trim_tick = trim_tick;
+            write_pfn(pfn, pfn_contents);
+
+            PPFN next_pfn = CONTAINING_RECORD(pfn->entry.Flink, PFN, entry);
+
+            // The policy can leave a ghost of the page in the bits above the transition format
+            pte_contents.entire_format = replacement_policy->on_evict(pte_contents);
+            pte_contents.transition_format.always_zero = 0;
+            pte_contents.transition_format.frame_number = frame_number_from_pfn(pfn);
+            pte_contents.transition_format.always_zero2 = 0;
+            write_pte(current_pte, pte_contents);
+
+            pfn = next_pfn;
+        }
+
+        // The PFNs stay locked until the batch is put on the modified list
+        // Each one moves from our private region list to the batch list of its modified shard
+        pfn = CONTAINING_RECORD(region_list.entry.Flink, PFN, entry);
+        for (ULONG i = 0; i < trim_batch_size; i++)
+        {
+            PPFN next_pfn = CONTAINING_RECORD(pfn->entry.Flink, PFN, entry);
+            add_to_list_tail(pfn, &batch->lists[modified_shard_from_pfn(pfn)]);
+            pfn = next_pfn;
+        }
+        batch->num_pages += trim_batch_size;
     }
 
     for (ULONG i = 0; i < NUMBER_OF_AGES; i++)
@@ -186,7 +446,9 @@ VOID trim_pte_region(PULONG64 target_trims) {
     }
 
     // Find the oldest age to insert the region back into the age lists
-    ULONG oldest_age = 0;
+    // Set oldest age to a value that is larger than any possible age
+    // If it stays that way, it means that no active pages remain in the region
+    ULONG oldest_age = NUMBER_OF_AGES;
     for (LONG i = NUMBER_OF_AGES - 1; i >= 0; i--)
     {
         if (local_count.ages[i] != 0)
@@ -196,18 +458,26 @@ VOID trim_pte_region(PULONG64 target_trims) {
         }
     }
 
-    PPTE_REGION_LIST new_listhead = &pte_region_age_lists[oldest_age];
+    // If there are no active pages left in the region, we can make it inactive
+    if (oldest_age == NUMBER_OF_AGES) {
+        make_region_inactive(region);
+    } else {
+        PPTE_REGION_LIST new_listhead = &pte_region_age_lists[oldest_age];
 
-    EnterCriticalSection(&new_listhead->lock);
-    add_region_to_list(region, new_listhead);
-    LeaveCriticalSection(&new_listhead->lock);
+        EnterCriticalSection(&new_listhead->lock);
+        add_region_to_list(region, new_listhead);
+        LeaveCriticalSection(&new_listhead->lock);
+    }
 
-    // Update the global age count
+    // Update the global age count, and the resident count of the region's address space by the pages that left it
+    LONG64 resident_change = 0;
     for (ULONG i = 0; i < NUMBER_OF_AGES; i++)
     {
         InterlockedAdd64((volatile LONG64 *) &global_age_count.pages_of_age[i],
-                         local_count.ages[i] - old_count.ages[i]);
+                         (LONG64) local_count.ages[i] - (LONG64) old_count.ages[i]);
+        resident_change += (LONG64) local_count.ages[i] - (LONG64) old_count.ages[i];
     }
+    charge_address_space(region, resident_change);
 
     unlock_pte_region(region);
 
@@ -216,20 +486,89 @@ VOID trim_pte_region(PULONG64 target_trims) {
     track_time(duration, trim_batch_size, trim_times,
                &trim_time_index, TRIM_TIMES_TO_TRACK);
 
+    // Discarded pages, dropped section mappings and shared pages let go of count as trimmed,
+    // As they were taken from the region just the same
+    return trim_batch_size + num_discards_freed + num_section_unmaps + num_unshared;
+}
+
+// TODO don't put everything in modified, reference has to be zero. still trim the page make it dangling state
+// Returns FALSE if there were no regions left to trim
+BOOLEAN trim_pte_region(PULONG64 target_trims, PTRIM_BATCH batch, PTRIMMER_STATS stats) {
+    GLOBAL_AGE_COUNT trim_of_age;
+
+    compute_trim_quotas(*target_trims, &trim_of_age);
+
+    PPTE_REGION region = claim_oldest_region();
+
+    // No regions to trim
+    if (region == NULL) {
+        return FALSE;
+    }
+
+    // A space under its minimum working set only has the region scanned and put back
+    if (is_working_set_protected(region)) {
+        memset(&trim_of_age, 0, sizeof(GLOBAL_AGE_COUNT));
+    }
+
+    ULONG64 trim_batch_size = trim_claimed_region(region, PTE_SCAN_RESET_ACCESSED, &trim_of_age, batch, NULL);
+
+    stats->pages_trimmed += trim_batch_size;
+    stats->regions_trimmed++;
+
     // Decrease the target trims by the number of pages we trimmed
     if (*target_trims < trim_batch_size) {
         *target_trims = 0;
     }
-    *target_trims -= trim_batch_size;
+    else {
+        *target_trims -= trim_batch_size;
+    }
+
+    return TRUE;
+}
+
+VOID wake_trimmers(VOID)
+{
+    for (ULONG i = 0; i < NUMBER_OF_TRIMMING_THREADS; i++)
+    {
+        SetEvent(trim_wake_events[i]);
+    }
+}
+
+VOID print_trim_statistics(VOID)
+{
+    ULONG64 total_pages_trimmed = 0;
+    DOUBLE longest_busy_time = 0;
+
+    for (ULONG i = 0; i < NUMBER_OF_TRIMMING_THREADS; i++)
+    {
+        PTRIMMER_STATS stats = &trimmer_stats[i];
+        DOUBLE rate = stats->busy_time > 0 ? (DOUBLE) stats->pages_trimmed / stats->busy_time : 0;
+
+        printf("trimming_thread %lu : trimmed %llu pages from %llu regions in %llu batches, %.0f pages per busy second\n",
+               i, stats->pages_trimmed, stats->regions_trimmed, stats->batches_flushed, rate);
+
+        total_pages_trimmed += stats->pages_trimmed;
+        longest_busy_time = max(longest_busy_time, stats->busy_time);
+    }
+
+    // The trimmers run side by side, so the busiest one bounds how long the trimming took
+    printf("trimming : %d trimmers trimmed %llu pages, %.0f pages per second combined\n",
+           NUMBER_OF_TRIMMING_THREADS, total_pages_trimmed,
+           longest_busy_time > 0 ? (DOUBLE) total_pages_trimmed / longest_busy_time : 0);
 }
 
 DWORD trimming_thread(PVOID context)
 {
-    UNREFERENCED_PARAMETER(context);
+    ULONG trimmer_index = (ULONG) (ULONG_PTR) context;
+    PTRIMMER_STATS stats = &trimmer_stats[trimmer_index];
+    TRIM_BATCH batch;
+    TIME_COUNTER time_counter;
 
     HANDLE handles[2];
     handles[0] = system_exit_event;
-    handles[1] = trim_wake_event;
+    handles[1] = trim_wake_events[trimmer_index];
+
+    initialize_trim_batch(&batch);
 
     WaitForSingleObject(system_start_event, INFINITE);
     // TODO status
@@ -238,26 +577,56 @@ DWORD trimming_thread(PVOID context)
     {
         ULONG64 num_trims = 0;
 
+        // Address spaces over their soft limit are trimmed first, and only their own pages are taken for it
+        start_counter(&time_counter);
+        ULONG64 address_space_trims = trim_address_spaces_over_soft_limit(&batch, stats);
+        flush_trim_batch(&batch, stats);
+        stop_counter(&time_counter);
+        stats->busy_time += get_counter_duration(&time_counter);
+
         // Find how many pages are of each age and how many should be trimmed from each age to meet the target
         ULONG64 average_page_consumption = average_page_consumption_global;
 
         ULONG64 consumable_pages = *(volatile ULONG_PTR *) (&free_page_list.num_pages) +
-                                         *(volatile ULONG_PTR *) (&standby_page_list.num_pages);
+                                         standby_page_count();
 
         DOUBLE time_until_no_pages = (DOUBLE) consumable_pages / (DOUBLE) average_page_consumption;
 
         // Calculate time required to trim and mod-write these pages
+        // The trimmers split the work between them
         TIME_MEASURE trim_average = average_tracked_times(trim_times, ARRAYSIZE(trim_times));
         TIME_MEASURE mw_average = *(volatile TIME_MEASURE *) &global_mw_average;
 
         DOUBLE trim_time = (DOUBLE) average_page_consumption * (trim_average.duration / (DOUBLE) trim_average.num_pages);
+        trim_time /= NUMBER_OF_TRIMMING_THREADS;
         DOUBLE mw_time = (DOUBLE) average_page_consumption * (mw_average.duration / (DOUBLE) mw_average.num_pages);
+        mw_time /= NUMBER_OF_MODIFIED_WRITERS;
         DOUBLE time_to_trim_and_mw = trim_time + mw_time;
 
+        // While the aging workers are trimming as they age, the trimmers stand down so regions are only walked once
+        if (*(volatile LONG64 *) &fused_trim_target != 0) {
+            ULONG index = WaitForMultipleObjects(ARRAYSIZE(handles), handles,
+                                             FALSE, INFINITE);
+            if (index == 0)
+            {
+                break;
+            }
+            continue;
+        }
+
         // If we need to start trimming before pages run out
         if (time_until_no_pages <= time_to_trim_and_mw) {
-            // Schedule trimming and mod-writing for pages_needed
-            num_trims = average_page_consumption;
+            // Schedule trimming and mod-writing for pages_needed, each trimmer takes its share
+            num_trims = (average_page_consumption + NUMBER_OF_TRIMMING_THREADS - 1) / NUMBER_OF_TRIMMING_THREADS;
+
+            // Pages trimmed out of the working set come straight back, so trim less while that is happening
+            num_trims = (ULONG64) ((DOUBLE) num_trims * (1.0 - workingset_refault_fraction / 2));
+            num_trims = max(1, num_trims);
+
+            // What the over limit spaces gave up already counts towards the pages we need,
+            // And spaces over their maximum working set give up the rest before anyone else is trimmed
+            num_trims -= min(num_trims, address_space_trims);
+            num_trims -= trim_address_spaces_over_max_working_set(num_trims, &batch, stats);
         } else {
             ULONG index = WaitForMultipleObjects(ARRAYSIZE(handles), handles,
                                              FALSE, INFINITE);
@@ -268,11 +637,39 @@ DWORD trimming_thread(PVOID context)
             }
         }
 
-        // Trim as many batches as the thread was told to
+        start_counter(&time_counter);
+
+        // Trim as many regions as the thread was told to, handing pages to the modified list in large batches
+        ULONG64 fruitless_regions = 0;
         while (num_trims > 0)
         {
-            trim_pte_region(&num_trims);
+            ULONG64 trims_before = num_trims;
+            if (trim_pte_region(&num_trims, &batch, stats) == FALSE)
+            {
+                break;
+            }
+
+            // A replacement policy can turn down every page it is shown, so stop once every region came up empty
+            if (num_trims == trims_before)
+            {
+                fruitless_regions++;
+                if (fruitless_regions >= number_of_pte_regions)
+                {
+                    break;
+                }
+            }
+            else
+            {
+                fruitless_regions = 0;
+            }
+
+            // A fault on a page in the batch waits for its PFN lock while holding its region, so pages are never
+            // Held past the region they came from
+            flush_trim_batch(&batch, stats);
         }
+
+        stop_counter(&time_counter);
+        stats->busy_time += get_counter_duration(&time_counter);
     }
 
     return 0;
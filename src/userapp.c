@@ -2,6 +2,9 @@
 #include <Windows.h>
 #include <stdlib.h>
 #include "../include/userapp.h"
+#include "../include/pressure.h"
+#include "../include/api.h"
+#include "../include/address_space.h"
 
 #include <system.h>
 
@@ -22,6 +25,7 @@ VOID full_virtual_memory_test(VOID) {
     // ULONG random_number;
     BOOL page_faulted;
     PULONG_PTR pointer;
+    PADDRESS_SPACE space;
     ULONG_PTR num_bytes;
     ULONG_PTR local;
 
@@ -47,18 +51,20 @@ VOID full_virtual_memory_test(VOID) {
     SHORT thread_line = (SHORT)(thread_index);
     PFAULT_STATS stats = &fault_stats[thread_index];
 
-    // This replaces a malloc call in our system
-    // Right now, we are just giving a set amount to the caller
-    pointer = (PULONG_PTR) allocate_memory(&num_bytes);
+    // Each thread allocates its own share of the VA space, just as a program would call malloc
+    // It still makes as many accesses as there are pages in the whole VA space, sweeping its share repeatedly
+    // The share is a whole number of PTE regions, as each thread runs in an address space of its own
+    // So that its working set can be measured apart from the others'
+    virtual_address_size_in_pages = virtual_address_size / PAGE_SIZE;
+    num_bytes = (virtual_address_size_in_pages / NUMBER_OF_FAULTING_THREADS / PTE_REGION_SIZE) * PTE_REGION_SIZE * PAGE_SIZE;
 
-    virtual_address_size_in_pages = num_bytes / PAGE_SIZE;
+    space = vm_create_address_space(num_bytes, 0, 0);
+    NULL_CHECK(space, "full_virtual_memory_test : could not create an address space for the test")
 
-    //PULONG_PTR p_end = pointer + (virtual_address_size_in_pages * PAGE_SIZE) / sizeof(ULONG_PTR);
+    pointer = (PULONG_PTR) vm_alloc_in_space(space, num_bytes);
+    NULL_CHECK(pointer, "full_virtual_memory_test : could not allocate memory for the test")
 
-    ULONG64 slice_size = virtual_address_size_in_pages / NUMBER_OF_FAULTING_THREADS;
-    slice_size = slice_size * PAGE_SIZE / sizeof(ULONG_PTR);
-
-    ULONG64 slice_start = slice_size * thread_index;
+    ULONG64 slice_size = num_bytes / sizeof(ULONG_PTR);
 
     // This is where the test is actually ran
     start_time = GetTickCount();
@@ -83,8 +89,8 @@ VOID full_virtual_memory_test(VOID) {
             // This computes a random virtual address within our range
 
             // Calculate arbitrary VA from rep
-            ULONG64 offset = slice_start + (rep * PAGE_SIZE) / sizeof(ULONG_PTR);
-            offset = offset % num_bytes;
+            ULONG64 offset = (rep * PAGE_SIZE) / sizeof(ULONG_PTR);
+            offset = offset % slice_size;
             arbitrary_va = pointer + offset;
 
 
@@ -100,12 +106,25 @@ VOID full_virtual_memory_test(VOID) {
             // Call the API function to try accessing the virtual address
             // This function simulates the CPU's actions of calling the page fault handler,
             // stamping accessed bits, resetting ages, abd retrying if the fault wasn't resolved.
+            // The admission controller may hold this thread here while the system is thrashing
+            wait_for_admission(thread_index);
+
             access_va(arbitrary_va);
+            stats->num_accesses++;
         }
     }
 
     // This gets the time elapsed in milliseconds
     end_time = GetTickCount();
+
+    // The working set history goes with the address space, so it is reported before the space is deleted
+    print_working_set_history(space);
+
+    // Our pages and disc slots go straight back to the system instead of being trimmed and written out
+    vm_free(pointer);
+    vm_delete_address_space(space);
+
+    faulting_thread_finished(thread_index);
     time_elapsed = end_time - start_time;
 
     // Final status update
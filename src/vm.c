@@ -3,14 +3,12 @@
 #include "../include/vm.h"
 #include "../include/debug.h"
 
-PPFN get_free_page(VOID);
 PPFN read_page_on_disc(PPTE pte, PPFN free_page);
 
 ULONG_PTR virtual_address_size;
 ULONG_PTR physical_page_count;
 PVOID va_base;
 PVOID va__end;
-PVOID modified_write_va;
 PVOID modified_read_va;
 PVOID repurpose_zero_va;
 
@@ -60,6 +58,21 @@ VOID unmap_pages_scatter(PVOID *virtual_addresses, ULONG_PTR num_pages)
     }
 }
 
+// Clears a page that is not mapped anywhere by mapping it into our zeroing VA
+VOID zero_frame(ULONG_PTR frame_number)
+{
+    EnterCriticalSection(&repurpose_zero_va_lock);
+
+    map_pages(repurpose_zero_va, 1, &frame_number);
+
+    memset(repurpose_zero_va, 0, PAGE_SIZE);
+
+    // Unmap the page from our va space
+    unmap_pages(repurpose_zero_va, 1);
+
+    LeaveCriticalSection(&repurpose_zero_va_lock);
+}
+
 // This is how we get pages for new virtual addresses as well as old ones only exist on the paging file
 PPFN get_free_page(VOID) {
     // Increment the number of pages consumed
@@ -77,7 +90,8 @@ PPFN get_free_page(VOID) {
     // This is where we take pages from the standby list and reallocate their physical pages for our new va to use
     if (free_page == NULL)
     {
-        free_page = pop_from_list_head(&standby_page_list);
+        // The least valuable pages are repurposed first
+        free_page = pop_from_standby_lists();
         if (free_page == NULL) {
             return NULL;
         }
@@ -95,23 +109,20 @@ PPFN get_free_page(VOID) {
         }
         local.disc_format.on_disc = 1;
         local.disc_format.disc_index = other_disc_index;
+        // Remember when the page left memory so that a refault can tell how far back that was
+        local.entire_format = (local.entire_format & ~(PTE_EVICTION_STAMPED_BIT | PTE_EVICTION_STAMP_MASK)) |
+                              stamp_eviction();
+        // A page of a mapped file goes back to being read from its file
+        if (free_page->flags.file_backed) {
+            local.entire_format |= PTE_FILE_BIT;
+            free_page->flags.file_backed = 0;
+        }
         write_pte(other_pte, local);
 
         // This is where we clear the previous contents off of the repurposed page
         // This is important as it can corrupt the new user's data if not entirely overwritten,
         // It also would allow a program to see another program's memory (HUGE SECURITY VIOLATION)
-        ULONG_PTR frame_number = frame_number_from_pfn(free_page);
-
-        EnterCriticalSection(&repurpose_zero_va_lock);
-
-        map_pages(repurpose_zero_va, 1, &frame_number);
-
-        memset(repurpose_zero_va, 0, PAGE_SIZE);
-
-        // Unmap the page from our va space
-        unmap_pages(repurpose_zero_va, 1);
-
-        LeaveCriticalSection(&repurpose_zero_va_lock);
+        zero_frame(frame_number_from_pfn(free_page));
     }
 
     // This is a last resort option when there are no available pages
@@ -122,12 +133,12 @@ PPFN get_free_page(VOID) {
     return free_page;
 }
 
-// This reads a page from the paging file and writes it back to memory
-PPFN read_page_on_disc(PPTE pte, PPFN free_page)
+// This reads a page from the paging file into a page that is not on any list, leaving the disc slot in use
+VOID read_disc_page(ULONG64 disc_index, PPFN pfn)
 {
     // We don't need a pfn lock here because this page is not on a list
     // And therefore is not visible to any other threads
-    ULONG_PTR frame_number = frame_number_from_pfn(free_page);
+    ULONG_PTR frame_number = frame_number_from_pfn(pfn);
 
     EnterCriticalSection(&modified_read_va_lock);
 
@@ -135,19 +146,37 @@ PPFN read_page_on_disc(PPTE pte, PPFN free_page)
     map_pages(modified_read_va, 1, &frame_number);
 
     // This would be a disc driver that does this read and write in a real operating system
-    //PVOID source = (PVOID) ((ULONG_PTR) page_file + (pte->disc_format.disc_index * PAGE_SIZE));
+    //PVOID source = (PVOID) ((ULONG_PTR) page_file + (disc_index * PAGE_SIZE));
     //memcpy(modified_read_va, source, PAGE_SIZE);
-    read_from_pagefile(pte->disc_format.disc_index, modified_read_va);
+    read_from_pagefile(disc_index, modified_read_va);
 
     unmap_pages(modified_read_va, 1);
 
     LeaveCriticalSection(&modified_read_va_lock);
+}
+
+// This reads a page from the paging file and writes it back to memory
+PPFN read_page_on_disc(PPTE pte, PPFN free_page)
+{
+    read_disc_page(pte->disc_format.disc_index, free_page);
 
     // Set the bit at disc_index in disc in use to be 0 to reuse the disc spot
     free_disc_index(pte->disc_format.disc_index);
     return free_page;
 }
 
+// Faulting threads wait here when there are no pages to be had, and the time they spend is counted as a stall
+VOID wait_for_pages(VOID)
+{
+    TIME_COUNTER time_counter;
+    start_counter(&time_counter);
+
+    WaitForSingleObject(pages_available_event, INFINITE);
+
+    stop_counter(&time_counter);
+    record_stall(get_counter_duration(&time_counter));
+}
+
 // Stamp the accessed bit in the corresponding PTE when a VA is accessed
 // In real life, this would be done by the CPU automatically
 // However my program needs to simulate it
@@ -155,6 +184,11 @@ VOID cpu_stamp(PVOID arbitrary_va) {
     PPTE pte = pte_from_va(arbitrary_va);
     NULL_CHECK(pte, "cpu_stamp : could not get pte from va")
 
+    // A page whose PTEs are paged out cannot be valid, and its PTEs cannot be read
+    if (is_pte_region_committed((ULONG64) (pte - pte_base) / PTE_REGION_SIZE) == FALSE) {
+        return;
+    }
+
     // If the page is valid, we update its age using interlocked
     BOOLEAN success = FALSE;
     PTE old_pte_contents;
@@ -172,6 +206,8 @@ VOID cpu_stamp(PVOID arbitrary_va) {
         new_contents = old_pte_contents;
         new_contents.memory_format.accessed = 1;
         new_contents.memory_format.age = 0;
+        // Touching a discarded page means its contents are wanted again
+        new_contents.entire_format &= ~(PTE_DISCARD_BIT | PTE_DONTNEED_BIT);
 
         // Try to write with an interlocked compare exchange
         success = InterlockedCompareExchange64((volatile LONG64 *) &pte->entire_format,
@@ -179,6 +215,29 @@ VOID cpu_stamp(PVOID arbitrary_va) {
     }
 }
 
+// Stamp the dirty bit in the corresponding PTE before a VA is written
+// Like the accessed bit, the CPU would do this by itself
+VOID cpu_stamp_dirty(PVOID arbitrary_va) {
+    PPTE pte = pte_from_va(arbitrary_va);
+    NULL_CHECK(pte, "cpu_stamp_dirty : could not get pte from va")
+
+    if (is_pte_region_committed((ULONG64) (pte - pte_base) / PTE_REGION_SIZE) == FALSE) {
+        return;
+    }
+
+    PTE old_pte_contents;
+    PTE new_contents;
+    do {
+        old_pte_contents = read_pte(pte);
+        if (old_pte_contents.memory_format.valid == 0 || (old_pte_contents.entire_format & PTE_DIRTY_BIT)) {
+            return;
+        }
+        new_contents = old_pte_contents;
+        new_contents.entire_format |= PTE_DIRTY_BIT;
+    } while (InterlockedCompareExchange64((volatile LONG64 *) &pte->entire_format,
+             new_contents.entire_format, old_pte_contents.entire_format) != old_pte_contents.entire_format);
+}
+
 // This is where we handle any access or fault of a page
 VOID page_fault_handler(PVOID arbitrary_va)
 {
@@ -187,6 +246,9 @@ VOID page_fault_handler(PVOID arbitrary_va)
     PPFN pfn;
     PFN pfn_contents;
     ULONG64 frame_number;
+    ULONG fault_type;
+    PSECTION section = NULL;
+    ULONG64 section_page;
 
     // Pages go through the handler regardless of whether they have faulted or not
     // This is because even if a page is accessed without a fault, it's age in the pte must be updated
@@ -195,13 +257,31 @@ VOID page_fault_handler(PVOID arbitrary_va)
     pte = pte_from_va(arbitrary_va);
     NULL_CHECK(pte, "page_fault_handler : could not get pte from va")
 
+    // The first fault in a region is what brings its PTEs and lock into existence
+    commit_pte_region_for_pte(pte);
+
     // This order of operations is very important
     // A pte lock MUST sequentially come before a pfn lock
     // This is because we must lock the pte corresponding to a faulted va in order to handle its fault
     // At this point we do not know the pfn and cannot find it without a pte lock
     lock_pte(pte);
+
+    // A page of PTEs that was paged out while cold has to be read back in before any of its PTEs can be looked at
+    page_in_pte_page((ULONG64) (pte - pte_base) / PTE_REGION_SIZE);
+
     pte_contents = read_pte(pte);
 
+    // A page about to come in counts against the limits of its address space, which may have to trim itself first
+    // Trimming the space can take any of its regions, so the PTE is let go of while it does and looked at again after
+    if (pte_contents.memory_format.valid == 0 && is_address_space_at_hard_limit(pte_region_from_pte(pte), 1)) {
+        unlock_pte(pte);
+        enforce_address_space_limits(pte_region_from_pte(pte), 1);
+        lock_pte(pte);
+
+        page_in_pte_page((ULONG64) (pte - pte_base) / PTE_REGION_SIZE);
+        pte_contents = read_pte(pte);
+    }
+
     // This is where the age is updated on an active page that has not actually faulted
     // We refer to this as a fake fault
     // We know this page is active because its valid bit is set, which only exists in a memory format pte
@@ -216,15 +296,32 @@ VOID page_fault_handler(PVOID arbitrary_va)
     // We know now that we need to get a free/standby page and map it to this va
     if (pte_contents.entire_format == 0)
     {
+        fault_type = FAULT_FIRST_ACCESS;
+
+        // Only a first touch can land outside of an allocation, as freeing an allocation zeroes its PTEs
+        if (find_va_section(arbitrary_va, &section, &section_page) == FALSE)
+        {
+            unlock_pte(pte);
+            fatal_error("page_fault_handler : access to a virtual address that was never allocated");
+        }
+
+        // A section mapping finds its page through the section's prototype PTE, whatever format that is in
+        if (section != NULL)
+        {
+            pfn = section_fault(section, section_page, &fault_type);
+        }
         // Get_free_page now returns a locked page, so we do not need to do it here
-        pfn = get_free_page();
+        else
+        {
+            pfn = get_free_page();
+        }
 
         // This occurs when we get_free_page fails to find us a free page
         // When this happens, we release our lock on this pte and wait for pages to become available
         // Once we are able to map a page to this va, we return, which lets the thread fault on this va again
         if (pfn == NULL) {
             unlock_pte(pte);
-            WaitForSingleObject(pages_available_event, INFINITE);
+            wait_for_pages();
             return;
         }
     }
@@ -235,17 +332,27 @@ VOID page_fault_handler(PVOID arbitrary_va)
     // We call this a hard fault, as we have to read from disc in order to handle it
     // We want to minimize hard faults, as they takes exponentially longer than other types of faults to resolve
     else if (pte_contents.disc_format.on_disc == 1) {
+        fault_type = FAULT_HARD;
 
         pfn = get_free_page();
         if (pfn == NULL) {
             unlock_pte(pte);
-            WaitForSingleObject(pages_available_event, INFINITE);
+            wait_for_pages();
             return;
         }
 
         // This is where we actually read the page from the disc and write its contents to our new page
+        // The thread is stalled on I/O for the whole read
+        TIME_COUNTER read_counter;
+        start_counter(&read_counter);
+
         read_page_on_disc(pte, pfn);
 
+        stop_counter(&read_counter);
+        record_stall(get_counter_duration(&read_counter));
+
+        record_refault(pte_contents);
+
         // At this point, we know that our pte is in transition format, as it is not active or on disc
         // This va must have been trimmed, but its pfn has not been repurposed
         // All we need to do is remove it from the standby or modified lists now
@@ -254,6 +361,7 @@ VOID page_fault_handler(PVOID arbitrary_va)
     } else {
         // This will unlink our page from the standby or modified list
         // It uses the PFNs information to determine which list it is on
+        fault_type = FAULT_SOFT;
 
         pfn = pfn_from_frame_number(pte_contents.transition_format.frame_number);
 
@@ -276,17 +384,20 @@ VOID page_fault_handler(PVOID arbitrary_va)
         // assert(pfn->flags.state == STANDBY || pfn->flags.state == MODIFIED)
 
         if (pfn->flags.state == MODIFIED) {
-            EnterCriticalSection(&modified_page_list.lock);
+            PPFN_LIST modified_list = modified_list_from_pfn(pfn);
+            EnterCriticalSection(&modified_list->lock);
             remove_from_list(pfn);
-            LeaveCriticalSection(&modified_page_list.lock);
+            LeaveCriticalSection(&modified_list->lock);
 
         } else /*(pfn->flags.state == STANDBY) */{
 
-            EnterCriticalSection(&standby_page_list.lock);
+            PPFN_LIST standby_list = standby_list_from_pfn(pfn);
+            EnterCriticalSection(&standby_list->lock);
             remove_from_list(pfn);
             // Freeing the space here and updating the pfn lower down
             free_disc_index(pfn->disc_index);
-            LeaveCriticalSection(&standby_page_list.lock);
+            LeaveCriticalSection(&standby_list->lock);
+            record_standby_rescue(pfn);
         }
     }
 
@@ -295,12 +406,20 @@ VOID page_fault_handler(PVOID arbitrary_va)
     pfn_contents = read_pfn(pfn);
     frame_number = frame_number_from_pfn(pfn);
 
+    // The valid PTE is built from nothing but the policy's bits, so no ghost bits leak into the valid format
+    pte_contents.entire_format = policy_fault(pte_contents, fault_type);
     pte_contents.memory_format.frame_number = frame_number_from_pfn(pfn);
     pte_contents.memory_format.valid = 1;
     pte_contents.memory_format.age = 0;
+    if (section != NULL) {
+        pte_contents.entire_format |= PTE_SECTION_BIT;
+    }
     write_pte(pte, pte_contents);
 
-    pfn_contents.pte = pte;
+    // A section page keeps pointing at its prototype PTE, which section_fault already set
+    if (section == NULL) {
+        pfn_contents.pte = pte;
+    }
     pfn_contents.flags.state = ACTIVE;
 
     if (pfn->flags.reference != 0) {
@@ -322,9 +441,15 @@ VOID page_fault_handler(PVOID arbitrary_va)
         LeaveCriticalSection(&pte_region_age_lists[0].lock);
     }
 
+    // New pages are young, so a filtered walk should visit their region next time
+    if (replacement_policy->filter_region_walks) {
+        bloom_filter_insert_region(pte_region);
+    }
+
     // Increment the age count for the region. We know that the age is 0
     pte_region->age_count.ages[0]++;
     InterlockedIncrement64((volatile LONG64 *) &global_age_count.pages_of_age[0]);
+    charge_address_space(pte_region, 1);
 
     // This is a Windows API call that confirms the changes we made with the OS
     // We have already mapped this va to this page on our side, but the OS also needs to do the same on its side
@@ -332,15 +457,61 @@ VOID page_fault_handler(PVOID arbitrary_va)
     map_pages(arbitrary_va, 1, &frame_number);
 
     unlock_pfn(pfn);
+
+    // A hard fault in a region advised as sequential brings in the pages after it while we still hold the region
+    if (fault_type == FAULT_HARD && pte_region->advice == VM_ADVICE_SEQUENTIAL) {
+        read_ahead(pte);
+    }
+
     unlock_pte(pte);
 }
 
-// Eventually, we will move this to an api.c and api.h file
-// That way programs can use our memory manager without knowing or having to know anything about how it works
-PVOID allocate_memory(PULONG_PTR num_bytes)
+// Writes the VA as a number into its page with the PTE locked, which stands in for the write protection a CPU would
+// Check atomically with the write. With the lock held vm_clone cannot share the page between the check and the write,
+// And nothing can unmap the page, so the write cannot fault
+// Returns FALSE if the page had to be faulted in or copied first, in which case the write has to be tried again
+static BOOLEAN write_va(PULONG_PTR arbitrary_va)
 {
-    *num_bytes = virtual_address_size;
-    return va_base;
+    PPTE pte = pte_from_va(arbitrary_va);
+    NULL_CHECK(pte, "write_va : could not get pte from va")
+
+    commit_pte_region_for_pte(pte);
+    lock_pte(pte);
+
+    // A paged out page of PTEs holds no valid PTEs, so there is no need to bring it in to find that out
+    PTE local;
+    local.entire_format = 0;
+    if (is_pte_region_committed((ULONG64) (pte - pte_base) / PTE_REGION_SIZE)) {
+        local = read_pte(pte);
+    }
+
+    if (local.memory_format.valid == 0) {
+        unlock_pte(pte);
+        page_fault_handler(arbitrary_va);
+        return FALSE;
+    }
+
+    if (local.entire_format & PTE_COPY_ON_WRITE_BIT) {
+        unlock_pte(pte);
+        copy_on_write_fault(arbitrary_va);
+        return FALSE;
+    }
+
+    // A read only view of a file has nowhere to write its pages back to, so writing to it is a program error
+    if (local.entire_format & PTE_SECTION_BIT) {
+        PSECTION section;
+        ULONG64 section_page;
+        if (find_va_section(arbitrary_va, &section, &section_page) && section != NULL && section->read_only) {
+            unlock_pte(pte);
+            fatal_error("write_va : write to a read only view of a file");
+        }
+    }
+
+    cpu_stamp_dirty(arbitrary_va);
+    *arbitrary_va = (ULONG_PTR) arbitrary_va;
+
+    unlock_pte(pte);
+    return TRUE;
 }
 
 // Accesses a virtual address and checks its checksum
@@ -365,7 +536,9 @@ VOID access_va(PULONG_PTR arbitrary_va) {
                 // }
             } else {
                 // We are trying to write the VA as a number into the page contents associated with that VA
-                *arbitrary_va = (ULONG_PTR) arbitrary_va;
+                // AWE cannot map pages read only, so the write fault a copy on write page would take is simulated
+                while (write_va(arbitrary_va) == FALSE) {
+                }
             }
 
             page_faulted = FALSE;
@@ -383,8 +556,6 @@ VOID access_va(PULONG_PTR arbitrary_va) {
 // Figure out attribute unused
 int main (int argc, char** argv)
 {
-    UNREFERENCED_PARAMETER(argc);
-    UNREFERENCED_PARAMETER(argv);
      /* This is where we initialize and test our virtual memory management state machine
 
      We control the entirety of virtual and physical memory management with only two exceptions
@@ -401,6 +572,13 @@ int main (int argc, char** argv)
      Virtual memory operations like handling page faults, materializing mappings, freeing them, trimming them,
      Writing them out to a paging file, bringing them back from the paging file, protecting them, and much more */
 
+#if PTE_SCAN_BENCHMARK
+    benchmark_pte_scan();
+#endif
+
+    // The replacement policy can be named as the first argument, the aging policy is used otherwise
+    select_replacement_policy(argc > 1 ? argv[1] : NULL);
+
     initialize_system();
 
     run_system();
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <Windows.h>
+#include "../include/vm.h"
+#include "../include/debug.h"
+
+volatile LONG64 eviction_clock;
+
+volatile ULONG trim_protected_ages;
+DOUBLE workingset_refault_fraction;
+
+// These count refaults since the scheduler last looked
+volatile LONG64 refaults_this_interval;
+volatile LONG64 workingset_refaults_this_interval;
+
+volatile LONG64 refault_histogram[REFAULT_HISTOGRAM_SIZE];
+volatile LONG64 total_refaults;
+volatile LONG64 total_workingset_refaults;
+
+// Ticks the eviction clock for a page being repurposed and returns the stamp to keep in its disc format PTE
+ULONG64 stamp_eviction(VOID)
+{
+    ULONG64 clock = (ULONG64) InterlockedIncrement64(&eviction_clock);
+    ULONG64 stamp = (clock >> EVICTION_STAMP_GRANULARITY_LOG2) << PTE_EVICTION_STAMP_SHIFT;
+
+    return PTE_EVICTION_STAMPED_BIT | (stamp & PTE_EVICTION_STAMP_MASK);
+}
+
+// Called on a hard fault with the disc format PTE. The refault distance is how many pages were evicted
+// Between this page being evicted and it coming back. If that is less than the number of active pages,
+// The page would still be in memory had the standby list been that much bigger, so the active pages were trimmed too hard
+VOID record_refault(PTE old_contents)
+{
+    if ((old_contents.entire_format & PTE_EVICTION_STAMPED_BIT) == 0) {
+        return;
+    }
+
+    ULONG64 stamp = (old_contents.entire_format & PTE_EVICTION_STAMP_MASK) >> PTE_EVICTION_STAMP_SHIFT;
+    ULONG64 now = ((ULONG64) eviction_clock >> EVICTION_STAMP_GRANULARITY_LOG2) & ((1ULL << PTE_EVICTION_STAMP_BITS) - 1);
+
+    // The stamp wraps, so the subtraction is done modulo the width of the field
+    ULONG64 distance = ((now - stamp) & ((1ULL << PTE_EVICTION_STAMP_BITS) - 1)) << EVICTION_STAMP_GRANULARITY_LOG2;
+
+    ULONG bucket = 0;
+    if (distance != 0) {
+        ULONG highest_bit;
+        _BitScanReverse64(&highest_bit, distance);
+        bucket = min(highest_bit + 1, REFAULT_HISTOGRAM_SIZE - 1);
+    }
+    InterlockedIncrement64(&refault_histogram[bucket]);
+    InterlockedIncrement64(&total_refaults);
+    InterlockedIncrement64(&refaults_this_interval);
+
+    ULONG64 active_pages = 0;
+    for (ULONG i = 0; i < NUMBER_OF_AGES; i++) {
+        active_pages += *(volatile ULONG64 *) &global_age_count.pages_of_age[i];
+    }
+
+    if (distance <= active_pages) {
+        InterlockedIncrement64(&total_workingset_refaults);
+        InterlockedIncrement64(&workingset_refaults_this_interval);
+    }
+}
+
+// Called by the scheduler once a second
+// The more hard faults are refaults inside the active set, the more of the youngest ages the trimmers leave alone
+VOID update_workingset_protection(VOID)
+{
+    LONG64 refaults = InterlockedExchange64(&refaults_this_interval, 0);
+    LONG64 workingset_refaults = InterlockedExchange64(&workingset_refaults_this_interval, 0);
+
+    DOUBLE fraction = refaults > 0 ? (DOUBLE) workingset_refaults / (DOUBLE) refaults : 0;
+    workingset_refault_fraction = fraction;
+
+    ULONG protected_ages = (ULONG) (fraction * MAX_PROTECTED_AGES + 0.5);
+    InterlockedExchange((volatile LONG *) &trim_protected_ages, (LONG) min(protected_ages, MAX_PROTECTED_AGES));
+}
+
+VOID print_refault_statistics(VOID)
+{
+    printf("refaults : %llu hard faults had an eviction stamp, %llu of them refaulted inside the active set\n",
+           (ULONG64) total_refaults, (ULONG64) total_workingset_refaults);
+
+    for (ULONG i = 0; i < REFAULT_HISTOGRAM_SIZE; i++)
+    {
+        if (refault_histogram[i] == 0) {
+            continue;
+        }
+
+        if (i == REFAULT_HISTOGRAM_SIZE - 1) {
+            printf("refaults : distance >= %llu pages : %llu\n", 1ULL << (i - 1), (ULONG64) refault_histogram[i]);
+        } else if (i == 0) {
+            printf("refaults : distance 0 pages : %llu\n", (ULONG64) refault_histogram[i]);
+        } else {
+            printf("refaults : distance %llu - %llu pages : %llu\n", 1ULL << (i - 1), (1ULL << i) - 1,
+                   (ULONG64) refault_histogram[i]);
+        }
+    }
+}